@@ -1362,8 +1362,15 @@ int app_rhizome_add_file(const struct cli_parsed *parsed, void *context)
     cli_put_string(bid, "\n");
   }
   {
+    const unsigned char *sk = rhizome_manifest_secret(mout);
+    if (sk == NULL) {
+      if (mout != m)
+	rhizome_manifest_free(mout);
+      rhizome_manifest_free(m);
+      return -1;
+    }
     char secret[RHIZOME_BUNDLE_KEY_STRLEN + 1];
-    rhizome_bytes_to_hex_upper(mout->cryptoSignSecret, secret, RHIZOME_BUNDLE_KEY_BYTES);
+    rhizome_bytes_to_hex_upper(sk, secret, RHIZOME_BUNDLE_KEY_BYTES);
     cli_field_name("secret", ":");
     cli_put_string(secret, "\n");
   }
@@ -2094,6 +2101,130 @@ int app_crypt_test(const struct cli_parsed *parsed, void *context)
   return 0;
 }
 
+static void sha512_digest(int multi, int count, const unsigned char *data[], const size_t len[], unsigned char digests[][SHA512_DIGEST_LENGTH])
+{
+  SHA512_CTX contexts[count];
+  SHA512_CTX *ctx[count];
+  int i;
+  for (i=0;i<count;i++){
+    ctx[i]=&contexts[i];
+    SHA512_Init(ctx[i]);
+  }
+  if (multi){
+    // feed an odd sized piece first, so the streams start with partly filled buffers
+    const unsigned char *rest[count];
+    size_t first[count], remaining[count];
+    for (i=0;i<count;i++){
+      first[i] = len[i] < 77 ? len[i] : 77;
+      rest[i] = data[i] + first[i];
+      remaining[i] = len[i] - first[i];
+    }
+    SHA512_Update_Multi(ctx, data, first, count);
+    SHA512_Update_Multi(ctx, rest, remaining, count);
+  }else{
+    for (i=0;i<count;i++)
+      SHA512_Update(ctx[i], data[i], len[i]);
+  }
+  for (i=0;i<count;i++)
+    SHA512_Final(digests[i], ctx[i]);
+}
+
+int app_sha512_test(const struct cli_parsed *parsed, void *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *size_arg = NULL;
+  if (cli_arg(parsed, "--size", &size_arg, cli_uint, "1048576") == -1)
+    return -1;
+  size_t size = atoi(size_arg);
+  if (size < 1)
+    return WHY("Invalid buffer size");
+  
+  // enough for the checks below
+  size_t buffer_size = size < 4096 ? 4096 : size;
+  unsigned char *buffer = malloc(buffer_size);
+  if (!buffer)
+    return WHY_perror("malloc");
+  urandombytes(buffer, buffer_size);
+  
+  int ret=0;
+  int saved = SHA512_SIMD_Enable(1);
+  
+  // compare every backend with the generic code, over a spread of lengths and block alignments
+  {
+    enum {STREAMS=7};
+    const unsigned char *data[STREAMS];
+    size_t len[STREAMS];
+    unsigned char expected[STREAMS][SHA512_DIGEST_LENGTH];
+    unsigned char simd[STREAMS][SHA512_DIGEST_LENGTH];
+    unsigned char multi[STREAMS][SHA512_DIGEST_LENGTH];
+    int n, i;
+    for (n=0;n<40;n++){
+      for (i=0;i<STREAMS;i++){
+	len[i] = (n*131 + i*389) % 1500;
+	data[i] = buffer + (n*7 + i) % 64;
+      }
+      SHA512_SIMD_Enable(0);
+      sha512_digest(0, STREAMS, data, len, expected);
+      SHA512_SIMD_Enable(1);
+      sha512_digest(0, STREAMS, data, len, simd);
+      sha512_digest(1, STREAMS, data, len, multi);
+      if (memcmp(expected, simd, sizeof expected) || memcmp(expected, multi, sizeof expected)){
+	ret=WHYF("SHA-512 backend %s does not match the generic code", SHA512_Backend());
+	goto end;
+      }
+    }
+  }
+  
+  {
+    enum {STREAMS=4};
+    int count = (64*1024*1024) / size;
+    if (count<1)
+      count=1;
+    const unsigned char *data[STREAMS];
+    size_t len[STREAMS];
+    unsigned char digests[STREAMS][SHA512_DIGEST_LENGTH];
+    int i;
+    for (i=0;i<STREAMS;i++){
+      data[i]=buffer;
+      len[i]=size;
+    }
+    double total = (double)size * count / 1048576;
+    printf("Benchmarking SHA-512, %d x %dKB:\n", count, (int)(size/1024));
+    
+    SHA512_SIMD_Enable(0);
+    time_ms_t start = gettime_ms();
+    for (i=0;i<count;i++)
+      sha512_digest(0, 1, data, len, digests);
+    time_ms_t end = gettime_ms();
+    printf("%-16s %5lldms (%6.1fMB/s)\n", "generic",
+	   (long long)(end - start), total * 1000 / (end - start + 1));
+    
+    SHA512_SIMD_Enable(1);
+    start = gettime_ms();
+    for (i=0;i<count;i++)
+      sha512_digest(0, 1, data, len, digests);
+    end = gettime_ms();
+    printf("%-16s %5lldms (%6.1fMB/s)\n", SHA512_Backend(),
+	   (long long)(end - start), total * 1000 / (end - start + 1));
+    
+    // the same amount of data, split over four streams
+    for (i=0;i<STREAMS;i++)
+      len[i]=size/STREAMS;
+    start = gettime_ms();
+    for (i=0;i<count;i++)
+      sha512_digest(1, STREAMS, data, len, digests);
+    end = gettime_ms();
+    printf("%-16s %5lldms (%6.1fMB/s)\n", "multi-buffer x4",
+	   (long long)(end - start), total * 1000 / (end - start + 1));
+  }
+  printf("Test passed.\n");
+end:
+  SHA512_SIMD_Enable(saved);
+  free(buffer);
+  return ret;
+}
+
 int app_route_print(const struct cli_parsed *parsed, void *context)
 {
   if (config.debug.verbose)
@@ -2366,8 +2497,22 @@ struct cli_schema command_line_options[]={
    "Interactive servald monitor interface."},
   {app_crypt_test,{"test","crypt",NULL}, 0,
    "Run cryptography speed test"},
+  {app_sha512_test,{"test","sha512","[--size=<bytes>]",NULL}, 0,
+   "Run SHA-512 hashing speed test"},
   {app_nonce_test,{"test","nonce",NULL}, 0,
    "Run nonce generation test"},
+  {app_sched_test,{"test","schedule","[--seed=<N>]","[--count=<N>]",NULL}, 0,
+   "Run alarm scheduler speed test"},
+  {app_subscriber_test,{"test","subscribers","[--seed=<N>]","[--count=<N>]",NULL}, 0,
+   "Run subscriber index speed test"},
+  {app_rhizome_store_test,{"test","rhizome","[--size=<bytes>]","[--external]",NULL}, 0,
+   "Run rhizome payload storage speed test"},
+  {app_rhizome_sql_test,{"test","rhizomedb","[--count=<N>]",NULL}, 0,
+   "Run rhizome database query speed test"},
+  {app_rhizome_crypt_test,{"test","rhizomecrypt","[--size=<bytes>]",NULL}, 0,
+   "Run rhizome payload encryption speed test"},
+  {app_rhizome_manifest_test,{"test","manifest","[--count=<N>]",NULL}, 0,
+   "Run rhizome manifest parsing speed test"},
   {app_slip_test,{"test","slip","[--seed=<N>]","[--duration=<seconds>|--iterations=<N>]",NULL}, 0,
    "Run serial encapsulation test"},
 #ifdef HAVE_VOIPTEST
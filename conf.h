@@ -662,6 +662,9 @@ int cf_fmt_uint32_nonzero(const char **, const uint32_t *intp);
 int cf_opt_uint64_scaled(uint64_t *intp, const char *text);
 int cf_fmt_uint64_scaled(const char **, const uint64_t *intp);
 
+int cf_opt_uint64_scaled_nonzero(uint64_t *intp, const char *text);
+int cf_fmt_uint64_scaled_nonzero(const char **, const uint64_t *intp);
+
 int cf_opt_protocol(char *str, size_t len, const char *text);
 int cf_fmt_protocol(const char **, const char *str);
 
@@ -692,6 +695,9 @@ int cf_fmt_socket_type(const char **, const short *typep);
 int cf_opt_encapsulation(short *encapp, const char *text);
 int cf_fmt_encapsulation(const char **, const short *encapp);
 
+int cf_opt_advertise_strategy(short *strategyp, const char *text);
+int cf_fmt_advertise_strategy(const char **, const short *strategyp);
+
 extern int cf_limbo;
 extern struct config_main config;
 
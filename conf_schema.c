@@ -451,6 +451,27 @@ int cf_cmp_uint64_scaled(const uint64_t *a, const uint64_t *b)
   return *a < *b ? -1 : *a > *b ? 1 : 0;
 }
 
+int cf_opt_uint64_scaled_nonzero(uint64_t *intp, const char *text)
+{
+  uint64_t ui;
+  if (cf_opt_uint64_scaled(&ui, text) != CFOK || ui == 0)
+    return CFINVALID;
+  *intp = ui;
+  return CFOK;
+}
+
+int cf_fmt_uint64_scaled_nonzero(const char **textp, const uint64_t *uintp)
+{
+  if (*uintp == 0)
+    return CFINVALID;
+  return cf_fmt_uint64_scaled(textp, uintp);
+}
+
+int cf_cmp_uint64_scaled_nonzero(const uint64_t *a, const uint64_t *b)
+{
+  return cf_cmp_uint64_scaled(a, b);
+}
+
 int cf_opt_ushort(unsigned short *ushortp, const char *text)
 {
   const char *end = text;
@@ -754,6 +775,42 @@ int cf_cmp_encapsulation(const short *a, const short *b)
   return cf_cmp_short(a, b);
 }
 
+int cf_opt_advertise_strategy(short *strategyp, const char *text)
+{
+  if (strcasecmp(text, "recent") == 0) {
+    *strategyp = RHIZOME_ADVERTISE_RECENT;
+    return CFOK;
+  }
+  if (strcasecmp(text, "round_robin") == 0) {
+    *strategyp = RHIZOME_ADVERTISE_ROUND_ROBIN;
+    return CFOK;
+  }
+  if (strcasecmp(text, "size") == 0) {
+    *strategyp = RHIZOME_ADVERTISE_SIZE;
+    return CFOK;
+  }
+  return CFINVALID;
+}
+
+int cf_fmt_advertise_strategy(const char **textp, const short *strategyp)
+{
+  const char *t = NULL;
+  switch (*strategyp) {
+    case RHIZOME_ADVERTISE_RECENT:      t = "recent"; break;
+    case RHIZOME_ADVERTISE_ROUND_ROBIN: t = "round_robin"; break;
+    case RHIZOME_ADVERTISE_SIZE:        t = "size"; break;
+  }
+  if (!t)
+    return CFINVALID;
+  *textp = str_edup(t);
+  return CFOK;
+}
+
+int cf_cmp_advertise_strategy(const short *a, const short *b)
+{
+  return cf_cmp_short(a, b);
+}
+
 int cf_opt_pattern_list(struct pattern_list *listp, const char *text)
 {
   struct pattern_list list;
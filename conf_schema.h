@@ -264,6 +264,7 @@ ATOM(bool_t, trace,                     0, boolean,, "")
 ATOM(bool_t, profiling,                 0, boolean,, "")
 ATOM(bool_t, externalblobs,             0, boolean,, "")
 ATOM(bool_t, linkstate,                 0, boolean,, "")
+ATOM(bool_t, subscribers,               0, boolean,, "")
 END_STRUCT
 
 #define LOG_FORMAT_OPTIONS \
@@ -328,6 +329,8 @@ END_ARRAY(5)
 
 STRUCT(mdp)
 STRING(256,                 socket,     DEFAULT_MDP_SOCKET_NAME, str_nonempty,, "Name of socket for MDP client interface")
+ATOM(int32_t,               subscriber_limit,        10000, int32_nonneg,, "Maximum number of subscribers to remember before forgetting unreachable ones, zero for no limit")
+ATOM(int32_t,               subscriber_idle_timeout, 3600, int32_nonneg,, "Seconds before an unused and unreachable subscriber is forgotten, zero to never expire")
 SUB_STRUCT(mdp_iftypelist,  iftype,)
 END_STRUCT
 
@@ -389,6 +392,26 @@ END_STRUCT
 STRUCT(rhizome_advertise)
 ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome advertisements are sent")
 ATOM(uint32_t,              interval,   500, uint32_nonzero,, "Interval between Rhizome advertisements")
+ATOM(short,                 strategy,   RHIZOME_ADVERTISE_RECENT, advertise_strategy,, "Order in which stored bundles are advertised")
+END_STRUCT
+
+STRUCT(rhizome_fetch_queue)
+ATOM(uint16_t,              under_1k,   40, uint16_nonzero,, "Number of fetch candidates queued with payloads smaller than 1KiB")
+ATOM(uint16_t,              under_8k,   32, uint16_nonzero,, "Number of fetch candidates queued with payloads smaller than 8KiB")
+ATOM(uint16_t,              under_64k,  24, uint16_nonzero,, "Number of fetch candidates queued with payloads smaller than 64KiB")
+ATOM(uint16_t,              under_512k, 16, uint16_nonzero,, "Number of fetch candidates queued with payloads smaller than 512KiB")
+ATOM(uint16_t,              under_4m,   8, uint16_nonzero,, "Number of fetch candidates queued with payloads smaller than 4MiB")
+ATOM(uint16_t,              larger,     4, uint16_nonzero,, "Number of fetch candidates queued with larger payloads")
+END_STRUCT
+
+STRUCT(rhizome_fetch_slots)
+ATOM(uint16_t,              under_1k,   2, uint16_nonzero,, "Number of concurrent fetches of payloads smaller than 1KiB")
+ATOM(uint16_t,              under_8k,   2, uint16_nonzero,, "Number of concurrent fetches of payloads smaller than 8KiB")
+ATOM(uint16_t,              under_64k,  2, uint16_nonzero,, "Number of concurrent fetches of payloads smaller than 64KiB")
+ATOM(uint16_t,              under_512k, 2, uint16_nonzero,, "Number of concurrent fetches of payloads smaller than 512KiB")
+ATOM(uint16_t,              under_4m,   2, uint16_nonzero,, "Number of concurrent fetches of payloads smaller than 4MiB")
+ATOM(uint16_t,              larger,     2, uint16_nonzero,, "Number of concurrent fetches of larger payloads")
+ATOM(uint16_t,              per_peer,   1, uint16_nonzero,, "Number of concurrent fetches from one peer in each size class")
 END_STRUCT
 
 STRUCT(rhizome)
@@ -398,15 +421,22 @@ ATOM(bool_t,                clean_on_open,  1, boolean,, "If true, Rhizome datab
 STRING(256,                 datastore_path, "", absolute_path,, "Path of rhizome storage directory, absolute or relative to instance directory")
 ATOM(uint64_t,              database_size,  1000000, uint64_scaled,, "Size of database in bytes")
 ATOM(bool_t,                external_blobs, 0, boolean,, "Store rhizome bundles as separate files.")
+ATOM(int32_t,               write_queue,    4, int32_nonneg,, "Number of received payload buffers queued for the background writer, 0 to write them synchronously")
+ATOM(bool_t,                wal,            0, boolean,, "If true, use a write-ahead log so that serving bundles does not wait for imports")
+ATOM(bool_t,                merkle,         0, boolean,, "If true, add a Merkle tree root to the manifests of new payloads, so receivers can verify each block")
+ATOM(uint32_t,              checkpoint_interval_ms, 5000, uint32_nonzero,, "Interval between write-ahead log checkpoints in the server")
 
-ATOM(uint64_t,              rhizome_mdp_block_size, 512, uint64_scaled,, "Rhizome MDP block size.")
+ATOM(uint64_t,              rhizome_mdp_block_size, 512, uint64_scaled_nonzero,, "Rhizome MDP block size.")
 ATOM(uint64_t,              idle_timeout,           RHIZOME_IDLE_TIMEOUT, uint64_scaled,, "Rhizome transfer timeout if no data received.")
 ATOM(uint32_t,              fetch_delay_ms,         50, uint32_nonzero,, "Delay from receiving first bundle advert to initiating fetch")
+ATOM(uint16_t,              fetch_sources,          4, uint16_nonzero,, "Most peers to fetch one payload from at once over MDP")
 SUB_STRUCT(rhizome_direct,  direct,)
 SUB_STRUCT(rhizome_api,     api,)
 SUB_STRUCT(rhizome_http,    http,)
 SUB_STRUCT(rhizome_mdp,     mdp,)
 SUB_STRUCT(rhizome_advertise, advertise,)
+SUB_STRUCT(rhizome_fetch_queue, fetch_queue,)
+SUB_STRUCT(rhizome_fetch_slots, fetch_slots,)
 END_STRUCT
 
 STRUCT(directory)
@@ -444,6 +474,9 @@ ATOM(bool_t,                default_route,   0, boolean,, "If true, use this int
 ATOM(bool_t,                prefer_unicast,  0, boolean,, "If true, send unicast data as unicast IP packets if available")
 ATOM(bool_t,                ctsrts,  0, boolean,, "If true, enable CTS/RTS hardware handshaking")
 ATOM(int32_t,               uartbps, 57600, int32_rs232baudrate,, "Speed of serial UART link speed (which may be different to serial device link speed)")
+ATOM(uint16_t,              recv_batch,      8, uint16_nonzero,, "Maximum number of datagrams to read in one system call")
+ATOM(uint16_t,              recv_budget,     16, uint16_nonzero,, "Maximum number of datagrams to read each time the socket becomes readable")
+ATOM(uint16_t,              send_batch,      8, uint16_nonzero,, "Maximum number of datagrams to send in one system call")
 END_STRUCT
 
 ARRAY(interface_list, NO_DUPLICATES)
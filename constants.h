@@ -145,6 +145,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define MDP_PORT_RHIZOME_RESPONSE 14
 #define MDP_PORT_DIRECTORY 15
 #define MDP_PORT_RHIZOME_MANIFEST_REQUEST 16
+#define MDP_PORT_RHIZOME_MERKLE_REQUEST 17
 #define MDP_PORT_NOREPLY 0x3f
 
 #define MDP_TYPE_MASK 0xff
@@ -218,4 +219,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define ENCAP_OVERLAY 1
 #define ENCAP_SINGLE 2
 
+#define RHIZOME_ADVERTISE_RECENT 0
+#define RHIZOME_ADVERTISE_ROUND_ROBIN 1
+#define RHIZOME_ADVERTISE_SIZE 2
+
 #endif // __SERVALD_CONSTANTS_H
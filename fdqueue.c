@@ -18,67 +18,174 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <poll.h>
+#include <assert.h>
 #include "serval.h"
 #include "conf.h"
 #include "str.h"
 #include "strbuf.h"
 #include "strbuf_helpers.h"
+#include "mem.h"
+#include "cli.h"
 
-#define MAX_WATCHED_FDS 128
-struct pollfd fds[MAX_WATCHED_FDS];
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#endif
+
+/* The set of watched file handles grows on demand.  With the epoll(7) backend, registrations live
+ * in the kernel between calls to fd_poll(), and fds[] is only our own record of them; otherwise
+ * fds[] is handed to poll(2) on every iteration.
+ */
+#define WATCHED_FDS_INITIAL_SIZE 32
+struct pollfd *fds=NULL;
 int fdcount=0;
-struct sched_ent *fd_callbacks[MAX_WATCHED_FDS];
-struct sched_ent *next_alarm=NULL;
-struct sched_ent *next_deadline=NULL;
+static int fdsize=0;
+struct sched_ent **fd_callbacks=NULL;
+#ifdef USE_EPOLL
+static int epoll_fd=-1;
+static struct epoll_event *epoll_events=NULL;
+#endif
 struct profile_total poll_stats={NULL,0,"Idle (in poll)",0,0,0};
 
+/* Pending alarms are kept in two binary min-heaps, one ordered by alarm time and one by deadline.
+ * Each sched_ent remembers which heap it is in and its index within that heap, so it can be
+ * removed or re-ordered in O(log n) without searching.
+ */
+struct sched_heap{
+  int by_deadline;
+  struct sched_ent **entries;
+  unsigned int count;
+  unsigned int size;
+};
+
+#define SCHED_HEAP_INITIAL_SIZE 64
+
+static struct sched_heap alarm_heap={.by_deadline=0};
+static struct sched_heap deadline_heap={.by_deadline=1};
+static unsigned int sched_sequence=0;
+
+#define next_alarm (alarm_heap.count ? alarm_heap.entries[0] : NULL)
+#define next_deadline (deadline_heap.count ? deadline_heap.entries[0] : NULL)
+
 #define alloca_alarm_name(alarm) ((alarm)->stats ? alloca_str_toprint((alarm)->stats->name) : "Unnamed")
 
+static int sched_before(const struct sched_heap *heap, const struct sched_ent *a, const struct sched_ent *b)
+{
+  time_ms_t ta = heap->by_deadline ? a->deadline : a->alarm;
+  time_ms_t tb = heap->by_deadline ? b->deadline : b->alarm;
+  if (ta != tb)
+    return ta < tb;
+  return (int)(a->_sched_seq - b->_sched_seq) < 0;
+}
+
+static void sched_heap_set(struct sched_heap *heap, unsigned int i, struct sched_ent *alarm)
+{
+  heap->entries[i] = alarm;
+  alarm->_heap_index = i;
+}
+
+static void sched_heap_sift_up(struct sched_heap *heap, unsigned int i)
+{
+  struct sched_ent *alarm = heap->entries[i];
+  while (i > 0) {
+    unsigned int parent = (i - 1) / 2;
+    if (!sched_before(heap, alarm, heap->entries[parent]))
+      break;
+    sched_heap_set(heap, i, heap->entries[parent]);
+    i = parent;
+  }
+  sched_heap_set(heap, i, alarm);
+}
+
+static void sched_heap_sift_down(struct sched_heap *heap, unsigned int i)
+{
+  struct sched_ent *alarm = heap->entries[i];
+  while (1) {
+    unsigned int child = i * 2 + 1;
+    if (child >= heap->count)
+      break;
+    if (child + 1 < heap->count && sched_before(heap, heap->entries[child + 1], heap->entries[child]))
+      child++;
+    if (!sched_before(heap, heap->entries[child], alarm))
+      break;
+    sched_heap_set(heap, i, heap->entries[child]);
+    i = child;
+  }
+  sched_heap_set(heap, i, alarm);
+}
+
+static int sched_heap_insert(struct sched_heap *heap, struct sched_ent *alarm)
+{
+  if (heap->count >= heap->size) {
+    unsigned int size = heap->size ? heap->size * 2 : SCHED_HEAP_INITIAL_SIZE;
+    struct sched_ent **entries = erealloc(heap->entries, size * sizeof(struct sched_ent *));
+    if (!entries)
+      return WHY("Unable to grow alarm queue");
+    heap->entries = entries;
+    heap->size = size;
+  }
+  alarm->_heap = heap;
+  alarm->_sched_seq = sched_sequence++;
+  heap->entries[heap->count] = alarm;
+  sched_heap_sift_up(heap, heap->count++);
+  return 0;
+}
+
+static void sched_heap_remove(struct sched_heap *heap, struct sched_ent *alarm)
+{
+  unsigned int i = alarm->_heap_index;
+  assert(i < heap->count && heap->entries[i] == alarm);
+  heap->count--;
+  if (i != heap->count) {
+    // move the last entry into the hole, then restore heap order in whichever direction it needs
+    sched_heap_set(heap, i, heap->entries[heap->count]);
+    if (i > 0 && sched_before(heap, heap->entries[i], heap->entries[(i - 1) / 2]))
+      sched_heap_sift_up(heap, i);
+    else
+      sched_heap_sift_down(heap, i);
+  }
+  heap->entries[heap->count] = NULL;
+  alarm->_heap = NULL;
+  alarm->_heap_index = 0;
+}
+
 void list_alarms()
 {
   DEBUG("Alarms;");
   time_ms_t now = gettime_ms();
-  struct sched_ent *alarm;
+  unsigned int i;
   
-  for (alarm = next_deadline; alarm; alarm = alarm->_next)
+  for (i = 0; i < deadline_heap.count; ++i) {
+    struct sched_ent *alarm = deadline_heap.entries[i];
     DEBUGF("%p %s deadline in %lldms", alarm->function, alloca_alarm_name(alarm), alarm->deadline - now);
+  }
   
-  for (alarm = next_alarm; alarm; alarm = alarm->_next)
+  for (i = 0; i < alarm_heap.count; ++i) {
+    struct sched_ent *alarm = alarm_heap.entries[i];
     DEBUGF("%p %s in %lldms, deadline in %lldms", alarm->function, alloca_alarm_name(alarm), alarm->alarm - now, alarm->deadline - now);
+  }
   
   DEBUG("File handles;");
-  int i;
-  for (i = 0; i < fdcount; ++i)
-    DEBUGF("%s watching #%d", alloca_alarm_name(fd_callbacks[i]), fds[i].fd);
+  int j;
+  for (j = 0; j < fdcount; ++j)
+    DEBUGF("%s watching #%d", alloca_alarm_name(fd_callbacks[j]), fds[j].fd);
 }
 
 int deadline(struct sched_ent *alarm)
 {
-  struct sched_ent *node = next_deadline, *last = NULL;
   if (alarm->deadline < alarm->alarm)
     alarm->deadline = alarm->alarm;
-  
-  while(node!=NULL){
-    if (node->deadline > alarm->deadline)
-      break;
-    last = node;
-    node = node->_next;
-  }
-  if (last == NULL){
-    next_deadline = alarm;
-  }else{
-    last->_next = alarm;
-  }
-  alarm->_prev = last;
-  if(node!=NULL)
-    node->_prev = alarm;
-  alarm->_next = node;
-  return 0;
+  return sched_heap_insert(&deadline_heap, alarm);
 }
 
 int is_scheduled(const struct sched_ent *alarm)
 {
-  return alarm->_next || alarm->_prev || alarm == next_alarm || alarm == next_deadline;
+  return alarm->_heap != NULL;
+}
+
+int is_watching(const struct sched_ent *alarm)
+{
+  return alarm->_poll_index>=0 && alarm->_poll_index<fdcount && fd_callbacks[alarm->_poll_index]==alarm;
 }
 
 // add an alarm to the list of scheduled function calls.
@@ -94,8 +201,6 @@ int _schedule(struct __sourceloc __whence, struct sched_ent *alarm)
     WARNF("schedule() called from %s() %s:%d without supplying an alarm name", 
 	  __whence.function,__whence.file,__whence.line);
 
-  struct sched_ent *node = next_alarm, *last = NULL;
-  
   if (is_scheduled(alarm))
     FATAL("Scheduling an alarm that is already scheduled");
   
@@ -109,23 +214,7 @@ int _schedule(struct __sourceloc __whence, struct sched_ent *alarm)
   if (alarm->alarm <= gettime_ms())
     return deadline(alarm);
   
-  while(node!=NULL){
-    if (node->alarm > alarm->alarm)
-      break;
-    last = node;
-    node = node->_next;
-  }
-  if (last == NULL){
-    next_alarm = alarm;
-  }else{
-    last->_next=alarm;
-  }
-  alarm->_prev = last;
-  if(node!=NULL)
-    node->_prev = alarm;
-  alarm->_next = node;
-  
-  return 0;
+  return sched_heap_insert(&alarm_heap, alarm);
 }
 
 // remove a function from the schedule before it has fired
@@ -135,24 +224,62 @@ int _unschedule(struct __sourceloc __whence, struct sched_ent *alarm)
   if (config.debug.io)
     DEBUGF("unschedule(alarm=%s)", alloca_alarm_name(alarm));
 
-  struct sched_ent *prev = alarm->_prev;
-  struct sched_ent *next = alarm->_next;
-  
-  if (prev)
-    prev->_next = next;
-  else if(next_alarm==alarm)
-    next_alarm = next;
-  else if(next_deadline==alarm)
-    next_deadline = next;
-  
-  if (next)
-    next->_prev = prev;
-  
-  alarm->_prev = NULL;
-  alarm->_next = NULL;
+  if (alarm->_heap)
+    sched_heap_remove(alarm->_heap, alarm);
   return 0;
 }
 
+static int grow_watched_fds()
+{
+  int size = fdsize ? fdsize * 2 : WATCHED_FDS_INITIAL_SIZE;
+  struct pollfd *new_fds = erealloc(fds, size * sizeof(struct pollfd));
+  if (!new_fds)
+    return -1;
+  fds = new_fds;
+  struct sched_ent **new_callbacks = erealloc(fd_callbacks, size * sizeof(struct sched_ent *));
+  if (!new_callbacks)
+    return -1;
+  fd_callbacks = new_callbacks;
+#ifdef USE_EPOLL
+  struct epoll_event *new_events = erealloc(epoll_events, size * sizeof(struct epoll_event));
+  if (!new_events)
+    return -1;
+  epoll_events = new_events;
+#endif
+  fdsize = size;
+  return 0;
+}
+
+#ifdef USE_EPOLL
+/* Each registration carries both the descriptor and its index in fds[], so that fd_poll() can tell
+ * when an earlier callback in the same batch has unwatched or moved the entry.  The epoll event
+ * bits have the same values as their poll(2) equivalents on Linux.
+ */
+static int epoll_register(int op, int index)
+{
+  if (epoll_fd == -1) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+      return WHY_perror("epoll_create1");
+  }
+  struct epoll_event event;
+  bzero(&event, sizeof event);
+  event.events = fds[index].events;
+  event.data.u64 = ((uint64_t)(uint32_t)fds[index].fd << 32) | (uint32_t)index;
+  if (epoll_ctl(epoll_fd, op, fds[index].fd, &event) == -1)
+    return WHYF_perror("epoll_ctl(%d, %s, %d)", epoll_fd,
+	op == EPOLL_CTL_ADD ? "ADD" : "MOD", fds[index].fd);
+  return 0;
+}
+
+static void epoll_unregister(int fd)
+{
+  // the descriptor may already have been closed, which removes it from the epoll set anyway
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1 && errno != EBADF && errno != ENOENT)
+    WHYF_perror("epoll_ctl(%d, DEL, %d)", epoll_fd, fd);
+}
+#endif
+
 // start watching a file handle, call this function again if you wish to change the event mask
 int _watch(struct __sourceloc __whence, struct sched_ent *alarm)
 {
@@ -165,18 +292,36 @@ int _watch(struct __sourceloc __whence, struct sched_ent *alarm)
   if (!alarm->function)
     return WHY("Can't watch if you haven't set the function pointer");
   
-  if (alarm->_poll_index>=0 && fd_callbacks[alarm->_poll_index]==alarm){
+  if (alarm->_poll_index>=0 && alarm->_poll_index<fdcount && fd_callbacks[alarm->_poll_index]==alarm){
     // updating event flags
     if (config.debug.io)
       DEBUGF("Updating watch %s, #%d for %d", alloca_alarm_name(alarm), alarm->poll.fd, alarm->poll.events);
+#ifdef USE_EPOLL
+    int index = alarm->_poll_index;
+    int op = EPOLL_CTL_MOD;
+    if (fds[index].fd != alarm->poll.fd) {
+      epoll_unregister(fds[index].fd);
+      op = EPOLL_CTL_ADD;
+    }
+    fds[index]=alarm->poll;
+    return epoll_register(op, index);
+#endif
   }else{
     if (config.debug.io)
       DEBUGF("Adding watch %s, #%d for %d", alloca_alarm_name(alarm), alarm->poll.fd, alarm->poll.events);
-    if (fdcount>=MAX_WATCHED_FDS)
+    if (fdcount>=fdsize && grow_watched_fds() == -1)
       return WHY("Too many file handles to watch");
     fd_callbacks[fdcount]=alarm;
     alarm->poll.revents = 0;
     alarm->_poll_index=fdcount;
+    fds[fdcount]=alarm->poll;
+#ifdef USE_EPOLL
+    if (epoll_register(EPOLL_CTL_ADD, fdcount) == -1) {
+      fd_callbacks[fdcount]=NULL;
+      alarm->_poll_index=-1;
+      return -1;
+    }
+#endif
     fdcount++;
   }
   fds[alarm->_poll_index]=alarm->poll;
@@ -190,15 +335,21 @@ int _unwatch(struct __sourceloc __whence, struct sched_ent *alarm)
     DEBUGF("unwatch(alarm=%s)", alloca_alarm_name(alarm));
 
   int index = alarm->_poll_index;
-  if (index <0 || fds[index].fd!=alarm->poll.fd)
+  if (index <0 || index>=fdcount || fds[index].fd!=alarm->poll.fd)
     return WHY("Attempted to unwatch a handle that is not being watched");
   
+#ifdef USE_EPOLL
+  epoll_unregister(fds[index].fd);
+#endif
   fdcount--;
   if (index!=fdcount){
     // squash fds
     fds[index] = fds[fdcount];
     fd_callbacks[index] = fd_callbacks[fdcount];
     fd_callbacks[index]->_poll_index=index;
+#ifdef USE_EPOLL
+    epoll_register(EPOLL_CTL_MOD, index);
+#endif
   }
   fds[fdcount].fd=-1;
   fd_callbacks[fdcount]=NULL;
@@ -231,6 +382,22 @@ static void call_alarm(struct sched_ent *alarm, int revents)
   OUT();
 }
 
+static void call_watched(int i)
+{
+  int fd = fds[i].fd;
+  /* Call the alarm callback with the socket in non-blocking mode */
+  errno=0;
+  set_nonblock(fd);
+  // Work around OSX behaviour that doesn't set POLLERR on 
+  // devices that have been deconfigured, e.g., a USB serial adapter
+  // that has been removed.
+  if (errno == ENXIO) fds[i].revents|=POLLERR;
+  call_alarm(fd_callbacks[i], fds[i].revents);
+  /* The alarm may have closed and unwatched the descriptor, make sure this descriptor still matches */
+  if (i<fdcount && fds[i].fd == fd)
+    set_block(fds[i].fd);
+}
+
 int fd_poll()
 {
   IN();
@@ -269,6 +436,26 @@ int fd_poll()
       else
 	usleep(ms*1000);
     }else{
+#ifdef USE_EPOLL
+      if (config.debug.io) DEBUGF("epoll_wait(%d,X,%d,%d)",epoll_fd,fdcount,ms);
+      r = epoll_wait(epoll_fd, epoll_events, fdcount, ms);
+      if (r == -1) {
+	if (errno != EINTR)
+	  WHY_perror("epoll_wait");
+	r = 0;
+      }
+      if (config.debug.io) {
+	strbuf b = strbuf_alloca(1024);
+	int i;
+	for (i = 0; i < r; ++i) {
+	  if (i)
+	    strbuf_puts(b, ", ");
+	  strbuf_sprintf(b, "%d:", (int)(epoll_events[i].data.u64 >> 32));
+	  strbuf_append_poll_events(b, epoll_events[i].events);
+	}
+	DEBUGF("epoll_wait(events=(%s), fdcount=%d, ms=%d) = %d", strbuf_str(b), fdcount, ms, r);
+      }
+#else
       if (config.debug.io) DEBUGF("poll(X,%d,%d)",fdcount,ms);
       r = poll(fds, fdcount, ms);
       if (config.debug.io) {
@@ -284,6 +471,7 @@ int fd_poll()
 	}
 	DEBUGF("poll(fds=(%s), fdcount=%d, ms=%d) = %d", strbuf_str(b), fdcount, ms, r);
       }
+#endif
     }
     fd_func_exit(__HERE__, &call_stats);
     now=gettime_ms();
@@ -299,22 +487,95 @@ int fd_poll()
   
   /* If file descriptors are ready, then call the appropriate functions */
   if (r>0) {
-    for(i=0;i<fdcount;i++)
-      if (fds[i].revents) {
-	int fd = fds[i].fd;
-	/* Call the alarm callback with the socket in non-blocking mode */
-	errno=0;
-	set_nonblock(fd);
-	// Work around OSX behaviour that doesn't set POLLERR on 
-	// devices that have been deconfigured, e.g., a USB serial adapter
-	// that has been removed.
-	if (errno == ENXIO) fds[i].revents|=POLLERR;
-	call_alarm(fd_callbacks[i], fds[i].revents);
-	/* The alarm may have closed and unwatched the descriptor, make sure this descriptor still matches */
-	if (i<fdcount && fds[i].fd == fd)
-	  set_block(fds[i].fd);
+#ifdef USE_EPOLL
+    for(i=0;i<r;i++){
+      int fd = (int)(epoll_events[i].data.u64 >> 32);
+      int index = (int)(uint32_t)epoll_events[i].data.u64;
+      /* An earlier callback may have unwatched or moved this entry; it is level-triggered, so any
+	 event we skip here will be reported again next time round */
+      if (index<fdcount && fds[index].fd == fd){
+	fds[index].revents = epoll_events[i].events;
+	call_watched(index);
       }
+    }
+#else
+    for(i=0;i<fdcount;i++)
+      if (fds[i].revents)
+	call_watched(i);
+#endif
   }
   RETURN(1);
   OUT();
 }
+
+static void sched_test_alarm(struct sched_ent *alarm)
+{
+}
+
+int app_sched_test(const struct cli_parsed *parsed, void *context)
+{
+  const char *seed = NULL;
+  const char *count_arg = NULL;
+  if (   cli_arg(parsed, "--seed", &seed, cli_uint, NULL) == -1
+      || cli_arg(parsed, "--count", &count_arg, cli_uint, NULL) == -1)
+    return -1;
+  if (seed)
+    srandom(atoi(seed));
+  int count = count_arg ? atoi(count_arg) : 100000;
+  if (count <= 0)
+    return WHY("Invalid alarm count");
+  struct profile_total stats = {.name = "sched_test_alarm"};
+  struct sched_ent *alarms = emalloc_zero(count * sizeof(struct sched_ent));
+  if (!alarms)
+    return -1;
+  int i;
+  time_ms_t base = gettime_ms() + 3600000;
+  for (i = 0; i < count; ++i) {
+    alarms[i].function = sched_test_alarm;
+    alarms[i].stats = &stats;
+  }
+
+  printf("Benchmarking alarm scheduling with %d alarms:\n", count);
+  time_ms_t start = gettime_ms();
+  for (i = 0; i < count; ++i) {
+    alarms[i].alarm = base + random() % 1000000;
+    alarms[i].deadline = alarms[i].alarm + 100;
+    schedule(&alarms[i]);
+  }
+  time_ms_t end = gettime_ms();
+  printf("schedule %d alarms took %lldms\n", count, (long long) end - start);
+
+  start = gettime_ms();
+  for (i = 0; i < count; ++i) {
+    struct sched_ent *alarm = &alarms[random() % count];
+    unschedule(alarm);
+    alarm->alarm = base + random() % 1000000;
+    alarm->deadline = alarm->alarm + 100;
+    schedule(alarm);
+  }
+  end = gettime_ms();
+  printf("reschedule %d random alarms took %lldms\n", count, (long long) end - start);
+
+  // drain in order, checking that the heap hands back alarms in time order
+  int ret = 0;
+  time_ms_t last = 0;
+  start = gettime_ms();
+  for (i = 0; i < count; ++i) {
+    struct sched_ent *alarm = next_alarm;
+    if (!alarm || alarm->alarm < last) {
+      ret = WHYF("Alarm #%d out of order", i);
+      break;
+    }
+    last = alarm->alarm;
+    unschedule(alarm);
+  }
+  end = gettime_ms();
+  printf("unschedule %d alarms in order took %lldms\n", i, (long long) end - start);
+
+  for (i = 0; i < count; ++i)
+    unschedule(&alarms[i]);
+  free(alarms);
+  if (ret == 0)
+    printf("Test passed.\n");
+  return ret;
+}
@@ -1619,6 +1619,21 @@ unsigned char *keyring_get_nm_bytes(unsigned char *known_sid, unsigned char *unk
   OUT();
 }
 
+/* Discard any cached shared secrets with a subscriber we are forgetting */
+void keyring_forget_nm_bytes(const unsigned char *unknown_sid)
+{
+  int i=0;
+  while(i<nm_slots_used){
+    if (memcmp(nm_cache[i].unknown_key,unknown_sid,SID_SIZE)==0){
+      nm_slots_used--;
+      if (i!=nm_slots_used)
+	bcopy(&nm_cache[nm_slots_used],&nm_cache[i],sizeof(struct nm_record));
+      bzero(&nm_cache[nm_slots_used],sizeof(struct nm_record));
+    }else
+      i++;
+  }
+}
+
 static int cmp_identity_ptrs(const keyring_identity *const *a, const keyring_identity *const *b)
 {
   int c;
@@ -63,6 +63,70 @@ char *_str_edup(struct __sourceloc __whence, const char *str)
   return _strn_edup(__whence, str, strlen(str));
 }
 
+#if defined(MALLOC_PARANOIA) && !defined(MEM_POOL_DISABLE)
+#define MEM_POOL_DISABLE
+#endif
+
+static struct mem_pool *mem_pools = NULL;
+
+void *_pool_alloc(struct __sourceloc __whence, struct mem_pool *pool)
+{
+  if (!pool->_registered) {
+    pool->_registered = 1;
+    pool->_next = mem_pools;
+    mem_pools = pool;
+  }
+  void *new;
+#ifndef MEM_POOL_DISABLE
+  if (pool->free_list) {
+    new = pool->free_list;
+    pool->free_list = *(void **)new;
+    pool->free_count--;
+    pool->hits++;
+  } else
+#endif
+  // every object must be big enough to hold the free list link
+  if (!(new = _emalloc(__whence, pool->size < sizeof(void *) ? sizeof(void *) : pool->size)))
+    return NULL;
+  pool->allocs++;
+  if (++pool->live > pool->high_water)
+    pool->high_water = pool->live;
+  return new;
+}
+
+void *_pool_alloc_zero(struct __sourceloc __whence, struct mem_pool *pool)
+{
+  void *new = _pool_alloc(__whence, pool);
+  if (new)
+    memset(new, 0, pool->size);
+  return new;
+}
+
+void pool_free(struct mem_pool *pool, void *ptr)
+{
+  if (!ptr)
+    return;
+  pool->live--;
+#ifndef MEM_POOL_DISABLE
+  if (pool->free_count < pool->max_free) {
+    *(void **)ptr = pool->free_list;
+    pool->free_list = ptr;
+    pool->free_count++;
+    return;
+  }
+#endif
+  free(ptr);
+}
+
+void mem_pool_showstats()
+{
+  struct mem_pool *pool;
+  for (pool = mem_pools; pool; pool = pool->_next)
+    INFOF("Pool %s: %u live (high water %u), %u allocations, %u (%.1f%%) from free list of %u",
+	pool->name, pool->live, pool->high_water, pool->allocs, pool->hits,
+	pool->allocs ? pool->hits * 100.0 / pool->allocs : 0.0, pool->free_count);
+}
+
 #undef malloc
 #undef calloc
 #undef free
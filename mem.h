@@ -63,6 +63,49 @@ void *_emalloc_zero(struct __sourceloc, size_t bytes);
 char *_str_edup(struct __sourceloc, const char *str);
 char *_strn_edup(struct __sourceloc, const char *str, size_t len);
 
+/* A free-list pool of fixed-size objects, for structures that are allocated and released at a high
+ * rate (eg, overlay frames and packet buffers).  Released objects are kept on the pool's free
+ * list, up to max_free of them, and handed out again in preference to calling malloc(3).  Every
+ * pool keeps counts of live objects, its high-water mark, and how many allocations were satisfied
+ * from the free list; mem_pool_showstats() logs them.
+ *
+ * Define MEM_POOL_DISABLE (implied by MALLOC_PARANOIA) to pass every allocation straight through
+ * to malloc(3) and free(3), eg, when hunting memory errors with valgrind.  The counts are still
+ * kept.
+ */
+// #define MEM_POOL_DISABLE
+
+struct mem_pool {
+  const char *name;
+  size_t size;
+  unsigned int max_free;
+  void *free_list;
+  unsigned int free_count;
+  unsigned int live;
+  unsigned int high_water;
+  unsigned int allocs;
+  unsigned int hits;
+  int _registered;
+  struct mem_pool *_next;
+};
+
+#define MEM_POOL_INIT(NAME, SIZE, MAX_FREE) {.name = (NAME), .size = (SIZE), .max_free = (MAX_FREE)}
+
+/* Return an uninitialised (or zero-filled) object from the pool, or log an error and return NULL.
+ */
+void *_pool_alloc(struct __sourceloc, struct mem_pool *pool);
+void *_pool_alloc_zero(struct __sourceloc, struct mem_pool *pool);
+
+/* Return an object obtained from pool_alloc() to the pool.  NULL is ignored.
+ */
+void pool_free(struct mem_pool *pool, void *ptr);
+
+/* Log the counts of every pool that has been used.
+ */
+void mem_pool_showstats();
+
+#define pool_alloc(pool)      _pool_alloc(__HERE__, (pool))
+#define pool_alloc_zero(pool) _pool_alloc_zero(__HERE__, (pool))
 #define emalloc(bytes)       _emalloc(__HERE__, (bytes))
 #define erealloc(ptr, bytes) _erealloc(__HERE__, (ptr), (bytes))
 #define emalloc_zero(bytes)  _emalloc_zero(__HERE__, (bytes))
@@ -3,6 +3,8 @@
 
 #define crypto_stream_salsa20_ref_KEYBYTES 32
 #define crypto_stream_salsa20_ref_NONCEBYTES 8
+#define crypto_stream_salsa20_simd_KEYBYTES 32
+#define crypto_stream_salsa20_simd_NONCEBYTES 8
 #ifdef __cplusplus
 #include <string>
 extern std::string crypto_stream_salsa20_ref(size_t,const std::string &,const std::string &);
@@ -14,30 +16,39 @@ extern int crypto_stream_salsa20_ref_xor(unsigned char *,const unsigned char *,u
 extern int crypto_stream_salsa20_ref_beforenm(unsigned char *,const unsigned char *);
 extern int crypto_stream_salsa20_ref_afternm(unsigned char *,unsigned long long,const unsigned char *,const unsigned char *);
 extern int crypto_stream_salsa20_ref_xor_afternm(unsigned char *,const unsigned char *,unsigned long long,const unsigned char *,const unsigned char *);
+extern int crypto_stream_salsa20_simd(unsigned char *,unsigned long long,const unsigned char *,const unsigned char *);
+extern int crypto_stream_salsa20_simd_xor(unsigned char *,const unsigned char *,unsigned long long,const unsigned char *,const unsigned char *);
+extern int crypto_stream_salsa20_simd_xor_offset(unsigned char *,const unsigned char *,unsigned long long,const unsigned char *,unsigned long long,const unsigned char *);
+extern const char *crypto_stream_salsa20_simd_dispatch(void);
 #ifdef __cplusplus
 }
 #endif
 
-#define crypto_stream_salsa20 crypto_stream_salsa20_ref
-/* POTATO crypto_stream_salsa20_ref crypto_stream_salsa20_ref crypto_stream_salsa20 */
-#define crypto_stream_salsa20_xor crypto_stream_salsa20_ref_xor
-/* POTATO crypto_stream_salsa20_ref_xor crypto_stream_salsa20_ref crypto_stream_salsa20 */
-#define crypto_stream_salsa20_beforenm crypto_stream_salsa20_ref_beforenm
-/* POTATO crypto_stream_salsa20_ref_beforenm crypto_stream_salsa20_ref crypto_stream_salsa20 */
-#define crypto_stream_salsa20_afternm crypto_stream_salsa20_ref_afternm
-/* POTATO crypto_stream_salsa20_ref_afternm crypto_stream_salsa20_ref crypto_stream_salsa20 */
-#define crypto_stream_salsa20_xor_afternm crypto_stream_salsa20_ref_xor_afternm
-/* POTATO crypto_stream_salsa20_ref_xor_afternm crypto_stream_salsa20_ref crypto_stream_salsa20 */
-#define crypto_stream_salsa20_KEYBYTES crypto_stream_salsa20_ref_KEYBYTES
-/* POTATO crypto_stream_salsa20_ref_KEYBYTES crypto_stream_salsa20_ref crypto_stream_salsa20 */
-#define crypto_stream_salsa20_NONCEBYTES crypto_stream_salsa20_ref_NONCEBYTES
-/* POTATO crypto_stream_salsa20_ref_NONCEBYTES crypto_stream_salsa20_ref crypto_stream_salsa20 */
-#define crypto_stream_salsa20_BEFORENMBYTES crypto_stream_salsa20_ref_BEFORENMBYTES
-/* POTATO crypto_stream_salsa20_ref_BEFORENMBYTES crypto_stream_salsa20_ref crypto_stream_salsa20 */
-#define crypto_stream_salsa20_IMPLEMENTATION "crypto_stream/salsa20/ref"
+#define crypto_stream_salsa20 crypto_stream_salsa20_simd
+/* POTATO crypto_stream_salsa20_simd crypto_stream_salsa20_simd crypto_stream_salsa20 */
+#define crypto_stream_salsa20_xor crypto_stream_salsa20_simd_xor
+/* POTATO crypto_stream_salsa20_simd_xor crypto_stream_salsa20_simd crypto_stream_salsa20 */
+#define crypto_stream_salsa20_beforenm crypto_stream_salsa20_simd_beforenm
+/* POTATO crypto_stream_salsa20_simd_beforenm crypto_stream_salsa20_simd crypto_stream_salsa20 */
+#define crypto_stream_salsa20_afternm crypto_stream_salsa20_simd_afternm
+/* POTATO crypto_stream_salsa20_simd_afternm crypto_stream_salsa20_simd crypto_stream_salsa20 */
+#define crypto_stream_salsa20_xor_afternm crypto_stream_salsa20_simd_xor_afternm
+/* POTATO crypto_stream_salsa20_simd_xor_afternm crypto_stream_salsa20_simd crypto_stream_salsa20 */
+#define crypto_stream_salsa20_xor_offset crypto_stream_salsa20_simd_xor_offset
+/* POTATO crypto_stream_salsa20_simd_xor_offset crypto_stream_salsa20_simd crypto_stream_salsa20 */
+#define crypto_stream_salsa20_KEYBYTES crypto_stream_salsa20_simd_KEYBYTES
+/* POTATO crypto_stream_salsa20_simd_KEYBYTES crypto_stream_salsa20_simd crypto_stream_salsa20 */
+#define crypto_stream_salsa20_NONCEBYTES crypto_stream_salsa20_simd_NONCEBYTES
+/* POTATO crypto_stream_salsa20_simd_NONCEBYTES crypto_stream_salsa20_simd crypto_stream_salsa20 */
+#define crypto_stream_salsa20_BEFORENMBYTES crypto_stream_salsa20_simd_BEFORENMBYTES
+/* POTATO crypto_stream_salsa20_simd_BEFORENMBYTES crypto_stream_salsa20_simd crypto_stream_salsa20 */
+#define crypto_stream_salsa20_IMPLEMENTATION "crypto_stream/salsa20/simd"
 #ifndef crypto_stream_salsa20_ref_VERSION
 #define crypto_stream_salsa20_ref_VERSION "-"
 #endif
-#define crypto_stream_salsa20_VERSION crypto_stream_salsa20_ref_VERSION
+#ifndef crypto_stream_salsa20_simd_VERSION
+#define crypto_stream_salsa20_simd_VERSION "-"
+#endif
+#define crypto_stream_salsa20_VERSION crypto_stream_salsa20_simd_VERSION
 
 #endif
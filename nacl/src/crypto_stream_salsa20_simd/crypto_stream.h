@@ -0,0 +1,28 @@
+#ifndef crypto_stream_H
+#define crypto_stream_H
+
+#include "crypto_stream_salsa20.h"
+
+#define crypto_stream crypto_stream_salsa20_simd
+/* CHEESEBURGER crypto_stream_salsa20_simd */
+#define crypto_stream_xor crypto_stream_salsa20_simd_xor
+/* CHEESEBURGER crypto_stream_salsa20_simd_xor */
+#define crypto_stream_beforenm crypto_stream_salsa20_simd_beforenm
+/* CHEESEBURGER crypto_stream_salsa20_simd_beforenm */
+#define crypto_stream_afternm crypto_stream_salsa20_simd_afternm
+/* CHEESEBURGER crypto_stream_salsa20_simd_afternm */
+#define crypto_stream_xor_afternm crypto_stream_salsa20_simd_xor_afternm
+/* CHEESEBURGER crypto_stream_salsa20_simd_xor_afternm */
+#define crypto_stream_KEYBYTES crypto_stream_salsa20_simd_KEYBYTES
+/* CHEESEBURGER crypto_stream_salsa20_simd_KEYBYTES */
+#define crypto_stream_NONCEBYTES crypto_stream_salsa20_simd_NONCEBYTES
+/* CHEESEBURGER crypto_stream_salsa20_simd_NONCEBYTES */
+#define crypto_stream_BEFORENMBYTES crypto_stream_salsa20_simd_BEFORENMBYTES
+/* CHEESEBURGER crypto_stream_salsa20_simd_BEFORENMBYTES */
+#define crypto_stream_xor_offset crypto_stream_salsa20_simd_xor_offset
+/* CHEESEBURGER crypto_stream_salsa20_simd_xor_offset */
+#define crypto_stream_PRIMITIVE "salsa20"
+#define crypto_stream_IMPLEMENTATION "crypto_stream/salsa20/simd"
+#define crypto_stream_VERSION crypto_stream_salsa20_simd_VERSION
+
+#endif
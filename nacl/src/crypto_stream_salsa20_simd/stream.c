@@ -0,0 +1,18 @@
+/*
+Salsa20 keystream, using the multi-block xor implementation.
+Based on version 20080913 by D. J. Bernstein.
+Public domain.
+*/
+
+#include <string.h>
+#include "crypto_stream.h"
+
+int crypto_stream(
+        unsigned char *c,unsigned long long clen,
+  const unsigned char *n,
+  const unsigned char *k
+)
+{
+  memset(c,0,clen);
+  return crypto_stream_xor(c,c,clen,n,k);
+}
@@ -0,0 +1,273 @@
+/*
+Salsa20 stream xor, computing several blocks of keystream at once.
+
+Each vector lane holds the same state word of a different block, so four
+(SSE2) or eight (AVX2) consecutive blocks are computed with the same round
+code as the reference core.  The widest implementation the CPU supports is
+chosen at run time; other architectures use the portable single block code.
+
+Based on version 20080913 by D. J. Bernstein.
+Public domain.
+*/
+
+#include "crypto_stream.h"
+
+typedef unsigned int uint32;
+typedef unsigned long long uint64;
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define SALSA20_X86 1
+#include <immintrin.h>
+#endif
+
+#define DOUBLEROUND(R,x) \
+  R(x[ 4],x[ 0],x[12], 7) R(x[ 8],x[ 4],x[ 0], 9) R(x[12],x[ 8],x[ 4],13) R(x[ 0],x[12],x[ 8],18) \
+  R(x[ 9],x[ 5],x[ 1], 7) R(x[13],x[ 9],x[ 5], 9) R(x[ 1],x[13],x[ 9],13) R(x[ 5],x[ 1],x[13],18) \
+  R(x[14],x[10],x[ 6], 7) R(x[ 2],x[14],x[10], 9) R(x[ 6],x[ 2],x[14],13) R(x[10],x[ 6],x[ 2],18) \
+  R(x[ 3],x[15],x[11], 7) R(x[ 7],x[ 3],x[15], 9) R(x[11],x[ 7],x[ 3],13) R(x[15],x[11],x[ 7],18) \
+  R(x[ 1],x[ 0],x[ 3], 7) R(x[ 2],x[ 1],x[ 0], 9) R(x[ 3],x[ 2],x[ 1],13) R(x[ 0],x[ 3],x[ 2],18) \
+  R(x[ 6],x[ 5],x[ 4], 7) R(x[ 7],x[ 6],x[ 5], 9) R(x[ 4],x[ 7],x[ 6],13) R(x[ 5],x[ 4],x[ 7],18) \
+  R(x[11],x[10],x[ 9], 7) R(x[ 8],x[11],x[10], 9) R(x[ 9],x[ 8],x[11],13) R(x[10],x[ 9],x[ 8],18) \
+  R(x[12],x[15],x[14], 7) R(x[13],x[12],x[15], 9) R(x[14],x[13],x[12],13) R(x[15],x[14],x[13],18)
+
+#define R_SCALAR(a,b,c,n) { uint32 t_ = (b) + (c); (a) ^= (t_ << (n)) | (t_ >> (32 - (n))); }
+
+static uint32 load_littleendian(const unsigned char *x)
+{
+  return
+      (uint32) (x[0]) \
+  | (((uint32) (x[1])) << 8) \
+  | (((uint32) (x[2])) << 16) \
+  | (((uint32) (x[3])) << 24)
+  ;
+}
+
+static void setup(uint32 s[16],const unsigned char *n,const unsigned char *k)
+{
+  /* "expand 32-byte k" */
+  s[0] = 0x61707865;
+  s[5] = 0x3320646e;
+  s[10] = 0x79622d32;
+  s[15] = 0x6b206574;
+  s[1] = load_littleendian(k + 0);
+  s[2] = load_littleendian(k + 4);
+  s[3] = load_littleendian(k + 8);
+  s[4] = load_littleendian(k + 12);
+  s[11] = load_littleendian(k + 16);
+  s[12] = load_littleendian(k + 20);
+  s[13] = load_littleendian(k + 24);
+  s[14] = load_littleendian(k + 28);
+  s[6] = load_littleendian(n + 0);
+  s[7] = load_littleendian(n + 4);
+  s[8] = 0;
+  s[9] = 0;
+}
+
+/* xor len bytes of block number counter, starting skip bytes into the block */
+static void block_xor(unsigned char *c,const unsigned char *m,unsigned int len,unsigned int skip,
+  const uint32 s[16],uint64 counter)
+{
+  uint32 x[16];
+  unsigned int i;
+
+  for (i = 0;i < 16;++i) x[i] = s[i];
+  x[8] = (uint32) counter;
+  x[9] = (uint32) (counter >> 32);
+  for (i = 0;i < 20;i += 2) {
+    DOUBLEROUND(R_SCALAR,x)
+  }
+  x[8] += (uint32) counter;
+  x[9] += (uint32) (counter >> 32);
+  for (i = 0;i < 16;++i) if (i != 8 && i != 9) x[i] += s[i];
+
+  for (i = skip;i < skip + len;++i)
+    c[i - skip] = m[i - skip] ^ (unsigned char) (x[i >> 2] >> (8 * (i & 3)));
+}
+
+#ifdef SALSA20_X86
+
+#define R_SSE2(a,b,c,n) { __m128i t_ = _mm_add_epi32((b),(c)); \
+  (a) = _mm_xor_si128((a),_mm_slli_epi32(t_,(n))); \
+  (a) = _mm_xor_si128((a),_mm_srli_epi32(t_,32 - (n))); }
+
+/* xor four consecutive blocks (256 bytes) */
+__attribute__((target("sse2")))
+static void blocks4_xor(unsigned char *c,const unsigned char *m,const uint32 s[16],uint64 counter)
+{
+  __m128i x[16],orig[16];
+  int i,g;
+
+  for (i = 0;i < 16;++i) orig[i] = _mm_set1_epi32(s[i]);
+  orig[8] = _mm_set_epi32((uint32) (counter + 3),(uint32) (counter + 2),
+                          (uint32) (counter + 1),(uint32) counter);
+  orig[9] = _mm_set_epi32((uint32) ((counter + 3) >> 32),(uint32) ((counter + 2) >> 32),
+                          (uint32) ((counter + 1) >> 32),(uint32) (counter >> 32));
+  for (i = 0;i < 16;++i) x[i] = orig[i];
+  for (i = 0;i < 20;i += 2) {
+    DOUBLEROUND(R_SSE2,x)
+  }
+  for (i = 0;i < 16;++i) x[i] = _mm_add_epi32(x[i],orig[i]);
+
+  /* transpose each group of four words back into block order */
+  for (g = 0;g < 4;++g) {
+    __m128i t0 = _mm_unpacklo_epi32(x[4*g],x[4*g+1]);
+    __m128i t1 = _mm_unpacklo_epi32(x[4*g+2],x[4*g+3]);
+    __m128i t2 = _mm_unpackhi_epi32(x[4*g],x[4*g+1]);
+    __m128i t3 = _mm_unpackhi_epi32(x[4*g+2],x[4*g+3]);
+    __m128i b[4];
+    b[0] = _mm_unpacklo_epi64(t0,t1);
+    b[1] = _mm_unpackhi_epi64(t0,t1);
+    b[2] = _mm_unpacklo_epi64(t2,t3);
+    b[3] = _mm_unpackhi_epi64(t2,t3);
+    for (i = 0;i < 4;++i) {
+      __m128i *out = (__m128i *) (c + 64*i + 16*g);
+      __m128i in = _mm_loadu_si128((const __m128i *) (m + 64*i + 16*g));
+      _mm_storeu_si128(out,_mm_xor_si128(in,b[i]));
+    }
+  }
+}
+
+#define R_AVX2(a,b,c,n) { __m256i t_ = _mm256_add_epi32((b),(c)); \
+  (a) = _mm256_xor_si256((a),_mm256_slli_epi32(t_,(n))); \
+  (a) = _mm256_xor_si256((a),_mm256_srli_epi32(t_,32 - (n))); }
+
+/* xor eight consecutive blocks (512 bytes) */
+__attribute__((target("avx2")))
+static void blocks8_xor(unsigned char *c,const unsigned char *m,const uint32 s[16],uint64 counter)
+{
+  __m256i x[16],orig[16],b[4][4];
+  int i,g;
+
+  for (i = 0;i < 16;++i) orig[i] = _mm256_set1_epi32(s[i]);
+  orig[8] = _mm256_set_epi32((uint32) (counter + 7),(uint32) (counter + 6),
+                             (uint32) (counter + 5),(uint32) (counter + 4),
+                             (uint32) (counter + 3),(uint32) (counter + 2),
+                             (uint32) (counter + 1),(uint32) counter);
+  orig[9] = _mm256_set_epi32((uint32) ((counter + 7) >> 32),(uint32) ((counter + 6) >> 32),
+                             (uint32) ((counter + 5) >> 32),(uint32) ((counter + 4) >> 32),
+                             (uint32) ((counter + 3) >> 32),(uint32) ((counter + 2) >> 32),
+                             (uint32) ((counter + 1) >> 32),(uint32) (counter >> 32));
+  for (i = 0;i < 16;++i) x[i] = orig[i];
+  for (i = 0;i < 20;i += 2) {
+    DOUBLEROUND(R_AVX2,x)
+  }
+  for (i = 0;i < 16;++i) x[i] = _mm256_add_epi32(x[i],orig[i]);
+
+  /* transpose within each 128 bit half; b[g][j] then holds words 4g..4g+3
+     of block j in the low half and of block j+4 in the high half */
+  for (g = 0;g < 4;++g) {
+    __m256i t0 = _mm256_unpacklo_epi32(x[4*g],x[4*g+1]);
+    __m256i t1 = _mm256_unpacklo_epi32(x[4*g+2],x[4*g+3]);
+    __m256i t2 = _mm256_unpackhi_epi32(x[4*g],x[4*g+1]);
+    __m256i t3 = _mm256_unpackhi_epi32(x[4*g+2],x[4*g+3]);
+    b[g][0] = _mm256_unpacklo_epi64(t0,t1);
+    b[g][1] = _mm256_unpackhi_epi64(t0,t1);
+    b[g][2] = _mm256_unpacklo_epi64(t2,t3);
+    b[g][3] = _mm256_unpackhi_epi64(t2,t3);
+  }
+  /* join pairs of groups into 32 byte runs of each block */
+  for (g = 0;g < 4;g += 2) {
+    for (i = 0;i < 4;++i) {
+      __m256i lo = _mm256_permute2x128_si256(b[g][i],b[g+1][i],0x20);
+      __m256i hi = _mm256_permute2x128_si256(b[g][i],b[g+1][i],0x31);
+      unsigned char *out = c + 64*i + 16*g;
+      const unsigned char *in = m + 64*i + 16*g;
+      _mm256_storeu_si256((__m256i *) out,
+        _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) in),lo));
+      _mm256_storeu_si256((__m256i *) (out + 256),
+        _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (in + 256)),hi));
+    }
+  }
+}
+
+#endif
+
+static int simd_level = -1;
+
+static int dispatch(void)
+{
+  if (simd_level == -1) {
+    int level = 0;
+#ifdef SALSA20_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) level = 2;
+    else if (__builtin_cpu_supports("sse2")) level = 1;
+#endif
+    simd_level = level;
+  }
+  return simd_level;
+}
+
+const char *crypto_stream_salsa20_simd_dispatch(void)
+{
+  switch (dispatch()) {
+    case 2: return "avx2";
+    case 1: return "sse2";
+  }
+  return "portable";
+}
+
+/* xor with the keystream starting at any byte offset, so callers can resume
+   part way through a stream without generating and discarding the start */
+int crypto_stream_xor_offset(
+        unsigned char *c,
+  const unsigned char *m,unsigned long long mlen,
+  const unsigned char *n,
+  unsigned long long offset,
+  const unsigned char *k
+)
+{
+  uint32 s[16];
+  uint64 counter = offset >> 6;
+  unsigned int skip = offset & 63;
+  unsigned int len;
+  int level;
+
+  if (!mlen) return 0;
+  setup(s,n,k);
+
+  if (skip) {
+    len = 64 - skip;
+    if (len > mlen) len = mlen;
+    block_xor(c,m,len,skip,s,counter);
+    c += len; m += len; mlen -= len;
+    ++counter;
+  }
+
+  level = dispatch();
+#ifdef SALSA20_X86
+  if (level >= 2)
+    while (mlen >= 512) {
+      blocks8_xor(c,m,s,counter);
+      c += 512; m += 512; mlen -= 512;
+      counter += 8;
+    }
+  if (level >= 1)
+    while (mlen >= 256) {
+      blocks4_xor(c,m,s,counter);
+      c += 256; m += 256; mlen -= 256;
+      counter += 4;
+    }
+#else
+  (void) level;
+#endif
+
+  while (mlen) {
+    len = mlen < 64 ? mlen : 64;
+    block_xor(c,m,len,0,s,counter);
+    c += len; m += len; mlen -= len;
+    ++counter;
+  }
+  return 0;
+}
+
+int crypto_stream_xor(
+        unsigned char *c,
+  const unsigned char *m,unsigned long long mlen,
+  const unsigned char *n,
+  const unsigned char *k
+)
+{
+  return crypto_stream_xor_offset(c,m,mlen,n,0,k);
+}
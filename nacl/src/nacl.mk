@@ -1,2 +1,2 @@
 NACL_SOURCES := \
-$(NACL_BASE)/crypto_auth_hmacsha256_ref/hmac.c $(NACL_BASE)/crypto_auth_hmacsha256_ref/verify.c $(NACL_BASE)/crypto_auth_hmacsha512256_ref/hmac.c $(NACL_BASE)/crypto_auth_hmacsha512256_ref/verify.c $(NACL_BASE)/crypto_box_curve25519xsalsa20poly1305_ref/after.c $(NACL_BASE)/crypto_box_curve25519xsalsa20poly1305_ref/before.c $(NACL_BASE)/crypto_box_curve25519xsalsa20poly1305_ref/box.c $(NACL_BASE)/crypto_box_curve25519xsalsa20poly1305_ref/keypair.c $(NACL_BASE)/crypto_core_hsalsa20_ref/core.c $(NACL_BASE)/crypto_core_salsa2012_ref/core.c $(NACL_BASE)/crypto_core_salsa208_ref/core.c $(NACL_BASE)/crypto_core_salsa20_ref/core.c $(NACL_BASE)/crypto_hash_sha256_ref/hash.c $(NACL_BASE)/crypto_hash_sha512_ref/hash.c $(NACL_BASE)/crypto_hashblocks_sha256_ref/blocks.c $(NACL_BASE)/crypto_hashblocks_sha512_ref/blocks.c $(NACL_BASE)/crypto_onetimeauth_poly1305_ref/auth.c $(NACL_BASE)/crypto_onetimeauth_poly1305_ref/verify.c $(NACL_BASE)/crypto_scalarmult_curve25519_ref/base.c $(NACL_BASE)/crypto_scalarmult_curve25519_ref/smult.c $(NACL_BASE)/crypto_secretbox_xsalsa20poly1305_ref/box.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe25519.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_0.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_1.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_add.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_cmov.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_copy.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_frombytes.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_invert.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_isnegative.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_isnonzero.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_mul.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_neg.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_pow22523.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_sq.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_sq2.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_sub.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_tobytes.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge25519.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_add.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_double_scalarmult.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_frombytes.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_madd.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_msub.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_p1p1_to_p2.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_p1p1_to_p3.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_p2_0.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_p2_dbl.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_p3_0.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_p3_dbl.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_p3_to_cached.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_p3_to_p2.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_p3_tobytes.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_precomp_0.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_scalarmult_base.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_sub.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_tobytes.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/keypair.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/open.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/sc25519.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/sc_muladd.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/sc_reduce.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/sign.c $(NACL_BASE)/crypto_stream_salsa2012_ref/stream.c $(NACL_BASE)/crypto_stream_salsa2012_ref/xor.c $(NACL_BASE)/crypto_stream_salsa208_ref/stream.c $(NACL_BASE)/crypto_stream_salsa208_ref/xor.c $(NACL_BASE)/crypto_stream_salsa20_ref/stream.c $(NACL_BASE)/crypto_stream_salsa20_ref/xor.c $(NACL_BASE)/crypto_stream_xsalsa20_ref/stream.c $(NACL_BASE)/crypto_stream_xsalsa20_ref/xor.c $(NACL_BASE)/crypto_verify_16_ref/verify.c $(NACL_BASE)/crypto_verify_32_ref/verify.c
+$(NACL_BASE)/crypto_auth_hmacsha256_ref/hmac.c $(NACL_BASE)/crypto_auth_hmacsha256_ref/verify.c $(NACL_BASE)/crypto_auth_hmacsha512256_ref/hmac.c $(NACL_BASE)/crypto_auth_hmacsha512256_ref/verify.c $(NACL_BASE)/crypto_box_curve25519xsalsa20poly1305_ref/after.c $(NACL_BASE)/crypto_box_curve25519xsalsa20poly1305_ref/before.c $(NACL_BASE)/crypto_box_curve25519xsalsa20poly1305_ref/box.c $(NACL_BASE)/crypto_box_curve25519xsalsa20poly1305_ref/keypair.c $(NACL_BASE)/crypto_core_hsalsa20_ref/core.c $(NACL_BASE)/crypto_core_salsa2012_ref/core.c $(NACL_BASE)/crypto_core_salsa208_ref/core.c $(NACL_BASE)/crypto_core_salsa20_ref/core.c $(NACL_BASE)/crypto_hash_sha256_ref/hash.c $(NACL_BASE)/crypto_hash_sha512_ref/hash.c $(NACL_BASE)/crypto_hashblocks_sha256_ref/blocks.c $(NACL_BASE)/crypto_hashblocks_sha512_ref/blocks.c $(NACL_BASE)/crypto_onetimeauth_poly1305_ref/auth.c $(NACL_BASE)/crypto_onetimeauth_poly1305_ref/verify.c $(NACL_BASE)/crypto_scalarmult_curve25519_ref/base.c $(NACL_BASE)/crypto_scalarmult_curve25519_ref/smult.c $(NACL_BASE)/crypto_secretbox_xsalsa20poly1305_ref/box.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe25519.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_0.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_1.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_add.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_cmov.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_copy.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_frombytes.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_invert.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_isnegative.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_isnonzero.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_mul.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_neg.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_pow22523.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_sq.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_sq2.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_sub.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/fe_tobytes.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge25519.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_add.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_double_scalarmult.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_frombytes.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_madd.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_msub.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_p1p1_to_p2.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_p1p1_to_p3.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_p2_0.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_p2_dbl.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_p3_0.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_p3_dbl.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_p3_to_cached.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_p3_to_p2.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_p3_tobytes.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_precomp_0.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_scalarmult_base.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_sub.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/ge_tobytes.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/keypair.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/open.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/sc25519.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/sc_muladd.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/sc_reduce.c $(NACL_BASE)/crypto_sign_edwards25519sha512batch_ref/sign.c $(NACL_BASE)/crypto_stream_salsa2012_ref/stream.c $(NACL_BASE)/crypto_stream_salsa2012_ref/xor.c $(NACL_BASE)/crypto_stream_salsa208_ref/stream.c $(NACL_BASE)/crypto_stream_salsa208_ref/xor.c $(NACL_BASE)/crypto_stream_salsa20_ref/stream.c $(NACL_BASE)/crypto_stream_salsa20_ref/xor.c $(NACL_BASE)/crypto_stream_salsa20_simd/stream.c $(NACL_BASE)/crypto_stream_salsa20_simd/xor.c $(NACL_BASE)/crypto_stream_xsalsa20_ref/stream.c $(NACL_BASE)/crypto_stream_xsalsa20_ref/xor.c $(NACL_BASE)/crypto_verify_16_ref/verify.c $(NACL_BASE)/crypto_verify_32_ref/verify.c
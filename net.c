@@ -123,8 +123,33 @@ ssize_t _write_str_nonblock(int fd, const char *str, struct __sourceloc __whence
   return _write_all_nonblock(fd, str, strlen(str), __whence);
 }
 
-ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl,
-		    struct sockaddr *recvaddr, socklen_t *recvaddrlen)
+static void recv_ttl(struct msghdr *msg, int *ttl)
+{
+  struct cmsghdr *cmsg;
+  for (cmsg = CMSG_FIRSTHDR(msg); 
+       cmsg != NULL; 
+       cmsg = CMSG_NXTHDR(msg,cmsg)) {
+    
+    if ((cmsg->cmsg_level == IPPROTO_IP) && 
+	((cmsg->cmsg_type == IP_RECVTTL) ||(cmsg->cmsg_type == IP_TTL))
+	&&(cmsg->cmsg_len) ){
+      if (config.debug.packetrx)
+	DEBUGF("  TTL (%p) data location resolves to %p", ttl,CMSG_DATA(cmsg));
+      if (CMSG_DATA(cmsg)) {
+	*ttl = *(unsigned char *) CMSG_DATA(cmsg);
+	if (config.debug.packetrx)
+	  DEBUGF("  TTL of packet is %d", *ttl);
+      } 
+    } else {
+      if (config.debug.packetrx)
+	DEBUGF("I didn't expect to see level=%02x, type=%02x",
+	       cmsg->cmsg_level,cmsg->cmsg_type);
+    }	 
+  }
+}
+
+static ssize_t _recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl,
+		    struct sockaddr *recvaddr, socklen_t *recvaddrlen, int flags)
 {
   struct msghdr msg;
   struct iovec iov[1];
@@ -145,7 +170,7 @@ ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl,
   msg.msg_controllen = sizeof(struct cmsghdr)*16;
   msg.msg_flags = 0;
   
-  ssize_t len = recvmsg(sock,&msg,0);
+  ssize_t len = recvmsg(sock,&msg,flags);
   if (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
     return WHY_perror("recvmsg");
   
@@ -154,31 +179,98 @@ ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl,
     dump("received data", buffer, len);
   }
   
-  struct cmsghdr *cmsg;
   if (len>0)
-  {
-    for (cmsg = CMSG_FIRSTHDR(&msg); 
-	 cmsg != NULL; 
-	 cmsg = CMSG_NXTHDR(&msg,cmsg)) {
-      
-      if ((cmsg->cmsg_level == IPPROTO_IP) && 
-	  ((cmsg->cmsg_type == IP_RECVTTL) ||(cmsg->cmsg_type == IP_TTL))
-	  &&(cmsg->cmsg_len) ){
-	if (config.debug.packetrx)
-	  DEBUGF("  TTL (%p) data location resolves to %p", ttl,CMSG_DATA(cmsg));
-	if (CMSG_DATA(cmsg)) {
-	  *ttl = *(unsigned char *) CMSG_DATA(cmsg);
-	  if (config.debug.packetrx)
-	    DEBUGF("  TTL of packet is %d", *ttl);
-	} 
-      } else {
-	if (config.debug.packetrx)
-	  DEBUGF("I didn't expect to see level=%02x, type=%02x",
-		 cmsg->cmsg_level,cmsg->cmsg_type);
-      }	 
-    }
-  }
+    recv_ttl(&msg, ttl);
   *recvaddrlen=msg.msg_namelen;
   
   return len;
 }
+
+ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl,
+		    struct sockaddr *recvaddr, socklen_t *recvaddrlen)
+{
+  return _recvwithttl(sock, buffer, bufferlen, ttl, recvaddr, recvaddrlen, 0);
+}
+
+int recvmanywithttl(int sock, struct recv_datagram *dgrams, int count)
+{
+#ifdef HAVE_RECVMMSG
+  if (count > RECV_BATCH_MAX)
+    count = RECV_BATCH_MAX;
+  struct mmsghdr msgs[count];
+  struct iovec iov[count];
+  struct cmsghdr cmsgcmsg[count][16];
+  int i;
+  bzero(msgs, sizeof msgs);
+  for (i = 0; i < count; ++i) {
+    iov[i].iov_base = dgrams[i].buffer;
+    iov[i].iov_len = dgrams[i].bufferlen;
+    msgs[i].msg_hdr.msg_name = &dgrams[i].addr;
+    msgs[i].msg_hdr.msg_namelen = sizeof dgrams[i].addr;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = &cmsgcmsg[i][0];
+    msgs[i].msg_hdr.msg_controllen = sizeof cmsgcmsg[i];
+  }
+  int n = recvmmsg(sock, msgs, count, MSG_DONTWAIT, NULL);
+  if (n == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    return WHY_perror("recvmmsg");
+  }
+  for (i = 0; i < n; ++i) {
+    dgrams[i].len = msgs[i].msg_len;
+    dgrams[i].addrlen = msgs[i].msg_hdr.msg_namelen;
+    dgrams[i].ttl = 1;
+    recv_ttl(&msgs[i].msg_hdr, &dgrams[i].ttl);
+  }
+  return n;
+#else
+  /* Without recvmmsg(), fill the batch one datagram at a time, so that a short batch still
+     means the socket would block */
+  int i;
+  for (i = 0; i < count; ++i) {
+    dgrams[i].ttl = 1;
+    dgrams[i].addrlen = sizeof dgrams[i].addr;
+    dgrams[i].len = _recvwithttl(sock, dgrams[i].buffer, dgrams[i].bufferlen, &dgrams[i].ttl,
+				 &dgrams[i].addr, &dgrams[i].addrlen, MSG_DONTWAIT);
+    if (dgrams[i].len == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	break;
+      return i ? i : -1;
+    }
+  }
+  return i;
+#endif
+}
+
+int sendmanyto(int sock, const struct send_datagram *dgrams, int count)
+{
+  if (count > SEND_BATCH_MAX)
+    count = SEND_BATCH_MAX;
+  int i;
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr msgs[count];
+  struct iovec iov[count];
+  bzero(msgs, sizeof msgs);
+  for (i = 0; i < count; ++i) {
+    iov[i].iov_base = (void *)dgrams[i].buffer;
+    iov[i].iov_len = dgrams[i].len;
+    msgs[i].msg_hdr.msg_name = (void *)dgrams[i].addr;
+    msgs[i].msg_hdr.msg_namelen = dgrams[i].addrlen;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  int n = sendmmsg(sock, msgs, count, 0);
+  if (n == -1)
+    return -1;
+  // a datagram socket sends each message whole or not at all
+  return n;
+#else
+  for (i = 0; i < count; ++i) {
+    if (sendto(sock, dgrams[i].buffer, dgrams[i].len, 0, dgrams[i].addr, dgrams[i].addrlen) != dgrams[i].len)
+      return i ? i : -1;
+  }
+  return count;
+#endif
+}
@@ -50,4 +50,42 @@ ssize_t _write_str(int fd, const char *str, struct __sourceloc __whence);
 ssize_t _write_str_nonblock(int fd, const char *str, struct __sourceloc __whence);
 ssize_t recvwithttl(int sock, unsigned char *buffer, size_t bufferlen, int *ttl, struct sockaddr *recvaddr, socklen_t *recvaddrlen);
 
+/* One datagram slot for recvmanywithttl().  The caller supplies the buffer and its size; the
+ * received length, TTL and source address are filled in.
+ */
+struct recv_datagram {
+  unsigned char *buffer;
+  size_t bufferlen;
+  ssize_t len;
+  int ttl;
+  struct sockaddr addr;
+  socklen_t addrlen;
+};
+
+#define RECV_BATCH_MAX 32
+
+/* Receive as many waiting datagrams as will fit in the given slots (at most RECV_BATCH_MAX) with a
+ * single recvmmsg(2) system call, or one recvmsg(2) call per datagram if recvmmsg() is not
+ * available.  Never blocks.  Returns fewer than count only if no more datagrams were waiting.
+ * Returns the number of datagrams received, 0 if none were waiting, or -1 on error.
+ */
+int recvmanywithttl(int sock, struct recv_datagram *dgrams, int count);
+
+/* One datagram for sendmanyto().
+ */
+struct send_datagram {
+  const unsigned char *buffer;
+  size_t len;
+  const struct sockaddr *addr;
+  socklen_t addrlen;
+};
+
+#define SEND_BATCH_MAX 32
+
+/* Send the given datagrams (at most SEND_BATCH_MAX) with a single sendmmsg(2) system call, or with
+ * one sendto(2) call each if sendmmsg() is not available.  Returns the number of datagrams sent
+ * before the first failure, or -1 with errno set if the first one could not be sent.
+ */
+int sendmanyto(int sock, const struct send_datagram *dgrams, int count);
+
 #endif // __SERVALD_NET_H
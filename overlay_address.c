@@ -28,6 +28,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "serval.h"
 #include "conf.h"
 #include "str.h"
+#include "mem.h"
+#include "cli.h"
 #include "overlay_address.h"
 #include "overlay_buffer.h"
 #include "overlay_packet.h"
@@ -40,121 +42,671 @@ static struct broadcast bpilist[MAX_BPIS];
 #define OA_CODE_SELF 0xff
 #define OA_CODE_PREVIOUS 0xfe
 
-// each node has 16 slots based on the next 4 bits of a subscriber id
-// each slot either points to another tree node or a struct subscriber.
-struct tree_node{
-  // bit flags for the type of object each element points to
-  int is_tree;
+/* Known subscribers are kept in one open addressed table, sorted by SID.
+
+ Each subscriber's home slot is chosen by the leading bits of its SID. SIDs are public keys, so those
+ bits are already evenly spread. An entry sits in its home slot, or further along the same run of
+ occupied slots when earlier SIDs have taken it. Probing never wraps around. Instead, there are spare
+ slots past the last home slot. Inserting shifts the rest of a run up by one slot, and removing
+ shifts it back, so the occupied slots are always in SID order.
+ - Resolving a whole SID costs one or two probes of a flat array.
+ - Every subscriber starting with an abbreviation at least as long as the table index has the same
+   home slot, so the abbreviation is resolved by scanning the run from there.
+ - Enumerating subscribers in SID order, and finding the neighbours that decide abbreviate_len, are
+   walks over the slots.
+ */
+
+struct subscriber_slot{
+  // the first 4 bytes of the sid, so most comparisons don't have to touch the subscriber
+  uint32_t prefix;
+  struct subscriber *subscriber;
+};
+
+struct subscriber_index{
+  // 1<<table_bits home slots, then spare slots for runs that continue past the last one
+  struct subscriber_slot *table;
+  unsigned int table_bits;
+  unsigned int table_size;
+  unsigned int count;
   
-  union{
-    struct tree_node *tree_nodes[16];
-    struct subscriber *subscribers[16];
-  };
+  // incremented whenever the table is modified, so enumeration can notice
+  unsigned int generation;
 };
 
-static struct tree_node root;
+#define SUBSCRIBER_SPARE_SLOTS 16
+
+// a whole or abbreviated sid to search for
+struct sid_search{
+  const unsigned char *sid;
+  int len;
+  uint32_t prefix;
+  uint32_t mask;
+};
+
+static struct subscriber_index subscribers;
 
 struct subscriber *my_subscriber=NULL;
 
-static unsigned char get_nibble(const unsigned char *sid, int pos){
-  unsigned char byte = sid[pos>>1];
-  if (!(pos&1))
-    byte=byte>>4;
-  return byte&0xF;
+// the first len bytes of the sid (at most 4), left aligned
+static uint32_t sid_prefix(const unsigned char *sid, int len){
+  uint32_t prefix = sid[0]<<24;
+  if (len>1)
+    prefix |= sid[1]<<16;
+  if (len>2)
+    prefix |= sid[2]<<8;
+  if (len>3)
+    prefix |= sid[3];
+  return prefix;
 }
 
-// find a subscriber struct from a whole or abbreviated subscriber id
-struct subscriber *find_subscriber(const unsigned char *sid, int len, int create){
-  struct tree_node *ptr = &root;
-  int pos=0;
-  if (len!=SID_SIZE)
-    create =0;
+static unsigned int slot_home(uint32_t prefix, unsigned int bits){
+  return prefix >> (32 - bits);
+}
+
+static void sid_search_init(struct sid_search *search, const unsigned char *sid, int len){
+  search->sid = sid;
+  search->len = len;
+  search->prefix = sid_prefix(sid, len);
+  search->mask = len>=4 ? ~(uint32_t)0 : ~(~(uint32_t)0 >> (len*8));
+}
+
+// compare an indexed subscriber with the first len bytes of the sid we are searching for
+static int sid_search_cmp(const struct subscriber_slot *slot, const struct sid_search *search){
+  uint32_t prefix = slot->prefix & search->mask;
+  if (prefix != search->prefix)
+    return prefix < search->prefix ? -1 : 1;
+  if (search->len<=4)
+    return 0;
+  return memcmp(slot->subscriber->sid+4, search->sid+4, search->len-4);
+}
+
+/* Find the first slot at or after the search's home slot that is empty, or holds a subscriber >= the
+ * search. Everything before it is smaller, and nothing from there on is.
+ */
+static unsigned int index_lower_bound(struct subscriber_index *index, struct sid_search *search){
+  unsigned int i;
+  for (i = slot_home(search->prefix, index->table_bits); i < index->table_size; i++){
+    if (!index->table[i].subscriber || sid_search_cmp(&index->table[i], search) >= 0)
+      break;
+  }
+  return i;
+}
+
+static struct subscriber *index_lookup(struct subscriber_index *index, const unsigned char *sid){
+  if (!index->table)
+    return NULL;
+  uint32_t prefix = sid_prefix(sid, SID_SIZE);
+  unsigned int i;
+  for (i = slot_home(prefix, index->table_bits); i < index->table_size && index->table[i].subscriber; i++){
+    if (index->table[i].prefix > prefix)
+      break;
+    if (index->table[i].prefix == prefix){
+      int c = memcmp(index->table[i].subscriber->sid+4, sid+4, SID_SIZE-4);
+      if (c==0)
+	return index->table[i].subscriber;
+      if (c>0)
+	break;
+    }
+  }
+  return NULL;
+}
+
+// copy the table in sid order, each entry goes in its home slot or just after the one before
+static int index_rebuild(struct subscriber_index *index, unsigned int bits, unsigned int spare){
+  unsigned int size = (1<<bits) + spare;
+  struct subscriber_slot *table = emalloc_zero(size * sizeof(struct subscriber_slot));
+  if (!table)
+    return -1;
+  unsigned int i, next=0;
+  for (i=0;i<index->table_size;i++){
+    if (!index->table[i].subscriber)
+      continue;
+    unsigned int home = slot_home(index->table[i].prefix, bits);
+    if (next < home)
+      next = home;
+    if (next >= size){
+      free(table);
+      return index_rebuild(index, bits, spare*2);
+    }
+    table[next++] = index->table[i];
+  }
+  if (index->table)
+    free(index->table);
+  index->table = table;
+  index->table_bits = bits;
+  index->table_size = size;
+  return 0;
+}
+
+// keep the table at most a quarter full, so that the runs of occupied slots stay short
+static int index_grow(struct subscriber_index *index){
+  if (!index->table)
+    return index_rebuild(index, 6, SUBSCRIBER_SPARE_SLOTS);
+  if ((index->count+1)*4 <= 1u<<index->table_bits)
+    return 0;
+  return index_rebuild(index, index->table_bits+1, index->table_size - (1<<index->table_bits));
+}
+
+static struct subscriber *index_prev(struct subscriber_index *index, unsigned int pos){
+  while (pos>0){
+    pos--;
+    if (index->table[pos].subscriber)
+      return index->table[pos].subscriber;
+  }
+  return NULL;
+}
+
+static struct subscriber *index_next(struct subscriber_index *index, unsigned int pos){
+  for (pos++; pos < index->table_size; pos++){
+    if (index->table[pos].subscriber)
+      return index->table[pos].subscriber;
+  }
+  return NULL;
+}
+
+// how many leading nibbles do these two sids have in common?
+static int common_nibbles(const unsigned char *a, const unsigned char *b){
+  int i;
+  for (i=0;i<SID_SIZE;i++){
+    if (a[i]!=b[i])
+      return i*2 + ((a[i]&0xF0)==(b[i]&0xF0)?1:0);
+  }
+  return SID_SIZE*2;
+}
+
+// abbreviate_len is the number of nibbles required to tell a subscriber apart from its closest neighbours
+static void update_abbreviation(struct subscriber *subscriber, struct subscriber *neighbour){
+  if (!neighbour)
+    return;
+  int len = common_nibbles(subscriber->sid, neighbour->sid)+1;
+  if (len > subscriber->abbreviate_len)
+    subscriber->abbreviate_len = len;
+  if (len > neighbour->abbreviate_len)
+    neighbour->abbreviate_len = len;
+}
+
+static int index_insert(struct subscriber_index *index, struct subscriber *subscriber){
+  if (index_grow(index))
+    return -1;
   
-  do{
-    unsigned char nibble = get_nibble(sid, pos++);
-    
-    if (ptr->is_tree & (1<<nibble)){
-      ptr = ptr->tree_nodes[nibble];
-      
-    }else if(!ptr->subscribers[nibble]){
-      // subscriber is not yet known
-      
-      if (create){
-	struct subscriber *ret=(struct subscriber *)malloc(sizeof(struct subscriber));
-	memset(ret,0,sizeof(struct subscriber));
-	ptr->subscribers[nibble]=ret;
-	bcopy(sid, ret->sid, SID_SIZE);
-	ret->abbreviate_len=pos;
-      }
-      return ptr->subscribers[nibble];
-      
-    }else{
-      // there's a subscriber in this slot, does it match the rest of the sid we've been given?
-      struct subscriber *ret = ptr->subscribers[nibble];
-      if (memcmp(ret->sid,sid,len)==0){
-	return ret;
-      }
-      
-      // if we need to insert this subscriber, we have to make a new tree node first
-      if (!create)
+  struct sid_search search;
+  sid_search_init(&search, subscriber->sid, SID_SIZE);
+  unsigned int pos = index_lower_bound(index, &search);
+  // make room by moving the rest of the run up a slot
+  unsigned int end;
+  for (end = pos; end < index->table_size && index->table[end].subscriber; end++)
+    ;
+  if (end == index->table_size){
+    if (index_rebuild(index, index->table_bits, (index->table_size - (1<<index->table_bits))*2))
+      return -1;
+    return index_insert(index, subscriber);
+  }
+  memmove(&index->table[pos+1], &index->table[pos], (end - pos) * sizeof(struct subscriber_slot));
+  index->table[pos].prefix = search.prefix;
+  index->table[pos].subscriber = subscriber;
+  index->count++;
+  index->generation++;
+  
+  subscriber->abbreviate_len=1;
+  update_abbreviation(subscriber, index_prev(index, pos));
+  update_abbreviation(subscriber, index_next(index, pos));
+  return 0;
+}
+
+static int index_remove(struct subscriber_index *index, struct subscriber *subscriber){
+  struct sid_search search;
+  sid_search_init(&search, subscriber->sid, SID_SIZE);
+  unsigned int i = index->table ? index_lower_bound(index, &search) : 0;
+  if (i >= index->table_size || index->table[i].subscriber != subscriber)
+    return WHYF("Subscriber %s is not in the index", alloca_tohex_sid(subscriber->sid));
+  
+  // shift the rest of the run back a slot, until an entry that is already in its home slot
+  while (i+1 < index->table_size && index->table[i+1].subscriber
+    && slot_home(index->table[i+1].prefix, index->table_bits) <= i){
+    index->table[i] = index->table[i+1];
+    i++;
+  }
+  index->table[i].subscriber = NULL;
+  index->table[i].prefix = 0;
+  index->count--;
+  index->generation++;
+  // the abbreviations of the neighbours are left alone, other nodes may still know the longer form
+  return 0;
+}
+
+// find the only subscriber whose sid starts with these len bytes
+static struct subscriber *index_find_abbreviation(struct subscriber_index *index, const unsigned char *sid, int len){
+  if (!index->table)
+    return NULL;
+  struct sid_search search;
+  sid_search_init(&search, sid, len);
+  // every match has its home slot in this range, and there are no empty slots between an entry and its home
+  unsigned int last_home = slot_home(search.prefix | ~search.mask, index->table_bits);
+  struct subscriber *ret = NULL;
+  unsigned int i;
+  for (i = slot_home(search.prefix, index->table_bits); i < index->table_size; i++){
+    if (!index->table[i].subscriber){
+      if (i >= last_home)
+	break;
+      continue;
+    }
+    int c = sid_search_cmp(&index->table[i], &search);
+    if (c > 0)
+      break;
+    if (c == 0){
+      if (ret)
+	// abbreviation is not unique
 	return NULL;
-      
-      // create a new tree node and move the existing subscriber into it
-      struct tree_node *new=(struct tree_node *)malloc(sizeof(struct tree_node));
-      memset(new,0,sizeof(struct tree_node));
-      ptr->tree_nodes[nibble]=new;
-      ptr->is_tree |= (1<<nibble);
-      
-      ptr=new;
-      nibble=get_nibble(ret->sid,pos);
-      ptr->subscribers[nibble]=ret;
-      ret->abbreviate_len=pos+1;
-      // then go around the loop again to compare the next nibble against the sid until we find an empty slot.
+      ret = index->table[i].subscriber;
     }
-  }while(pos < len*2);
-  
-  // abbreviation is not unique
-  return NULL;
+  }
+  return ret;
 }
 
 /* 
- Walk the subscriber tree, calling the callback function for each subscriber.
- if start is a valid pointer, the first entry returned will be after this subscriber
+ Walk the subscriber index in sid order, calling the callback function for each subscriber.
+ if start is a valid pointer, the first entry returned will be the first sid >= start.
+ if prefix is a valid pointer, stop at the first sid that doesn't begin with prefix.
  if the callback returns non-zero, the process will stop.
  */
-static int walk_tree(struct tree_node *node, int pos, 
-	      unsigned char *start, int start_len, 
-	      unsigned char *end, int end_len,
+static int index_walk(struct subscriber_index *index, 
+	      const unsigned char *start, int start_len, 
+	      const unsigned char *prefix, int prefix_len,
 	      int(*callback)(struct subscriber *, void *), void *context){
-  int i=0, e=16;
-  
-  if (start && pos < start_len*2){
-    i=get_nibble(start,pos);
-  }
-  
-  if (end && pos < end_len*2){
-    e=get_nibble(end,pos) +1;
+  if (!index->table)
+    return 0;
+  struct sid_search search;
+  unsigned int i=0;
+  if (start){
+    sid_search_init(&search, start, start_len);
+    i = index_lower_bound(index, &search);
   }
   
-  for (;i<e;i++){
-    if (node->is_tree & (1<<i)){
-      if (walk_tree(node->tree_nodes[i], pos+1, start, start_len, end, end_len, callback, context))
-	return 1;
-    }else if(node->subscribers[i]){
-      if (callback(node->subscribers[i], context))
-	return 1;
+  for (;i < index->table_size;i++){
+    struct subscriber *subscriber = index->table[i].subscriber;
+    if (!subscriber)
+      continue;
+    if (prefix && memcmp(subscriber->sid, prefix, prefix_len))
+      break;
+    unsigned int generation = index->generation;
+    if (callback(subscriber, context))
+      return 1;
+    if (generation != index->generation){
+      // the callback added subscribers, find our place again
+      sid_search_init(&search, subscriber->sid, SID_SIZE);
+      i = index_lower_bound(index, &search);
     }
-    // stop comparing the start sid after looking at the first branch of the tree
-    start=NULL;
   }
   return 0;
 }
 
+static void subscriber_expire(struct sched_ent *alarm);
+static struct profile_total subscriber_expire_stats={
+  .name="subscriber_expire",
+};
+static struct sched_ent subscriber_expire_alarm={
+  .function = subscriber_expire,
+  .stats = &subscriber_expire_stats,
+};
+#define SUBSCRIBER_EXPIRE_INTERVAL 60000
+
+// a coarse clock for last_used, so lookups don't have to read the time
+static time_ms_t subscriber_clock=0;
+static time_ms_t last_expire=0;
+
+static unsigned int subscribers_created=0;
+static unsigned int subscribers_expired=0;
+static unsigned int subscribers_evicted=0;
+static unsigned int subscribers_high_water=0;
+
+static void schedule_expire(time_ms_t when){
+  if (is_scheduled(&subscriber_expire_alarm)){
+    if (subscriber_expire_alarm.alarm <= when)
+      return;
+    unschedule(&subscriber_expire_alarm);
+  }
+  subscriber_expire_alarm.alarm = when;
+  subscriber_expire_alarm.deadline = when + 10000;
+  schedule(&subscriber_expire_alarm);
+}
+
+// find a subscriber struct from a whole or abbreviated subscriber id
+struct subscriber *find_subscriber(const unsigned char *sid, int len, int create){
+  struct subscriber *ret;
+  if (len!=SID_SIZE){
+    ret = index_find_abbreviation(&subscribers, sid, len);
+    if (ret)
+      ret->last_used = subscriber_clock;
+    return ret;
+  }
+  
+  ret = index_lookup(&subscribers, sid);
+  if (ret)
+    ret->last_used = subscriber_clock;
+  if (ret || !create)
+    return ret;
+  
+  // subscriber is not yet known
+  ret = emalloc_zero(sizeof(struct subscriber));
+  if (!ret)
+    return NULL;
+  bcopy(sid, ret->sid, SID_SIZE);
+  if (index_insert(&subscribers, ret)){
+    free(ret);
+    return NULL;
+  }
+  
+  time_ms_t now = gettime_ms();
+  subscriber_clock = now;
+  ret->last_used = now;
+  subscribers_created++;
+  if (subscribers.count > subscribers_high_water)
+    subscribers_high_water = subscribers.count;
+  
+  // never forget subscribers while a packet is being parsed, the caller may be holding pointers to them
+  if (config.mdp.subscriber_limit && subscribers.count > (unsigned)config.mdp.subscriber_limit)
+    schedule_expire(last_expire + 1000 > now ? last_expire + 1000 : now);
+  else
+    schedule_expire(now + SUBSCRIBER_EXPIRE_INTERVAL);
+  return ret;
+}
+
 /*
- walk the tree, starting at start inclusive, calling the supplied callback function
+ walk the index, starting at start inclusive, calling the supplied callback function
  */
 void enum_subscribers(struct subscriber *start, int(*callback)(struct subscriber *, void *), void *context){
-  walk_tree(&root, 0, start->sid, SID_SIZE, NULL, 0, callback, context);
+  index_walk(&subscribers, start?start->sid:NULL, SID_SIZE, NULL, 0, callback, context);
+}
+
+static unsigned int in_use_mark=1;
+
+/* While looking for subscribers to forget, every module that holds pointers to subscribers marks them
+ as being in use. */
+void mark_subscriber_in_use(struct subscriber *subscriber){
+  if (subscriber)
+    subscriber->in_use_mark = in_use_mark;
+}
+
+struct expire_candidates{
+  struct subscriber **subscribers;
+  unsigned int count;
+  unsigned int size;
+};
+
+static int find_expire_candidates(struct subscriber *subscriber, void *context){
+  struct expire_candidates *candidates = context;
+  if (subscriber->in_use_mark == in_use_mark
+    || subscriber->reachable != REACHABLE_NONE
+    || subscriber->identity)
+    return 0;
+  if (candidates->count >= candidates->size){
+    unsigned int size = candidates->size ? candidates->size*2 : 256;
+    struct subscriber **list = erealloc(candidates->subscribers, size * sizeof(struct subscriber *));
+    if (!list)
+      return 1;
+    candidates->subscribers = list;
+    candidates->size = size;
+  }
+  candidates->subscribers[candidates->count++] = subscriber;
+  return 0;
+}
+
+static int cmp_last_used(const void *a, const void *b){
+  const struct subscriber *sa = *(const struct subscriber **)a;
+  const struct subscriber *sb = *(const struct subscriber **)b;
+  if (sa->last_used < sb->last_used)
+    return -1;
+  return sa->last_used > sb->last_used ? 1 : 0;
+}
+
+static int forget_expiring(struct subscriber *subscriber, void *context){
+  if (subscriber->next_hop && subscriber->next_hop->expiring)
+    subscriber->next_hop = NULL;
+  link_forget_expiring(subscriber);
+  return 0;
+}
+
+/* Forget unreachable subscribers that nobody is using, either because they have been idle for too long,
+ or to bring the number we remember back under the configured limit, least recently used first. */
+static void subscriber_expire(struct sched_ent *alarm){
+  time_ms_t now = gettime_ms();
+  subscriber_clock = now;
+  last_expire = now;
+  
+  in_use_mark++;
+  mark_subscriber_in_use(my_subscriber);
+  mark_subscriber_in_use(directory_service);
+  link_mark_subscribers();
+  overlay_queue_mark_subscribers();
+  overlay_mdp_mark_subscribers();
+  vomp_mark_subscribers();
+  
+  struct expire_candidates candidates;
+  bzero(&candidates, sizeof candidates);
+  index_walk(&subscribers, NULL, 0, NULL, 0, find_expire_candidates, &candidates);
+  qsort(candidates.subscribers, candidates.count, sizeof(struct subscriber *), cmp_last_used);
+  
+  // when over the limit, go well under it, so we aren't sweeping again for every new subscriber
+  unsigned int target = subscribers.count;
+  if (config.mdp.subscriber_limit && subscribers.count > (unsigned)config.mdp.subscriber_limit)
+    target = config.mdp.subscriber_limit - config.mdp.subscriber_limit/8;
+  time_ms_t idle_before = now - config.mdp.subscriber_idle_timeout * 1000ll;
+  
+  unsigned int i, expired=0, evicted=0;
+  for (i=0;i<candidates.count;i++){
+    struct subscriber *subscriber = candidates.subscribers[i];
+    if (config.mdp.subscriber_idle_timeout && subscriber->last_used < idle_before)
+      expired++;
+    else if (subscribers.count - i > target)
+      evicted++;
+    else
+      break;
+    subscriber->expiring = 1;
+  }
+  unsigned int count = expired+evicted;
+  
+  if (count){
+    // clear any remaining references to the subscribers we are about to free
+    index_walk(&subscribers, NULL, 0, NULL, 0, forget_expiring, NULL);
+    for (i=0;i<count;i++){
+      struct subscriber *subscriber = candidates.subscribers[i];
+      if (config.debug.subscribers)
+	DEBUGF("Forgetting subscriber %s, last used %lldms ago", 
+	  alloca_tohex_sid(subscriber->sid), (long long)(now - subscriber->last_used));
+      index_remove(&subscribers, subscriber);
+      link_free_state(subscriber);
+      keyring_forget_nm_bytes(subscriber->sid);
+      free(subscriber);
+    }
+    subscribers_expired+=expired;
+    subscribers_evicted+=evicted;
+  }
+  if (candidates.subscribers)
+    free(candidates.subscribers);
+  
+  if (config.debug.subscribers)
+    DEBUGF("Subscriber sweep; %u known, %u unused, forgot %u idle and %u over the limit",
+      subscribers.count, candidates.count, expired, evicted);
+  
+  alarm->alarm = now + SUBSCRIBER_EXPIRE_INTERVAL;
+  alarm->deadline = alarm->alarm + 10000;
+  schedule(alarm);
+}
+
+void overlay_address_showstats(){
+  INFOF("Subscribers: %u known (high water %u), %u created, %u expired when idle, %u evicted over the limit of %d",
+    subscribers.count, subscribers_high_water, subscribers_created,
+    subscribers_expired, subscribers_evicted, config.mdp.subscriber_limit);
+}
+
+static int count_subscriber(struct subscriber *subscriber, void *context){
+  unsigned int *count = context;
+  (*count)++;
+  return 0;
+}
+
+static void free_index(struct subscriber_index *index){
+  if (index->table)
+    free(index->table);
+  bzero(index, sizeof *index);
+}
+
+static int subscriber_test(int count){
+  struct subscriber *subs = emalloc_zero(count * sizeof(struct subscriber));
+  if (!subs)
+    return -1;
+  int i, j;
+  for (i=0;i<count;i++)
+    for (j=0;j<SID_SIZE;j++)
+      subs[i].sid[j]=random()&0xff;
+  
+  struct subscriber_index index;
+  bzero(&index, sizeof index);
+  int ret=0;
+  
+  // repeat smaller tests so that every measurement covers a similar number of operations
+  int rounds = count < 100000 ? 100000/count : 1;
+  int r;
+  time_ms_t start = gettime_ms();
+  for (r=0;r<rounds;r++){
+    free_index(&index);
+    for (i=0;i<count;i++)
+      if (index_insert(&index, &subs[i])){
+	ret=-1;
+	goto end;
+      }
+  }
+  time_ms_t end = gettime_ms();
+  printf("%d subscribers: insert %d in %lldms\n", count, count*rounds, (long long) end - start);
+  
+  int lookups = 1000000;
+  start = gettime_ms();
+  for (i=0;i<lookups;i++){
+    struct subscriber *s = &subs[random()%count];
+    if (index_lookup(&index, s->sid)!=s){
+      ret=WHYF("Failed to find %s", alloca_tohex_sid(s->sid));
+      goto end;
+    }
+  }
+  end = gettime_ms();
+  printf("%d subscribers: lookup %d in %lldms\n", count, lookups, (long long) end - start);
+  
+  start = gettime_ms();
+  for (i=0;i<lookups;i++){
+    struct subscriber *s = &subs[random()%count];
+    // the same abbreviation as overlay_address_append() will send
+    int len=(s->abbreviate_len+2)/2;
+    if (len>SID_SIZE)
+      len=SID_SIZE;
+    if (index_find_abbreviation(&index, s->sid, len)!=s){
+      ret=WHYF("Failed to find abbreviation %s", alloca_tohex(s->sid, len));
+      goto end;
+    }
+  }
+  end = gettime_ms();
+  printf("%d subscribers: abbreviation lookup %d in %lldms\n", count, lookups, (long long) end - start);
+  
+  unsigned int visited=0;
+  rounds = count < 1000000 ? 1000000/count : 1;
+  start = gettime_ms();
+  for (r=0;r<rounds;r++)
+    index_walk(&index, NULL, 0, NULL, 0, count_subscriber, &visited);
+  end = gettime_ms();
+  printf("%d subscribers: enumerate %u in %lldms\n", count, visited, (long long) end - start);
+  if (visited != (unsigned)count*rounds){
+    ret=WHYF("Enumerated %u subscribers, expected %u", visited, (unsigned)count*rounds);
+    goto end;
+  }
+  
+  /* check the order, that no entry is before its home slot or after an empty slot past it, and that
+   * each abbreviation is the shortest unique prefix
+   */
+  unsigned int pos, empty=0;
+  struct subscriber *prev=NULL, *s;
+  for (pos=0;pos<index.table_size;pos++){
+    if (!(s = index.table[pos].subscriber)){
+      empty = pos+1;
+      continue;
+    }
+    unsigned int home = slot_home(index.table[pos].prefix, index.table_bits);
+    if (home > pos || home < empty){
+      ret=WHYF("%s is in slot %u, home slot %u, empty slots end at %u", alloca_tohex_sid(s->sid), pos, home, empty);
+      goto end;
+    }
+    struct subscriber *next = index_next(&index, pos);
+    int len = 1;
+    if (prev){
+      if (memcmp(prev->sid, s->sid, SID_SIZE)>=0){
+	ret=WHY("Subscribers are out of order");
+	goto end;
+      }
+      if (common_nibbles(prev->sid, s->sid)+1 > len)
+	len = common_nibbles(prev->sid, s->sid)+1;
+    }
+    if (next && common_nibbles(next->sid, s->sid)+1 > len)
+      len = common_nibbles(next->sid, s->sid)+1;
+    if (s->abbreviate_len != len){
+      ret=WHYF("abbreviate_len of %s is %d, expected %d", alloca_tohex_sid(s->sid), s->abbreviate_len, len);
+      goto end;
+    }
+    // any whole number of bytes shorter than that is shared with a neighbour
+    if ((len-1)/2 > 0 && index_find_abbreviation(&index, s->sid, (len-1)/2)){
+      ret=WHYF("Abbreviation %s is not unique", alloca_tohex(s->sid, (len-1)/2));
+      goto end;
+    }
+    prev = s;
+  }
+  
+  // forget every second subscriber, then make sure the rest can still be found
+  start = gettime_ms();
+  for (i=0;i<count;i+=2)
+    if (index_remove(&index, &subs[i])){
+      ret=-1;
+      goto end;
+    }
+  end = gettime_ms();
+  printf("%d subscribers: remove %d in %lldms\n", count, (count+1)/2, (long long) end - start);
+  for (i=0;i<count;i++){
+    struct subscriber *found = index_lookup(&index, subs[i].sid);
+    if (found != (i&1 ? &subs[i] : NULL)){
+      ret=WHYF("Lookup of %s after removal returned %p", alloca_tohex_sid(subs[i].sid), found);
+      goto end;
+    }
+  }
+  visited=0;
+  index_walk(&index, NULL, 0, NULL, 0, count_subscriber, &visited);
+  if (visited != index.count || visited != (unsigned)count/2){
+    ret=WHYF("Enumerated %u subscribers after removal, expected %u", visited, (unsigned)count/2);
+    goto end;
+  }
+end:
+  free_index(&index);
+  free(subs);
+  return ret;
+}
+
+int app_subscriber_test(const struct cli_parsed *parsed, void *context)
+{
+  const char *seed = NULL;
+  const char *count_arg = NULL;
+  if (   cli_arg(parsed, "--seed", &seed, cli_uint, NULL) == -1
+      || cli_arg(parsed, "--count", &count_arg, cli_uint, NULL) == -1)
+    return -1;
+  if (seed)
+    srandom(atoi(seed));
+  if (count_arg){
+    int count = atoi(count_arg);
+    if (count <= 0)
+      return WHY("Invalid subscriber count");
+    if (subscriber_test(count))
+      return -1;
+  }else{
+    printf("Benchmarking subscriber index:\n");
+    if (subscriber_test(1000) || subscriber_test(10000) || subscriber_test(100000))
+      return -1;
+  }
+  printf("Test passed.\n");
+  return 0;
 }
 
 // generate a new random broadcast address
@@ -229,6 +781,7 @@ int overlay_address_append(struct decode_context *context, struct overlay_buffer
     if (ob_append_bytes(b, subscriber->sid, len))
       return -1;
   }
+  subscriber->last_used = subscriber_clock;
   if (context)
     context->previous = subscriber;
   return 0;
@@ -237,7 +790,7 @@ int overlay_address_append(struct decode_context *context, struct overlay_buffer
 static int add_explain_response(struct subscriber *subscriber, void *context){
   struct decode_context *response = context;
   if (!response->please_explain){
-    response->please_explain = calloc(sizeof(struct overlay_frame),1);
+    response->please_explain = op_new();
     response->please_explain->payload=ob_new();
     ob_limitsize(response->please_explain->payload, 1024);
   }
@@ -289,14 +842,14 @@ static int find_subscr_buffer(struct decode_context *context, struct overlay_buf
     
     // add the abbreviation you told me about
     if (!context->please_explain){
-      context->please_explain = calloc(sizeof(struct overlay_frame),1);
+      context->please_explain = op_new();
       context->please_explain->payload=ob_new();
       ob_limitsize(context->please_explain->payload, MDP_MTU);
     }
     
     // And I'll tell you about any subscribers I know that match this abbreviation, 
     // so you don't try to use an abbreviation that's too short in future.
-    walk_tree(&root, 0, id, len, id, len, add_explain_response, context);
+    index_walk(&subscribers, id, len, id, len, add_explain_response, context);
     
     INFOF("Asking for explanation of %s", alloca_tohex(id, len));
     ob_append_byte(context->please_explain->payload, len);
@@ -407,7 +960,7 @@ int process_explain(struct overlay_frame *frame){
     }else{
       // reply to the sender with all subscribers that match this abbreviation
       INFOF("Sending responses for %s", alloca_tohex(sid, len));
-      walk_tree(&root, 0, sid, len, sid, len, add_explain_response, &context);
+      index_walk(&subscribers, sid, len, sid, len, add_explain_response, &context);
     }
   }
   
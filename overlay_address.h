@@ -87,6 +87,12 @@ struct subscriber{
   
   // private keys for local identities
   keyring_identity *identity;
+  
+  // when we last resolved or sent to this address, unreachable subscribers that stay idle are forgotten
+  time_ms_t last_used;
+  // see mark_subscriber_in_use()
+  unsigned int in_use_mark;
+  char expiring;
 };
 
 struct broadcast{
@@ -107,6 +113,8 @@ extern struct subscriber *directory_service;
 
 struct subscriber *find_subscriber(const unsigned char *sid, int len, int create);
 void enum_subscribers(struct subscriber *start, int(*callback)(struct subscriber *, void *), void *context);
+void mark_subscriber_in_use(struct subscriber *subscriber);
+void overlay_address_showstats();
 int subscriber_is_reachable(struct subscriber *subscriber);
 int set_reachable(struct subscriber *subscriber, int reachable);
 int reachable_unicast(struct subscriber *subscriber, overlay_interface *interface, struct in_addr addr, int port);
@@ -32,9 +32,51 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 
 
+/* Buffer headers, and their byte arrays up to the size of a typical packet, are recycled through
+ free-list pools instead of going back to libc every time. */
+static struct mem_pool buffer_pool = MEM_POOL_INIT("overlay_buffer", sizeof(struct overlay_buffer), 256);
+
+#define OB_BYTES_CLASSES 6
+static struct mem_pool bytes_pools[OB_BYTES_CLASSES]={
+  MEM_POOL_INIT("overlay_buffer bytes[64]", 64, 64),
+  MEM_POOL_INIT("overlay_buffer bytes[128]", 128, 64),
+  MEM_POOL_INIT("overlay_buffer bytes[256]", 256, 64),
+  MEM_POOL_INIT("overlay_buffer bytes[512]", 512, 64),
+  MEM_POOL_INIT("overlay_buffer bytes[1024]", 1024, 64),
+  MEM_POOL_INIT("overlay_buffer bytes[2048]", 2048, 64),
+};
+
+static struct mem_pool *ob_bytes_pool(int size)
+{
+  int i;
+  for (i=0;i<OB_BYTES_CLASSES;i++)
+    if (size<=bytes_pools[i].size)
+      return &bytes_pools[i];
+  return NULL;
+}
+
+// allocate byte storage for a buffer, rounding *size up to the size class actually used
+static unsigned char *ob_bytes_alloc(int *size)
+{
+  struct mem_pool *pool = ob_bytes_pool(*size);
+  if (!pool)
+    return emalloc(*size);
+  *size = pool->size;
+  return pool_alloc(pool);
+}
+
+static void ob_bytes_free(unsigned char *bytes, int size)
+{
+  struct mem_pool *pool = ob_bytes_pool(size);
+  if (pool)
+    pool_free(pool, bytes);
+  else
+    free(bytes);
+}
+
 struct overlay_buffer *ob_new(void)
 {
-  struct overlay_buffer *ret=calloc(sizeof(struct overlay_buffer),1);
+  struct overlay_buffer *ret=pool_alloc_zero(&buffer_pool);
   if (!ret) return NULL;
   
   ob_unlimitsize(ret);
@@ -45,7 +87,7 @@ struct overlay_buffer *ob_new(void)
 // index an existing static buffer.
 // and allow other callers to use the ob_ convenience methods for reading and writing up to size bytes.
 struct overlay_buffer *ob_static(unsigned char *bytes, int size){
-  struct overlay_buffer *ret=calloc(sizeof(struct overlay_buffer),1);
+  struct overlay_buffer *ret=pool_alloc_zero(&buffer_pool);
   if (!ret) return NULL;
   ret->bytes = bytes;
   ret->allocSize = size;
@@ -55,28 +97,90 @@ struct overlay_buffer *ob_static(unsigned char *bytes, int size){
   return ret;
 }
 
+// how often ob_share() was able to share bytes, and how often it had to copy them
+static unsigned int ob_shared_count=0;
+static unsigned int ob_copied_count=0;
+
+// the buffer that owns b's bytes, if they were allocated by us
+static struct overlay_buffer *ob_owner(struct overlay_buffer *b){
+  if (b->parent)
+    return b->parent;
+  return b->allocated?b:NULL;
+}
+
 // create a new overlay buffer from an existing piece of another buffer.
 // Both buffers will point to the same memory region.
-// It is up to the caller to ensure this buffer is not used after the parent buffer is freed.
+// If the bytes were allocated by ob_new(), the slice holds a reference to them and they will
+// not be released (or written to) until the slice is freed.
+// Otherwise it is up to the caller to ensure this buffer is not used after the parent buffer is freed.
 struct overlay_buffer *ob_slice(struct overlay_buffer *b, int offset, int length){
   if (offset+length > b->allocSize) {
     WHY("Buffer isn't long enough to slice");
 	return NULL;
   }
       
-  struct overlay_buffer *ret=calloc(sizeof(struct overlay_buffer),1);
+  struct overlay_buffer *ret=pool_alloc_zero(&buffer_pool);
   if (!ret)
       return NULL;
   ret->bytes = b->bytes+offset;
   ret->allocSize = length;
   ret->allocated = NULL;
+  ret->parent = ob_owner(b);
+  if (ret->parent)
+    ret->parent->refs++;
   ob_unlimitsize(ret);
   
   return ret;
 }
 
+// create a read only copy of a buffer, positioned after its data as ob_dup() would, without copying any bytes.
+// Bytes that we don't own (eg, from ob_static()) may be released by the caller at any time,
+// so those are copied, once, into a new buffer that can then be shared.
+struct overlay_buffer *ob_share(struct overlay_buffer *b){
+  struct overlay_buffer *owner = ob_owner(b);
+  if (!owner){
+    ob_copied_count++;
+    return ob_dup(b);
+  }
+  ob_shared_count++;
+  
+  struct overlay_buffer *ret=pool_alloc_zero(&buffer_pool);
+  if (!ret)
+    return NULL;
+  // as with ob_dup(), the new buffer appears to have had any relevant bytes written to it
+  int byteCount = b->sizeLimit;
+  if (byteCount < b->position)
+    byteCount = b->position;
+  if (byteCount > b->allocSize)
+    byteCount = b->allocSize;
+  ret->bytes = b->bytes;
+  ret->allocSize = byteCount;
+  ret->sizeLimit = b->sizeLimit;
+  ret->position = byteCount;
+  ret->checkpointLength = b->checkpointLength;
+  ret->parent = owner;
+  owner->refs++;
+  return ret;
+}
+
+// are these bytes visible through any other buffer?
+int ob_is_shared(struct overlay_buffer *b){
+  return b->refs || b->parent;
+}
+
+static int ob_check_writable(struct overlay_buffer *b){
+  if (!ob_is_shared(b))
+    return 0;
+#ifdef OB_SHARED_PARANOIA
+  FATALF("Attempted to write to shared buffer %p", b);
+#endif
+  return WHYF("Can't write to shared buffer %p", b);
+}
+
 struct overlay_buffer *ob_dup(struct overlay_buffer *b){
-  struct overlay_buffer *ret=calloc(sizeof(struct overlay_buffer),1);
+  struct overlay_buffer *ret=pool_alloc_zero(&buffer_pool);
+  if (!ret)
+    return NULL;
   ret->sizeLimit = b->sizeLimit;
   ret->position = b->position;
   ret->checkpointLength = b->checkpointLength;
@@ -97,16 +201,29 @@ struct overlay_buffer *ob_dup(struct overlay_buffer *b){
 int ob_free(struct overlay_buffer *b)
 {
   if (!b) return WHY("Asked to free NULL");
-  if (b->bytes && b->allocated) free(b->allocated);
+  // keep our bytes until the last reference is released
+  if (b->refs){
+    b->refs--;
+    return 0;
+  }
+  if (b->parent) ob_free(b->parent);
+  b->parent=NULL;
+  if (b->bytes && b->allocated) ob_bytes_free(b->allocated, b->allocSize);
   // we're about to free this anyway, why are we clearing it?
   b->bytes=NULL;
   b->allocated=NULL;
   b->allocSize=0;
   b->sizeLimit=0;
-  free(b);
+  pool_free(&buffer_pool, b);
   return 0;
 }
 
+void overlay_buffer_showstats()
+{
+  INFOF("Buffers: %u shared without copying, %u copied to share",
+    ob_shared_count, ob_copied_count);
+}
+
 int ob_checkpoint(struct overlay_buffer *b)
 {
   if (!b) return WHY("Asked to checkpoint NULL");
@@ -146,6 +263,9 @@ int ob_makespace(struct overlay_buffer *b,int bytes)
     return -1;
   }
   
+  if (ob_check_writable(b))
+    return -1;
+  
   // already enough space?
   if (b->position + bytes <= b->allocSize)
     return 0;
@@ -193,10 +313,11 @@ int ob_makespace(struct overlay_buffer *b,int bytes)
     for(i=0;i<4096;i++) new[newSize+i]=0xbd;
   }
 #else
-  unsigned char *new=malloc(newSize);
+  unsigned char *new=ob_bytes_alloc(&newSize);
+  if (!new) return WHY("ob_bytes_alloc() failed");
 #endif
   bcopy(b->bytes,new,b->position);
-  if (b->allocated) free(b->allocated);
+  if (b->allocated) ob_bytes_free(b->allocated, b->allocSize);
   b->bytes=new;
   b->allocated=new;
   b->allocSize=newSize;
@@ -370,7 +491,7 @@ int ob_get(struct overlay_buffer *b){
 
 int ob_set_ui16(struct overlay_buffer *b, int offset, uint16_t v)
 {
-  if (test_offset(b, offset, 2))
+  if (test_offset(b, offset, 2) || ob_check_writable(b))
     return -1;
   
   b->bytes[offset] = (v >> 8) & 0xFF;
@@ -380,7 +501,7 @@ int ob_set_ui16(struct overlay_buffer *b, int offset, uint16_t v)
 
 int ob_set(struct overlay_buffer *b, int ofs, unsigned char byte)
 {
-  if (test_offset(b, ofs, 1))
+  if (test_offset(b, ofs, 1) || ob_check_writable(b))
     return -1;
   b->bytes[ofs] = byte;
   return 0;
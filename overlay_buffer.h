@@ -20,6 +20,11 @@
 #ifndef _SERVALD_OVERLAY_BUFFER_H
 #define _SERVALD_OVERLAY_BUFFER_H
 
+/* Define OB_SHARED_PARANOIA to abort the daemon on any attempt to write to a buffer whose bytes are
+ * shared with another buffer, instead of just logging an error and failing the write.
+ */
+// #define OB_SHARED_PARANOIA
+
 struct overlay_buffer {
   unsigned char *bytes;
   
@@ -40,12 +45,21 @@ struct overlay_buffer {
   
   // length position for later patching
   int var_length_offset;
+  
+  // number of other buffers (see ob_share() and ob_slice()) that point into our bytes,
+  // our bytes are immutable and will not be released until this drops to zero.
+  int refs;
+  
+  // the buffer that owns the bytes we point into, if we are holding a reference to it
+  struct overlay_buffer *parent;
 };
 
 struct overlay_buffer *ob_new(void);
 struct overlay_buffer *ob_static(unsigned char *bytes, int size);
 struct overlay_buffer *ob_slice(struct overlay_buffer *b, int offset, int length);
 struct overlay_buffer *ob_dup(struct overlay_buffer *b);
+struct overlay_buffer *ob_share(struct overlay_buffer *b);
+int ob_is_shared(struct overlay_buffer *b);
 int ob_free(struct overlay_buffer *b);
 int ob_checkpoint(struct overlay_buffer *b);
 int ob_rewind(struct overlay_buffer *b);
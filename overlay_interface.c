@@ -21,6 +21,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <stddef.h>
 #include <assert.h>
 #include <time.h>
 #include <fnmatch.h>
@@ -147,6 +148,24 @@ overlay_interface * overlay_interface_get_default(){
   return NULL;
 }
 
+// report how many datagrams each interface has been reading per wake-up, and writing per system call
+void overlay_interface_showstats(){
+  int i;
+  for (i=0;i<OVERLAY_MAX_INTERFACES;i++){
+    overlay_interface *interface = &overlay_interfaces[i];
+    if (interface->state!=INTERFACE_STATE_UP || interface->socket_type!=SOCK_DGRAM)
+      continue;
+    if (interface->recv_wakeups)
+      INFOF("Interface %s received %u packets in %u wake-ups and %u reads (%.1f per wake-up, max %u)",
+	    interface->name, interface->recv_packets, interface->recv_wakeups, interface->recv_calls,
+	    interface->recv_packets * 1.0 / interface->recv_wakeups, interface->recv_max_per_wakeup);
+    if (interface->send_calls)
+      INFOF("Interface %s sent %u packets in %u writes (%.1f per write)",
+	    interface->name, interface->send_packets, interface->send_calls,
+	    interface->send_packets * 1.0 / interface->send_calls);
+  }
+}
+
 // find an interface that can send a packet to this address
 overlay_interface * overlay_interface_find(struct in_addr addr, int return_default){
   int i;
@@ -209,6 +228,44 @@ int overlay_interface_compare(overlay_interface *one, overlay_interface *two)
   return 0;
 }
 
+#define RECV_BUFFER_SIZE 8096
+
+/* Packets are received into buffers that we own, so that payloads forwarded or queued from them
+ can share the bytes instead of copying them (see ob_share()). A buffer that is still shared once
+ its packet has been processed is left to the frames that hold it, and replaced. */
+static struct overlay_buffer *recv_buffers[RECV_BATCH_MAX];
+
+static struct overlay_buffer *recv_buffer(int i){
+  struct overlay_buffer *b = recv_buffers[i];
+  if (b && ob_is_shared(b)){
+    ob_free(b);
+    b = recv_buffers[i] = NULL;
+  }
+  if (!b){
+    b = ob_new();
+    if (!b)
+      return NULL;
+    if (ob_makespace(b, RECV_BUFFER_SIZE)){
+      ob_free(b);
+      return NULL;
+    }
+    recv_buffers[i] = b;
+  }
+  // rewind, ready to be filled with a new packet
+  b->position = 0;
+  b->checkpointLength = 0;
+  ob_unlimitsize(b);
+  return b;
+}
+
+// decode a packet that has been received into the buffer from recv_buffer()
+static int packetOkRecvBuffer(struct overlay_interface *interface, struct overlay_buffer *b, int len,
+			      int recvttl, struct sockaddr *recvaddr, size_t recvaddrlen){
+  if (ob_limitsize(b, len))
+    return -1;
+  return packetOkOverlayBuffer(interface, b, recvttl, recvaddr, recvaddrlen);
+}
+
 // OSX doesn't recieve broadcast packets on sockets bound to an interface's address
 // So we have to bind a socket to INADDR_ANY to receive these packets.
 static void
@@ -216,14 +273,17 @@ overlay_interface_read_any(struct sched_ent *alarm){
   if (alarm->poll.revents & POLLIN) {
     int plen=0;
     int recvttl=1;
-    unsigned char packet[16384];
     overlay_interface *interface=NULL;
     struct sockaddr src_addr;
     socklen_t addrlen = sizeof(src_addr);
     
     /* Read only one UDP packet per call to share resources more fairly, and also
      enable stats to accurately count packets received */
-    plen = recvwithttl(alarm->poll.fd, packet, sizeof(packet), &recvttl, &src_addr, &addrlen);
+    struct overlay_buffer *b = recv_buffer(0);
+    if (!b)
+      return;
+    unsigned char *packet = ob_ptr(b);
+    plen = recvwithttl(alarm->poll.fd, packet, b->allocSize, &recvttl, &src_addr, &addrlen);
     if (plen == -1) {
       WHY_perror("recvwithttl(c)");
       unwatch(alarm);
@@ -251,7 +311,7 @@ overlay_interface_read_any(struct sched_ent *alarm){
 	     inet_ntoa(src),
 	     interface->name);
     
-    if (packetOkOverlay(interface, packet, plen, recvttl, &src_addr, addrlen)) {
+    if (packetOkRecvBuffer(interface, b, plen, recvttl, &src_addr, addrlen)) {
       if (config.debug.rejecteddata) {
 	WHYF("Malformed packet (length = %d)",plen);
 	dump("the malformed packet",packet,plen);
@@ -385,6 +445,15 @@ overlay_interface_init(const char *name, struct in_addr src_addr, struct in_addr
   interface->encapsulation = ifconfig->encapsulation;
   interface->uartbps = ifconfig->uartbps;
   interface->ctsrts = ifconfig->ctsrts;
+  interface->recv_batch = ifconfig->recv_batch > RECV_BATCH_MAX ? RECV_BATCH_MAX : ifconfig->recv_batch;
+  interface->recv_budget = ifconfig->recv_budget;
+  interface->send_batch = ifconfig->send_batch > SEND_BATCH_MAX ? SEND_BATCH_MAX : ifconfig->send_batch;
+  interface->send_calls = 0;
+  interface->send_packets = 0;
+  interface->recv_wakeups = 0;
+  interface->recv_calls = 0;
+  interface->recv_packets = 0;
+  interface->recv_max_per_wakeup = 0;
 
   /* Pick a reasonable default MTU.
      This will ultimately get tuned by the bandwidth and other properties of the interface */
@@ -536,38 +605,64 @@ cleanup:
 }
 
 static void interface_read_dgram(struct overlay_interface *interface){
-  int plen=0;
-  unsigned char packet[8096];
-  
-  struct sockaddr src_addr;
-  socklen_t addrlen = sizeof(src_addr);
-  
-  
-  /* Read only one UDP packet per call to share resources more fairly, and also
-   enable stats to accurately count packets received */
-  int recvttl=1;
-  plen = recvwithttl(interface->alarm.poll.fd,packet, sizeof(packet), &recvttl, &src_addr, &addrlen);
-  if (plen == -1) {
-    WHY_perror("recvwithttl(c)");
-    overlay_interface_close(interface);
-    return;
-  }
+  struct recv_datagram dgrams[RECV_BATCH_MAX];
+  int i;
   
-  /* We have a frame from this interface */
-  if (config.debug.packetrx)
-    DEBUG_packet_visualise("Read from real interface", packet,plen);
-  if (config.debug.overlayinterfaces) {
-    struct in_addr src = ((struct sockaddr_in *)&src_addr)->sin_addr; // avoid strict-alias warning on Solaris (gcc 4.4)
-    DEBUGF("Received %d bytes from %s on interface %s",plen,
-	   inet_ntoa(src),
-	   interface->name);
-  }
-  if (packetOkOverlay(interface, packet, plen, recvttl, &src_addr, addrlen)) {
-    if (config.debug.rejecteddata) {
-      WHYF("Malformed packet (length = %d)",plen);
-      dump("the malformed packet",packet,plen);
+  /* Read at most recv_budget packets per wake-up to share resources fairly with other
+   interfaces and alarms, in batches of up to recv_batch packets per system call */
+  interface->recv_wakeups++;
+  int received = 0;
+  while (received < interface->recv_budget && interface->state == INTERFACE_STATE_UP) {
+    int count = interface->recv_budget - received;
+    if (count > interface->recv_batch)
+      count = interface->recv_batch;
+    for (i = 0; i < count; ++i) {
+      struct overlay_buffer *b = recv_buffer(i);
+      if (!b)
+	break;
+      dgrams[i].buffer = ob_ptr(b);
+      dgrams[i].bufferlen = b->allocSize;
+    }
+    if (i == 0)
+      break;
+    count = i;
+    int n = recvmanywithttl(interface->alarm.poll.fd, dgrams, count);
+    if (n == -1) {
+      overlay_interface_close(interface);
+      return;
     }
+    if (n == 0)
+      break;
+    interface->recv_calls++;
+    interface->recv_packets += n;
+    received += n;
+    
+    for (i = 0; i < n; ++i) {
+      unsigned char *packet = dgrams[i].buffer;
+      int plen = dgrams[i].len;
+      
+      /* We have a frame from this interface */
+      if (config.debug.packetrx)
+	DEBUG_packet_visualise("Read from real interface", packet,plen);
+      if (config.debug.overlayinterfaces) {
+	struct in_addr src = ((struct sockaddr_in *)&dgrams[i].addr)->sin_addr; // avoid strict-alias warning on Solaris (gcc 4.4)
+	DEBUGF("Received %d bytes from %s on interface %s",plen,
+	       inet_ntoa(src),
+	       interface->name);
+      }
+      if (packetOkRecvBuffer(interface, recv_buffers[i], plen, dgrams[i].ttl, &dgrams[i].addr, dgrams[i].addrlen)) {
+	if (config.debug.rejecteddata) {
+	  WHYF("Malformed packet (length = %d)",plen);
+	  dump("the malformed packet",packet,plen);
+	}
+      }
+    }
+    /* A short batch means the socket has been drained */
+    if (n < count)
+      break;
   }
+  if (received > interface->recv_max_per_wakeup)
+    interface->recv_max_per_wakeup = received;
 }
 
 struct file_packet{
@@ -612,13 +707,13 @@ static void interface_read_file(struct overlay_interface *interface)
 {
   IN();
   /* Grab packets, unpackage and dispatch frames to consumers */
-  struct file_packet packet;
+  struct file_packet *packet;
   time_ms_t now = gettime_ms();
   
   /* Read from interface file */
   long long length=lseek(interface->alarm.poll.fd,0,SEEK_END);
   
-  int new_packets = (length - interface->recv_offset) / sizeof packet;
+  int new_packets = (length - interface->recv_offset) / sizeof *packet;
   if (new_packets > 20)
     WARNF("Getting behind, there are %d unread packets", new_packets);
   
@@ -632,31 +727,45 @@ static void interface_read_file(struct overlay_interface *interface)
     if (config.debug.overlayinterfaces)
       DEBUGF("Read interface %s (size=%lld) at offset=%d",interface->name, length, interface->recv_offset);
     
-    ssize_t nread = read(interface->alarm.poll.fd, &packet, sizeof packet);
+    struct overlay_buffer *b = recv_buffer(0);
+    if (!b){
+      OUT();
+      return;
+    }
+    packet = (struct file_packet *)ob_ptr(b);
+    ssize_t nread = read(interface->alarm.poll.fd, packet, sizeof *packet);
     if (nread == -1){
       WHY_perror("read");
       OUT();
       return;
     }
     
-    if (nread == sizeof packet) {
+    if (nread == sizeof *packet) {
       interface->recv_offset += nread;
       
       if (config.debug.packetrx)
-	DEBUG_packet_visualise("Read from dummy interface", packet.payload, packet.payload_length);
+	DEBUG_packet_visualise("Read from dummy interface", packet->payload, packet->payload_length);
       
-      if (!should_drop(interface, packet.dst_addr)){
-	    
-	if (packetOkOverlay(interface, packet.payload, packet.payload_length, -1, 
-			    (struct sockaddr*)&packet.src_addr, sizeof(packet.src_addr))<0) {
-	  if (config.debug.rejecteddata) {
-	    WARN("Unsupported packet from dummy interface");
-	    WHYF("Malformed packet (length = %d)",packet.payload_length);
-	    dump("the malformed packet",packet.payload,packet.payload_length);
+      if (!should_drop(interface, packet->dst_addr)){
+	// decode the payload in place, so that it can be shared like any other received packet
+	struct overlay_buffer *payload = NULL;
+	if (packet->payload_length >= 0 && packet->payload_length <= (int)sizeof packet->payload)
+	  payload = ob_slice(b, offsetof(struct file_packet, payload), packet->payload_length);
+	else
+	  WHYF("Invalid dummy packet length (%d)", packet->payload_length);
+	if (payload){
+	  if (packetOkRecvBuffer(interface, payload, packet->payload_length, -1, 
+			      (struct sockaddr*)&packet->src_addr, sizeof(packet->src_addr))<0) {
+	    if (config.debug.rejecteddata) {
+	      WARN("Unsupported packet from dummy interface");
+	      WHYF("Malformed packet (length = %d)",packet->payload_length);
+	      dump("the malformed packet",packet->payload,packet->payload_length);
+	    }
 	  }
+	  ob_free(payload);
 	}
       }else if (config.debug.packetrx)
-	DEBUGF("Ignoring packet addressed to %s:%d", inet_ntoa(packet.dst_addr.sin_addr), ntohs(packet.dst_addr.sin_port));
+	DEBUGF("Ignoring packet addressed to %s:%d", inet_ntoa(packet->dst_addr.sin_addr), ntohs(packet->dst_addr.sin_port));
     }
   }
   
@@ -904,6 +1013,8 @@ overlay_broadcast_ensemble(overlay_interface *interface,
 	  overlay_interface_close(interface);
 	return -1;
       }
+      interface->send_calls++;
+      interface->send_packets++;
       return 0;
     }
       
@@ -912,6 +1023,59 @@ overlay_broadcast_ensemble(overlay_interface *interface,
   }
 }
 
+/* Send several assembled packets on a datagram interface, send_batch at a time per system call.
+ * Marks failed[i] for each packet that could not be sent and returns the number of failures.
+ */
+int overlay_broadcast_ensemble_batch(overlay_interface *interface,
+				     struct send_datagram *dgrams, char *failed, int count)
+{
+  int i, failures=0;
+  interface->last_tx = gettime_ms();
+  bzero(failed, count);
+  
+  if (config.debug.packettx){
+    for (i=0;i<count;i++){
+      DEBUGF("Sending this packet via interface %s (len=%d)",interface->name,(int)dgrams[i].len);
+      DEBUG_packet_visualise(NULL,dgrams[i].buffer,dgrams[i].len);
+    }
+  }
+  
+  i=0;
+  while(i<count){
+    if (interface->state!=INTERFACE_STATE_UP || interface->socket_type!=SOCK_DGRAM){
+      WHYF("Cannot send to interface %s as it is down", interface->name);
+      break;
+    }
+    int n = count - i;
+    if (n > interface->send_batch)
+      n = interface->send_batch;
+    if (config.debug.overlayinterfaces) 
+      DEBUGF("Sending %d overlay frames on %s",n,interface->name);
+    int sent = sendmanyto(interface->alarm.poll.fd, &dgrams[i], n);
+    if (sent>0){
+      interface->send_calls++;
+      interface->send_packets+=sent;
+      i+=sent;
+      continue;
+    }
+    // the first packet of this batch could not be sent, skip it and carry on with the rest
+    int e=errno;
+    WHY_perror("sendmmsg(c)");
+    failed[i++]=1;
+    failures++;
+    // only close the interface on some kinds of errors
+    if (e==ENETDOWN || e==EINVAL){
+      overlay_interface_close(interface);
+      break;
+    }
+  }
+  for(;i<count;i++){
+    failed[i]=1;
+    failures++;
+  }
+  return failures;
+}
+
 /* Register the real interface, or update the existing interface registration. */
 int
 overlay_interface_register(char *name,
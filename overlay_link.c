@@ -290,8 +290,7 @@ int overlay_send_probe(struct subscriber *peer, struct sockaddr_in addr, overlay
   if (peer && peer->last_probe+1000>now)
     return -1;
   
-  struct overlay_frame *frame=malloc(sizeof(struct overlay_frame));
-  bzero(frame,sizeof(struct overlay_frame));
+  struct overlay_frame *frame=op_new();
   frame->type=OF_TYPE_DATA;
   frame->source = my_subscriber;
   frame->next_hop = frame->destination = peer;
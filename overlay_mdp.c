@@ -182,6 +182,14 @@ int overlay_mdp_reply_ok(int sock,
   return overlay_mdp_reply_error(sock,recvaddr,recvaddrlen,0,message);
 }
 
+void overlay_mdp_mark_subscribers()
+{
+  int i;
+  for(i=0;i<MDP_MAX_BINDINGS;i++)
+    if (mdp_bindings[i].port)
+      mark_subscriber_in_use(mdp_bindings[i].subscriber);
+}
+
 int overlay_mdp_releasebindings(struct sockaddr_un *recvaddr,int recvaddrlen)
 {
   /* Free up any MDP bindings held by this client. */
@@ -563,7 +571,7 @@ int overlay_mdp_dispatch(overlay_mdp_frame *mdp,int userGeneratedFrameP,
   IN();
 
   /* Prepare the overlay frame for dispatch */
-  struct overlay_frame *frame = calloc(1,sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
   if (!frame)
     FATAL("Couldn't allocate frame buffer");
   
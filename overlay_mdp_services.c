@@ -33,6 +33,7 @@ int overlay_mdp_service_rhizomerequest(overlay_mdp_frame *mdp)
 {
   IN();
 
+  if (mdp->out.payload_length<RHIZOME_MDP_REQUEST_BYTES) RETURN(-1);
   uint64_t version=
     read_uint64(&mdp->out.payload[RHIZOME_MANIFEST_ID_BYTES]);
   uint64_t fileOffset=
@@ -41,12 +42,21 @@ int overlay_mdp_service_rhizomerequest(overlay_mdp_frame *mdp)
     read_uint32(&mdp->out.payload[RHIZOME_MANIFEST_ID_BYTES+8+8]);
   uint16_t blockLength=
     read_uint16(&mdp->out.payload[RHIZOME_MANIFEST_ID_BYTES+8+8+4]);
-  if (blockLength>1024) RETURN(-1);
+  if (blockLength==0 || blockLength>RHIZOME_MDP_MAX_BLOCK_LENGTH) RETURN(-1);
+  // Newer requesters append the window size and the bitmap of blocks 32 and up.
+  int window=32;
+  uint32_t bitmap_high=0;
+  if (mdp->out.payload_length>=RHIZOME_MDP_REQUEST_WINDOW_BYTES){
+    window=read_uint16(&mdp->out.payload[RHIZOME_MDP_REQUEST_BYTES]);
+    bitmap_high=read_uint32(&mdp->out.payload[RHIZOME_MDP_REQUEST_BYTES+2]);
+    if (window>RHIZOME_MDP_MAX_WINDOW)
+      window=RHIZOME_MDP_MAX_WINDOW;
+  }
 
   struct subscriber *source = find_subscriber(mdp->out.src.sid, SID_SIZE, 0);
   
   if (config.debug.rhizome_tx)
-    DEBUGF("Requested blocks for %s @%llx", alloca_tohex_bid(&mdp->out.payload[0]), fileOffset);
+    DEBUGF("Requested %d blocks of %d bytes for %s @%llx", window, blockLength, alloca_tohex_bid(&mdp->out.payload[0]), fileOffset);
 
   /* Find manifest that corresponds to BID and version.
      If we don't have this combination, then do nothing.
@@ -57,16 +67,12 @@ int overlay_mdp_service_rhizomerequest(overlay_mdp_frame *mdp)
      journal, then the newer version is okay to use to service this request.
   */
   
-  char filehash[SHA512_DIGEST_STRING_LENGTH];
-  if (rhizome_database_filehash_from_id(alloca_tohex_bid(mdp->out.payload), version, filehash)<=0)
+  struct rhizome_read *read = rhizome_read_cached(mdp->out.payload, version);
+  if (!read)
     RETURN(-1);
+  int ret=0;
   
-  struct rhizome_read read;
-  bzero(&read, sizeof read);
-  
-  int ret=rhizome_open_read(&read, filehash, 0);
-  
-  if (!ret){
+  {
     overlay_mdp_frame reply;
     bzero(&reply,sizeof(reply));
     // Reply is broadcast, so we cannot authcrypt, and signing is too time consuming
@@ -111,31 +117,33 @@ int overlay_mdp_service_rhizomerequest(overlay_mdp_frame *mdp)
 	  &reply.out.payload[1+16],8);
     
     int i;
-    for(i=0;i<32;i++){
-      if (bitmap&(1<<(31-i)))
+    for(i=0;i<window;i++){
+      if (i<32 ? bitmap&(1u<<(31-i)) : bitmap_high&(1u<<(63-i)))
 	continue;
       
       if (overlay_queue_remaining(reply.out.queue) < 10)
 	break;
       
       // calculate and set offset of block
-      read.offset = fileOffset+i*blockLength;
+      read->offset = fileOffset+i*blockLength;
       
       // stop if we passed the length of the file
       // (but we may not know the file length until we attempt a read)
-      if (read.length!=-1 && read.offset>read.length)
+      if (read->length!=-1 && read->offset>read->length)
 	break;
       
-      write_uint64(&reply.out.payload[1+16+8], read.offset);
+      write_uint64(&reply.out.payload[1+16+8], read->offset);
       
-      int bytes_read = rhizome_read(&read, &reply.out.payload[1+16+8+8], blockLength);
+      int bytes_read = rhizome_read(read, &reply.out.payload[1+16+8+8], blockLength);
+      if (bytes_read<0)
+	ret=-1;
       if (bytes_read<=0)
 	break;
       
-      reply.out.payload_length=1+16+8+8+bytes_read;
+      reply.out.payload_length=RHIZOME_MDP_BLOCK_HEADER_BYTES+bytes_read;
       
       // Mark the last block of the file, if required
-      if (read.offset >= read.length)
+      if (read->offset >= read->length)
 	reply.out.payload[0]='T';
       
       // send packet
@@ -143,12 +151,62 @@ int overlay_mdp_service_rhizomerequest(overlay_mdp_frame *mdp)
 	break;
     }
   }
-  rhizome_read_close(&read);
+  rhizome_read_cached_done(read, ret);
 
   RETURN(ret);
   OUT();
 }
 
+/* Send the requested leaves of a payload's Merkle tree, so that the requester can verify each
+   block of the payload as it arrives.  Peers that have no tree for the payload stay silent. */
+int overlay_mdp_service_rhizome_merkle_request(overlay_mdp_frame *mdp)
+{
+  IN();
+  
+  if (mdp->out.payload_length<RHIZOME_MDP_MERKLE_REQUEST_BYTES) RETURN(-1);
+  uint64_t version=read_uint64(&mdp->out.payload[RHIZOME_MANIFEST_ID_BYTES]);
+  uint32_t first=read_uint32(&mdp->out.payload[RHIZOME_MANIFEST_ID_BYTES+8]);
+  int count=read_uint16(&mdp->out.payload[RHIZOME_MANIFEST_ID_BYTES+8+4]);
+  if (count>RHIZOME_MDP_MERKLE_MAX_REQUEST)
+    count=RHIZOME_MDP_MERKLE_MAX_REQUEST;
+  
+  if (config.debug.rhizome_tx)
+    DEBUGF("Requested %d Merkle leaves from %u for %s", count, first, alloca_tohex_bid(&mdp->out.payload[0]));
+  
+  char filehash[SHA512_DIGEST_STRING_LENGTH];
+  if (rhizome_database_filehash_from_id(alloca_tohex_bid(mdp->out.payload), version, filehash)<=0)
+    RETURN(-1);
+  
+  overlay_mdp_frame reply;
+  bzero(&reply,sizeof(reply));
+  // The leaves are checked against the signed root, so they need no protection of their own.
+  reply.packetTypeAndFlags=MDP_TX|MDP_NOCRYPT|MDP_NOSIGN;
+  bcopy(my_subscriber->sid,reply.out.src.sid,SID_SIZE);
+  reply.out.src.port=MDP_PORT_RHIZOME_RESPONSE;
+  bcopy(mdp->out.src.sid,reply.out.dst.sid,SID_SIZE);
+  reply.out.dst.port=MDP_PORT_RHIZOME_RESPONSE;
+  reply.out.ttl=PAYLOAD_TTL_DEFAULT;
+  reply.out.queue=OQ_OPPORTUNISTIC;
+  reply.out.payload[0]='H'; // reply contains Merkle leaves
+  bcopy(&mdp->out.payload[0],&reply.out.payload[1],16);
+  bcopy(&mdp->out.payload[RHIZOME_MANIFEST_ID_BYTES],&reply.out.payload[1+16],8);
+  
+  while (count>0){
+    int n = count < RHIZOME_MDP_MERKLE_LEAVES_PER_PACKET ? count : RHIZOME_MDP_MERKLE_LEAVES_PER_PACKET;
+    n = rhizome_merkle_read(filehash, first, n, &reply.out.payload[RHIZOME_MDP_MERKLE_HEADER_BYTES]);
+    if (n<=0)
+      break;
+    write_uint32(&reply.out.payload[1+16+8], first);
+    reply.out.payload_length=RHIZOME_MDP_MERKLE_HEADER_BYTES+n*RHIZOME_MERKLE_HASH_BYTES;
+    if (overlay_mdp_dispatch(&reply,0 /* system generated */, NULL,0))
+      break;
+    first+=n;
+    count-=n;
+  }
+  RETURN(0);
+  OUT();
+}
+
 int overlay_mdp_service_rhizomeresponse(overlay_mdp_frame *mdp)
 {
   IN();
@@ -177,11 +235,25 @@ int overlay_mdp_service_rhizomeresponse(overlay_mdp_frame *mdp)
 	 a slot to capture this files as it is being requested
 	 by someone else.
       */
-      rhizome_received_content(bidprefix,version,offset,count,bytes,type);
+      rhizome_received_content(mdp->out.src.sid,bidprefix,version,offset,count,bytes,type);
 
       RETURN(-1);
     }
     break;
+  case 'H': /* Merkle leaves */
+    {
+      if (mdp->out.payload_length<RHIZOME_MDP_MERKLE_HEADER_BYTES+RHIZOME_MERKLE_HASH_BYTES) RETURN(-1);
+      unsigned char *bidprefix=&mdp->out.payload[1];
+      uint64_t version=read_uint64(&mdp->out.payload[1+16]);
+      uint32_t first=read_uint32(&mdp->out.payload[1+16+8]);
+      int count=(mdp->out.payload_length-RHIZOME_MDP_MERKLE_HEADER_BYTES)/RHIZOME_MERKLE_HASH_BYTES;
+      if (config.debug.rhizome_rx)
+	DEBUGF("Received %d Merkle leaves from %u for %s* version 0x%llx",
+	       count,first,alloca_tohex(bidprefix,16),version);
+      rhizome_received_merkle_leaves(bidprefix,version,first,count,&mdp->out.payload[RHIZOME_MDP_MERKLE_HEADER_BYTES]);
+      RETURN(-1);
+    }
+    break;
   }
 
   RETURN(-1);
@@ -416,6 +488,11 @@ int overlay_mdp_try_interal_services(overlay_mdp_frame *mdp)
     break;
   case MDP_PORT_RHIZOME_RESPONSE: RETURN(overlay_mdp_service_rhizomeresponse(mdp));    
   case MDP_PORT_RHIZOME_MANIFEST_REQUEST: RETURN(overlay_mdp_service_manifest_response(mdp));
+  case MDP_PORT_RHIZOME_MERKLE_REQUEST:
+    if (is_rhizome_mdp_server_running()) {
+      RETURN(overlay_mdp_service_rhizome_merkle_request(mdp));
+    }
+    break;
   }
    
   /* Unbound socket.  We won't be sending ICMP style connection refused
@@ -301,8 +301,26 @@ int parseEnvelopeHeader(struct decode_context *context, struct overlay_interface
   OUT();
 }
 
+// decode a packet held in bytes that the caller may release or reuse as soon as we return,
+// so any payload we forward or queue will be copied
 int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, size_t len,
 		    int recvttl, struct sockaddr *recvaddr, size_t recvaddrlen)
+{
+  struct overlay_buffer *b = ob_static(packet, len);
+  if (!b)
+    return WHY("Unable to index packet");
+  ob_limitsize(b, len);
+  int ret = packetOkOverlayBuffer(interface, b, recvttl, recvaddr, recvaddrlen);
+  ob_free(b);
+  return ret;
+}
+
+// decode a packet from b, which must be positioned at the start of the packet with its size
+// limited to the packet length. If b owns its bytes (see ob_new()), payloads that we forward
+// or queue will share them instead of copying them, and b will remain shared until they have
+// been sent.
+int packetOkOverlayBuffer(struct overlay_interface *interface, struct overlay_buffer *b,
+		    int recvttl, struct sockaddr *recvaddr, size_t recvaddrlen)
 {
   IN();
   /* 
@@ -365,8 +383,6 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
   bzero(&f,sizeof f);
   
   time_ms_t now = gettime_ms();
-  struct overlay_buffer *b = ob_static(packet, len);
-  ob_limitsize(b, len);
   
   context.interface = f.interface = interface;
   if (recvaddr)
@@ -385,10 +401,8 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
     RETURN(WHY("Invalid packet encapsulation"));
   
   int ret=parseEnvelopeHeader(&context, interface, (struct sockaddr_in *)recvaddr, b);
-  if (ret){
-    ob_free(b);
+  if (ret)
     RETURN(ret);
-  }
   
   while(ob_remaining(b)>0){
     context.invalid_addresses=0;
@@ -460,8 +474,6 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
 end:
   send_please_explain(&context, my_subscriber, context.sender);
   
-  ob_free(b);
-  
   RETURN(ret);
   OUT();
 }
@@ -20,6 +20,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "serval.h"
 #include "conf.h"
 #include "str.h"
+#include "mem.h"
 #include "overlay_buffer.h"
 #include "overlay_packet.h"
 
@@ -148,6 +149,13 @@ int single_packet_encapsulation(struct overlay_buffer *b, struct overlay_frame *
   return 0;
 }
 
+static struct mem_pool frame_pool = MEM_POOL_INIT("overlay_frame", sizeof(struct overlay_frame), 128);
+
+struct overlay_frame *op_new()
+{
+  return pool_alloc_zero(&frame_pool);
+}
+
 int op_free(struct overlay_frame *p)
 {
   if (!p) return WHY("Asked to free NULL");
@@ -157,7 +165,7 @@ int op_free(struct overlay_frame *p)
   p->next=NULL;
   if (p->payload) ob_free(p->payload);
   p->payload=NULL;
-  free(p);
+  pool_free(&frame_pool, p);
   return 0;
 }
 
@@ -166,13 +174,14 @@ struct overlay_frame *op_dup(struct overlay_frame *in)
   if (!in) return NULL;
 
   /* clone the frame */
-  struct overlay_frame *out=malloc(sizeof(struct overlay_frame));
-  if (!out) { WHY("malloc() failed"); return NULL; }
+  struct overlay_frame *out=pool_alloc(&frame_pool);
+  if (!out) return NULL;
 
   /* copy main data structure */
   bcopy(in,out,sizeof(struct overlay_frame));
 
+  // the payload bytes are shared with the original frame, not copied
   if (in->payload)
-    out->payload=ob_dup(in->payload);
+    out->payload=ob_share(in->payload);
   return out;
 }
@@ -130,6 +130,21 @@ int overlay_queue_remaining(int queue){
   return overlay_tx[queue].maxLength - overlay_tx[queue].length;
 }
 
+// queued frames hold pointers to their source, destination and next hop
+void overlay_queue_mark_subscribers()
+{
+  int i;
+  for (i=0;i<OQ_MAX;i++){
+    struct overlay_frame *frame = overlay_tx[i].first;
+    while(frame){
+      mark_subscriber_in_use(frame->source);
+      mark_subscriber_in_use(frame->destination);
+      mark_subscriber_in_use(frame->next_hop);
+      frame = frame->next;
+    }
+  }
+}
+
 int overlay_payload_enqueue(struct overlay_frame *p)
 {
   /* Add payload p to queue q.
@@ -510,9 +525,9 @@ overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, tim
   }
 }
 
-// fill a packet from our outgoing queues and send it
+// fill a packet from our outgoing queues, returns 1 if a packet was assembled
 static int
-overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now) {
+overlay_fill_packet(struct outgoing_packet *packet, time_ms_t now) {
   int i;
   IN();
   // while we're looking at queues, work out when to schedule another packet
@@ -529,26 +544,86 @@ overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now) {
   if(packet->buffer){
     if (config.debug.packetconstruction)
       ob_dump(packet->buffer,"assembled packet");
-      
-    if (overlay_broadcast_ensemble(packet->interface, &packet->dest, ob_ptr(packet->buffer), ob_position(packet->buffer))){
-      // sendto failed. We probably don't have a valid route
-      if (packet->unicast_subscriber){
-	set_reachable(packet->unicast_subscriber, REACHABLE_NONE);
-      }
-    }
-    ob_free(packet->buffer);
     RETURN(1);
   }
   RETURN(0);
   OUT();
 }
 
-// when the queue timer elapses, send a packet
+static void
+overlay_send_failed(struct outgoing_packet *packet){
+  // sendto failed. We probably don't have a valid route
+  if (packet->unicast_subscriber){
+    set_reachable(packet->unicast_subscriber, REACHABLE_NONE);
+  }
+}
+
+// fill a packet from our outgoing queues and send it
+static int
+overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now) {
+  if (!overlay_fill_packet(packet, now))
+    return 0;
+  if (overlay_broadcast_ensemble(packet->interface, &packet->dest, ob_ptr(packet->buffer), ob_position(packet->buffer)))
+    overlay_send_failed(packet);
+  ob_free(packet->buffer);
+  return 1;
+}
+
+// send every assembled packet, with one batch of system calls per interface
+static void
+overlay_flush_packets(struct outgoing_packet *packets, int count){
+  struct send_datagram dgrams[SEND_BATCH_MAX];
+  struct outgoing_packet *batch[SEND_BATCH_MAX];
+  char failed[SEND_BATCH_MAX];
+  int i, j;
+  
+  for (i=0;i<count;i++){
+    if (!packets[i].buffer)
+      continue;
+    overlay_interface *interface = packets[i].interface;
+    int n=0;
+    for (j=i;j<count;j++){
+      if (!packets[j].buffer || packets[j].interface!=interface)
+	continue;
+      batch[n]=&packets[j];
+      dgrams[n].buffer=ob_ptr(packets[j].buffer);
+      dgrams[n].len=ob_position(packets[j].buffer);
+      dgrams[n].addr=(struct sockaddr *)&packets[j].dest;
+      dgrams[n].addrlen=sizeof(packets[j].dest);
+      n++;
+    }
+    overlay_broadcast_ensemble_batch(interface, dgrams, failed, n);
+    for (j=0;j<n;j++){
+      if (failed[j])
+	overlay_send_failed(batch[j]);
+      ob_free(batch[j]->buffer);
+      batch[j]->buffer=NULL;
+    }
+  }
+}
+
+// when the queue timer elapses, assemble as many packets as the queues and rate limits allow
 static void overlay_send_packet(struct sched_ent *alarm){
-  struct outgoing_packet packet;
-  bzero(&packet, sizeof(struct outgoing_packet));
+  struct outgoing_packet packets[SEND_BATCH_MAX];
+  int i, count=0;
+  time_ms_t now = gettime_ms();
   
-  overlay_fill_send_packet(&packet, gettime_ms());
+  for (i=0;i<SEND_BATCH_MAX;i++){
+    struct outgoing_packet *packet = &packets[count];
+    bzero(packet, sizeof(struct outgoing_packet));
+    if (!overlay_fill_packet(packet, now))
+      break;
+    if (packet->interface->socket_type==SOCK_DGRAM){
+      // hold datagrams back so they can go out together
+      count++;
+      continue;
+    }
+    // streams and dummy files can only take one packet at a time
+    if (overlay_broadcast_ensemble(packet->interface, &packet->dest, ob_ptr(packet->buffer), ob_position(packet->buffer)))
+      overlay_send_failed(packet);
+    ob_free(packet->buffer);
+  }
+  overlay_flush_packets(packets, count);
 }
 
 int overlay_send_tick_packet(struct overlay_interface *interface){
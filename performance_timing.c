@@ -19,6 +19,8 @@
 
 #include "serval.h"
 #include "conf.h"
+#include "mem.h"
+#include "overlay_address.h"
 
 struct profile_total *stats_head=NULL;
 struct call_stats *current_call=NULL;
@@ -184,6 +186,17 @@ int fd_showstats()
       stats = stats->_next;
     }    
     fd_showstat(&total,&total);
+    overlay_interface_showstats();
+    mem_pool_showstats();
+    overlay_buffer_showstats();
+    overlay_address_showstats();
+    rhizome_write_showstats();
+    rhizome_read_showstats();
+    rhizome_http_showstats();
+    rhizome_database_showstats();
+    rhizome_signature_showstats();
+    rhizome_advert_showstats();
+    rhizome_fetch_showstats();
   }
   
   return 0;
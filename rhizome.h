@@ -75,6 +75,27 @@ extern time_ms_t rhizome_voice_timeout;
 
 #define RHIZOME_IDLE_TIMEOUT 10000
 
+/* MDP block transfer.  A request is the bundle ID, version, file offset, a 32 bit bitmap of
+ * blocks not to send, and the block length.  It may be followed by the number of blocks in the
+ * window and a further 32 bit bitmap for blocks 32 to 63.  A response block is preceded by its
+ * type, 16 bytes of bundle ID, the version and the offset.
+ */
+#define RHIZOME_MDP_REQUEST_BYTES (RHIZOME_MANIFEST_ID_BYTES+8+8+4+2)
+#define RHIZOME_MDP_REQUEST_WINDOW_BYTES (RHIZOME_MDP_REQUEST_BYTES+2+4)
+#define RHIZOME_MDP_MAX_WINDOW 64
+#define RHIZOME_MDP_BLOCK_HEADER_BYTES (1+16+8+8)
+#define RHIZOME_MDP_MAX_BLOCK_LENGTH (MDP_MTU-100-RHIZOME_MDP_BLOCK_HEADER_BYTES)
+/* A request for Merkle leaves: BID, version, first leaf, number of leaves.  The 'H' reply carries
+   the BID prefix, version and first leaf, then as many leaves as fit. */
+#define RHIZOME_MDP_MERKLE_REQUEST_BYTES (32+8+4+2)
+#define RHIZOME_MDP_MERKLE_HEADER_BYTES (1+16+8+4)
+#define RHIZOME_MDP_MERKLE_LEAVES_PER_PACKET ((MDP_MTU-100-RHIZOME_MDP_MERKLE_HEADER_BYTES)/RHIZOME_MERKLE_HASH_BYTES)
+#define RHIZOME_MDP_MERKLE_MAX_REQUEST 64
+
+/* Payloads are hashed in blocks of this size into a Merkle tree, see rhizome_merkle.c */
+#define RHIZOME_MERKLE_BLOCK_BYTES 4096
+#define RHIZOME_MERKLE_HASH_BYTES SHA512_DIGEST_LENGTH
+
 #define EXISTING_BUNDLE_ID 1
 #define NEW_BUNDLE_ID 2
 
@@ -95,11 +116,51 @@ typedef struct rhizome_signature {
 
 #define MAX_MANIFEST_VARS 256
 #define MAX_MANIFEST_BYTES 8192
+/* Well known manifest fields, whose positions in vars[] are indexed when the manifest is read or
+ * modified, so that looking them up does not need a search.
+ */
+enum rhizome_manifest_field {
+  RHIZOME_FIELD_ID,
+  RHIZOME_FIELD_VERSION,
+  RHIZOME_FIELD_FILESIZE,
+  RHIZOME_FIELD_FILEHASH,
+  RHIZOME_FIELD_SERVICE,
+  RHIZOME_FIELD_NAME,
+  RHIZOME_FIELD_SENDER,
+  RHIZOME_FIELD_RECIPIENT,
+  RHIZOME_FIELD_DATE,
+  RHIZOME_FIELD_BK,
+  RHIZOME_FIELD_CRYPT,
+  RHIZOME_FIELD_COUNT
+};
+
+/* A manifest variable, as the offsets of its nul terminated name and value in the manifest's text
+ * buffer.
+ */
+struct rhizome_manifest_var {
+  unsigned short name;
+  unsigned short value;
+};
+
+/* The names and values of a manifest's variables.  When it fills up, the live strings are compacted
+ * into a bigger buffer, and the old one is kept on the 'retired' list until the manifest is freed,
+ * so that strings returned by rhizome_manifest_get() stay valid.
+ */
+struct rhizome_manifest_text {
+  struct rhizome_manifest_text *retired;
+  int used;
+  int size;
+  char bytes[];
+};
+
 typedef struct rhizome_manifest {
   int manifest_record_number;
   int manifest_bytes;
   int manifest_all_bytes;
-  unsigned char manifestdata[MAX_MANIFEST_BYTES];
+  /* The text and signature blocks, in a buffer of manifestdata_size bytes that is grown as needed,
+     with room for a nul after the last byte */
+  unsigned char *manifestdata;
+  int manifestdata_size;
   unsigned char manifesthash[crypto_hash_sha512_BYTES];
 
   /* CryptoSign key pair for this manifest.
@@ -107,19 +168,23 @@ typedef struct rhizome_manifest {
      of this pair, thus ensuring that noone can tamper with a bundle
      except the creator. */
   unsigned char cryptoSignPublic[crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES];
-  unsigned char cryptoSignSecret[crypto_sign_edwards25519sha512batch_SECRETKEYBYTES];
+  /* Only allocated, by rhizome_manifest_secret(), when the secret is created or derived */
+  unsigned char *cryptoSignSecret;
 
   int var_count;
-  char *vars[MAX_MANIFEST_VARS];
-  char *values[MAX_MANIFEST_VARS];
+  int var_size;
+  struct rhizome_manifest_var *vars;
+  struct rhizome_manifest_text *text;
+  /* 1 + index in vars[] of each well known field, or 0 if absent */
+  unsigned short field_slot[RHIZOME_FIELD_COUNT];
 
   int sig_count;
   /* Parties who have signed this manifest (raw byte format) */
-  unsigned char *signatories[MAX_MANIFEST_VARS];
+  unsigned char (*signatories)[crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES];
   /*
     0x17 = crypto_sign_edwards25519sha512batch()
   */
-  unsigned char signatureTypes[MAX_MANIFEST_VARS];
+  unsigned char *signatureTypes;
 
   int errors; /* if non-zero, then manifest should not be trusted */
   time_ms_t inserttime;
@@ -157,13 +222,17 @@ typedef struct rhizome_manifest {
   long long version;
   
   int group_count;
-  char *groups[MAX_MANIFEST_VARS];
+  char **groups;
 
   /* Author of the manifest.  A reference to a local keyring entry.  Manifests
    * not authored locally will have the ANY author (all zeros).
    */
   unsigned char author[SID_SIZE];
 
+  /* Where this manifest was allocated and last freed, to help find leaks and double frees */
+  struct __sourceloc alloc_whence;
+  struct __sourceloc free_whence;
+
 } rhizome_manifest;
 
 /* Supported service identifiers.  These go in the 'service' field of every
@@ -197,6 +266,8 @@ int create_rhizome_import_dir();
 #define FORM_RHIZOME_IMPORT_PATH(buf,fmt,...) (form_rhizome_import_path((buf), sizeof(buf), (fmt), ##__VA_ARGS__))
 
 extern sqlite3 *rhizome_db;
+extern sqlite3 *rhizome_read_db;
+sqlite3 *rhizome_reader();
 
 int rhizome_opendb();
 int rhizome_close_db();
@@ -210,6 +281,8 @@ struct rhizome_cleanup_report {
 int rhizome_cleanup(struct rhizome_cleanup_report *report);
 
 int rhizome_manifest_createid(rhizome_manifest *m);
+unsigned char *rhizome_manifest_secret(rhizome_manifest *m);
+void rhizome_manifest_forget_secret(rhizome_manifest *m);
 int rhizome_strn_is_manifest_id(const char *text);
 int rhizome_str_is_manifest_id(const char *text);
 int rhizome_strn_is_bundle_key(const char *text);
@@ -262,6 +335,7 @@ int rhizome_bundle_import(rhizome_manifest *m, int ttl);
 int rhizome_fill_manifest(rhizome_manifest *m, const char *filepath, const sid_t *authorSid, rhizome_bk_t *bsk);
 
 int rhizome_manifest_verify(rhizome_manifest *m);
+int rhizome_manifest_verify_batch(rhizome_manifest *manifests[], int count);
 int rhizome_manifest_check_sanity(rhizome_manifest *m_in);
 int rhizome_manifest_check_duplicate(rhizome_manifest *m_in,rhizome_manifest **m_out, int check_author);
 
@@ -301,6 +375,13 @@ int _sqlite_exec_int64_retry(struct __sourceloc, sqlite_retry_state *retry, long
 int _sqlite_exec_strbuf(struct __sourceloc, strbuf sb, const char *sqlformat, ...);
 int _sqlite_exec_strbuf_retry(struct __sourceloc, sqlite_retry_state *retry, strbuf sb, const char *sqlformat, ...);
 int _sqlite_vexec_strbuf_retry(struct __sourceloc, sqlite_retry_state *retry, strbuf sb, const char *sqlformat, va_list ap);
+sqlite3_stmt *_sqlite_prepare_cached(struct __sourceloc, sqlite_retry_state *retry, const char *sql);
+sqlite3_stmt *_sqlite_prepare_cached_read(struct __sourceloc, sqlite_retry_state *retry, const char *sql);
+sqlite3_stmt *_sqlite_prepare_read(struct __sourceloc, sqlite_retry_state *retry, const char *sqlformat, ...);
+int _sqlite_exec_int64_prepared(struct __sourceloc, sqlite_retry_state *retry, long long *result, sqlite3_stmt *statement);
+int _sqlite_exec_strbuf_prepared(struct __sourceloc, sqlite_retry_state *retry, strbuf sb, sqlite3_stmt *statement);
+void sqlite_release(sqlite3_stmt *statement);
+void sqlite_statement_cache_flush();
 
 #define sqlite_prepare(rs,fmt,...)              _sqlite_prepare(__WHENCE__, (rs), (fmt), ##__VA_ARGS__)
 #define sqlite_prepare_loglevel(ll,rs,sb)       _sqlite_prepare_loglevel(__WHENCE__, (ll), (rs), (sb))
@@ -316,6 +397,11 @@ int _sqlite_vexec_strbuf_retry(struct __sourceloc, sqlite_retry_state *retry, st
 #define sqlite_exec_int64_retry(rs,res,fmt,...) _sqlite_exec_int64_retry(__WHENCE__, (rs), (res), (fmt), ##__VA_ARGS__)
 #define sqlite_exec_strbuf(sb,fmt,...)          _sqlite_exec_strbuf(__WHENCE__, (sb), (fmt), ##__VA_ARGS__)
 #define sqlite_exec_strbuf_retry(rs,sb,fmt,...) _sqlite_exec_strbuf_retry(__WHENCE__, (rs), (sb), (fmt), ##__VA_ARGS__)
+#define sqlite_prepare_cached(rs,sql)           _sqlite_prepare_cached(__WHENCE__, (rs), (sql))
+#define sqlite_prepare_cached_read(rs,sql)      _sqlite_prepare_cached_read(__WHENCE__, (rs), (sql))
+#define sqlite_prepare_read(rs,fmt,...)         _sqlite_prepare_read(__WHENCE__, (rs), (fmt), ##__VA_ARGS__)
+#define sqlite_exec_int64_prepared(rs,res,stmt) _sqlite_exec_int64_prepared(__WHENCE__, (rs), (res), (stmt))
+#define sqlite_exec_strbuf_prepared(rs,sb,stmt) _sqlite_exec_strbuf_prepared(__WHENCE__, (rs), (sb), (stmt))
 
 double rhizome_manifest_get_double(rhizome_manifest *m,char *var,double default_value);
 int rhizome_manifest_extract_signature(rhizome_manifest *m,int *ofs);
@@ -330,6 +416,8 @@ int rhizome_list_manifests(const char *service, const char *name,
 			   int limit, int offset, char count_rows);
 int rhizome_retrieve_manifest(const char *manifestid, rhizome_manifest *m);
 int rhizome_advertise_manifest(rhizome_manifest *m);
+void rhizome_bar_cache_store(int64_t rowid, const unsigned char *bar);
+void rhizome_bar_cache_delete(const char *manifestid);
 int rhizome_delete_bundle(const char *manifestid);
 int rhizome_delete_manifest(const char *manifestid);
 int rhizome_delete_payload(const char *manifestid);
@@ -375,14 +463,40 @@ int rhizome_queue_ignore_manifest(unsigned char *bid_prefix, int prefix_len, int
 int rhizome_ignore_manifest_check(unsigned char *bid_prefix, int prefix_len);
 
 /* one manifest is required per candidate, plus a few spare.
-   so MAX_RHIZOME_MANIFESTS must be > MAX_CANDIDATES. 
+   so MAX_RHIZOME_MANIFESTS must be > MAX_CANDIDATES.  Manifests are pooled and allocated on
+   demand, so this only bounds how many can be in use at once, to catch leaks.
 */
-#define MAX_RHIZOME_MANIFESTS 40
+#define MAX_RHIZOME_MANIFESTS 1024
 #define MAX_CANDIDATES 32
 
 int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sockaddr_in *peerip,const unsigned char peersid[SID_SIZE]);
 rhizome_manifest * rhizome_fetch_search(unsigned char *id, int prefix_length);
+int rhizome_fetch_add_source(const unsigned char *id, int prefix_length, int64_t version,
+			     const unsigned char peersid[SID_SIZE]);
+
+
+/* A Merkle tree being built over a payload as it is written */
+struct rhizome_merkle{
+  char enabled;
+  char have_root; // compare with root once the payload is written
+  unsigned char root[RHIZOME_MERKLE_HASH_BYTES];
+  SHA512_CTX block_context;
+  int block_bytes;
+  unsigned char *leaves;
+  int leaf_count;
+  int allocated;
+};
 
+int rhizome_merkle_leaf_count(int64_t length);
+void rhizome_merkle_hash_leaf(const unsigned char *data, int length, unsigned char *hash);
+int rhizome_merkle_root(const unsigned char *leaves, int count, unsigned char *root);
+int rhizome_manifest_merkle_root(const rhizome_manifest *m, unsigned char *root);
+int rhizome_merkle_update(struct rhizome_merkle *merkle, const unsigned char *buffer, int length);
+int rhizome_merkle_end_block(struct rhizome_merkle *merkle);
+void rhizome_merkle_release(struct rhizome_merkle *merkle);
+int rhizome_merkle_store(const char *fileid, const unsigned char *leaves, int count, int64_t verified);
+int rhizome_merkle_load(const char *fileid, unsigned char **leaves, int *count, int64_t *verified);
+int rhizome_merkle_read(const char *fileid, int first, int count, unsigned char *leaves);
 
 /* Rhizome file storage api */
 struct rhizome_write{
@@ -403,6 +517,22 @@ struct rhizome_write{
   SHA512_CTX sha512_context;
   int64_t blob_rowid;
   int blob_fd;
+  /* Open handle on the FILEBLOBS row, held inside a transaction until the write is finished */
+  sqlite3_blob *blob;
+  char blob_txn;
+  
+  /* Hand full buffers to the background writer instead of storing them from the event loop.
+     While any are pending, the writer thread owns the hash context and the fields above. */
+  int async;
+  int pending;
+  int cancel;
+  char error[128];
+  struct sched_ent *idle_alarm;
+  /* Waiting for room in the writer's queue, see rhizome_write_wait() */
+  struct sched_ent *ready_alarm;
+  struct rhizome_write *next_waiting;
+  
+  struct rhizome_merkle merkle;
 };
 
 struct rhizome_read{
@@ -417,6 +547,7 @@ struct rhizome_read{
   
   int64_t blob_rowid;
   int blob_fd;
+  sqlite3_blob *blob;
   
   int64_t offset;
   int64_t length;
@@ -518,7 +649,9 @@ struct http_response {
   const char * body;
 };
 
-int rhizome_received_content(unsigned char *bidprefix,uint64_t version, 
+int rhizome_received_merkle_leaves(unsigned char *bidprefix, uint64_t version, uint32_t first,
+				   int count, const unsigned char *leaves);
+int rhizome_received_content(const unsigned char *sender,unsigned char *bidprefix,uint64_t version, 
 			     uint64_t offset,int count,unsigned char *bytes,
 			     int type);
 int64_t rhizome_database_create_blob_for(const char *filehashhex_or_tempid,
@@ -676,7 +809,14 @@ int rhizome_open_write(struct rhizome_write *write, char *expectedFileHash, int6
 int rhizome_flush(struct rhizome_write *write);
 int rhizome_write_file(struct rhizome_write *write, const char *filename);
 int rhizome_fail_write(struct rhizome_write *write);
+int rhizome_write_truncate(struct rhizome_write *write, int64_t length);
+int rhizome_suspend_write(struct rhizome_write *write, int64_t verified, const unsigned char *leaves, int leaf_count);
+int rhizome_resume_write(struct rhizome_write *write, const char *fileHash, int64_t file_length,
+			 const unsigned char *leaves, int leaf_count, int64_t verified);
 int rhizome_finish_write(struct rhizome_write *write);
+int rhizome_write_wait(struct rhizome_write *write, struct sched_ent *alarm);
+int rhizome_write_when_idle(struct rhizome_write *write, int cancel, struct sched_ent *alarm);
+int rhizome_is_writer_thread();
 int rhizome_import_file(rhizome_manifest *m, const char *filepath);
 int rhizome_stat_file(rhizome_manifest *m, const char *filepath);
 int rhizome_add_file(rhizome_manifest *m, const char *filepath);
@@ -686,6 +826,11 @@ int rhizome_crypt_xor_block(unsigned char *buffer, int buffer_size, int64_t stre
 int rhizome_open_read(struct rhizome_read *read, const char *fileid, int hash);
 int rhizome_read(struct rhizome_read *read, unsigned char *buffer, int buffer_length);
 int rhizome_read_close(struct rhizome_read *read);
+void rhizome_read_release(struct rhizome_read *read);
+struct rhizome_read *rhizome_read_cached(const unsigned char *bid, uint64_t version);
+void rhizome_read_cached_done(struct rhizome_read *read, int failed);
+void rhizome_read_cache_invalidate(const char *fileid);
+void rhizome_read_cache_flush();
 int rhizome_store_delete(const char *id);
 int rhizome_open_decrypt_read(rhizome_manifest *m, rhizome_bk_t *bsk, struct rhizome_read *read_state, int hash);
 int rhizome_extract_file(rhizome_manifest *m, const char *filepath, rhizome_bk_t *bsk);
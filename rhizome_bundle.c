@@ -23,19 +23,30 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "rhizome.h"
 #include "str.h"
 
-int rhizome_manifest_verify(rhizome_manifest *m)
+/* find end of manifest body and start of signatures */
+static int manifest_text_length(const rhizome_manifest *m)
 {
   int end_of_text=0;
-
-  /* find end of manifest body and start of signatures */
   while(m->manifestdata[end_of_text]&&end_of_text<m->manifest_all_bytes)
     end_of_text++;
   end_of_text++; /* include null byte in body for verification purposes */
+  return end_of_text;
+}
+
+static int manifest_verify_hashed(rhizome_manifest *m, int end_of_text);
+
+int rhizome_manifest_verify(rhizome_manifest *m)
+{
+  int end_of_text=manifest_text_length(m);
 
   /* Calculate hash of the text part of the file, as we need to couple this with
      each signature block to */
   crypto_hash_sha512(m->manifesthash,m->manifestdata,end_of_text);
-  
+  return manifest_verify_hashed(m, end_of_text);
+}
+
+static int manifest_verify_hashed(rhizome_manifest *m, int end_of_text)
+{
   /* Read signature blocks from file. */
   int ofs=end_of_text;  
   while(ofs<m->manifest_all_bytes) {
@@ -84,6 +95,225 @@ int rhizome_manifest_verify(rhizome_manifest *m)
   else return 0;
 }
 
+/* Verify a batch of manifests heard together, eg, in one advert frame, returning the number that
+ * failed.  The manifest texts are hashed side by side with SHA512_Update_Multi().  Signature blocks
+ * repeated within the batch, or already seen in earlier batches, are only checked once, courtesy of
+ * the signature cache in rhizome_manifest_lookup_signature_validity().
+ */
+int rhizome_manifest_verify_batch(rhizome_manifest *manifests[], int count)
+{
+  SHA512_CTX contexts[count];
+  SHA512_CTX *ctx[count];
+  const unsigned char *text[count];
+  size_t text_length[count];
+  rhizome_manifest *todo[count];
+  int i, n=0, failed=0;
+  
+  for (i=0;i<count;i++){
+    if (manifests[i]->selfSigned)
+      continue;
+    todo[n]=manifests[i];
+    ctx[n]=&contexts[n];
+    text[n]=todo[n]->manifestdata;
+    text_length[n]=manifest_text_length(todo[n]);
+    SHA512_Init(ctx[n]);
+    n++;
+  }
+  SHA512_Update_Multi(ctx, text, text_length, n);
+  for (i=0;i<n;i++){
+    SHA512_Final(todo[i]->manifesthash, ctx[i]);
+    if (manifest_verify_hashed(todo[i], text_length[i]))
+      failed++;
+  }
+  return failed;
+}
+
+/* Perfect hash of the well known field names, ignoring case.  Every name lands in its own bucket,
+ * so a single comparison confirms the match.
+ */
+#define MANIFEST_FIELD_HASH(len,first,last) ((2 * (len) + 4 * (first) + (last)) % 14)
+static const struct {
+  const char *name;
+  int field;
+} manifest_field_names[14] = {
+  [1] = {"service", RHIZOME_FIELD_SERVICE},
+  [2] = {"recipient", RHIZOME_FIELD_RECIPIENT},
+  [3] = {"name", RHIZOME_FIELD_NAME},
+  [4] = {"crypt", RHIZOME_FIELD_CRYPT},
+  [5] = {"date", RHIZOME_FIELD_DATE},
+  [6] = {"id", RHIZOME_FIELD_ID},
+  [7] = {"filesize", RHIZOME_FIELD_FILESIZE},
+  [8] = {"version", RHIZOME_FIELD_VERSION},
+  [10] = {"filehash", RHIZOME_FIELD_FILEHASH},
+  [12] = {"sender", RHIZOME_FIELD_SENDER},
+  [13] = {"BK", RHIZOME_FIELD_BK},
+};
+
+// for the benchmark, including the comparisons a plain search of vars[] would have made
+static unsigned long manifest_lookups=0, manifest_compares=0, manifest_allocs=0, manifest_search_compares=0;
+static unsigned long manifest_heap_bytes=0;
+
+#define MANIFEST_VAR_NAME(m,i) (&(m)->text->bytes[(m)->vars[i].name])
+#define MANIFEST_VAR_VALUE(m,i) (&(m)->text->bytes[(m)->vars[i].value])
+/* text offsets are unsigned short */
+#define MANIFEST_TEXT_MAX 0xFFFF
+
+static int manifest_field_id(const char *var)
+{
+  size_t len = strlen(var);
+  if (len < 2 || len > 9)
+    return -1;
+  unsigned h = MANIFEST_FIELD_HASH(len, tolower((unsigned char)var[0]), tolower((unsigned char)var[len - 1]));
+  if (!manifest_field_names[h].name)
+    return -1;
+  manifest_compares++;
+  if (strcasecmp(manifest_field_names[h].name, var))
+    return -1;
+  return manifest_field_names[h].field;
+}
+
+static void manifest_index_fields(rhizome_manifest *m)
+{
+  int i;
+  bzero(m->field_slot, sizeof m->field_slot);
+  for (i = 0; i < m->var_count; ++i) {
+    int field = manifest_field_id(MANIFEST_VAR_NAME(m, i));
+    if (field != -1 && !m->field_slot[field])
+      m->field_slot[field] = i + 1;
+  }
+}
+
+/* Return the index of var in m->vars[], or -1 */
+static int manifest_search(const rhizome_manifest *m, const char *var)
+{
+  int i;
+  for (i = 0; i < m->var_count; ++i) {
+    manifest_compares++;
+    if (strcmp(MANIFEST_VAR_NAME(m, i), var) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static int manifest_find(const rhizome_manifest *m, const char *var)
+{
+  int i;
+  manifest_lookups++;
+  int field = manifest_field_id(var);
+  if (field == -1)
+    i = manifest_search(m, var);
+  else if (!m->field_slot[field])
+    i = -1;
+  else {
+    i = m->field_slot[field] - 1;
+    manifest_compares++;
+    if (strcmp(MANIFEST_VAR_NAME(m, i), var) != 0)
+      // the indexed field differs in case, so fall back to a search
+      i = manifest_search(m, var);
+  }
+  manifest_search_compares += i == -1 ? m->var_count : i + 1;
+  return i;
+}
+
+/* Ensure the manifest data buffer can hold the given number of bytes, plus a terminating nul.
+ */
+static int manifest_data_reserve(rhizome_manifest *m, int bytes)
+{
+  if (m->manifestdata && bytes < m->manifestdata_size)
+    return 0;
+  unsigned char *data = erealloc(m->manifestdata, bytes + 1);
+  if (!data)
+    return -1;
+  manifest_allocs++;
+  manifest_heap_bytes += bytes + 1 - m->manifestdata_size;
+  m->manifestdata = data;
+  m->manifestdata_size = bytes + 1;
+  return 0;
+}
+
+/* Ensure there is room for the given number of variables.
+ */
+static int manifest_vars_reserve(rhizome_manifest *m, int count)
+{
+  if (count <= m->var_size)
+    return 0;
+  if (count > MAX_MANIFEST_VARS)
+    return WHY("Too many manifest variables");
+  int size = m->var_size * 2;
+  if (size < count)
+    size = count;
+  if (size > MAX_MANIFEST_VARS)
+    size = MAX_MANIFEST_VARS;
+  struct rhizome_manifest_var *vars = erealloc(m->vars, size * sizeof *vars);
+  if (!vars)
+    return -1;
+  manifest_allocs++;
+  manifest_heap_bytes += (size - m->var_size) * sizeof *vars;
+  m->vars = vars;
+  m->var_size = size;
+  return 0;
+}
+
+static unsigned short manifest_text_append(struct rhizome_manifest_text *t, const char *str, size_t len)
+{
+  unsigned short ofs = t->used;
+  memcpy(&t->bytes[ofs], str, len);
+  t->used += len;
+  return ofs;
+}
+
+/* Ensure the text buffer has room for the given number of bytes of new names and values.  The old
+ * buffer is retired rather than freed, as callers may still hold strings within it.
+ */
+static int manifest_text_reserve(rhizome_manifest *m, size_t bytes)
+{
+  struct rhizome_manifest_text *old = m->text;
+  if (old && old->used + bytes <= old->size)
+    return 0;
+  size_t live = 0;
+  int i;
+  for (i = 0; i < m->var_count; ++i)
+    live += strlen(MANIFEST_VAR_NAME(m, i)) + strlen(MANIFEST_VAR_VALUE(m, i)) + 2;
+  if (live + bytes > MANIFEST_TEXT_MAX)
+    return WHY("Manifest variables too long");
+  size_t size = old ? old->size * 2 : 0;
+  if (size < live + bytes)
+    size = live + bytes;
+  if (size > MANIFEST_TEXT_MAX)
+    size = MANIFEST_TEXT_MAX;
+  struct rhizome_manifest_text *t = emalloc(sizeof *t + size);
+  if (!t)
+    return -1;
+  manifest_allocs++;
+  manifest_heap_bytes += sizeof *t + size;
+  t->retired = old;
+  t->used = 0;
+  t->size = size;
+  for (i = 0; i < m->var_count; ++i) {
+    const char *name = MANIFEST_VAR_NAME(m, i);
+    const char *value = MANIFEST_VAR_VALUE(m, i);
+    m->vars[i].name = manifest_text_append(t, name, strlen(name) + 1);
+    m->vars[i].value = manifest_text_append(t, value, strlen(value) + 1);
+  }
+  m->text = t;
+  return 0;
+}
+
+/* Set the value of vars[i], which is a new variable called var if i == var_count */
+static int manifest_set_var(rhizome_manifest *m, int i, const char *var, const char *value)
+{
+  size_t varlen = i < m->var_count ? 0 : strlen(var) + 1;
+  size_t valuelen = strlen(value) + 1;
+  if (manifest_vars_reserve(m, i + 1) == -1)
+    return -1;
+  if (manifest_text_reserve(m, varlen + valuelen) == -1)
+    return -1;
+  if (varlen)
+    m->vars[i].name = manifest_text_append(m->text, var, varlen);
+  m->vars[i].value = manifest_text_append(m->text, value, valuelen);
+  return 0;
+}
+
 int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bufferP)
 {
   IN();
@@ -91,24 +321,45 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
   if (!m) RETURN(WHY("Null manifest"));
 
   if (bufferP) {
+    if (manifest_data_reserve(m, bufferP) == -1)
+      RETURN(-1);
     m->manifest_bytes=bufferP;
     memcpy(m->manifestdata, filename, m->manifest_bytes);
   } else {
     FILE *f = fopen(filename, "r");
     if (f == NULL)
       RETURN(WHYF("Could not open manifest file %s for reading.", filename)); 
-    m->manifest_bytes = fread(m->manifestdata, 1, MAX_MANIFEST_BYTES, f);
+    unsigned char buffer[MAX_MANIFEST_BYTES];
+    int bytes = fread(buffer, 1, sizeof buffer, f);
     int ret = 0;
-    if (m->manifest_bytes == -1)
+    if (bytes == -1)
       ret = WHY_perror("fread");
     if (fclose(f) == EOF)
       ret = WHY_perror("fclose");
+    if (ret == 0)
+      ret = manifest_data_reserve(m, bytes);
     if (ret == -1)
       RETURN(-1);
+    m->manifest_bytes = bytes;
+    memcpy(m->manifestdata, buffer, bytes);
   }
+  m->manifestdata[m->manifest_bytes] = '\0';
 
   m->manifest_all_bytes=m->manifest_bytes;
 
+  /* Size the variable table and text buffer to the whole text up front, so that parsing needs no
+     more allocations.  The text can only shrink, as '=' and line ends become nuls. */
+  {
+    int lines = 1, i;
+    for (i = 0; i < m->manifest_bytes && m->manifestdata[i]; ++i)
+      if (m->manifestdata[i] == '\n')
+	++lines;
+    if (lines > MAX_MANIFEST_VARS)
+      lines = MAX_MANIFEST_VARS;
+    if (manifest_vars_reserve(m, m->var_count + lines) == -1 || manifest_text_reserve(m, i + 1) == -1)
+      RETURN(-1);
+  }
+
   /* Parse out variables, signature etc */
   int have_service = 0;
   int have_id = 0;
@@ -148,7 +399,8 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
       *p++ = '\0';
       char *var = line;
       char *value = p;
-      if (rhizome_manifest_get(m, var, NULL, 0)) {
+      int field = manifest_field_id(var);
+      if (manifest_find(m, var) != -1) {
 	if (config.debug.rejecteddata)
 	  WARNF("Ill formed manifest file, duplicate variable \"%s\"", var);
 	m->errors++;
@@ -156,10 +408,12 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	if (config.debug.rejecteddata)
 	  WARN("Ill formed manifest file, too many variables");
 	m->errors++;
+      } else if (manifest_set_var(m, m->var_count, var, value) == -1) {
+	m->errors++;
       } else {
-	m->vars[m->var_count] = strdup(var);
-	m->values[m->var_count] = strdup(value);
-	if (strcasecmp(var, "id") == 0) {
+	if (field != -1 && !m->field_slot[field])
+	  m->field_slot[field] = m->var_count + 1;
+	if (field == RHIZOME_FIELD_ID) {
 	  have_id = 1;
 	  if (fromhexstr(m->cryptoSignPublic, value, RHIZOME_MANIFEST_ID_BYTES) == -1) {
 	    if (config.debug.rejecteddata)
@@ -167,9 +421,9 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	    m->errors++;
 	  } else {
 	    /* Force to upper case to avoid case sensitive comparison problems later. */
-	    str_toupper_inplace(m->values[m->var_count]);
+	    str_toupper_inplace(MANIFEST_VAR_VALUE(m, m->var_count));
 	  }
-	} else if (strcasecmp(var, "filehash") == 0) {
+	} else if (field == RHIZOME_FIELD_FILEHASH) {
 	  have_filehash = 1;
 	  if (!rhizome_str_is_file_hash(value)) {
 	    if (config.debug.rejecteddata)
@@ -177,19 +431,19 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	    m->errors++;
 	  } else {
 	    /* Force to upper case to avoid case sensitive comparison problems later. */
-	    str_toupper_inplace(m->values[m->var_count]);
-	    strcpy(m->fileHexHash, m->values[m->var_count]);
+	    str_toupper_inplace(MANIFEST_VAR_VALUE(m, m->var_count));
+	    strcpy(m->fileHexHash, MANIFEST_VAR_VALUE(m, m->var_count));
 	  }
-	} else if (strcasecmp(var, "BK") == 0) {
+	} else if (field == RHIZOME_FIELD_BK) {
 	  if (!rhizome_str_is_bundle_key(value)) {
 	    if (config.debug.rejecteddata)
 	      WARNF("Invalid BK: %s", value);
 	    m->errors++;
 	  } else {
 	    /* Force to upper case to avoid case sensitive comparison problems later. */
-	    str_toupper_inplace(m->values[m->var_count]);
+	    str_toupper_inplace(MANIFEST_VAR_VALUE(m, m->var_count));
 	  }
-	} else if (strcasecmp(var, "filesize") == 0) {
+	} else if (field == RHIZOME_FIELD_FILESIZE) {
 	  have_filesize = 1;
 	  char *ep = value;
 	  long long filesize = strtoll(value, &ep, 10);
@@ -200,7 +454,7 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	  } else {
 	    m->fileLength = filesize;
 	  }
-	} else if (strcasecmp(var, "service") == 0) {
+	} else if (field == RHIZOME_FIELD_SERVICE) {
 	  have_service = 1;
 	  if ( strcasecmp(value, RHIZOME_SERVICE_FILE) == 0
 	    || strcasecmp(value, RHIZOME_SERVICE_MESHMS) == 0) {
@@ -208,7 +462,7 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	    INFOF("Unsupported service: %s", value);
 	    // This is not an error... older rhizome nodes must carry newer manifests.
 	  }
-	} else if (strcasecmp(var, "version") == 0) {
+	} else if (field == RHIZOME_FIELD_VERSION) {
 	  have_version = 1;
 	  char *ep = value;
 	  long long version = strtoll(value, &ep, 10);
@@ -219,7 +473,7 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	  } else {
 	    m->version = version;
 	  }
-	} else if (strcasecmp(var, "date") == 0) {
+	} else if (field == RHIZOME_FIELD_DATE) {
 	  have_date = 1;
 	  char *ep = value;
 	  long long date = strtoll(value, &ep, 10);
@@ -229,23 +483,23 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	    m->errors++;
 	  }
 	  // TODO: store date in manifest struct
-	} else if (strcasecmp(var, "sender") == 0 || strcasecmp(var, "recipient") == 0) {
+	} else if (field == RHIZOME_FIELD_SENDER || field == RHIZOME_FIELD_RECIPIENT) {
 	  if (!str_is_subscriber_id(value)) {
 	    if (config.debug.rejecteddata)
 	      WARNF("Invalid %s: %s", var, value);
 	    m->errors++;
 	  } else {
 	    /* Force to upper case to avoid case sensitive comparison problems later. */
-	    str_toupper_inplace(m->values[m->var_count]);
+	    str_toupper_inplace(MANIFEST_VAR_VALUE(m, m->var_count));
 	  }
-	} else if (strcasecmp(var, "name") == 0) {
+	} else if (field == RHIZOME_FIELD_NAME) {
 	  if (value[0] == '\0') {
 	    if (config.debug.rejecteddata)
 	      WARNF("Empty name", value);
 	    m->errors++;
 	  }
 	  // TODO: complain if service is not MeshMS
-	} else if (strcasecmp(var, "crypt") == 0) {
+	} else if (field == RHIZOME_FIELD_CRYPT) {
 	  if (!(strcmp(value, "0") == 0 || strcmp(value, "1") == 0)) {
 	    if (config.debug.rejecteddata)
 	      WARNF("Invalid crypt: %s", value);
@@ -253,6 +507,10 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	  } else {
 	    m->payloadEncryption = atoi(value);
 	  }
+	} else if (strcasecmp(var, "merkle") == 0) {
+	  // Root of the payload's Merkle tree, see rhizome_merkle.c; a malformed one is not used.
+	  if (!rhizome_str_is_file_hash(value) && config.debug.rejecteddata)
+	    WARNF("Invalid merkle: %s", value);
 	} else {
 	  INFOF("Unsupported field: %s=%s", var, value);
 	  // This is not an error... older rhizome nodes must carry newer manifests.
@@ -359,32 +617,29 @@ char *rhizome_manifest_get(const rhizome_manifest *m, const char *var, char *out
 
   if (!m) return NULL;
 
-  for(i=0;i<m->var_count;i++)
-    if (!strcmp(m->vars[i],var)) {
-      if (out) {
-	for(j=0;(j<maxlen);j++) {
-	  out[j]=m->values[i][j];
-	  if (!out[j]) break;
-	}
-      }
-      return m->values[i];
+  i = manifest_find(m, var);
+  if (i == -1)
+    return NULL;
+  if (out) {
+    for(j=0;(j<maxlen);j++) {
+      out[j]=MANIFEST_VAR_VALUE(m, i)[j];
+      if (!out[j]) break;
     }
-  return NULL;
+  }
+  return MANIFEST_VAR_VALUE(m, i);
 }
 
 long long rhizome_manifest_get_ll(rhizome_manifest *m, const char *var)
 {
   if (!m)
     return -1;
-  int i;
-  for (i = 0; i < m->var_count; ++i)
-    if (!strcmp(m->vars[i], var)) {
-      char *vp = m->values[i];
-      char *ep = vp;
-      long long val = strtoll(vp, &ep, 10);
-      return (ep != vp && *ep == '\0') ? val : -1;
-    }
-  return -1;
+  int i = manifest_find(m, var);
+  if (i == -1)
+    return -1;
+  char *vp = MANIFEST_VAR_VALUE(m, i);
+  char *ep = vp;
+  long long val = strtoll(vp, &ep, 10);
+  return (ep != vp && *ep == '\0') ? val : -1;
 }
 
 double rhizome_manifest_get_double(rhizome_manifest *m,char *var,double default_value)
@@ -393,50 +648,45 @@ double rhizome_manifest_get_double(rhizome_manifest *m,char *var,double default_
 
   if (!m) return default_value;
 
-  for(i=0;i<m->var_count;i++)
-    if (!strcmp(m->vars[i],var))
-      return strtod(m->values[i],NULL);
-  return default_value;
+  i = manifest_find(m, var);
+  if (i == -1)
+    return default_value;
+  return strtod(MANIFEST_VAR_VALUE(m, i),NULL);
 }
 
 /* @author Andrew Bettison <andrew@servalproject.com>
  */
 int rhizome_manifest_del(rhizome_manifest *m, const char *var)
 {
-  int ret = 0;
-  int i;
-  for (i = 0; i < m->var_count; ++i)
-    if (strcmp(m->vars[i], var) == 0) {
-      free(m->vars[i]); 
-      free(m->values[i]); 
-      --m->var_count;
-      m->finalised = 0;
-      ret = 1;
-      break;
-    }
-  for (; i < m->var_count; ++i) {
+  int i = manifest_find(m, var);
+  if (i == -1)
+    return 0;
+  --m->var_count;
+  m->finalised = 0;
+  for (; i < m->var_count; ++i)
     m->vars[i] = m->vars[i + 1];
-    m->values[i] = m->values[i + 1];
-  }
-  return ret;
+  manifest_index_fields(m);
+  return 1;
 }
 
 int rhizome_manifest_set(rhizome_manifest *m, const char *var, const char *value)
 {
   if (!m)
     return WHY("m == NULL");
-  int i;
-  for(i=0;i<m->var_count;i++)
-    if (!strcmp(m->vars[i],var)) {
-      free(m->values[i]); 
-      m->values[i]=strdup(value);
-      m->finalised=0;
-      return 0;
-    }
+  int i = manifest_find(m, var);
+  if (i != -1) {
+    if (manifest_set_var(m, i, var, value) == -1)
+      return -1;
+    m->finalised=0;
+    return 0;
+  }
   if (m->var_count >= MAX_MANIFEST_VARS)
     return WHY("no more manifest vars");
-  m->vars[m->var_count]=strdup(var);
-  m->values[m->var_count]=strdup(value);
+  if (manifest_set_var(m, m->var_count, var, value) == -1)
+    return -1;
+  int field = manifest_field_id(var);
+  if (field != -1 && !m->field_slot[field])
+    m->field_slot[field] = m->var_count + 1;
   m->var_count++;
   m->finalised=0;
   return 0;
@@ -451,65 +701,54 @@ int rhizome_manifest_set_ll(rhizome_manifest *m,char *var,long long value)
   return rhizome_manifest_set(m,var,svalue);
 }
 
-rhizome_manifest manifests[MAX_RHIZOME_MANIFESTS];
-char manifest_free[MAX_RHIZOME_MANIFESTS];
-int manifest_first_free=-1;
-struct __sourceloc manifest_alloc_whence[MAX_RHIZOME_MANIFESTS];
-struct __sourceloc manifest_free_whence[MAX_RHIZOME_MANIFESTS];
+/* Manifests come from a pool that keeps every released manifest for reuse, so a freed manifest is
+ * never returned to the heap and double frees can still be diagnosed.  The live manifests are
+ * listed in manifests_live[], indexed by manifest_record_number, to report leaks.
+ */
+static struct mem_pool manifest_pool = MEM_POOL_INIT("rhizome_manifest", sizeof(rhizome_manifest), MAX_RHIZOME_MANIFESTS);
+static rhizome_manifest **manifests_live = NULL;
+static int manifests_live_count = 0;
+static int manifests_live_size = 0;
 
 static void _log_manifest_trace(struct __sourceloc __whence, const char *operation)
 {
-  int count_free = 0;
-  int i;
-  for (i = 0; i != MAX_RHIZOME_MANIFESTS; ++i)
-    if (manifest_free[i])
-      ++count_free;
-  DEBUGF("%s(): count_free = %d", operation, count_free);
+  DEBUGF("%s(): count_live = %d", operation, manifests_live_count);
 }
 
 rhizome_manifest *_rhizome_new_manifest(struct __sourceloc __whence)
 {
-  if (manifest_first_free<0) {
-    /* Setup structures */
+  if (manifests_live_count >= MAX_RHIZOME_MANIFESTS) {
     int i;
-    for(i=0;i<MAX_RHIZOME_MANIFESTS;i++) {
-      manifest_alloc_whence[i]=__NOWHERE__;
-      manifest_free_whence[i]=__NOWHERE__;
-      manifest_free[i]=1;
+    WHYF("%s(): no free manifest records, this probably indicates a memory leak", __FUNCTION__);
+    WHYF("   Slot# | Last allocated by");
+    for(i=0;i<manifests_live_count;i++) {
+      WHYF("   %-5d | %s:%d in %s()",
+	      i,
+	      manifests_live[i]->alloc_whence.file,
+	      manifests_live[i]->alloc_whence.line,
+	      manifests_live[i]->alloc_whence.function
+	  );
     }
-    manifest_first_free=0;
+    return NULL;
   }
-
-  /* No free manifests */
-  if (manifest_first_free>=MAX_RHIZOME_MANIFESTS)
-    {
-      int i;
-      WHYF("%s(): no free manifest records, this probably indicates a memory leak", __FUNCTION__);
-      WHYF("   Slot# | Last allocated by");
-      for(i=0;i<MAX_RHIZOME_MANIFESTS;i++) {
-	WHYF("   %-5d | %s:%d in %s()",
-		i,
-		manifest_alloc_whence[i].file,
-		manifest_alloc_whence[i].line,
-		manifest_alloc_whence[i].function
-	    );
-      }     
+  if (manifests_live_count >= manifests_live_size) {
+    int size = manifests_live_size ? manifests_live_size * 2 : 32;
+    rhizome_manifest **live = _erealloc(__whence, manifests_live, size * sizeof *live);
+    if (!live)
       return NULL;
-    }
-
-  rhizome_manifest *m=&manifests[manifest_first_free];
-  bzero(m,sizeof(rhizome_manifest));
-  m->manifest_record_number=manifest_first_free;
+    manifests_live = live;
+    manifests_live_size = size;
+  }
 
-  /* Indicate where manifest was allocated, and that it is no longer
-     free. */
-  manifest_alloc_whence[manifest_first_free]=__whence;
-  manifest_free[manifest_first_free]=0;
-  manifest_free_whence[manifest_first_free]=__NOWHERE__;
+  rhizome_manifest *m = _pool_alloc_zero(__whence, &manifest_pool);
+  if (!m)
+    return NULL;
+  m->manifest_record_number = manifests_live_count;
+  manifests_live[manifests_live_count++] = m;
 
-  /* Work out where next free manifest record lives */
-  for (; manifest_first_free < MAX_RHIZOME_MANIFESTS && !manifest_free[manifest_first_free]; ++manifest_first_free)
-    ;
+  /* Indicate where manifest was allocated */
+  m->alloc_whence = __whence;
+  m->free_whence = __NOWHERE__;
 
   if (config.debug.manifests) _log_manifest_trace(__whence, __FUNCTION__);
 
@@ -519,35 +758,40 @@ rhizome_manifest *_rhizome_new_manifest(struct __sourceloc __whence)
 void _rhizome_manifest_free(struct __sourceloc __whence, rhizome_manifest *m)
 {
   if (!m) return;
-  int i;
   int mid=m->manifest_record_number;
 
-  if (m!=&manifests[mid]) {
-    WHYF("%s(): asked to free manifest %p, which claims to be manifest slot #%d (%p), but isn't",
-	__FUNCTION__, m, mid, &manifests[mid]
+  if (m->free_whence.file) {
+    WHYF("%s(): asked to free manifest %p, which was already freed at %s:%d:%s()",
+	__FUNCTION__, m,
+	m->free_whence.file,
+	m->free_whence.line,
+	m->free_whence.function
       );
     exit(-1);
   }
 
-  if (manifest_free[mid]) {
-    WHYF("%s(): asked to free manifest slot #%d (%p), which was already freed at %s:%d:%s()",
-	__FUNCTION__, mid, m,
-	manifest_free_whence[mid].file,
-	manifest_free_whence[mid].line,
-	manifest_free_whence[mid].function
+  if (mid < 0 || mid >= manifests_live_count || manifests_live[mid] != m) {
+    WHYF("%s(): asked to free manifest %p, which claims to be manifest slot #%d, but isn't",
+	__FUNCTION__, m, mid
       );
     exit(-1);
   }
 
-  /* Free variable and signature blocks.
-     XXX These should be moved to malloc-free storage eventually */
-  for(i=0;i<m->var_count;i++)
-    { free(m->vars[i]); free(m->values[i]); 
-      m->vars[i]=NULL; m->values[i]=NULL; }
-  for(i=0;i<m->sig_count;i++)
-    { free(m->signatories[i]);
-      m->signatories[i]=NULL;
-    }
+  /* Free variables and signature blocks */
+  while (m->text) {
+    struct rhizome_manifest_text *t = m->text;
+    m->text = t->retired;
+    free(t);
+  }
+  free(m->vars);
+  free(m->manifestdata);
+  free(m->signatories);
+  free(m->signatureTypes);
+  int i;
+  for (i = 0; i < m->group_count; i++)
+    free(m->groups[i]);
+  free(m->groups);
+  rhizome_manifest_forget_secret(m);
 
   if (m->dataFileName) {
     if (m->dataFileUnlinkOnFree && unlink(m->dataFileName) == -1)
@@ -556,9 +800,13 @@ void _rhizome_manifest_free(struct __sourceloc __whence, rhizome_manifest *m)
     m->dataFileName = NULL;
   }
 
-  manifest_free[mid]=1;
-  manifest_free_whence[mid]=__whence;
-  if (mid<manifest_first_free) manifest_first_free=mid;
+  /* Move the last live manifest into the vacated slot */
+  rhizome_manifest *last = manifests_live[--manifests_live_count];
+  manifests_live[mid] = last;
+  last->manifest_record_number = mid;
+
+  m->free_whence = __whence;
+  pool_free(&manifest_pool, m);
 
   if (config.debug.manifests) _log_manifest_trace(__whence, __FUNCTION__);
 
@@ -571,13 +819,18 @@ void _rhizome_manifest_free(struct __sourceloc __whence, rhizome_manifest *m)
 int rhizome_manifest_pack_variables(rhizome_manifest *m)
 {
   int i,ofs=0;
+  size_t bytes=1;
 
+  for(i=0;i<m->var_count;i++)
+    bytes+=strlen(MANIFEST_VAR_NAME(m, i))+1+strlen(MANIFEST_VAR_VALUE(m, i))+1;
+  if (bytes>MAX_MANIFEST_BYTES)
+    return WHY("Manifest variables too long in total to fit in MAX_MANIFEST_BYTES");
+  if (manifest_data_reserve(m, bytes) == -1)
+    return -1;
   for(i=0;i<m->var_count;i++)
     {
-      if ((ofs+strlen(m->vars[i])+1+strlen(m->values[i])+1+1)>MAX_MANIFEST_BYTES)
-	return WHY("Manifest variables too long in total to fit in MAX_MANIFEST_BYTES");
-      snprintf((char *)&m->manifestdata[ofs],MAX_MANIFEST_BYTES-ofs,"%s=%s\n",
-	       m->vars[i],m->values[i]);
+      snprintf((char *)&m->manifestdata[ofs],m->manifestdata_size-ofs,"%s=%s\n",
+	       MANIFEST_VAR_NAME(m, i),MANIFEST_VAR_VALUE(m, i));
       ofs+=strlen((char *)&m->manifestdata[ofs]);
     }
   m->manifestdata[ofs++]=0x00;
@@ -604,8 +857,11 @@ int rhizome_manifest_selfsign(rhizome_manifest *m)
   /* Append signature to end of manifest data */
   if (sig.signatureLength + m->manifest_bytes > MAX_MANIFEST_BYTES)
     return WHY("Manifest plus signatures is too long");
+  if (manifest_data_reserve(m, sig.signatureLength + m->manifest_bytes) == -1)
+    return -1;
   bcopy(&sig.signature[0], &m->manifestdata[m->manifest_bytes], sig.signatureLength);
   m->manifest_bytes += sig.signatureLength;
+  m->manifestdata[m->manifest_bytes] = '\0';
   m->manifest_all_bytes = m->manifest_bytes;
   return 0;
 }
@@ -653,7 +909,7 @@ int rhizome_manifest_dump(rhizome_manifest *m, const char *msg)
   int i;
   WHYF("Dumping manifest %s:", msg);
   for(i=0;i<m->var_count;i++)
-    WHYF("[%s]=[%s]\n", m->vars[i], m->values[i]);
+    WHYF("[%s]=[%s]\n", MANIFEST_VAR_NAME(m, i), MANIFEST_VAR_VALUE(m, i));
   return 0;
 }
 
@@ -777,3 +1033,70 @@ int rhizome_fill_manifest(rhizome_manifest *m, const char *filepath, const sid_t
   
   return 0;
 }
+
+int app_rhizome_manifest_test(const struct cli_parsed *parsed, void *context)
+{
+  const char *count_arg = NULL;
+  if (cli_arg(parsed, "--count", &count_arg, cli_uint, "100000") == -1)
+    return -1;
+  int count = atoi(count_arg);
+  if (count < 1)
+    return WHY("Invalid count");
+  
+  char hex[RHIZOME_FILEHASH_STRLEN + 1];
+  unsigned char bytes[RHIZOME_FILEHASH_BYTES];
+  urandombytes(bytes, sizeof bytes);
+  tohex(hex, bytes, sizeof bytes);
+  
+  // a MeshMS manifest has the most fields that get looked up
+  char text[1024];
+  snprintf(text, sizeof text,
+      "service=" RHIZOME_SERVICE_MESHMS "\n"
+      "id=%.64s\nversion=1370000000000\ndate=1370000000000\n"
+      "filesize=1024\nfilehash=%s\ncrypt=1\n"
+      "sender=%.64s\nrecipient=%.64s\nname=benchmark\nBK=%.64s\n",
+      hex, hex, hex + 16, hex + 32, hex + 64);
+  int text_length = strlen(text) + 1;
+  
+  unsigned long lookups = manifest_lookups, compares = manifest_compares;
+  unsigned long allocs = manifest_allocs, search_compares = manifest_search_compares;
+  unsigned long heap_bytes = manifest_heap_bytes;
+  time_ms_t start = gettime_ms();
+  int i;
+  for (i = 0; i < count; i++) {
+    rhizome_manifest *m = rhizome_new_manifest();
+    if (!m)
+      return -1;
+    if (rhizome_read_manifest_file(m, text, text_length) || m->errors) {
+      rhizome_manifest_free(m);
+      return WHY("Could not parse the test manifest");
+    }
+    // the lookups made while importing, checking for a duplicate and listing a bundle
+    int j;
+    for (j = 0; j < 2; j++) {
+      rhizome_manifest_get(m, "service", NULL, 0);
+      rhizome_manifest_get(m, "name", NULL, 0);
+      rhizome_manifest_get(m, "sender", NULL, 0);
+      rhizome_manifest_get(m, "recipient", NULL, 0);
+      rhizome_manifest_get(m, "id", NULL, 0);
+      rhizome_manifest_get(m, "filehash", NULL, 0);
+      rhizome_manifest_get_ll(m, "version");
+      rhizome_manifest_get_ll(m, "filesize");
+      rhizome_manifest_get_ll(m, "date");
+    }
+    rhizome_manifest_free(m);
+  }
+  time_ms_t end = gettime_ms();
+  
+  printf("Parsed and queried %d manifests in %lldms (%.2fus each)\n",
+	 count, (long long)(end - start), (end - start) * 1000.0 / count);
+  printf("per manifest: %.1f lookups, %.1f string comparisons (%.1f by searching), %.1f allocations\n",
+	 (double)(manifest_lookups - lookups) / count,
+	 (double)(manifest_compares - compares) / count,
+	 (double)(manifest_search_compares - search_compares) / count,
+	 (double)(manifest_allocs - allocs) / count);
+  printf("footprint: %d byte manifest record, plus %.1f bytes of text and variables\n",
+	 (int)sizeof(rhizome_manifest), (double)(manifest_heap_bytes - heap_bytes) / count);
+  printf("Test passed.\n");
+  return 0;
+}
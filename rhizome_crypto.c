@@ -35,8 +35,32 @@ unsigned char *rhizome_bundle_shared_secret(rhizome_manifest *m)
   return NULL;
 }
 
+/* Return the manifest's secret key buffer, allocating it on first use.  Most manifests are only
+ * ever read, so they never need one.
+ */
+unsigned char *rhizome_manifest_secret(rhizome_manifest *m)
+{
+  if (!m->cryptoSignSecret)
+    m->cryptoSignSecret = emalloc_zero(crypto_sign_edwards25519sha512batch_SECRETKEYBYTES);
+  return m->cryptoSignSecret;
+}
+
+/* Wipe and release the manifest's secret key, if any.
+ */
+void rhizome_manifest_forget_secret(rhizome_manifest *m)
+{
+  if (m->cryptoSignSecret) {
+    memset(m->cryptoSignSecret, 0, crypto_sign_edwards25519sha512batch_SECRETKEYBYTES);
+    free(m->cryptoSignSecret);
+    m->cryptoSignSecret = NULL;
+  }
+  m->haveSecret = 0;
+}
+
 int rhizome_manifest_createid(rhizome_manifest *m)
 {
+  if (!rhizome_manifest_secret(m))
+    return -1;
   m->haveSecret=NEW_BUNDLE_ID;
   int r=crypto_sign_edwards25519sha512batch_keypair(m->cryptoSignPublic,m->cryptoSignSecret);
   if (!r) return 0;
@@ -215,6 +239,8 @@ int rhizome_extract_privatekey(rhizome_manifest *m, rhizome_bk_t *bsk)
   char *bk = rhizome_manifest_get(m, "BK", NULL, 0);
   int result;
   
+  if (!rhizome_manifest_secret(m))
+    RETURN(-1);
   if (bk){
     if (fromhexstr(bkBytes, bk, RHIZOME_BUNDLE_KEY_BYTES) == -1)
       RETURN(WHYF("invalid BK field: %s", bk));
@@ -252,8 +278,7 @@ int rhizome_extract_privatekey(rhizome_manifest *m, rhizome_bk_t *bsk)
   if (result == 0){
     m->haveSecret=EXISTING_BUNDLE_ID;
   }else{
-    memset(m->cryptoSignSecret, 0, sizeof m->cryptoSignSecret);
-    m->haveSecret=0;
+    rhizome_manifest_forget_secret(m);
   }
   
   RETURN(result);
@@ -310,6 +335,8 @@ int rhizome_find_bundle_author(rhizome_manifest *m)
   unsigned char bkBytes[RHIZOME_BUNDLE_KEY_BYTES];
   if (fromhexstr(bkBytes, bk, RHIZOME_BUNDLE_KEY_BYTES) == -1)
     RETURN(WHYF("invalid BK field: %s", bk));
+  if (!rhizome_manifest_secret(m))
+    RETURN(-1);
   int cn = 0, in = 0, kp = 0;
   for (; keyring_next_identity(keyring, &cn, &in, &kp); ++kp) {
     const unsigned char *authorSid = keyring->contexts[cn]->identities[in]->keypairs[kp]->public_key;
@@ -341,6 +368,8 @@ int rhizome_find_bundle_author(rhizome_manifest *m)
   }
   if (config.debug.rhizome)
     DEBUG("bundle author not found");
+  if (!m->haveSecret)
+    rhizome_manifest_forget_secret(m);
   RETURN(1);
   OUT();
 }
@@ -422,68 +451,135 @@ int rhizome_sign_hash_with_key(rhizome_manifest *m,const unsigned char *sk,
   OUT();
 }
 
-typedef struct manifest_signature_block_cache {
+/* Cache of signature verification results.
+
+   Verifying an ed25519 signature is by far the most expensive part of reading a manifest, and the
+   same manifests are heard over and over again in adverts from every neighbour.  Results are kept
+   in a hash table keyed by the manifest hash and the signature block, and the least recently used
+   entry is recycled when the table is full.
+ */
+
+#define SIG_CACHE_SIZE 1024
+#define SIG_CACHE_BUCKETS 1024
+#define SIG_CACHE_BYTES (crypto_sign_edwards25519sha512batch_BYTES + crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES)
+
+struct signature_cache_entry {
   unsigned char manifest_hash[crypto_hash_sha512_BYTES];
-  unsigned char signature_bytes[256];
-  int signature_length;
+  unsigned char signature_bytes[SIG_CACHE_BYTES];
   int signature_valid;
-} manifest_signature_block_cache;
+  // hash chain, and LRU list with the most recently used entry first
+  short bucket, chain, lru_prev, lru_next;
+};
 
-#define SIG_CACHE_SIZE 1024
-manifest_signature_block_cache sig_cache[SIG_CACHE_SIZE];
+static struct signature_cache_entry sig_cache[SIG_CACHE_SIZE];
+static short sig_cache_bucket[SIG_CACHE_BUCKETS];
+static short sig_cache_count=0, sig_cache_lru_head=-1, sig_cache_lru_tail=-1;
+static unsigned int sig_cache_hits=0, sig_cache_misses=0, sig_cache_evictions=0;
+
+static unsigned sig_cache_slot(const unsigned char *hash, const unsigned char *sig)
+{
+  // the manifest hash is already uniformly distributed, the signature is folded in so that
+  // different signatures over the same manifest don't all land in one chain
+  unsigned slot = (hash[0] | hash[1]<<8 | hash[2]<<16 | (unsigned)hash[3]<<24)
+    ^ (sig[0] | sig[1]<<8 | sig[2]<<16 | (unsigned)sig[3]<<24);
+  return slot % SIG_CACHE_BUCKETS;
+}
+
+static void sig_cache_lru_unlink(short i)
+{
+  struct signature_cache_entry *e = &sig_cache[i];
+  if (e->lru_prev==-1) sig_cache_lru_head=e->lru_next; else sig_cache[e->lru_prev].lru_next=e->lru_next;
+  if (e->lru_next==-1) sig_cache_lru_tail=e->lru_prev; else sig_cache[e->lru_next].lru_prev=e->lru_prev;
+}
+
+static void sig_cache_lru_push(short i)
+{
+  struct signature_cache_entry *e = &sig_cache[i];
+  e->lru_prev=-1;
+  e->lru_next=sig_cache_lru_head;
+  if (sig_cache_lru_head!=-1) sig_cache[sig_cache_lru_head].lru_prev=i; else sig_cache_lru_tail=i;
+  sig_cache_lru_head=i;
+}
+
+static void sig_cache_unchain(short i)
+{
+  short *p = &sig_cache_bucket[sig_cache[i].bucket];
+  while (*p!=i)
+    p = &sig_cache[*p].chain;
+  *p = sig_cache[i].chain;
+}
+
+static int verify_signature(const unsigned char *hash, const unsigned char *sig)
+{
+  unsigned char sigBuf[256];
+  unsigned char verifyBuf[256];
+  unsigned char publicKey[crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES];
+
+  /* Reconstitute signature by putting manifest hash between the two
+     32-byte halves */
+  bcopy(&sig[0],&sigBuf[0],64);
+  bcopy(hash,&sigBuf[64],crypto_hash_sha512_BYTES);
+
+  /* Get public key of signatory */
+  bcopy(&sig[64],&publicKey[0],crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
+
+  unsigned long long mlen=0;
+  return crypto_sign_edwards25519sha512batch_open(verifyBuf,&mlen,&sigBuf[0],128,publicKey) ? -1 : 0;
+}
 
 int rhizome_manifest_lookup_signature_validity(unsigned char *hash,unsigned char *sig,int sig_len)
 {
   IN();
-  unsigned int slot=0;
-  int i;
+  if (sig_len!=SIG_CACHE_BYTES)
+    RETURN(verify_signature(hash, sig));
 
-  for(i=0;i<crypto_hash_sha512_BYTES;i++) {
-    slot=(slot<<1)+(slot&0x80000000?1:0);
-    slot+=hash[i];
+  if (sig_cache_count==0){
+    int b;
+    for (b=0;b<SIG_CACHE_BUCKETS;b++)
+      sig_cache_bucket[b]=-1;
   }
-  for(i=0;i<sig_len;i++) {
-    slot=(slot<<1)+(slot&0x80000000?1:0);
-    slot+=sig[i];
+  unsigned slot = sig_cache_slot(hash, sig);
+  short i;
+  for (i=sig_cache_bucket[slot]; i!=-1; i=sig_cache[i].chain){
+    if (memcmp(sig_cache[i].manifest_hash, hash, crypto_hash_sha512_BYTES)==0
+      && memcmp(sig_cache[i].signature_bytes, sig, SIG_CACHE_BYTES)==0){
+      sig_cache_hits++;
+      if (sig_cache_lru_head!=i){
+	sig_cache_lru_unlink(i);
+	sig_cache_lru_push(i);
+      }
+      RETURN(sig_cache[i].signature_valid);
+    }
   }
-  slot%=SIG_CACHE_SIZE;
-
-  int replace=0;
-  if (sig_cache[slot].signature_length!=sig_len) replace=1;
-  for(i=0;i<crypto_hash_sha512_BYTES;i++)
-    if (hash[i]!=sig_cache[i].manifest_hash[i]) { replace=1; break; }
-  for(i=0;i<sig_len;i++)
-    if (sig[i]!=sig_cache[i].signature_bytes[i]) { replace=1; break; }
-
-  if (replace) {
-    for(i=0;i<crypto_hash_sha512_BYTES;i++)
-      sig_cache[i].manifest_hash[i]=hash[i];
-    for(i=0;i<sig_len;i++)
-      sig_cache[i].signature_bytes[i]=sig[i];
-    sig_cache[i].signature_length=sig_len;
-
-    unsigned char sigBuf[256];
-    unsigned char verifyBuf[256];
-    unsigned char publicKey[256];
-
-    /* Reconstitute signature by putting manifest hash between the two
-       32-byte halves */
-    bcopy(&sig[0],&sigBuf[0],64);
-    bcopy(hash,&sigBuf[64],crypto_hash_sha512_BYTES);
-
-    /* Get public key of signatory */
-    bcopy(&sig[64],&publicKey[0],crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
-
-    unsigned long long mlen=0;
-    sig_cache[i].signature_valid=
-      crypto_sign_edwards25519sha512batch_open(verifyBuf,&mlen,&sigBuf[0],128,
-					       publicKey)
-      ? -1 : 0;
+
+  sig_cache_misses++;
+  if (sig_cache_count < SIG_CACHE_SIZE){
+    i = sig_cache_count++;
+  }else{
+    i = sig_cache_lru_tail;
+    sig_cache_lru_unlink(i);
+    sig_cache_unchain(i);
+    sig_cache_evictions++;
   }
-  RETURN(sig_cache[i].signature_valid);
+  struct signature_cache_entry *e = &sig_cache[i];
+  bcopy(hash, e->manifest_hash, crypto_hash_sha512_BYTES);
+  bcopy(sig, e->signature_bytes, SIG_CACHE_BYTES);
+  e->signature_valid = verify_signature(hash, sig);
+  e->bucket = slot;
+  e->chain = sig_cache_bucket[slot];
+  sig_cache_bucket[slot] = i;
+  sig_cache_lru_push(i);
+  RETURN(e->signature_valid);
   OUT();
 }
 
+void rhizome_signature_showstats()
+{
+  if (sig_cache_hits || sig_cache_misses)
+    INFOF("Rhizome signature cache: %u hits, %u verified, %u evicted, %d cached",
+	  sig_cache_hits, sig_cache_misses, sig_cache_evictions, sig_cache_count);
+}
+
 int rhizome_manifest_extract_signature(rhizome_manifest *m,int *ofs)
 {
   IN();
@@ -525,13 +621,17 @@ int rhizome_manifest_extract_signature(rhizome_manifest *m,int *ofs)
 	  RETURN(WHY("Error in signature block (verification failed)."));
 	} else {
 	  /* Signature block passes, so add to list of signatures */
-	  m->signatureTypes[m->sig_count]=len;
-	  m->signatories[m->sig_count]
-	    =malloc(crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
-	  if(!m->signatories[m->sig_count]) {
+	  unsigned char *types = erealloc(m->signatureTypes, m->sig_count + 1);
+	  if (types)
+	    m->signatureTypes = types;
+	  void *signatories = erealloc(m->signatories, (m->sig_count + 1) * sizeof m->signatories[0]);
+	  if (signatories)
+	    m->signatories = signatories;
+	  if (!types || !signatories) {
 	    (*ofs)+=len;
 	    RETURN(WHY("malloc() failed when reading signature block"));
 	  }
+	  m->signatureTypes[m->sig_count]=len;
 	  bcopy(&m->manifestdata[(*ofs)+1+64],m->signatories[m->sig_count],
 		crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
 	  m->sig_count++;
@@ -567,42 +667,36 @@ static void add_nonce(unsigned char *nonce, int64_t value){
   }
 }
 
+static const unsigned char salsa20_sigma[16] = "expand 32-byte k";
+
 /* crypt a block of a stream, allowing for offsets that don't align perfectly to block boundaries
+ * each page of the payload is its own XSalsa20 stream, so we derive the page key here and xor
+ * the buffer in place from the right position in the page's keystream.
  * for efficiency the caller should use a buffer size of (n*RHIZOME_CRYPT_PAGE_SIZE)
  */
 int rhizome_crypt_xor_block(unsigned char *buffer, int buffer_size, int64_t stream_offset, 
 			    const unsigned char *key, const unsigned char *nonce){
   int64_t nonce_offset = stream_offset & ~(RHIZOME_CRYPT_PAGE_SIZE -1);
+  int padding = stream_offset & (RHIZOME_CRYPT_PAGE_SIZE -1);
   int offset=0;
   
   unsigned char block_nonce[crypto_stream_xsalsa20_NONCEBYTES];
+  unsigned char subkey[crypto_stream_salsa20_KEYBYTES];
   bcopy(nonce, block_nonce, sizeof(block_nonce));
   add_nonce(block_nonce, nonce_offset);
   
-  if (nonce_offset < stream_offset){
-    int padding = stream_offset & (RHIZOME_CRYPT_PAGE_SIZE -1);
-    int size = RHIZOME_CRYPT_PAGE_SIZE - padding;
-    if (size>buffer_size)
-      size=buffer_size;
-    
-    unsigned char temp[RHIZOME_CRYPT_PAGE_SIZE];
-    bcopy(temp + padding, buffer, size);
-    crypto_stream_xsalsa20_xor(temp, temp, size, block_nonce, key);
-    bcopy(buffer, temp + padding, size);
-    
-    add_nonce(block_nonce, RHIZOME_CRYPT_PAGE_SIZE);
-    offset+=size;
-  }
-  
   while(offset < buffer_size){
-    int size = buffer_size - offset;
-    if (size>RHIZOME_CRYPT_PAGE_SIZE)
-      size=RHIZOME_CRYPT_PAGE_SIZE;
+    int size = RHIZOME_CRYPT_PAGE_SIZE - padding;
+    if (size > buffer_size - offset)
+      size = buffer_size - offset;
     
-    crypto_stream_xsalsa20_xor(buffer+offset, buffer+offset, size, block_nonce, key);
+    // the same as crypto_stream_xsalsa20_xor, but able to start part way through the page
+    crypto_core_hsalsa20(subkey, block_nonce, key, salsa20_sigma);
+    crypto_stream_salsa20_xor_offset(buffer+offset, buffer+offset, size, block_nonce+16, padding, subkey);
     
     add_nonce(block_nonce, RHIZOME_CRYPT_PAGE_SIZE);
     offset+=size;
+    padding=0;
   }
   
   return 0;
@@ -674,3 +768,89 @@ int rhizome_derive_key(rhizome_manifest *m, rhizome_bk_t *bsk)
   
   return 0;  
 }
+
+// the payload encryption as it was done one page at a time with the reference salsa20 code
+static void crypt_reference(unsigned char *buffer, int buffer_size, const unsigned char *key, const unsigned char *nonce)
+{
+  unsigned char block_nonce[crypto_stream_xsalsa20_NONCEBYTES];
+  unsigned char subkey[crypto_stream_salsa20_KEYBYTES];
+  bcopy(nonce, block_nonce, sizeof(block_nonce));
+  int offset;
+  for (offset=0;offset<buffer_size;offset+=RHIZOME_CRYPT_PAGE_SIZE){
+    int size = buffer_size - offset;
+    if (size>RHIZOME_CRYPT_PAGE_SIZE)
+      size=RHIZOME_CRYPT_PAGE_SIZE;
+    crypto_core_hsalsa20(subkey, block_nonce, key, salsa20_sigma);
+    crypto_stream_salsa20_ref_xor(buffer+offset, buffer+offset, size, block_nonce+16, subkey);
+    add_nonce(block_nonce, RHIZOME_CRYPT_PAGE_SIZE);
+  }
+}
+
+int app_rhizome_crypt_test(const struct cli_parsed *parsed, void *context)
+{
+  const char *size_arg = NULL;
+  if (cli_arg(parsed, "--size", &size_arg, cli_uint, "1048576") == -1)
+    return -1;
+  int size = atoi(size_arg);
+  if (size <= 0)
+    return WHY("Invalid buffer size");
+  
+  unsigned char key[RHIZOME_CRYPT_KEY_BYTES];
+  unsigned char nonce[crypto_stream_xsalsa20_NONCEBYTES];
+  urandombytes(key, sizeof key);
+  urandombytes(nonce, sizeof nonce);
+  
+  unsigned char *plain = malloc(size);
+  unsigned char *expected = malloc(size);
+  unsigned char *buffer = malloc(size);
+  int ret=0;
+  if (!plain || !expected || !buffer){
+    ret=WHY_perror("malloc");
+    goto end;
+  }
+  urandombytes(plain, size);
+  
+  // check the results against the reference code, including reads that don't start on a page
+  bcopy(plain, expected, size);
+  crypt_reference(expected, size, key, nonce);
+  bcopy(plain, buffer, size);
+  rhizome_crypt_xor_block(buffer, size, 0, key, nonce);
+  if (memcmp(buffer, expected, size)){
+    ret=WHY("Encrypted payload does not match the reference implementation");
+    goto end;
+  }
+  int offset, chunk=1;
+  for (offset=0;offset<size;offset+=chunk, chunk=chunk*3+7){
+    int len = size - offset < chunk ? size - offset : chunk;
+    rhizome_crypt_xor_block(buffer+offset, len, offset, key, nonce);
+  }
+  if (memcmp(buffer, plain, size)){
+    ret=WHY("Unaligned decryption does not match the original payload");
+    goto end;
+  }
+  
+  int count = (64*1024*1024) / size;
+  if (count<1)
+    count=1;
+  int i;
+  time_ms_t start = gettime_ms();
+  for (i=0;i<count;i++)
+    crypt_reference(buffer, size, key, nonce);
+  time_ms_t ref_end = gettime_ms();
+  for (i=0;i<count;i++)
+    rhizome_crypt_xor_block(buffer, size, 0, key, nonce);
+  time_ms_t end = gettime_ms();
+  
+  long long total = (long long)size * count;
+  printf("Benchmarking rhizome payload encryption, %d x %dKB:\n", count, size/1024);
+  printf("reference %5lldms (%6.1fMB/s)\n",
+	 (long long)(ref_end - start), total / 1048576.0 * 1000 / (ref_end - start + 1));
+  printf("%-9s %5lldms (%6.1fMB/s)\n", crypto_stream_salsa20_simd_dispatch(),
+	 (long long)(end - ref_end), total / 1048576.0 * 1000 / (end - ref_end + 1));
+  printf("Test passed.\n");
+end:
+  if (plain) free(plain);
+  if (expected) free(expected);
+  if (buffer) free(buffer);
+  return ret;
+}
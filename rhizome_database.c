@@ -26,6 +26,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "strbuf.h"
 #include "strbuf_helpers.h"
 #include "str.h"
+#include "cli.h"
 
 static char rhizome_thisdatastore_path[256];
 
@@ -98,6 +99,92 @@ int create_rhizome_import_dir()
 
 sqlite3 *rhizome_db=NULL;
 
+/* When the database is in WAL mode, the server serves bundles through a second, read-only
+ * connection, so that HTTP, MDP and advert queries read from a committed snapshot and are never
+ * held up by imports on the main connection or in other processes.
+ */
+sqlite3 *rhizome_read_db=NULL;
+
+static void sqlite_trace_callback(void *context, const char *rendered_sql);
+static sqlite3_stmt *_sqlite_prepare_db(struct __sourceloc __whence, sqlite3 *db, int log_level, sqlite_retry_state *retry, strbuf stmt);
+static void rhizome_checkpoint(struct sched_ent *alarm);
+static struct profile_total checkpoint_stats={.name="rhizome_checkpoint"};
+static struct sched_ent checkpoint_alarm={.function=rhizome_checkpoint, .stats=&checkpoint_stats};
+
+static unsigned int checkpoint_count=0, checkpoint_busy=0;
+static long long checkpoint_frames=0;
+static unsigned int busy_retries=0, busy_recovered=0, busy_failures=0;
+static time_ms_t busy_wait_ms=0;
+
+/* Return the connection that serving paths should read from.
+ */
+sqlite3 *rhizome_reader()
+{
+  return rhizome_read_db ? rhizome_read_db : rhizome_db;
+}
+
+static int rhizome_open_reader(const char *dbpath)
+{
+  if (sqlite3_open_v2(dbpath, &rhizome_read_db, SQLITE_OPEN_READONLY, NULL)){
+    WARNF("SQLite could not open read connection to %s: %s", dbpath, sqlite3_errmsg(rhizome_read_db));
+    sqlite3_close(rhizome_read_db);
+    rhizome_read_db=NULL;
+    return -1;
+  }
+  sqlite3_trace(rhizome_read_db, sqlite_trace_callback, NULL);
+  return 0;
+}
+
+/* Switch the journal between WAL and rollback mode as configured.  The mode is a property of the
+ * database file, so it stays in force for every process until it is changed back.  Leaving WAL
+ * mode needs exclusive access, so it is left alone (and retried at the next open) while any other
+ * process has the database open.
+ */
+static int rhizome_journal_mode()
+{
+  char mode[16];
+  strbuf sb = strbuf_local(mode, sizeof mode);
+  if (sqlite_exec_strbuf(sb, "PRAGMA journal_mode;") == -1)
+    return -1;
+  int wal = strcasecmp(mode, "wal")==0;
+  if (config.rhizome.wal == wal)
+    return wal;
+  strbuf_reset(sb);
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_strbuf_retry(&retry, sb, "PRAGMA journal_mode=%s;", config.rhizome.wal?"WAL":"DELETE") == -1)
+    return wal;
+  wal = strcasecmp(mode, "wal")==0;
+  if (config.rhizome.wal != wal)
+    INFOF("Could not change Rhizome journal mode, still using %s", mode);
+  return wal;
+}
+
+/* Checkpoint the WAL from the server's event loop.  Automatic checkpoints are disabled on the
+ * server's main connection, so that a long checkpoint doesn't delay whichever import happens to
+ * cross the threshold.  A passive checkpoint never waits for readers or writers; anything it
+ * can't copy back is left for the next run.
+ */
+static void rhizome_checkpoint(struct sched_ent *alarm)
+{
+  if (rhizome_db){
+    int log_frames=0, checkpointed=0;
+    int ret = sqlite3_wal_checkpoint_v2(rhizome_db, NULL, SQLITE_CHECKPOINT_PASSIVE, &log_frames, &checkpointed);
+    if (sqlite_code_busy(ret))
+      checkpoint_busy++;
+    else if (ret != SQLITE_OK)
+      WARNF("WAL checkpoint failed: %s", sqlite3_errmsg(rhizome_db));
+    else if (checkpointed>0){
+      checkpoint_count++;
+      checkpoint_frames+=checkpointed;
+      if (config.debug.rhizome)
+	DEBUGF("Checkpointed %d of %d WAL frames", checkpointed, log_frames);
+    }
+  }
+  alarm->alarm = gettime_ms() + config.rhizome.checkpoint_interval_ms;
+  alarm->deadline = alarm->alarm + 1000;
+  schedule(alarm);
+}
+
 /* XXX Requires a messy join that might be slow. */
 int rhizome_manifest_priority(sqlite_retry_state *retry, const char *id)
 {
@@ -157,9 +244,35 @@ int (*sqlite_set_tracefunc(int (*newfunc)()))()
 }
 
 void sqlite_log(void *ignored, int result, const char *msg){
+  // logging is not thread safe, the writer thread reports its own errors
+  if (rhizome_is_writer_thread())
+    return;
   WARNF("Sqlite: %d %s", result, msg);
 }
 
+#define VERIFY_BUNDLES_BATCH 8
+
+static void verify_bundles_batch(rhizome_manifest *manifests[], sqlite3_int64 rowids[], int count)
+{
+  rhizome_manifest_verify_batch(manifests, count);
+  int i;
+  for (i=0;i<count;i++){
+    rhizome_manifest *m=manifests[i];
+    int ret = m->errors?-1:0;
+    if (ret==0){
+      m->finalised=1;
+      m->manifest_bytes=m->manifest_all_bytes;
+      // store it again, to ensure it is valid and stored correctly with matching file content.
+      ret=rhizome_store_bundle(m);
+    }
+    if (ret!=0){
+      DEBUGF("Removing invalid manifest entry @%lld", rowids[i]);
+      //sqlite_exec_void_retry(&retry, "DELETE FROM MANIFESTS WHERE ROWID=%lld;", rowid);
+    }
+    rhizome_manifest_free(m);
+  }
+}
+
 static void verify_bundles(){
   // assume that only the manifest itself can be trusted
   // fetch all manifests and reinsert them.
@@ -167,30 +280,33 @@ static void verify_bundles(){
   // This cursor must be ordered descending as re-inserting the manifests will give them a new higher manifest id.
   // If we didn't, we'd get stuck in an infinite loop.
   sqlite3_stmt *statement = sqlite_prepare(&retry, "SELECT ROWID, MANIFEST FROM MANIFESTS ORDER BY ROWID DESC;");
+  // verify a few manifests at a time, so their hashes can be computed together
+  rhizome_manifest *batch[VERIFY_BUNDLES_BATCH];
+  sqlite3_int64 rowids[VERIFY_BUNDLES_BATCH];
+  int count=0;
   while(sqlite_step_retry(&retry, statement)==SQLITE_ROW){
     sqlite3_int64 rowid = sqlite3_column_int64(statement, 0);
     const void *manifest = sqlite3_column_blob(statement, 1);
     int manifest_length = sqlite3_column_bytes(statement, 1);
     
     rhizome_manifest *m=rhizome_new_manifest();
-    int ret=0;
-    ret = rhizome_read_manifest_file(m, manifest, manifest_length);
-    if (ret==0 && m->errors)
-      ret=-1;
-    if (ret==0)
-      ret=rhizome_manifest_verify(m);
-    if (ret==0){
-      m->finalised=1;
-      m->manifest_bytes=m->manifest_all_bytes;
-      // store it again, to ensure it is valid and stored correctly with matching file content.
-      ret=rhizome_store_bundle(m);
-    }
-    if (ret!=0){
+    if (!m)
+      break;
+    int ret = rhizome_read_manifest_file(m, manifest, manifest_length);
+    if (ret!=0 || m->errors){
       DEBUGF("Removing invalid manifest entry @%lld", rowid);
-      //sqlite_exec_void_retry(&retry, "DELETE FROM MANIFESTS WHERE ROWID=%lld;", rowid);
+      rhizome_manifest_free(m);
+      continue;
+    }
+    batch[count]=m;
+    rowids[count]=rowid;
+    if (++count>=VERIFY_BUNDLES_BATCH){
+      verify_bundles_batch(batch, rowids, count);
+      count=0;
     }
-    rhizome_manifest_free(m);
   }
+  if (count)
+    verify_bundles_batch(batch, rowids, count);
   sqlite3_finalize(statement);
 }
 
@@ -293,8 +409,23 @@ int rhizome_opendb()
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=3;");
   }
   
+  if (version<4){
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TABLE IF NOT EXISTS MERKLE(id text not null primary key, leaves blob, verified integer);");
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=4;");
+  }
+  
   // TODO recreate tables with collate nocase on hex columns
   
+  if (rhizome_journal_mode()==1 && serverMode){
+    sqlite3_wal_autocheckpoint(rhizome_db, 0);
+    rhizome_open_reader(dbpath);
+    if (!is_scheduled(&checkpoint_alarm)){
+      checkpoint_alarm.alarm = gettime_ms() + config.rhizome.checkpoint_interval_ms;
+      checkpoint_alarm.deadline = checkpoint_alarm.alarm + 1000;
+      schedule(&checkpoint_alarm);
+    }
+  }
+  
   /* Future schema updates should be performed here. 
    The above schema can be assumed to exist.
    All changes should attempt to preserve any existing data */
@@ -314,6 +445,15 @@ int rhizome_close_db()
       WHY("Uncommitted transaction!");
       sqlite_exec_void("ROLLBACK;");
     }
+    rhizome_read_cache_flush();
+    sqlite_statement_cache_flush();
+    if (is_scheduled(&checkpoint_alarm))
+      unschedule(&checkpoint_alarm);
+    if (rhizome_read_db){
+      if (sqlite3_close(rhizome_read_db) != SQLITE_OK)
+	WARNF("Failed to close read connection, %s", sqlite3_errmsg(rhizome_read_db));
+      rhizome_read_db=NULL;
+    }
     sqlite3_stmt *stmt = NULL;
     while ((stmt = sqlite3_next_stmt(rhizome_db, stmt))) {
       const char *sql = sqlite3_sql(stmt);
@@ -395,7 +535,10 @@ int _sqlite_retry(struct __sourceloc __whence, sqlite_retry_state *retry, const
       action
     );
   
+  busy_retries++;
   if (retry->elapsed >= retry->limit) {
+    busy_failures++;
+    busy_wait_ms += retry->elapsed;
     // reset ready for next query
     retry->busytries = 0;
     if (!serverMode)
@@ -412,6 +555,8 @@ void _sqlite_retry_done(struct __sourceloc __whence, sqlite_retry_state *retry,
 {
   if (retry->busytries) {
     time_ms_t now = gettime_ms();
+    busy_recovered++;
+    busy_wait_ms += now - retry->start;
     INFOF("succeeded on try %u after %.3f seconds (limit %.3f): %s",
 	retry->busytries + 1,
 	(now - retry->start) / 1e3,
@@ -437,17 +582,31 @@ sqlite3_stmt *_sqlite_prepare(struct __sourceloc __whence, sqlite_retry_state *r
   return _sqlite_prepare_loglevel(__whence, LOG_LEVEL_ERROR, retry, sql);
 }
 
+sqlite3_stmt *_sqlite_prepare_read(struct __sourceloc __whence, sqlite_retry_state *retry, const char *sqlformat, ...)
+{
+  strbuf sql = strbuf_alloca(8192);
+  strbuf_va_printf(sql, sqlformat);
+  if (!rhizome_db && rhizome_opendb() == -1)
+    return NULL;
+  return _sqlite_prepare_db(__whence, rhizome_reader(), LOG_LEVEL_ERROR, retry, sql);
+}
+
 sqlite3_stmt *_sqlite_prepare_loglevel(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, strbuf stmt)
+{
+  if (!rhizome_db && rhizome_opendb() == -1)
+    return NULL;
+  return _sqlite_prepare_db(__whence, rhizome_db, log_level, retry, stmt);
+}
+
+static sqlite3_stmt *_sqlite_prepare_db(struct __sourceloc __whence, sqlite3 *db, int log_level, sqlite_retry_state *retry, strbuf stmt)
 {
   sqlite3_stmt *statement = NULL;
   if (strbuf_overrun(stmt)) {
     WHYF("SQL overrun: %s", strbuf_str(stmt));
     return NULL;
   }
-  if (!rhizome_db && rhizome_opendb() == -1)
-    return NULL;
   while (1) {
-    switch (sqlite3_prepare_v2(rhizome_db, strbuf_str(stmt), -1, &statement, NULL)) {
+    switch (sqlite3_prepare_v2(db, strbuf_str(stmt), -1, &statement, NULL)) {
       case SQLITE_OK:
 	return statement;
       case SQLITE_BUSY:
@@ -457,13 +616,125 @@ sqlite3_stmt *_sqlite_prepare_loglevel(struct __sourceloc __whence, int log_leve
 	}
 	// fall through...
       default:
-	LOGF(log_level, "query invalid, %s: %s", sqlite3_errmsg(rhizome_db), strbuf_str(stmt));
+	LOGF(log_level, "query invalid, %s: %s", sqlite3_errmsg(db), strbuf_str(stmt));
 	sqlite3_finalize(statement);
 	return NULL;
     }
   }
 }
 
+/* Prepared statement cache.
+
+   Frequent queries bind their values to a parameterised statement instead of formatting them into
+   the SQL text, so the compiled statement can be kept and re-used.  The cache is keyed by the SQL
+   text, which must be a string constant as only the pointer is kept.  A statement obtained from
+   sqlite_prepare_cached() must be handed back with sqlite_release(), which resets it and clears its
+   bindings instead of finalising it.  If the cached statement is already in use (eg, by an
+   enclosing query), a private copy is prepared and finalised on release.
+ */
+
+#define SQLITE_STATEMENT_CACHE_SIZE 32
+
+struct cached_statement{
+  sqlite3 *db;
+  const char *sql;
+  sqlite3_stmt *statement;
+  char in_use;
+};
+
+static struct cached_statement statement_cache[SQLITE_STATEMENT_CACHE_SIZE];
+static int statement_cache_count=0;
+static unsigned int statement_prepares=0, statement_hits=0;
+
+static sqlite3_stmt *prepare_cached(struct __sourceloc __whence, sqlite3 *db, sqlite_retry_state *retry, const char *sql)
+{
+  struct cached_statement *slot = NULL;
+  int i;
+  for (i=0;i<statement_cache_count;i++){
+    struct cached_statement *c = &statement_cache[i];
+    if (c->db==db && (c->sql==sql || strcmp(c->sql, sql)==0)){
+      if (!c->in_use){
+	c->in_use=1;
+	statement_hits++;
+	return c->statement;
+      }
+      slot = c;
+      break;
+    }
+  }
+  strbuf stmt = strbuf_alloca(strlen(sql)+1);
+  strbuf_puts(stmt, sql);
+  sqlite3_stmt *statement = _sqlite_prepare_db(__whence, db, LOG_LEVEL_ERROR, retry, stmt);
+  if (!statement)
+    return NULL;
+  statement_prepares++;
+  if (!slot && statement_cache_count < SQLITE_STATEMENT_CACHE_SIZE){
+    slot = &statement_cache[statement_cache_count++];
+    slot->db = db;
+    slot->sql = sql;
+    slot->statement = statement;
+    slot->in_use = 1;
+  }
+  return statement;
+}
+
+sqlite3_stmt *_sqlite_prepare_cached(struct __sourceloc __whence, sqlite_retry_state *retry, const char *sql)
+{
+  if (!rhizome_db && rhizome_opendb() == -1)
+    return NULL;
+  return prepare_cached(__whence, rhizome_db, retry, sql);
+}
+
+/* Same as sqlite_prepare_cached(), but for queries that only read, which use the read connection if
+ * there is one.
+ */
+sqlite3_stmt *_sqlite_prepare_cached_read(struct __sourceloc __whence, sqlite_retry_state *retry, const char *sql)
+{
+  if (!rhizome_db && rhizome_opendb() == -1)
+    return NULL;
+  return prepare_cached(__whence, rhizome_reader(), retry, sql);
+}
+
+void sqlite_release(sqlite3_stmt *statement)
+{
+  if (!statement)
+    return;
+  int i;
+  for (i=0;i<statement_cache_count;i++){
+    if (statement_cache[i].statement==statement){
+      sqlite3_reset(statement);
+      sqlite3_clear_bindings(statement);
+      statement_cache[i].in_use=0;
+      return;
+    }
+  }
+  sqlite3_finalize(statement);
+}
+
+void sqlite_statement_cache_flush()
+{
+  int i;
+  for (i=0;i<statement_cache_count;i++){
+    if (statement_cache[i].in_use)
+      WARNF("flushing statement that is still in use: %s", statement_cache[i].sql);
+    sqlite3_finalize(statement_cache[i].statement);
+  }
+  statement_cache_count=0;
+}
+
+void rhizome_database_showstats()
+{
+  if (statement_prepares || statement_hits)
+    INFOF("Rhizome statement cache: %u prepared, %u re-used, %d cached",
+	  statement_prepares, statement_hits, statement_cache_count);
+  if (busy_retries)
+    INFOF("Rhizome database busy: %u retries, %u recovered, %u gave up, %lldms waiting",
+	  busy_retries, busy_recovered, busy_failures, (long long)busy_wait_ms);
+  if (checkpoint_count || checkpoint_busy)
+    INFOF("Rhizome WAL: %u checkpoints, %lld frames, %u busy",
+	  checkpoint_count, checkpoint_frames, checkpoint_busy);
+}
+
 int _sqlite_step_retry(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement)
 {
   int ret = -1;
@@ -487,7 +758,7 @@ int _sqlite_step_retry(struct __sourceloc __whence, int log_level, sqlite_retry_
 	}
 	// fall through...
       default:
-	LOGF(log_level, "query failed (%d), %s: %s", stepcode, sqlite3_errmsg(rhizome_db), sqlite3_sql(statement));
+	LOGF(log_level, "query failed (%d), %s: %s", stepcode, sqlite3_errmsg(sqlite3_db_handle(statement)), sqlite3_sql(statement));
 	ret = -1;
 	statement = NULL;
 	break;
@@ -597,13 +868,8 @@ int _sqlite_exec_void_retry_loglevel(struct __sourceloc __whence, int log_level,
   return ret;
 }
 
-static int _sqlite_vexec_int64(struct __sourceloc __whence, sqlite_retry_state *retry, long long *result, const char *sqlformat, va_list ap)
+static int _sqlite_step_int64(struct __sourceloc __whence, sqlite_retry_state *retry, long long *result, sqlite3_stmt *statement)
 {
-  strbuf stmt = strbuf_alloca(8192);
-  strbuf_vsprintf(stmt, sqlformat, ap);
-  sqlite3_stmt *statement = _sqlite_prepare_loglevel(__whence, LOG_LEVEL_ERROR, retry, stmt);
-  if (!statement)
-    return -1;
   int ret = 0;
   int rowcount = 0;
   int stepcode;
@@ -616,7 +882,6 @@ static int _sqlite_vexec_int64(struct __sourceloc __whence, sqlite_retry_state *
   }
   if (rowcount > 1)
     WARNF("query unexpectedly returned %d rows, ignored all but first", rowcount);
-  sqlite3_finalize(statement);
   if (!sqlite_code_ok(stepcode) || ret == -1)
     return -1;
   if (sqlite_trace_func())
@@ -624,6 +889,30 @@ static int _sqlite_vexec_int64(struct __sourceloc __whence, sqlite_retry_state *
   return rowcount;
 }
 
+static int _sqlite_vexec_int64(struct __sourceloc __whence, sqlite_retry_state *retry, long long *result, const char *sqlformat, va_list ap)
+{
+  strbuf stmt = strbuf_alloca(8192);
+  strbuf_vsprintf(stmt, sqlformat, ap);
+  sqlite3_stmt *statement = _sqlite_prepare_loglevel(__whence, LOG_LEVEL_ERROR, retry, stmt);
+  if (!statement)
+    return -1;
+  int ret = _sqlite_step_int64(__whence, retry, result, statement);
+  sqlite3_finalize(statement);
+  return ret;
+}
+
+/* Same as sqlite_exec_int64_retry(), but executes a statement from sqlite_prepare_cached() whose
+ * parameters have been bound, then releases it.
+ */
+int _sqlite_exec_int64_prepared(struct __sourceloc __whence, sqlite_retry_state *retry, long long *result, sqlite3_stmt *statement)
+{
+  if (!statement)
+    return -1;
+  int ret = _sqlite_step_int64(__whence, retry, result, statement);
+  sqlite_release(statement);
+  return ret;
+}
+
 /*
  * Convenience wrapper for executing an SQL command that returns a single int64 value.
  * Logs an error and returns -1 if an error occurs.
@@ -687,29 +976,47 @@ int _sqlite_exec_strbuf_retry(struct __sourceloc __whence, sqlite_retry_state *r
   return ret;
 }
 
-int _sqlite_vexec_strbuf_retry(struct __sourceloc __whence, sqlite_retry_state *retry, strbuf sb, const char *sqlformat, va_list ap)
+static int _sqlite_step_strbuf(struct __sourceloc __whence, sqlite_retry_state *retry, strbuf sb, sqlite3_stmt *statement)
 {
-  strbuf stmt = strbuf_alloca(8192);
-  strbuf_vsprintf(stmt, sqlformat, ap);
-  sqlite3_stmt *statement = _sqlite_prepare_loglevel(__whence, LOG_LEVEL_ERROR, retry, stmt);
-  if (!statement)
-    return -1;
   int ret = 0;
   int rowcount = 0;
   int stepcode;
   while ((stepcode = _sqlite_step_retry(__whence, LOG_LEVEL_ERROR, retry, statement)) == SQLITE_ROW) {
     int columncount = sqlite3_column_count(statement);
     if (columncount != 1)
-      ret - WHYF("incorrect column count %d (should be 1): %s", columncount, sqlite3_sql(statement));
+      ret = WHYF("incorrect column count %d (should be 1): %s", columncount, sqlite3_sql(statement));
     else if (++rowcount == 1)
       strbuf_puts(sb, (const char *)sqlite3_column_text(statement, 0));
   }
   if (rowcount > 1)
     WARNF("query unexpectedly returned %d rows, ignored all but first", rowcount);
-  sqlite3_finalize(statement);
   return sqlite_code_ok(stepcode) && ret != -1 ? rowcount : -1;
 }
 
+int _sqlite_vexec_strbuf_retry(struct __sourceloc __whence, sqlite_retry_state *retry, strbuf sb, const char *sqlformat, va_list ap)
+{
+  strbuf stmt = strbuf_alloca(8192);
+  strbuf_vsprintf(stmt, sqlformat, ap);
+  sqlite3_stmt *statement = _sqlite_prepare_loglevel(__whence, LOG_LEVEL_ERROR, retry, stmt);
+  if (!statement)
+    return -1;
+  int ret = _sqlite_step_strbuf(__whence, retry, sb, statement);
+  sqlite3_finalize(statement);
+  return ret;
+}
+
+/* Same as sqlite_exec_strbuf_retry(), but executes a statement from sqlite_prepare_cached() whose
+ * parameters have been bound, then releases it.
+ */
+int _sqlite_exec_strbuf_prepared(struct __sourceloc __whence, sqlite_retry_state *retry, strbuf sb, sqlite3_stmt *statement)
+{
+  if (!statement)
+    return -1;
+  int ret = _sqlite_step_strbuf(__whence, retry, sb, statement);
+  sqlite_release(statement);
+  return ret;
+}
+
 long long rhizome_database_used_bytes()
 {
   long long db_page_size;
@@ -728,8 +1035,13 @@ int rhizome_database_filehash_from_id(const char *id, uint64_t version, char has
   IN();
   
   strbuf hash_sb = strbuf_local(hash, SHA512_DIGEST_STRING_LENGTH);
-  RETURN(sqlite_exec_strbuf(hash_sb, "SELECT filehash FROM MANIFESTS WHERE manifests.version=%lld AND manifests.id='%s';",
-			    version,id));
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_cached(&retry, "SELECT filehash FROM MANIFESTS WHERE manifests.version=?1 AND manifests.id=?2;");
+  if (!statement)
+    RETURN(-1);
+  sqlite3_bind_int64(statement, 1, version);
+  sqlite3_bind_text(statement, 2, id, -1, SQLITE_STATIC);
+  RETURN(sqlite_exec_strbuf_prepared(&retry, hash_sb, statement));
   OUT();
 }
 
@@ -769,6 +1081,8 @@ int rhizome_cleanup(struct rhizome_cleanup_report *report)
   ret = sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DELETE FROM FILEBLOBS WHERE NOT EXISTS ( SELECT  1 FROM FILES WHERE FILES.id = FILEBLOBS.id );");
   if (report)
     report->deleted_orphan_fileblobs = ret + externals_removed;
+  
+  sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DELETE FROM MERKLE WHERE NOT EXISTS ( SELECT  1 FROM FILES WHERE FILES.id = MERKLE.id );");
    
   RETURN(0);
   OUT();
@@ -862,7 +1176,8 @@ int rhizome_drop_stored_file(const char *id,int maximum_priority)
     } else {
       if (config.debug.rhizome)
 	DEBUGF("removing stale manifests, groupmemberships");
-      sqlite_exec_void_retry(&retry, "delete from manifests where id='%s';", manifestId);
+      if (sqlite_exec_void_retry(&retry, "delete from manifests where id='%s';", manifestId) != -1)
+	rhizome_bar_cache_delete(manifestId);
       sqlite_exec_void_retry(&retry, "delete from keypairs where public='%s';", manifestId);
       sqlite_exec_void_retry(&retry, "delete from groupmemberships where manifestid='%s';", manifestId);
     }
@@ -964,6 +1279,7 @@ int rhizome_store_bundle(rhizome_manifest *m)
     goto rollback;
   sqlite3_finalize(stmt);
   stmt = NULL;
+  sqlite3_int64 rowid = sqlite3_last_insert_rowid(rhizome_db);
 
   // TODO remove old payload?
   
@@ -1007,6 +1323,7 @@ int rhizome_store_bundle(rhizome_manifest *m)
     stmt = NULL;
   }
   if (sqlite_exec_void_retry(&retry, "COMMIT;") != -1){
+    rhizome_bar_cache_store(rowid, bar);
     // This message used in tests; do not modify or remove.
     const char *service = rhizome_manifest_get(m, "service", NULL, 0);
     INFOF("RHIZOME ADD MANIFEST service=%s bid=%s version=%lld",
@@ -1459,12 +1776,16 @@ int rhizome_delete_manifest_retry(sqlite_retry_state *retry, const char *manifes
   sqlite3_bind_text(statement, 1, manifestid, -1, SQLITE_STATIC);
   if (_sqlite_exec_prepared(__WHENCE__, LOG_LEVEL_ERROR, retry, statement) == -1)
     return -1;
-  return sqlite3_changes(rhizome_db) ? 0 : 1;
+  if (!sqlite3_changes(rhizome_db))
+    return 1;
+  rhizome_bar_cache_delete(manifestid);
+  return 0;
 }
 
 static int rhizome_delete_file_retry(sqlite_retry_state *retry, const char *fileid)
 {
   int ret = 0;
+  rhizome_read_cache_invalidate(fileid);
   sqlite3_stmt *statement = sqlite_prepare(retry, "DELETE FROM files WHERE id = ?");
   if (!statement)
     ret = -1;
@@ -1624,3 +1945,107 @@ int rhizome_is_bar_interesting(unsigned char *bar){
   RETURN(ret);
   OUT();
 }
+
+static int sql_test(int count)
+{
+  int ret=0;
+  char (*ids)[RHIZOME_FILEHASH_STRLEN + 1] = malloc(count * sizeof *ids);
+  if (!ids)
+    return WHY_perror("malloc");
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_void_retry(&retry, "BEGIN;") == -1){
+    free(ids);
+    return -1;
+  }
+  int i;
+  for (i=0;i<count;i++){
+    int j;
+    for (j=0;j<RHIZOME_FILEHASH_STRLEN;j++)
+      ids[i][j] = "0123456789ABCDEF"[random()&15];
+    ids[i][RHIZOME_FILEHASH_STRLEN]=0;
+    if (sqlite_exec_void_retry(&retry,
+	  "INSERT INTO FILES(id,length,highestpriority,datavalid,inserttime) VALUES('%s',0,0,1,0);", ids[i]) == -1){
+      sqlite_exec_void_retry(&retry, "ROLLBACK;");
+      free(ids);
+      return -1;
+    }
+  }
+  if (sqlite_exec_void_retry(&retry, "COMMIT;") == -1){
+    sqlite_exec_void_retry(&retry, "ROLLBACK;");
+    free(ids);
+    return -1;
+  }
+  
+  // formatted statements, prepared and finalised every time
+  time_ms_t start = gettime_ms();
+  for (i=0;i<count;i++){
+    long long found=0;
+    if (sqlite_exec_int64(&found, "SELECT COUNT(*) FROM FILES WHERE ID='%s' and datavalid=1;", ids[i]) != 1 || found!=1){
+      ret=WHYF("Lookup of %s failed", ids[i]);
+      goto end;
+    }
+    long long version=-1;
+    if (sqlite_exec_int64(&version, "SELECT version FROM MANIFESTS WHERE id='%s';", ids[i]) == -1){
+      ret=-1;
+      goto end;
+    }
+  }
+  time_ms_t formatted = gettime_ms();
+  
+  // cached statements with bound parameters
+  unsigned int prepares = statement_prepares;
+  for (i=0;i<count;i++){
+    if (rhizome_exists(ids[i])!=1){
+      ret=WHYF("Lookup of %s failed", ids[i]);
+      goto end;
+    }
+    long long version=-1;
+    sqlite3_stmt *statement = sqlite_prepare_cached(&retry, "SELECT version FROM MANIFESTS WHERE id=?1;");
+    if (!statement){
+      ret=-1;
+      goto end;
+    }
+    sqlite3_bind_text(statement, 1, ids[i], -1, SQLITE_STATIC);
+    if (sqlite_exec_int64_prepared(&retry, &version, statement) == -1){
+      ret=-1;
+      goto end;
+    }
+  }
+  time_ms_t end = gettime_ms();
+  
+  printf("%7d rows: formatted %5lldms (%4lldus/query), cached %5lldms (%4lldus/query), %u prepares\n",
+	 count,
+	 (long long)(formatted - start), (long long)(formatted - start)*500/count,
+	 (long long)(end - formatted), (long long)(end - formatted)*500/count,
+	 statement_prepares - prepares);
+  
+end:
+  sqlite_exec_void_retry(&retry, "BEGIN;");
+  for (i=0;i<count;i++)
+    sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry, "DELETE FROM FILES WHERE id='%s';", ids[i]);
+  sqlite_exec_void_retry(&retry, "COMMIT;");
+  free(ids);
+  return ret;
+}
+
+int app_rhizome_sql_test(const struct cli_parsed *parsed, void *context)
+{
+  const char *count_arg = NULL;
+  if (cli_arg(parsed, "--count", &count_arg, cli_uint, NULL) == -1)
+    return -1;
+  if (rhizome_opendb() == -1)
+    return -1;
+  if (count_arg){
+    int count = atoi(count_arg);
+    if (count <= 0)
+      return WHY("Invalid row count");
+    if (sql_test(count))
+      return -1;
+  }else{
+    printf("Benchmarking rhizome database queries:\n");
+    if (sql_test(1000) || sql_test(10000) || sql_test(100000))
+      return -1;
+  }
+  printf("Test passed.\n");
+  return 0;
+}
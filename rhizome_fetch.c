@@ -39,8 +39,19 @@ struct rhizome_fetch_candidate {
   unsigned char peer_sid[SID_SIZE];
 
   int priority;
+
+  struct rhizome_fetch_queue *queue;
+  int heap_index[2]; // position in each of the queue's heaps, -1 if not in them
+  struct rhizome_fetch_candidate *index_next; // next candidate with same first bundle ID byte
+  unsigned char index_bucket;
+  uint64_t seq; // order of queuing, to break ties
+  struct rhizome_fetch_candidate *held_next;
 };
 
+/* Most peers that one payload is fetched from at once over MDP; see rhizome.fetch_sources.
+ */
+#define RHIZOME_FETCH_MAX_SOURCES 8
+
 /* Represents an active fetch (in progress) of a bundle payload (.manifest != NULL) or of a bundle
  * manifest (.manifest == NULL).
  */
@@ -48,16 +59,25 @@ struct rhizome_fetch_slot {
   struct sched_ent alarm; // must be first element in struct
   rhizome_manifest *manifest;
 
+  struct rhizome_fetch_queue *queue;
+  int index; // within queue's slots
+
   struct sockaddr_in peer_ipandport;
   unsigned char peer_sid[SID_SIZE];
 
   int state;
+  int completed_state; // transport that delivered the payload, while STORING
 #define RHIZOME_FETCH_FREE 0
 #define RHIZOME_FETCH_CONNECTING 1
 #define RHIZOME_FETCH_SENDINGHTTPREQUEST 2
 #define RHIZOME_FETCH_RXHTTPHEADERS 3
 #define RHIZOME_FETCH_RXFILE 4
 #define RHIZOME_FETCH_RXFILEMDP 5
+#define RHIZOME_FETCH_STORING 6
+#define RHIZOME_FETCH_CLOSING 7 // waiting for the writer to finish with the payload
+
+  /* Called when the writer has room for more of the payload, or, while closing, is done with it */
+  struct sched_ent write_alarm;
 
   /* Keep track of how much of the file we have read */
   struct rhizome_write write_state;
@@ -81,62 +101,218 @@ struct rhizome_fetch_slot {
   unsigned char prefix[RHIZOME_MANIFEST_ID_BYTES];
   int prefix_length;
   int mdpIdleTimeout;
-  int mdpResponsesOutstanding;
   int mdpRXBlockLength;
-  uint32_t mdpRXBitmap;
-  unsigned char mdpRXWindow[32*200];
+  /* Blocks are numbered from mdpRXBase.  The bitmaps are indexed by block number modulo
+     RHIZOME_MDP_MAX_WINDOW, and only cover blocks from the current write position. */
+  uint64_t mdpRXBase;
+  uint64_t mdpRXReceived; // arrived out of order, held in mdpRXBuffer
+  uint64_t mdpRXRequested; // requested and not yet received
+  unsigned char *mdpRXBuffer;
+  unsigned short mdpRXLength[RHIZOME_MDP_MAX_WINDOW];
+  uint64_t mdpRequestedEnd; // one past the highest block ever requested
+  uint64_t mdpRecoverBlock; // do not shrink the window again for losses below this block
+  uint64_t mdpRTTBlock; // block that will give the next round trip time sample
+  time_ms_t mdpRequestTime;
+  int mdpWindow; // number of blocks to keep requested
+  int mdpCleanBlocks; // received since the window last changed
+  int mdpSRTT; // smoothed round trip time in ms, 0 until measured
+  int mdpRTTVar;
+  int mdpRTO; // retransmission timeout in ms
+  /* Peers known to hold the same version of the bundle.  Each request for blocks is split into
+     contiguous ranges, one per source.  mdpBlockSource[] records which source each requested block
+     was asked of, indexed like the bitmaps. */
+  unsigned char mdpSources[RHIZOME_FETCH_MAX_SOURCES][SID_SIZE];
+  int mdpSourceCount;
+  unsigned char mdpSourceMisses[RHIZOME_FETCH_MAX_SOURCES]; // timeouts in a row without a block
+  unsigned char mdpSourceHeard[RHIZOME_FETCH_MAX_SOURCES]; // sent a block since the last timeout
+  /* Sources dropped for sending bad blocks.  They are not added again, and blocks they send are
+     ignored, for the rest of the fetch. */
+  unsigned char mdpBanned[RHIZOME_FETCH_MAX_SOURCES][SID_SIZE];
+  int mdpBannedCount;
+  unsigned char mdpBlockSource[RHIZOME_MDP_MAX_WINDOW];
+  signed char mdpBlockSender[RHIZOME_MDP_MAX_WINDOW]; // source that sent each held block, -1 if none
+  int mdpWritingSource; // source that sent the bytes being written, -1 if none
+
+  /* Merkle verification, when the manifest carries a root.  The leaves are fetched over MDP and
+     checked against the root before any block is requested.  After that, the bytes of each Merkle
+     block are held in merkleBlock until the block is complete and matches its leaf, and only then
+     written. */
+  int merkleState;
+#define RHIZOME_MERKLE_NONE 0
+#define RHIZOME_MERKLE_FETCHING 1 // requesting leaves
+#define RHIZOME_MERKLE_VERIFYING 2 // leaves match the root
+  unsigned char merkleRoot[RHIZOME_MERKLE_HASH_BYTES];
+  unsigned char *merkleLeaves;
+  int merkleLeafCount;
+  int merkleLeavesReceived;
+  int merkleRequestEnd; // one past the last leaf asked for
+  int merkleRequestTries;
+  unsigned char merkleBlock[RHIZOME_MERKLE_BLOCK_BYTES];
+  int merkleBlockBytes;
+  unsigned merkleBlockSenders; // bit per source that sent part of merkleBlock
+  int merkleBlockOverheard; // part of merkleBlock came from a peer that is not a source
+  int merkleRetrySource; // source asked for all of a bad block that several sources sent, -1 if none
+  uint64_t merkleRetryEnd; // MDP block after the one being asked of merkleRetrySource
+  int merkleFailures;
+  int64_t merkleVerified; // bytes from the start of the payload verified and written
 };
 
+/* Bounds for the MDP block window and retransmission timeout.  The window starts as the fixed 32
+ * blocks that older peers always send.
+ */
+#define RHIZOME_MDP_MIN_WINDOW 4
+#define RHIZOME_MDP_INITIAL_WINDOW 32
+#define RHIZOME_MDP_WINDOW_STEP 4
+#define RHIZOME_MDP_REORDER_BLOCKS 2
+#define RHIZOME_MDP_MIN_RTO 100
+#define RHIZOME_MDP_MAX_RTO 1000
+#define RHIZOME_MDP_NO_BLOCK UINT64_MAX
+#define RHIZOME_MDP_SOURCE_MISSES 3
+
+/* Requests for Merkle leaves are given up after this many timeouts, or half the idle timeout, and a
+ * fetch is abandoned after this many blocks that do not match their leaves.
+ */
+#define RHIZOME_MERKLE_REQUEST_TRIES 3
+#define RHIZOME_MERKLE_MAX_FAILURES 3
+
 static int rhizome_fetch_switch_to_mdp(struct rhizome_fetch_slot *slot);
 static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot);
+static int rhizome_fetch_mdp_startblocks(struct rhizome_fetch_slot *slot);
+static int rhizome_fetch_mdp_requestleaves(struct rhizome_fetch_slot *slot);
+static void rhizome_fetch_mdp_shrink_window(struct rhizome_fetch_slot *slot);
+static void rhizome_fetch_mdp_source_timeout(struct rhizome_fetch_slot *slot);
+int rhizome_write_content(struct rhizome_fetch_slot *slot, char *buffer, int bytes);
 static int rhizome_fetch_mdp_requestmanifest(struct rhizome_fetch_slot *slot);
 
-/* Represents a queue of fetch candidates and a single active fetch for bundle payloads whose size
- * is less than a given threshold.
+/* A binary heap of fetch candidates.  Each candidate records its own position in the heap, so that
+ * any candidate can be removed in O(log n) time.
+ */
+struct rhizome_fetch_heap {
+  struct rhizome_fetch_candidate **items;
+  int count;
+  int allocated;
+};
+
+#define HEAP_BEST 0	// root is the next candidate to fetch
+#define HEAP_WORST 1	// root is the first candidate to drop when the queue is full
+
+/* Represents a queue of fetch candidates and the active fetches for bundle payloads whose size is
+ * less than a given threshold.  The number of concurrent fetches is configured per queue, and the
+ * slots are allocated as they are first needed.
  *
- * TODO: If the queues ever get much larger, use pointer-linked queue instead of physically ordered
- * in memory, to avoid the need for memory copies when deleting or inserting queue entries.
+ * The candidates are kept in two heaps over the same set: one ordered best-first, from which
+ * fetches are started, and one ordered worst-first, from which candidates are dropped when the
+ * queue reaches its configured capacity.
  *
  * @author Andrew Bettison <andrew@servalproject.com>
  */
 struct rhizome_fetch_queue {
-  struct rhizome_fetch_slot active; // must be first element in struct
-  int candidate_queue_size;
-  struct rhizome_fetch_candidate *candidate_queue;
+  struct rhizome_fetch_slot **slots;
+  int slot_count;
+  const uint16_t *max_slots; // from config.rhizome.fetch_slots
+  struct rhizome_fetch_heap heap[2];
+  const uint16_t *capacity; // from config.rhizome.fetch_queue
   unsigned char log_size_threshold; // will only queue payloads smaller than this.
+  const char *name;
+  int peak;
+  unsigned added;
+  unsigned dropped;
 };
 
-/* Static allocation of the candidate queues.
- */
-struct rhizome_fetch_candidate queue0[10];
-struct rhizome_fetch_candidate queue1[8];
-struct rhizome_fetch_candidate queue2[6];
-struct rhizome_fetch_candidate queue3[4];
-struct rhizome_fetch_candidate queue4[2];
-struct rhizome_fetch_candidate queue5[2];
-
 #define NELS(a) (sizeof (a) / sizeof *(a))
-#define slotno(slot) ((struct rhizome_fetch_queue *)(slot) - &rhizome_fetch_queues[0])
+#define slotno(slot) ((slot)->queue - &rhizome_fetch_queues[0])
 
 /* Static allocation of the queue structures.  Must be in order of ascending log_size_threshold.
  */
 struct rhizome_fetch_queue rhizome_fetch_queues[] = {
-  { .candidate_queue_size = NELS(queue0), .candidate_queue = queue0, .log_size_threshold =   10, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue1), .candidate_queue = queue1, .log_size_threshold =   13, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue2), .candidate_queue = queue2, .log_size_threshold =   16, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue3), .candidate_queue = queue3, .log_size_threshold =   19, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue4), .candidate_queue = queue4, .log_size_threshold =   22, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue5), .candidate_queue = queue5, .log_size_threshold = 0xFF, .active = { .state = RHIZOME_FETCH_FREE } }
+  { .capacity = &config.rhizome.fetch_queue.under_1k,  .max_slots = &config.rhizome.fetch_slots.under_1k,  .name = "<1K",   .log_size_threshold =   10 },
+  { .capacity = &config.rhizome.fetch_queue.under_8k,  .max_slots = &config.rhizome.fetch_slots.under_8k,  .name = "<8K",   .log_size_threshold =   13 },
+  { .capacity = &config.rhizome.fetch_queue.under_64k, .max_slots = &config.rhizome.fetch_slots.under_64k, .name = "<64K",  .log_size_threshold =   16 },
+  { .capacity = &config.rhizome.fetch_queue.under_512k,.max_slots = &config.rhizome.fetch_slots.under_512k,.name = "<512K", .log_size_threshold =   19 },
+  { .capacity = &config.rhizome.fetch_queue.under_4m,  .max_slots = &config.rhizome.fetch_slots.under_4m,  .name = "<4M",   .log_size_threshold =   22 },
+  { .capacity = &config.rhizome.fetch_queue.larger,    .max_slots = &config.rhizome.fetch_slots.larger,    .name = "large", .log_size_threshold = 0xFF }
 };
 
 #define NQUEUES	    NELS(rhizome_fetch_queues)
 
+static struct mem_pool candidate_pool = MEM_POOL_INIT("rhizome_fetch_candidate", sizeof(struct rhizome_fetch_candidate), 64);
+
+/* Every queued candidate, in any queue, chained by the first byte of its bundle ID.
+ */
+#define CANDIDATE_INDEX_SIZE 256
+static struct rhizome_fetch_candidate *candidate_index[CANDIDATE_INDEX_SIZE];
+static uint64_t candidate_seq = 0;
+
+static unsigned mdp_requests = 0;
+static unsigned mdp_blocks_received = 0;
+static unsigned mdp_blocks_held = 0;
+static unsigned mdp_blocks_lost = 0;
+static unsigned mdp_timeouts = 0;
+static unsigned mdp_sources_added = 0;
+static unsigned mdp_sources_dropped = 0;
+static unsigned merkle_leaves_received = 0;
+static unsigned merkle_blocks_verified = 0;
+static unsigned merkle_blocks_failed = 0;
+static unsigned merkle_fetches_resumed = 0;
+
+/* Return the given slot of a queue, allocating it if it has not been used before.
+ */
+static struct rhizome_fetch_slot *rhizome_fetch_queue_slot(struct rhizome_fetch_queue *q, int i)
+{
+  if (i >= q->slot_count) {
+    struct rhizome_fetch_slot **slots = erealloc(q->slots, (i + 1) * sizeof *slots);
+    if (slots == NULL)
+      return NULL;
+    q->slots = slots;
+    while (q->slot_count <= i) {
+      struct rhizome_fetch_slot *slot = emalloc_zero(sizeof *slot);
+      if (slot == NULL)
+	return NULL;
+      slot->alarm = STRUCT_SCHED_ENT_UNUSED;
+      slot->write_alarm = STRUCT_SCHED_ENT_UNUSED;
+      slot->write_alarm.context = slot;
+      slot->state = RHIZOME_FETCH_FREE;
+      slot->queue = q;
+      slot->index = q->slot_count;
+      q->slots[q->slot_count++] = slot;
+    }
+  }
+  return q->slots[i];
+}
+
+/* Return a free slot of the given queue, or NULL if as many as configured are busy.
+ */
+static struct rhizome_fetch_slot *rhizome_fetch_queue_free_slot(struct rhizome_fetch_queue *q)
+{
+  int i;
+  for (i = 0; i < *q->max_slots; ++i) {
+    struct rhizome_fetch_slot *slot = rhizome_fetch_queue_slot(q, i);
+    if (slot == NULL)
+      return NULL;
+    if (slot->state == RHIZOME_FETCH_FREE)
+      return slot;
+  }
+  return NULL;
+}
+
+/* Count the busy slots of the given queue that are fetching from the given peer.
+ */
+static int rhizome_fetch_peer_count(const struct rhizome_fetch_queue *q, const unsigned char peersid[SID_SIZE])
+{
+  int i, count = 0;
+  for (i = 0; i < q->slot_count; ++i)
+    if (q->slots[i]->state != RHIZOME_FETCH_FREE && memcmp(q->slots[i]->peer_sid, peersid, SID_SIZE) == 0)
+      ++count;
+  return count;
+}
+
 int rhizome_active_fetch_count()
 {
-  int i,active=0;
+  int i,j,active=0;
   for(i=0;i<NQUEUES;i++)
-    if (rhizome_fetch_queues[i].active.state!=RHIZOME_FETCH_FREE)
-      active++;
+    for(j=0;j<rhizome_fetch_queues[i].slot_count;j++)
+      if (rhizome_fetch_queues[i].slots[j]->state!=RHIZOME_FETCH_FREE)
+	active++;
   return active;
 }
 
@@ -144,27 +320,77 @@ int rhizome_active_fetch_bytes_received(int q)
 {
   if (q<0) return -1;
   if (q>=NQUEUES) return -1;
-  if (rhizome_fetch_queues[q].active.state==RHIZOME_FETCH_FREE) return -1;
-  return (int)rhizome_fetch_queues[q].active.write_state.file_offset + rhizome_fetch_queues[q].active.write_state.data_size;
+  int j,bytes=-1;
+  for(j=0;j<rhizome_fetch_queues[q].slot_count;j++){
+    struct rhizome_fetch_slot *slot=rhizome_fetch_queues[q].slots[j];
+    if (slot->state!=RHIZOME_FETCH_FREE){
+      if (bytes==-1)
+	bytes=0;
+      bytes+=slot->write_state.file_offset + slot->write_state.data_size;
+    }
+  }
+  return bytes;
 }
 
 int rhizome_fetch_queue_bytes(){
   int i,j,bytes=0;
   for(i=0;i<NQUEUES;i++){
-    if (rhizome_fetch_queues[i].active.state!=RHIZOME_FETCH_FREE){
-      int received=rhizome_fetch_queues[i].active.write_state.file_offset + rhizome_fetch_queues[i].active.write_state.data_size;
-      bytes+=rhizome_fetch_queues[i].active.manifest->fileLength - received;
-    }
-    for (j=0;j<rhizome_fetch_queues[i].candidate_queue_size;j++){
-      if (rhizome_fetch_queues[i].candidate_queue[j].manifest)
-        bytes+=rhizome_fetch_queues[i].candidate_queue[j].manifest->fileLength;
+    struct rhizome_fetch_heap *h = &rhizome_fetch_queues[i].heap[HEAP_BEST];
+    for(j=0;j<rhizome_fetch_queues[i].slot_count;j++){
+      struct rhizome_fetch_slot *slot=rhizome_fetch_queues[i].slots[j];
+      if (slot->state!=RHIZOME_FETCH_FREE && slot->manifest){
+	int received=slot->write_state.file_offset + slot->write_state.data_size;
+	bytes+=slot->manifest->fileLength - received;
+      }
     }
+    for (j=0;j<h->count;j++)
+      bytes+=h->items[j]->manifest->fileLength;
   }
   return bytes;
 }
 
+void rhizome_fetch_showstats()
+{
+  int i;
+  for (i = 0; i < NQUEUES; ++i) {
+    struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
+    int j, active = 0;
+    for (j = 0; j < q->slot_count; ++j)
+      if (q->slots[j]->state != RHIZOME_FETCH_FREE)
+	++active;
+    if (q->added || q->dropped || q->heap[HEAP_BEST].count || active)
+      INFOF("Rhizome fetch queue %s: %d of %d queued (peak %d), %u added, %u dropped, %d of %d slots active",
+	    q->name, q->heap[HEAP_BEST].count, *q->capacity, q->peak, q->added, q->dropped, active, *q->max_slots);
+    q->peak = q->heap[HEAP_BEST].count;
+    q->added = 0;
+    q->dropped = 0;
+  }
+  if (mdp_requests)
+    INFOF("Rhizome MDP fetch: %u requests, %u blocks received (%u out of order), %u lost, %u timeouts",
+	  mdp_requests, mdp_blocks_received, mdp_blocks_held, mdp_blocks_lost, mdp_timeouts);
+  mdp_requests = 0;
+  mdp_blocks_received = 0;
+  mdp_blocks_held = 0;
+  mdp_blocks_lost = 0;
+  mdp_timeouts = 0;
+  if (mdp_sources_added || mdp_sources_dropped)
+    INFOF("Rhizome MDP fetch: %u extra sources added, %u dropped", mdp_sources_added, mdp_sources_dropped);
+  mdp_sources_added = 0;
+  mdp_sources_dropped = 0;
+  if (merkle_leaves_received || merkle_blocks_verified || merkle_blocks_failed || merkle_fetches_resumed)
+    INFOF("Rhizome Merkle fetch: %u leaves received, %u blocks verified, %u bad, %u fetches resumed",
+	  merkle_leaves_received, merkle_blocks_verified, merkle_blocks_failed, merkle_fetches_resumed);
+  merkle_leaves_received = 0;
+  merkle_blocks_verified = 0;
+  merkle_blocks_failed = 0;
+  merkle_fetches_resumed = 0;
+}
+
 static struct sched_ent sched_activate = STRUCT_SCHED_ENT_UNUSED;
 static struct profile_total fetch_stats;
+static struct profile_total fetch_stored_stats={.name="rhizome_fetch_stored"};
+static struct profile_total fetch_write_ready_stats={.name="rhizome_fetch_write_ready"};
+static struct profile_total fetch_closed_stats={.name="rhizome_fetch_closed"};
 
 /* Find a queue suitable for a fetch of the given number of bytes.  If there is no suitable queue,
  * return NULL.
@@ -195,58 +421,179 @@ static struct rhizome_fetch_slot *rhizome_find_fetch_slot(long long size)
   unsigned char log_size = log2ll(size);
   for (i = 0; i < NQUEUES; ++i) {
     struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-    if (log_size < q->log_size_threshold && q->active.state == RHIZOME_FETCH_FREE)
-      return &q->active;
+    if (log_size < q->log_size_threshold) {
+      struct rhizome_fetch_slot *slot = rhizome_fetch_queue_free_slot(q);
+      if (slot)
+	return slot;
+    }
   }
   return NULL;
 }
 
-/* Insert a candidate into a given queue at a given position.  All candidates succeeding the given
- * position are copied backward in the queue to open up an empty element at the given position.  If
- * the queue was full, then the tail element is discarded, freeing the manifest it points to.
- *
- * @author Andrew Bettison <andrew@servalproject.com>
+/* Return true if candidate 'a' should be fetched before candidate 'b': higher priority first, then
+ * smaller payloads, then in the order they were queued.
+ */
+static int rhizome_fetch_candidate_before(const struct rhizome_fetch_candidate *a, const struct rhizome_fetch_candidate *b)
+{
+  if (a->priority != b->priority)
+    return a->priority > b->priority;
+  if (a->manifest->fileLength != b->manifest->fileLength)
+    return a->manifest->fileLength < b->manifest->fileLength;
+  return a->seq < b->seq;
+}
+
+static int heap_above(int which, const struct rhizome_fetch_candidate *a, const struct rhizome_fetch_candidate *b)
+{
+  return which == HEAP_BEST ? rhizome_fetch_candidate_before(a, b) : rhizome_fetch_candidate_before(b, a);
+}
+
+static void heap_set(struct rhizome_fetch_heap *h, int which, int i, struct rhizome_fetch_candidate *c)
+{
+  h->items[i] = c;
+  c->heap_index[which] = i;
+}
+
+static void heap_sift_up(struct rhizome_fetch_heap *h, int which, int i)
+{
+  struct rhizome_fetch_candidate *c = h->items[i];
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!heap_above(which, c, h->items[parent]))
+      break;
+    heap_set(h, which, i, h->items[parent]);
+    i = parent;
+  }
+  heap_set(h, which, i, c);
+}
+
+static void heap_sift_down(struct rhizome_fetch_heap *h, int which, int i)
+{
+  struct rhizome_fetch_candidate *c = h->items[i];
+  while (1) {
+    int child = 2 * i + 1;
+    if (child >= h->count)
+      break;
+    if (child + 1 < h->count && heap_above(which, h->items[child + 1], h->items[child]))
+      ++child;
+    if (!heap_above(which, h->items[child], c))
+      break;
+    heap_set(h, which, i, h->items[child]);
+    i = child;
+  }
+  heap_set(h, which, i, c);
+}
+
+static int heap_push(struct rhizome_fetch_heap *h, int which, struct rhizome_fetch_candidate *c)
+{
+  if (h->count >= h->allocated) {
+    int allocated = h->allocated ? h->allocated * 2 : 8;
+    struct rhizome_fetch_candidate **items = erealloc(h->items, allocated * sizeof *items);
+    if (items == NULL)
+      return -1;
+    h->items = items;
+    h->allocated = allocated;
+  }
+  heap_set(h, which, h->count++, c);
+  heap_sift_up(h, which, h->count - 1);
+  return 0;
+}
+
+static void heap_remove(struct rhizome_fetch_heap *h, int which, struct rhizome_fetch_candidate *c)
+{
+  int i = c->heap_index[which];
+  assert(i >= 0 && i < h->count && h->items[i] == c);
+  c->heap_index[which] = -1;
+  struct rhizome_fetch_candidate *last = h->items[--h->count];
+  if (last != c) {
+    heap_set(h, which, i, last);
+    heap_sift_up(h, which, i);
+    heap_sift_down(h, which, last->heap_index[which]);
+  }
+}
+
+/* Add a candidate to both heaps of a queue.
+ */
+static int rhizome_fetch_heap_insert(struct rhizome_fetch_queue *q, struct rhizome_fetch_candidate *c)
+{
+  if (heap_push(&q->heap[HEAP_BEST], HEAP_BEST, c) == -1)
+    return -1;
+  if (heap_push(&q->heap[HEAP_WORST], HEAP_WORST, c) == -1) {
+    heap_remove(&q->heap[HEAP_BEST], HEAP_BEST, c);
+    return -1;
+  }
+  return 0;
+}
+
+static void rhizome_fetch_heap_remove(struct rhizome_fetch_queue *q, struct rhizome_fetch_candidate *c)
+{
+  heap_remove(&q->heap[HEAP_BEST], HEAP_BEST, c);
+  heap_remove(&q->heap[HEAP_WORST], HEAP_WORST, c);
+}
+
+/* Return the first queued candidate whose bundle ID starts with the given prefix, or NULL.
+ */
+static struct rhizome_fetch_candidate *rhizome_fetch_candidate_find(const unsigned char *id, int prefix_length)
+{
+  int bucket = 0, last = CANDIDATE_INDEX_SIZE - 1;
+  if (prefix_length > 0)
+    bucket = last = id[0];
+  for (; bucket <= last; ++bucket) {
+    struct rhizome_fetch_candidate *c;
+    for (c = candidate_index[bucket]; c; c = c->index_next)
+      if (memcmp(id, c->manifest->cryptoSignPublic, prefix_length) == 0)
+	return c;
+  }
+  return NULL;
+}
+
+/* Queue a candidate for the given manifest.  The caller must already have made room in the queue.
+ * Returns NULL, without freeing the manifest, if the candidate cannot be allocated.
  */
-static struct rhizome_fetch_candidate *rhizome_fetch_insert(struct rhizome_fetch_queue *q, int i)
+static struct rhizome_fetch_candidate *rhizome_fetch_enqueue(struct rhizome_fetch_queue *q, rhizome_manifest *m, int priority,
+							       const struct sockaddr_in *peerip, const unsigned char peersid[SID_SIZE])
 {
-  struct rhizome_fetch_candidate * const c = &q->candidate_queue[i];
-  struct rhizome_fetch_candidate * e = &q->candidate_queue[q->candidate_queue_size - 1];
+  struct rhizome_fetch_candidate *c = pool_alloc_zero(&candidate_pool);
+  if (c == NULL)
+    return NULL;
+  c->manifest = m;
+  c->priority = priority;
+  c->peer_ipandport = *peerip;
+  bcopy(peersid, c->peer_sid, SID_SIZE);
+  c->queue = q;
+  c->seq = candidate_seq++;
+  if (rhizome_fetch_heap_insert(q, c) == -1) {
+    pool_free(&candidate_pool, c);
+    return NULL;
+  }
+  c->index_bucket = m->cryptoSignPublic[0];
+  struct rhizome_fetch_candidate **bucket = &candidate_index[c->index_bucket];
+  c->index_next = *bucket;
+  *bucket = c;
   if (config.debug.rhizome_rx)
-    DEBUGF("insert queue[%d] candidate[%d]", q - rhizome_fetch_queues, i);
-  assert(i >= 0 && i < q->candidate_queue_size);
-  assert(i == 0 || c[-1].manifest);
-  if (e->manifest) // queue is full
-    rhizome_manifest_free(e->manifest);
-  else
-    while (e > c && !e[-1].manifest)
-      --e;
-  for (; e > c; --e)
-    e[0] = e[-1];
-  assert(e == c);
-  c->manifest = NULL;
+    DEBUGF("insert queue[%d] candidate bid=%s", q - rhizome_fetch_queues, alloca_tohex_bid(m->cryptoSignPublic));
+  q->added++;
+  if (q->heap[HEAP_BEST].count > q->peak)
+    q->peak = q->heap[HEAP_BEST].count;
   return c;
 }
 
-/* Remove the given candidate from a given queue.  If the element points to a manifest structure,
- * then frees the manifest.  All succeeding candidates are copied forward in the queue to close up
- * the gap, leaving an empty element at the tail of the queue.
- *
- * @author Andrew Bettison <andrew@servalproject.com>
+/* Forget a candidate.  If it is still in its queue's heaps then removes it from them.  If the
+ * candidate still points to a manifest structure, then frees the manifest.
  */
-static void rhizome_fetch_unqueue(struct rhizome_fetch_queue *q, int i)
+static void rhizome_fetch_unqueue(struct rhizome_fetch_candidate *c)
 {
-  assert(i >= 0 && i < q->candidate_queue_size);
-  struct rhizome_fetch_candidate *c = &q->candidate_queue[i];
+  struct rhizome_fetch_queue *q = c->queue;
   if (config.debug.rhizome_rx)
-    DEBUGF("unqueue queue[%d] candidate[%d] manifest=%p", q - rhizome_fetch_queues, i, c->manifest);
-  if (c->manifest) {
+    DEBUGF("unqueue queue[%d] candidate manifest=%p", q - rhizome_fetch_queues, c->manifest);
+  if (c->heap_index[HEAP_BEST] != -1)
+    rhizome_fetch_heap_remove(q, c);
+  struct rhizome_fetch_candidate **cp = &candidate_index[c->index_bucket];
+  while (*cp != c)
+    cp = &(*cp)->index_next;
+  *cp = c->index_next;
+  if (c->manifest)
     rhizome_manifest_free(c->manifest);
-    c->manifest = NULL;
-  }
-  struct rhizome_fetch_candidate *e = &q->candidate_queue[q->candidate_queue_size - 1];
-  for (; c < e && c[1].manifest; ++c)
-    c[0] = c[1];
-  c->manifest = NULL;
+  pool_free(&candidate_pool, c);
 }
 
 /* Return true if there are any active fetches currently in progress.
@@ -255,11 +602,7 @@ static void rhizome_fetch_unqueue(struct rhizome_fetch_queue *q, int i)
  */
 int rhizome_any_fetch_active()
 {
-  int i;
-  for (i = 0; i < NQUEUES; ++i)
-    if (rhizome_fetch_queues[i].active.state != RHIZOME_FETCH_FREE)
-      return 1;
-  return 0;
+  return rhizome_active_fetch_count() != 0;
 }
 
 /* Return true if there are any fetches queued.
@@ -270,7 +613,7 @@ int rhizome_any_fetch_queued()
 {
   int i;
   for (i = 0; i < NQUEUES; ++i)
-    if (rhizome_fetch_queues[i].candidate_queue[0].manifest)
+    if (rhizome_fetch_queues[i].heap[HEAP_BEST].count)
       return 1;
   return 0;
 }
@@ -337,7 +680,12 @@ int rhizome_manifest_version_cache_lookup(rhizome_manifest *m)
   
   // skip the cache for now
   long long dbVersion = -1;
-  if (sqlite_exec_int64(&dbVersion, "SELECT version FROM MANIFESTS WHERE id='%s';", id) == -1)
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_cached(&retry, "SELECT version FROM MANIFESTS WHERE id=?1;");
+  if (!statement)
+    return WHY("Select failure");
+  sqlite3_bind_text(statement, 1, id, -1, SQLITE_STATIC);
+  if (sqlite_exec_int64_prepared(&retry, &dbVersion, statement) == -1)
     return WHY("Select failure");
   if (dbVersion >= m->version) {
     if (0) WHYF("We already have %s (%lld vs %lld)", id, dbVersion, m->version);
@@ -533,18 +881,85 @@ static int rhizome_import_received_bundle(struct rhizome_manifest *m)
   return rhizome_bundle_import(m, m->ttl - 1 /* TTL */);
 }
 
+static void rhizome_fetch_merkle_release(struct rhizome_fetch_slot *slot)
+{
+  if (slot->merkleLeaves)
+    free(slot->merkleLeaves);
+  slot->merkleLeaves = NULL;
+  slot->merkleState = RHIZOME_MERKLE_NONE;
+  slot->merkleBlockBytes = 0;
+}
+
+/* Prepare to verify a payload against the Merkle root in its manifest, if it has one.  If an
+ * earlier fetch of the same payload was interrupted, its leaves are loaded from the store and the
+ * part of the payload that it verified is reopened.  Returns 0 if the write was resumed, 1 if the
+ * payload must be written from the start.
+ */
+static int rhizome_fetch_merkle_open(struct rhizome_fetch_slot *slot)
+{
+  rhizome_manifest *m = slot->manifest;
+  rhizome_fetch_merkle_release(slot);
+  slot->merkleBlockSenders = 0;
+  slot->merkleBlockOverheard = 0;
+  slot->merkleRetrySource = -1;
+  slot->merkleFailures = 0;
+  slot->merkleVerified = 0;
+  slot->merkleRequestEnd = 0;
+  slot->merkleRequestTries = 0;
+  slot->merkleLeavesReceived = 0;
+  if (!rhizome_manifest_merkle_root(m, slot->merkleRoot))
+    return 1;
+  slot->merkleLeafCount = rhizome_merkle_leaf_count(m->fileLength);
+
+  unsigned char *leaves = NULL;
+  int count = 0;
+  int64_t verified = 0;
+  if (rhizome_merkle_load(m->fileHexHash, &leaves, &count, &verified) == 0) {
+    unsigned char root[RHIZOME_MERKLE_HASH_BYTES];
+    if (count == slot->merkleLeafCount && rhizome_merkle_root(leaves, count, root) == 0
+	&& memcmp(root, slot->merkleRoot, sizeof root) == 0) {
+      slot->merkleLeaves = leaves;
+      slot->merkleLeavesReceived = count;
+      slot->merkleState = RHIZOME_MERKLE_VERIFYING;
+      if (rhizome_resume_write(&slot->write_state, m->fileHexHash, m->fileLength, leaves, count, verified) == 0) {
+	slot->merkleVerified = slot->write_state.file_offset;
+	merkle_fetches_resumed++;
+	return 0;
+      }
+      return 1;
+    }
+    free(leaves);
+  }
+  if ((slot->merkleLeaves = emalloc(slot->merkleLeafCount * RHIZOME_MERKLE_HASH_BYTES)) != NULL)
+    slot->merkleState = RHIZOME_MERKLE_FETCHING;
+  return 1;
+}
+
 static int schedule_fetch(struct rhizome_fetch_slot *slot)
 {
   IN();
   int sock = -1;
-  /* TODO Don't forget to implement resume */
+  int resumed = 0;
   slot->start_time=gettime_ms();
+  slot->mdpWritingSource=-1;
+  slot->mdpBannedCount=0;
   if (create_rhizome_import_dir() == -1)
     RETURN(WHY("Unable to create import directory"));
   if (slot->manifest) {
-    if (rhizome_open_write(&slot->write_state, slot->manifest->fileHexHash, slot->manifest->fileLength, RHIZOME_PRIORITY_DEFAULT))
-      RETURN(-1);
+    resumed = rhizome_fetch_merkle_open(slot) == 0;
+    if (!resumed) {
+      if (rhizome_open_write(&slot->write_state, slot->manifest->fileHexHash, slot->manifest->fileLength, RHIZOME_PRIORITY_DEFAULT)) {
+	rhizome_fetch_merkle_release(slot);
+	RETURN(-1);
+      }
+      // build the tree while writing, so that the leaves can be checked and served to other peers
+      if (rhizome_manifest_merkle_root(slot->manifest, slot->write_state.merkle.root))
+	slot->write_state.merkle.enabled = slot->write_state.merkle.have_root = 1;
+    }
+    // store the payload from the background writer, so big transfers don't stall the event loop
+    slot->write_state.async=1;
   } else {
+    slot->merkleState=RHIZOME_MERKLE_NONE;
     slot->write_state.blob_rowid=-1;
     slot->write_state.file_offset=0;
     slot->write_state.file_length=-1;
@@ -553,7 +968,8 @@ static int schedule_fetch(struct rhizome_fetch_slot *slot)
   slot->request_ofs = 0;
   slot->state = RHIZOME_FETCH_CONNECTING;
 
-  if (slot->peer_ipandport.sin_family == AF_INET && slot->peer_ipandport.sin_port) {
+  // The HTTP server can only send whole payloads, so a resumed fetch continues over MDP.
+  if (!resumed && slot->peer_ipandport.sin_family == AF_INET && slot->peer_ipandport.sin_port) {
     /* Transfer via HTTP over IPv4 */
     if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
       WHY_perror("socket");
@@ -671,8 +1087,8 @@ rhizome_fetch(struct rhizome_fetch_slot *slot, rhizome_manifest *m, const struct
   */
 
   if (config.debug.rhizome_rx)
-    DEBUGF("Fetching bundle slot=%d bid=%s version=%lld size=%lld peerip=%s",
-	   slotno(slot),
+    DEBUGF("Fetching bundle slot=%d.%d bid=%s version=%lld size=%lld peerip=%s",
+	   slotno(slot), slot->index,
 	   bid,
 	   m->version,
 	   m->fileLength,
@@ -702,11 +1118,12 @@ rhizome_fetch(struct rhizome_fetch_slot *slot, rhizome_manifest *m, const struct
    * This avoids the problem of indefinite postponement of fetching if new versions are constantly
    * being published faster than we can fetch them.
    */
-  int i;
-  for (i = 0; i < NQUEUES; ++i) {
-    struct rhizome_fetch_slot *as = &rhizome_fetch_queues[i].active;
+  int i, j;
+  for (i = 0; i < NQUEUES; ++i)
+  for (j = 0; j < rhizome_fetch_queues[i].slot_count; ++j) {
+    struct rhizome_fetch_slot *as = rhizome_fetch_queues[i].slots[j];
     const rhizome_manifest *am = as->manifest;
-    if (as->state != RHIZOME_FETCH_FREE && memcmp(m->cryptoSignPublic, am->cryptoSignPublic, RHIZOME_MANIFEST_ID_BYTES) == 0) {
+    if (as->state != RHIZOME_FETCH_FREE && am && memcmp(m->cryptoSignPublic, am->cryptoSignPublic, RHIZOME_MANIFEST_ID_BYTES) == 0) {
       if (am->version < m->version) {
 	if (config.debug.rhizome_rx)
 	  DEBUGF("   fetch already in progress -- older version");
@@ -733,12 +1150,13 @@ rhizome_fetch(struct rhizome_fetch_slot *slot, rhizome_manifest *m, const struct
   }
 
   // Fetch the file, unless already queued.
-  for (i = 0; i < NQUEUES; ++i) {
-    struct rhizome_fetch_slot *s = &rhizome_fetch_queues[i].active;
+  for (i = 0; i < NQUEUES; ++i)
+  for (j = 0; j < rhizome_fetch_queues[i].slot_count; ++j) {
+    struct rhizome_fetch_slot *s = rhizome_fetch_queues[i].slots[j];
     const rhizome_manifest *sm = s->manifest;
-    if (s->state != RHIZOME_FETCH_FREE && strcasecmp(m->fileHexHash, sm->fileHexHash) == 0) {
+    if (s->state != RHIZOME_FETCH_FREE && sm && strcasecmp(m->fileHexHash, sm->fileHexHash) == 0) {
       if (config.debug.rhizome_rx)
-	DEBUGF("   fetch already in progress, slot=%d filehash=%s", i, m->fileHexHash);
+	DEBUGF("   fetch already in progress, slot=%d.%d filehash=%s", i, j, m->fileHexHash);
       return SAMEPAYLOAD;
     }
   }
@@ -770,9 +1188,9 @@ rhizome_fetch(struct rhizome_fetch_slot *slot, rhizome_manifest *m, const struct
   if (schedule_fetch(slot) == -1)
     return -1;
   if (config.debug.rhizome_rx)
-    DEBUGF("   started fetch bid %s version 0x%llx into %s, slot=%d filehash=%s",
+    DEBUGF("   started fetch bid %s version 0x%llx into %s, slot=%d.%d filehash=%s",
 	   alloca_tohex_bid(slot->bid), (long long) slot->bidVersion,
-	   alloca_str_toprint(slot->manifest->dataFileName), slotno(slot), m->fileHexHash);
+	   alloca_str_toprint(slot->manifest->dataFileName), slotno(slot), slot->index, m->fileHexHash);
   return STARTED;
 }
 
@@ -819,7 +1237,8 @@ rhizome_fetch_request_manifest_by_prefix(const struct sockaddr_in *peerip,
 }
 
 /* Activate the next fetch for the given slot.  This takes the next job from the head of the slot's
- * own queue.  If there is none, then takes jobs from other queues.
+ * own queue.  If there is none, then takes jobs from other queues.  Skips candidates from peers
+ * that already have rhizome.fetch_slots.per_peer fetches active in the slot's queue.
  *
  * @author Andrew Bettison <andrew@servalproject.com>
  */
@@ -827,18 +1246,28 @@ static void rhizome_start_next_queued_fetch(struct rhizome_fetch_slot *slot)
 {
   IN();
   struct rhizome_fetch_queue *q;
-  for (q = (struct rhizome_fetch_queue *) slot; q >= rhizome_fetch_queues; --q) {
-    int i = 0;
-    struct rhizome_fetch_candidate *c;
-    while (i < q->candidate_queue_size && (c = &q->candidate_queue[i])->manifest) {
+  struct rhizome_fetch_candidate *held = NULL;
+  for (q = slot->queue; q >= rhizome_fetch_queues; --q) {
+    while (q->heap[HEAP_BEST].count) {
+      // Take the candidate out of the heaps before trying it, in case the attempt closes the slot
+      // and recursively starts another queued fetch.
+      struct rhizome_fetch_candidate *c = q->heap[HEAP_BEST].items[0];
+      rhizome_fetch_heap_remove(q, c);
+      if (rhizome_fetch_peer_count(slot->queue, c->peer_sid) >= config.rhizome.fetch_slots.per_peer) {
+	c->held_next = held;
+	held = c;
+	continue;
+      }
       int result = rhizome_fetch(slot, c->manifest, &c->peer_ipandport,c->peer_sid);
       switch (result) {
       case SLOTBUSY:
-	OUT(); return;
+	c->held_next = held;
+	held = c;
+	goto done;
       case STARTED:
 	c->manifest = NULL;
-	rhizome_fetch_unqueue(q, i);
-	OUT(); return;
+	rhizome_fetch_unqueue(c);
+	goto done;
       case IMPORTED:
       case SAMEBUNDLE:
       case SAMEPAYLOAD:
@@ -846,20 +1275,28 @@ static void rhizome_start_next_queued_fetch(struct rhizome_fetch_slot *slot)
       case NEWERBUNDLE:
       default:
 	// Discard the candidate fetch and loop to try the next in queue.
-	rhizome_fetch_unqueue(q, i);
+	rhizome_fetch_unqueue(c);
 	break;
       case OLDERBUNDLE:
-	// Do not un-queue, so that when the fetch of the older bundle finishes, we will start
+	// Keep it queued, so that when the fetch of the older bundle finishes, we will start
 	// fetching a newer one.
-	++i;
+	c->held_next = held;
+	held = c;
 	break;
       }
     }
   }
+done:
+  while (held) {
+    struct rhizome_fetch_candidate *c = held;
+    held = c->held_next;
+    if (rhizome_fetch_heap_insert(c->queue, c) == -1)
+      rhizome_fetch_unqueue(c);
+  }
   OUT();
 }
 
-/* Called soon after any fetch candidate is queued, to start any queued fetches.
+/* Called soon after any fetch candidate is queued, to start queued fetches in every idle slot.
  *
  * @author Andrew Bettison <andrew@servalproject.com>
  */
@@ -867,8 +1304,14 @@ static void rhizome_start_next_queued_fetches(struct sched_ent *alarm)
 {
   IN();
   int i;
-  for (i = 0; i < NQUEUES; ++i)
-    rhizome_start_next_queued_fetch(&rhizome_fetch_queues[i].active);
+  for (i = 0; i < NQUEUES; ++i) {
+    struct rhizome_fetch_slot *slot;
+    while ((slot = rhizome_fetch_queue_free_slot(&rhizome_fetch_queues[i]))) {
+      rhizome_start_next_queued_fetch(slot);
+      if (slot->state == RHIZOME_FETCH_FREE)
+	break;
+    }
+  }
   OUT();
 }
 
@@ -877,19 +1320,15 @@ rhizome_manifest * rhizome_fetch_search(unsigned char *id, int prefix_length){
   int i, j;
   for (i = 0; i < NQUEUES; ++i) {
     struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-    
-    if (q->active.state != RHIZOME_FETCH_FREE && 
-	memcmp(id, q->active.manifest->cryptoSignPublic, prefix_length) == 0)
-      return q->active.manifest;
-      
-    for (j = 0; j < q->candidate_queue_size; j++) {
-      struct rhizome_fetch_candidate *c = &q->candidate_queue[j];
-      if (c->manifest && memcmp(id, c->manifest->cryptoSignPublic, prefix_length) == 0)
-	return c->manifest;
+    for (j = 0; j < q->slot_count; ++j) {
+      struct rhizome_fetch_slot *s = q->slots[j];
+      if (s->state != RHIZOME_FETCH_FREE && s->manifest &&
+	  memcmp(id, s->manifest->cryptoSignPublic, prefix_length) == 0)
+	return s->manifest;
     }
   }
-  
-  return NULL;
+  struct rhizome_fetch_candidate *c = rhizome_fetch_candidate_find(id, prefix_length);
+  return c ? c->manifest : NULL;
 }
 
 /* Do we have space to add a fetch candidate of this size? */
@@ -897,14 +1336,8 @@ int rhizome_fetch_has_queue_space(unsigned char log2_size){
   int i;
   for (i = 0; i < NQUEUES; ++i) {
     struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-    if (log2_size < q->log_size_threshold){
-      // is there an empty candidate?
-      int j=0;
-      for (j=0;j < q->candidate_queue_size;j++)
-	if (!q->candidate_queue[j].manifest)
-	  return 1;
-      return 0;
-    }
+    if (log2_size < q->log_size_threshold)
+      return q->heap[HEAP_BEST].count < *q->capacity;
   }
   return 0;
 }
@@ -949,6 +1382,11 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
     RETURN(-1);
   }
 
+  if (rhizome_fetch_add_source(m->cryptoSignPublic, RHIZOME_MANIFEST_ID_BYTES, m->version, peersid)) {
+    rhizome_manifest_free(m);
+    RETURN(0);
+  }
+
   if (config.debug.rhizome_rx) {
     long long stored_version;
     if (sqlite_exec_int64(&stored_version, "select version from manifests where id='%s'", bid) > 0)
@@ -956,7 +1394,7 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
   }
 
   if (m->fileLength == 0) {
-    if (rhizome_manifest_verify(m) != 0) {
+    if (!m->selfSigned && rhizome_manifest_verify(m) != 0) {
       WHY("Error verifying manifest when considering for import");
       /* Don't waste time looking at this manifest again for a while */
       rhizome_queue_ignore_manifest(m->cryptoSignPublic,
@@ -979,46 +1417,43 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
   // Search all the queues for the same manifest (it could be in any queue because its payload size
   // may have changed between versions.) If a newer or the same version is already queued, then
   // ignore this one.  Otherwise, unqueue all older candidates.
-  int ci = -1;
-  int i, j;
-  for (i = 0; i < NQUEUES; ++i) {
-    struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-    for (j = 0; j < q->candidate_queue_size; ) {
-      struct rhizome_fetch_candidate *c = &q->candidate_queue[j];
-      if (c->manifest) {
-	if (memcmp(m->cryptoSignPublic, c->manifest->cryptoSignPublic, RHIZOME_MANIFEST_ID_BYTES) == 0) {
-	  if (c->manifest->version >= m->version) {
-	    rhizome_manifest_free(m);
-	    RETURN(0);
-	  }
-	  if (!m->selfSigned && rhizome_manifest_verify(m)) {
-	    WHY("Error verifying manifest when considering queuing for import");
-	    /* Don't waste time looking at this manifest again for a while */
-	    rhizome_queue_ignore_manifest(m->cryptoSignPublic,
-					  crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES, 60000);
-	    rhizome_manifest_free(m);
-	    RETURN(-1);
-	  }
-	  rhizome_fetch_unqueue(q, j);
-	} else {
-	  if (ci == -1 && q == qi && c->priority < priority)
-	    ci = j;
-	  ++j;
-	}
-      } else {
-	if (ci == -1 && q == qi)
-	  ci = j;
-	break;
+  struct rhizome_fetch_candidate *c;
+  int verified = 0;
+  while ((c = rhizome_fetch_candidate_find(m->cryptoSignPublic, RHIZOME_MANIFEST_ID_BYTES))) {
+    if (c->manifest->version >= m->version) {
+      rhizome_manifest_free(m);
+      RETURN(0);
+    }
+    if (!verified) {
+      if (!m->selfSigned && rhizome_manifest_verify(m)) {
+	WHY("Error verifying manifest when considering queuing for import");
+	/* Don't waste time looking at this manifest again for a while */
+	rhizome_queue_ignore_manifest(m->cryptoSignPublic,
+				      crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES, 60000);
+	rhizome_manifest_free(m);
+	RETURN(-1);
       }
+      verified = 1;
     }
+    rhizome_fetch_unqueue(c);
   }
-  // No duplicate was found, so if no free queue place was found either then bail out.
-  if (ci == -1) {
-    rhizome_manifest_free(m);
-    RETURN(1);
+
+  // If the queue is full, make room by dropping the worst candidate, unless this one would be
+  // worse still.
+  struct rhizome_fetch_candidate probe = { .manifest = m, .priority = priority, .seq = candidate_seq };
+  while (qi->heap[HEAP_BEST].count >= *qi->capacity) {
+    struct rhizome_fetch_candidate *worst = qi->heap[HEAP_WORST].items[0];
+    qi->dropped++;
+    if (!rhizome_fetch_candidate_before(&probe, worst)) {
+      if (config.debug.rhizome_rx)
+	DEBUGF("   queue[%d] is full", qi - rhizome_fetch_queues);
+      rhizome_manifest_free(m);
+      RETURN(1);
+    }
+    rhizome_fetch_unqueue(worst);
   }
 
-  if (!m->selfSigned && rhizome_manifest_verify(m)) {
+  if (!verified && !m->selfSigned && rhizome_manifest_verify(m)) {
     WHY("Error verifying manifest when considering queuing for import");
     /* Don't waste time looking at this manifest again for a while */
     rhizome_queue_ignore_manifest(m->cryptoSignPublic,
@@ -1027,21 +1462,18 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
     RETURN(-1);
   }
 
-  struct rhizome_fetch_candidate *c = rhizome_fetch_insert(qi, ci);
-  c->manifest = m;
-  c->priority = priority;
-  c->peer_ipandport = *peerip;
-  bcopy(peersid,c->peer_sid,SID_SIZE);
+  if (rhizome_fetch_enqueue(qi, m, priority, peerip, peersid) == NULL) {
+    rhizome_manifest_free(m);
+    RETURN(-1);
+  }
 
   if (config.debug.rhizome_rx) {
     DEBUG("Rhizome fetch queues:");
     int i, j;
     for (i = 0; i < NQUEUES; ++i) {
-      struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-      for (j = 0; j < q->candidate_queue_size; ++j) {
-	struct rhizome_fetch_candidate *c = &q->candidate_queue[j];
-	if (!c->manifest)
-	  break;
+      struct rhizome_fetch_heap *h = &rhizome_fetch_queues[i].heap[HEAP_BEST];
+      for (j = 0; j < h->count; ++j) {
+	struct rhizome_fetch_candidate *c = h->items[j];
 	DEBUGF("%d:%d manifest=%p bid=%s priority=%d size=%lld", i, j,
 	    c->manifest,
 	    alloca_tohex_bid(c->manifest->cryptoSignPublic),
@@ -1064,37 +1496,130 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
   OUT();
 }
 
+/* Release what is left of a closed slot, once the writer has finished with its payload.
+ */
+static int rhizome_fetch_release(struct rhizome_fetch_slot *slot)
+{
+  unschedule(&slot->write_alarm);
+
+  /* Free ephemeral data */
+  if (slot->manifest)
+    rhizome_manifest_free(slot->manifest);
+  slot->manifest = NULL;
+
+  // Keep the verified part of an unfinished payload, so that the next fetch can resume from there,
+  // unless the writer was told to discard it.
+  if (slot->write_state.buffer) {
+    if (slot->merkleState == RHIZOME_MERKLE_VERIFYING && slot->merkleVerified > 0 && !slot->write_state.cancel)
+      rhizome_suspend_write(&slot->write_state, slot->merkleVerified, slot->merkleLeaves, slot->merkleLeafCount);
+    else
+      rhizome_fail_write(&slot->write_state);
+  }
+  rhizome_fetch_merkle_release(slot);
+
+  if (slot->mdpRXBuffer) {
+    free(slot->mdpRXBuffer);
+    slot->mdpRXBuffer = NULL;
+  }
+
+  // Release the fetch slot.
+  slot->state = RHIZOME_FETCH_FREE;
+
+  // Activate the next queued fetch that is eligible for this slot.  Try starting candidates from
+  // all queues with the same or smaller size thresholds until the slot is taken.  Slots beyond the
+  // configured number are left idle.
+  if (slot->index < *slot->queue->max_slots)
+    rhizome_start_next_queued_fetch(slot);
+
+  return 0;
+}
+
+static void rhizome_fetch_closed(struct sched_ent *alarm)
+{
+  struct rhizome_fetch_slot *slot = alarm->context;
+  if (slot->state != RHIZOME_FETCH_CLOSING) {
+    DEBUGF("Stale alarm triggered on idle/reclaimed slot. Ignoring");
+    return;
+  }
+  rhizome_fetch_release(slot);
+}
+
 static int rhizome_fetch_close(struct rhizome_fetch_slot *slot)
 {
   if (config.debug.rhizome_rx)
-    DEBUGF("close Rhizome fetch slot=%d", slotno(slot));
+    DEBUGF("close Rhizome fetch slot=%d.%d", slotno(slot), slot->index);
   assert(slot->state != RHIZOME_FETCH_FREE);
+  assert(slot->state != RHIZOME_FETCH_CLOSING);
 
   /* close socket and stop watching it */
   unschedule(&slot->alarm);
   if (slot->alarm.poll.fd>=0){
-    unwatch(&slot->alarm);
+    if (is_watching(&slot->alarm))
+      unwatch(&slot->alarm);
     close(slot->alarm.poll.fd);
   }
   slot->alarm.poll.fd = -1;
   slot->alarm.function=NULL;
 
-  /* Free ephemeral data */
-  if (slot->manifest)
-    rhizome_manifest_free(slot->manifest);
-  slot->manifest = NULL;
-
-  if (slot->write_state.buffer)
-    rhizome_fail_write(&slot->write_state);
-
-  // Release the fetch slot.
-  slot->state = RHIZOME_FETCH_FREE;
+  // The slot, and the write in it, stay ours until the writer has finished with anything already
+  // queued.  The manifest is kept until then too, so that the same payload is not fetched again
+  // while it is being discarded.
+  unschedule(&slot->write_alarm);
+  if (slot->write_state.buffer) {
+    int keep = slot->merkleState == RHIZOME_MERKLE_VERIFYING && slot->merkleVerified > 0
+      && rhizome_write_truncate(&slot->write_state, slot->merkleVerified) == 0;
+    slot->write_alarm.function = rhizome_fetch_closed;
+    slot->write_alarm.stats = &fetch_closed_stats;
+    if (rhizome_write_when_idle(&slot->write_state, !keep, &slot->write_alarm)) {
+      slot->state = RHIZOME_FETCH_CLOSING;
+      return 0;
+    }
+  }
+  return rhizome_fetch_release(slot);
+}
 
-  // Activate the next queued fetch that is eligible for this slot.  Try starting candidates from
-  // all queues with the same or smaller size thresholds until the slot is taken.
-  rhizome_start_next_queued_fetch(slot);
+/* Carry on receiving once the writer has room for more of the payload.  Time spent waiting for the
+ * writer does not count towards the idle timeout.
+ */
+static void rhizome_fetch_write_ready(struct sched_ent *alarm)
+{
+  struct rhizome_fetch_slot *slot = alarm->context;
+  switch (slot->state) {
+  case RHIZOME_FETCH_RXFILE:
+    slot->last_write_time = gettime_ms();
+    unschedule(&slot->alarm);
+    slot->alarm.alarm = slot->last_write_time + config.rhizome.idle_timeout;
+    slot->alarm.deadline = slot->alarm.alarm + config.rhizome.idle_timeout;
+    schedule(&slot->alarm);
+    watch(&slot->alarm);
+    break;
+  case RHIZOME_FETCH_RXFILEMDP:
+    slot->last_write_time = gettime_ms();
+    rhizome_fetch_mdp_requestblocks(slot);
+    break;
+  default:
+    DEBUGF("Stale alarm triggered on idle/reclaimed slot. Ignoring");
+  }
+}
 
-  return 0;
+/* Returns 1 if the writer's queue is full, after arranging for rhizome_fetch_write_ready() to be
+ * called once it has room.  Until then the socket is not read, and no timeout is pending.
+ */
+static int rhizome_fetch_wait_for_writer(struct rhizome_fetch_slot *slot)
+{
+  int paused = slot->write_state.ready_alarm != NULL;
+  slot->write_alarm.function = rhizome_fetch_write_ready;
+  slot->write_alarm.stats = &fetch_write_ready_stats;
+  if (!rhizome_write_wait(&slot->write_state, &slot->write_alarm))
+    return 0;
+  unschedule(&slot->alarm);
+  if (slot->alarm.poll.fd>=0 && is_watching(&slot->alarm))
+    unwatch(&slot->alarm);
+  if (!paused && config.debug.rhizome_rx)
+    DEBUGF("Writer queue is full, pausing slot=%d.%d at %lld of %lld bytes", slotno(slot), slot->index,
+	   (long long)(slot->write_state.file_offset + slot->write_state.data_size),
+	   (long long)slot->write_state.file_length);
+  return 1;
 }
 
 static void rhizome_fetch_mdp_slot_callback(struct sched_ent *alarm)
@@ -1121,8 +1646,28 @@ static void rhizome_fetch_mdp_slot_callback(struct sched_ent *alarm)
   if (config.debug.rhizome_rx)
     DEBUGF("Timeout: Resending request for slot=0x%p (%d of %d received)",
 	   slot,slot->write_state.file_offset + slot->write_state.data_size,slot->write_state.file_length);
-  if (slot->bidP)
+  if (slot->bidP && slot->merkleState == RHIZOME_MERKLE_FETCHING) {
+    // Peers that cannot send the leaves can still send the payload, checked as a whole at the end.
+    if (++slot->merkleRequestTries >= RHIZOME_MERKLE_REQUEST_TRIES || now - slot->last_write_time > slot->mdpIdleTimeout / 2) {
+      if (config.debug.rhizome_rx)
+	DEBUGF("No Merkle leaves for bid %s, fetching without per-block verification", alloca_tohex_bid(slot->bid));
+      rhizome_fetch_merkle_release(slot);
+      rhizome_fetch_mdp_startblocks(slot);
+    } else
+      rhizome_fetch_mdp_requestleaves(slot);
+  }
+  else if (slot->bidP) {
+    // Assume that everything still requested was lost, and back off.
+    if (slot->mdpRXRequested) {
+      mdp_timeouts++;
+      rhizome_fetch_mdp_source_timeout(slot);
+      slot->mdpRXRequested = 0;
+      slot->mdpRTTBlock = RHIZOME_MDP_NO_BLOCK;
+      slot->mdpRTO = slot->mdpRTO * 2 > RHIZOME_MDP_MAX_RTO ? RHIZOME_MDP_MAX_RTO : slot->mdpRTO * 2;
+      rhizome_fetch_mdp_shrink_window(slot);
+    }
     rhizome_fetch_mdp_requestblocks(slot);
+  }
   else
     rhizome_fetch_mdp_requestmanifest(slot);
   OUT();
@@ -1130,60 +1675,193 @@ static void rhizome_fetch_mdp_slot_callback(struct sched_ent *alarm)
 
 static int rhizome_fetch_mdp_touch_timeout(struct rhizome_fetch_slot *slot)
 {
-  // 266ms @ 1mbit (WiFi broadcast speed) = 32x1024 byte packets.
-  // But on a packet radio interface at perhaps 50kbit, this is clearly
-  // a bad policy.  Ideally we should know about the interface speed
-  // and adjust behaviour accordingly. Also the packet size should be smaller
-  // on lossy links.  1K packets seem to get through only very rarely.
-  // For now, we will just make the timeout 1 second from the time of the last
-  // received block.
+  // Resend the request if nothing more arrives within the retransmission timeout, which starts at
+  // one second and follows the measured round trip time once the first blocks arrive.
   unschedule(&slot->alarm);
   slot->alarm.stats=&rfmsc_stats;
   slot->alarm.function = rhizome_fetch_mdp_slot_callback;
-  slot->alarm.alarm=gettime_ms()+1000; 
+  slot->alarm.alarm=gettime_ms()+slot->mdpRTO;
   slot->alarm.deadline=slot->alarm.alarm+500;
   schedule(&slot->alarm);
   return 0;
 }
 
-static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
+static uint64_t mdp_block_bit(uint64_t block)
+{
+  return 1ull << (block % RHIZOME_MDP_MAX_WINDOW);
+}
+
+/* Return how much of the payload has been received in order, including the bytes of a Merkle block
+ * that are held until the block can be verified.
+ */
+static uint64_t rhizome_fetch_position(const struct rhizome_fetch_slot *slot)
+{
+  return slot->write_state.file_offset + slot->write_state.data_size + slot->merkleBlockBytes;
+}
+
+/* Return the number of the block at the current write position.
+ */
+static uint64_t rhizome_fetch_mdp_next_block(const struct rhizome_fetch_slot *slot)
+{
+  return (rhizome_fetch_position(slot) - slot->mdpRXBase) / slot->mdpRXBlockLength;
+}
+
+static int rhizome_fetch_mdp_requested_count(const struct rhizome_fetch_slot *slot)
+{
+  int count = 0;
+  uint64_t bits;
+  for (bits = slot->mdpRXRequested; bits; bits &= bits - 1)
+    ++count;
+  return count;
+}
+
+static void rhizome_fetch_mdp_shrink_window(struct rhizome_fetch_slot *slot)
+{
+  slot->mdpWindow /= 2;
+  if (slot->mdpWindow < RHIZOME_MDP_MIN_WINDOW)
+    slot->mdpWindow = RHIZOME_MDP_MIN_WINDOW;
+  slot->mdpCleanBlocks = 0;
+  if (config.debug.rhizome_rx)
+    DEBUGF("MDP block window shrunk to %d, rto=%dms", slot->mdpWindow, slot->mdpRTO);
+}
+
+/* Update the smoothed round trip time and retransmission timeout, as TCP does (RFC 6298).
+ */
+static void rhizome_fetch_mdp_rtt_sample(struct rhizome_fetch_slot *slot, int rtt)
+{
+  if (rtt < 1)
+    rtt = 1;
+  if (slot->mdpSRTT == 0) {
+    slot->mdpSRTT = rtt;
+    slot->mdpRTTVar = rtt / 2;
+  } else {
+    int err = rtt - slot->mdpSRTT;
+    slot->mdpSRTT += err / 8;
+    slot->mdpRTTVar += ((err < 0 ? -err : err) - slot->mdpRTTVar) / 4;
+  }
+  slot->mdpRTO = slot->mdpSRTT + 4 * slot->mdpRTTVar;
+  if (slot->mdpRTO < RHIZOME_MDP_MIN_RTO)
+    slot->mdpRTO = RHIZOME_MDP_MIN_RTO;
+  if (slot->mdpRTO > RHIZOME_MDP_MAX_RTO)
+    slot->mdpRTO = RHIZOME_MDP_MAX_RTO;
+}
+
+/* Send one request for blocks to one source.  A set bit in the bitmaps tells the sender to skip
+ * that block.
+ */
+static void rhizome_fetch_mdp_send_request(struct rhizome_fetch_slot *slot, const unsigned char *sid,
+					   uint32_t bitmap, uint32_t bitmap_high, int count)
 {
-  IN();
-  // only issue new requests every 133ms.  
-  // we automatically re-issue once we have received all packets in this
-  // request also, so if there is no packet loss, we can go substantially
-  // faster.  Optimising behaviour when there is no packet loss is an
-  // outstanding task.
-  
   overlay_mdp_frame mdp;
 
   bzero(&mdp,sizeof(mdp));
   bcopy(my_subscriber->sid,mdp.out.src.sid,SID_SIZE);
   mdp.out.src.port=MDP_PORT_RHIZOME_RESPONSE;
-  bcopy(slot->peer_sid,mdp.out.dst.sid,SID_SIZE);
+  bcopy(sid,mdp.out.dst.sid,SID_SIZE);
   mdp.out.dst.port=MDP_PORT_RHIZOME_REQUEST;
   mdp.out.ttl=1;
   mdp.packetTypeAndFlags=MDP_TX;
 
   mdp.out.queue=OQ_ORDINARY;
-  mdp.out.payload_length=RHIZOME_MANIFEST_ID_BYTES+8+8+4+2;
+  mdp.out.payload_length=RHIZOME_MDP_REQUEST_WINDOW_BYTES;
   bcopy(slot->bid,&mdp.out.payload[0],RHIZOME_MANIFEST_ID_BYTES);
 
   write_uint64(&mdp.out.payload[RHIZOME_MANIFEST_ID_BYTES],slot->bidVersion);
-  write_uint64(&mdp.out.payload[RHIZOME_MANIFEST_ID_BYTES+8],slot->write_state.file_offset + slot->write_state.data_size);
-  write_uint32(&mdp.out.payload[RHIZOME_MANIFEST_ID_BYTES+8+8],slot->mdpRXBitmap);
-  write_uint16(&mdp.out.payload[RHIZOME_MANIFEST_ID_BYTES+8+8+4],slot->mdpRXBlockLength);  
+  write_uint64(&mdp.out.payload[RHIZOME_MANIFEST_ID_BYTES+8],rhizome_fetch_position(slot));
+  write_uint32(&mdp.out.payload[RHIZOME_MANIFEST_ID_BYTES+8+8],bitmap);
+  write_uint16(&mdp.out.payload[RHIZOME_MANIFEST_ID_BYTES+8+8+4],slot->mdpRXBlockLength);
+  write_uint16(&mdp.out.payload[RHIZOME_MDP_REQUEST_BYTES],slot->mdpWindow);
+  write_uint32(&mdp.out.payload[RHIZOME_MDP_REQUEST_BYTES+2],bitmap_high);
 
   if (config.debug.rhizome_tx)
-    DEBUGF("src sid=%s, dst sid=%s, mdpRXWindowStart=0x%x",
+    DEBUGF("src sid=%s, dst sid=%s, mdpRXWindowStart=0x%x, window=%d, requesting %d blocks",
 	   alloca_tohex_sid(mdp.out.src.sid),alloca_tohex_sid(mdp.out.dst.sid),
-	   slot->write_state.file_offset + slot->write_state.data_size);
+	   (int)rhizome_fetch_position(slot), slot->mdpWindow, count);
 
   overlay_mdp_dispatch(&mdp,0 /* system generated */,NULL,0);
-  
-  // remember when we sent the request so that we can adjust the inter-request
-  // interval based on how fast the packets arrive.
-  slot->mdpResponsesOutstanding=32; // TODO: set according to bitmap
+  mdp_requests++;
+}
+
+/* Ask source s for the wanted blocks from index i up to range_end.
+ */
+static void rhizome_fetch_mdp_request_range(struct rhizome_fetch_slot *slot, int s, uint64_t next,
+					    const uint64_t *wanted, int i, int range_end)
+{
+  uint32_t bitmap = 0xFFFFFFFF, bitmap_high = 0xFFFFFFFF;
+  int n = range_end - i;
+  for (; i < range_end; ++i) {
+    int offset = wanted[i] - next;
+    if (offset < 32)
+      bitmap &= ~(1u << (31 - offset));
+    else
+      bitmap_high &= ~(1u << (63 - offset));
+    slot->mdpBlockSource[wanted[i] % RHIZOME_MDP_MAX_WINDOW] = s;
+  }
+  rhizome_fetch_mdp_send_request(slot, slot->mdpSources[s], bitmap, bitmap_high, n);
+}
+
+/* Request every block in the window that has neither arrived nor is already on its way.  Called
+ * whenever half of the window has arrived, so that the senders always have more to send.  When
+ * several peers hold the bundle, the blocks are shared between them in contiguous ranges, so that
+ * each sender still sends its blocks in order.
+ */
+static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
+{
+  IN();
+  // Ask for no more blocks until the writer has room for them, nor time out the ones in flight.
+  if (rhizome_fetch_wait_for_writer(slot))
+    RETURN(0);
+  uint64_t next = rhizome_fetch_mdp_next_block(slot);
+  uint64_t end = next + slot->mdpWindow;
+  if (slot->write_state.file_length > 0) {
+    uint64_t blocks = (slot->write_state.file_length - slot->mdpRXBase + slot->mdpRXBlockLength - 1) / slot->mdpRXBlockLength;
+    if (end > blocks)
+      end = blocks;
+  }
+
+  uint64_t wanted[RHIZOME_MDP_MAX_WINDOW];
+  uint64_t first_new = RHIZOME_MDP_NO_BLOCK;
+  int count = 0;
+  uint64_t b;
+  for (b = next; b < end; ++b) {
+    uint64_t bit = mdp_block_bit(b);
+    if ((slot->mdpRXReceived | slot->mdpRXRequested) & bit)
+      continue;
+    wanted[count++] = b;
+    slot->mdpRXRequested |= bit;
+    if (b >= slot->mdpRequestedEnd) {
+      if (first_new == RHIZOME_MDP_NO_BLOCK)
+	first_new = b;
+      slot->mdpRequestedEnd = b + 1;
+    }
+  }
+  if (count == 0) {
+    rhizome_fetch_mdp_touch_timeout(slot);
+    RETURN(0);
+  }
+  // Only time blocks that have never been requested before, so that the sample is not confused by
+  // a late reply to an earlier request.
+  if (first_new != RHIZOME_MDP_NO_BLOCK && slot->mdpRTTBlock == RHIZOME_MDP_NO_BLOCK) {
+    slot->mdpRTTBlock = first_new;
+    slot->mdpRequestTime = gettime_ms();
+  }
+
+  // A Merkle block being asked again after it failed is asked of one source only, so that the
+  // next failure can be blamed.
+  int first = 0;
+  if (slot->merkleRetrySource >= 0) {
+    while (first < count && wanted[first] < slot->merkleRetryEnd)
+      ++first;
+    if (first)
+      rhizome_fetch_mdp_request_range(slot, slot->merkleRetrySource, next, wanted, 0, first);
+  }
+  int sources = slot->mdpSourceCount < count - first ? slot->mdpSourceCount : count - first;
+  int s, i = first;
+  for (s = 0; s < sources; ++s) {
+    int range_end = first + (count - first) * (s + 1) / sources;
+    rhizome_fetch_mdp_request_range(slot, s, next, wanted, i, range_end);
+    i = range_end;
+  }
 
   rhizome_fetch_mdp_touch_timeout(slot);
   
@@ -1191,6 +1869,341 @@ static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
   OUT();
 }
 
+static int rhizome_fetch_mdp_banned(struct rhizome_fetch_slot *slot, const unsigned char *sid)
+{
+  int i;
+  for (i = 0; i < slot->mdpBannedCount; ++i)
+    if (memcmp(slot->mdpBanned[i], sid, SID_SIZE) == 0)
+      return 1;
+  return 0;
+}
+
+/* Add a peer that holds the given version of a bundle as another source for an MDP fetch of it
+ * that is already under way.  Returns 1 if the peer was added.
+ */
+int rhizome_fetch_add_source(const unsigned char *id, int prefix_length, int64_t version,
+			     const unsigned char peersid[SID_SIZE])
+{
+  int max_sources = config.rhizome.fetch_sources;
+  if (max_sources > RHIZOME_FETCH_MAX_SOURCES)
+    max_sources = RHIZOME_FETCH_MAX_SOURCES;
+  int i, j, s;
+  for (i = 0; i < NQUEUES; ++i) {
+    struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
+    for (j = 0; j < q->slot_count; ++j) {
+      struct rhizome_fetch_slot *slot = q->slots[j];
+      if (slot->state != RHIZOME_FETCH_RXFILEMDP || !slot->bidP || slot->bidVersion != version
+	  || memcmp(id, slot->bid, prefix_length) != 0)
+	continue;
+      for (s = 0; s < slot->mdpSourceCount; ++s)
+	if (memcmp(slot->mdpSources[s], peersid, SID_SIZE) == 0)
+	  return 0;
+      if (slot->mdpSourceCount >= max_sources || memcmp(my_subscriber->sid, peersid, SID_SIZE) == 0
+	  || rhizome_fetch_mdp_banned(slot, peersid))
+	return 0;
+      s = slot->mdpSourceCount++;
+      bcopy(peersid, slot->mdpSources[s], SID_SIZE);
+      slot->mdpSourceMisses[s] = 0;
+      slot->mdpSourceHeard[s] = 0;
+      mdp_sources_added++;
+      if (config.debug.rhizome_rx)
+	DEBUGF("Added source %s for bid %s version 0x%llx, slot=%d.%d now has %d sources",
+	       alloca_tohex_sid(peersid), alloca_tohex_bid(slot->bid), (long long) slot->bidVersion,
+	       slotno(slot), slot->index, slot->mdpSourceCount);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Remove source s from the slot.  Everything that refers to a source by its index is renumbered to
+ * match, so that a later block is never blamed on the peer that moved into the dropped index.
+ * Blocks still requested of the dropped source are requested again from the others.
+ */
+static void rhizome_fetch_mdp_drop_source(struct rhizome_fetch_slot *slot, int s, const char *reason)
+{
+  if (config.debug.rhizome_rx)
+    DEBUGF("Dropped %s source %s, slot=%d.%d", reason, alloca_tohex_sid(slot->mdpSources[s]),
+	   slotno(slot), slot->index);
+  slot->mdpSourceCount--;
+  int i;
+  for (i = s; i < slot->mdpSourceCount; ++i) {
+    bcopy(slot->mdpSources[i + 1], slot->mdpSources[i], SID_SIZE);
+    slot->mdpSourceMisses[i] = slot->mdpSourceMisses[i + 1];
+    slot->mdpSourceHeard[i] = slot->mdpSourceHeard[i + 1];
+  }
+  for (i = 0; i < RHIZOME_MDP_MAX_WINDOW; ++i) {
+    if (slot->mdpBlockSource[i] == s) {
+      slot->mdpRXRequested &= ~(1ull << i);
+      slot->mdpBlockSource[i] = 0;
+    } else if (slot->mdpBlockSource[i] > s)
+      slot->mdpBlockSource[i]--;
+    if (slot->mdpBlockSender[i] == s)
+      slot->mdpBlockSender[i] = -1;
+    else if (slot->mdpBlockSender[i] > s)
+      slot->mdpBlockSender[i]--;
+  }
+  if (slot->mdpWritingSource == s)
+    slot->mdpWritingSource = -1;
+  else if (slot->mdpWritingSource > s)
+    slot->mdpWritingSource--;
+  if (slot->merkleRetrySource == s)
+    slot->merkleRetrySource = -1;
+  else if (slot->merkleRetrySource > s)
+    slot->merkleRetrySource--;
+  unsigned below = (1u << s) - 1;
+  slot->merkleBlockSenders = (slot->merkleBlockSenders & below) | ((slot->merkleBlockSenders >> 1) & ~below);
+  mdp_sources_dropped++;
+}
+
+/* Called when requested blocks have timed out.  Drops any source that has not sent a block for
+ * several timeouts in a row while it had blocks to send, as long as another source remains.
+ */
+static void rhizome_fetch_mdp_source_timeout(struct rhizome_fetch_slot *slot)
+{
+  unsigned char waiting[RHIZOME_FETCH_MAX_SOURCES];
+  bzero(waiting, sizeof waiting);
+  int i;
+  for (i = 0; i < RHIZOME_MDP_MAX_WINDOW; ++i)
+    if (slot->mdpRXRequested & (1ull << i))
+      waiting[slot->mdpBlockSource[i]] = 1;
+  int s;
+  for (s = slot->mdpSourceCount - 1; s >= 0; --s) {
+    if (slot->mdpSourceHeard[s])
+      slot->mdpSourceMisses[s] = 0;
+    else if (waiting[s])
+      slot->mdpSourceMisses[s]++;
+    slot->mdpSourceHeard[s] = 0;
+    if (slot->mdpSourceMisses[s] >= RHIZOME_MDP_SOURCE_MISSES && slot->mdpSourceCount > 1)
+      rhizome_fetch_mdp_drop_source(slot, s, "unresponsive");
+  }
+}
+
+/* Accept a block of the payload being fetched over MDP.  Blocks that arrive ahead of a missing one
+ * are held until it arrives.  A block that is still missing when blocks requested after it from the
+ * same source have arrived is taken as lost, which halves the window (at most once per window).
+ * Each full window of blocks without loss grows the window.  Blocks from a source that was dropped
+ * for sending bad blocks are ignored, as are blocks of a bad Merkle block that is being asked again
+ * of one source, unless they come from that source.
+ */
+static void rhizome_fetch_mdp_received_block(struct rhizome_fetch_slot *slot, const unsigned char *sender,
+					     uint64_t offset, int count, unsigned char *bytes)
+{
+  if (rhizome_fetch_mdp_banned(slot, sender))
+    return;
+  uint64_t position = rhizome_fetch_position(slot);
+  if (offset < position || (offset - slot->mdpRXBase) % slot->mdpRXBlockLength)
+    return;
+  uint64_t next = rhizome_fetch_mdp_next_block(slot);
+  uint64_t block = (offset - slot->mdpRXBase) / slot->mdpRXBlockLength;
+  if (block >= next + RHIZOME_MDP_MAX_WINDOW)
+    return;
+  uint64_t bit = mdp_block_bit(block);
+  if (block != next && (slot->mdpRXReceived & bit))
+    return; // duplicate
+  int source;
+  for (source = slot->mdpSourceCount - 1; source >= 0; --source)
+    if (memcmp(slot->mdpSources[source], sender, SID_SIZE) == 0)
+      break;
+  if (slot->merkleRetrySource >= 0 && block < slot->merkleRetryEnd && source != slot->merkleRetrySource)
+    return;
+  mdp_blocks_received++;
+  slot->mdpRXRequested &= ~bit;
+  if (block == slot->mdpRTTBlock) {
+    rhizome_fetch_mdp_rtt_sample(slot, gettime_ms() - slot->mdpRequestTime);
+    slot->mdpRTTBlock = RHIZOME_MDP_NO_BLOCK;
+  }
+
+  // Blocks overheard from a peer that is not one of our sources say nothing about loss.
+  if (source >= 0) {
+    slot->mdpSourceHeard[source] = 1;
+    slot->mdpSourceMisses[source] = 0;
+  }
+
+  int lost = 0;
+  uint64_t b;
+  for (b = next; source >= 0 && b + RHIZOME_MDP_REORDER_BLOCKS < block; ++b) {
+    if ((slot->mdpRXRequested & mdp_block_bit(b)) && slot->mdpBlockSource[b % RHIZOME_MDP_MAX_WINDOW] == source) {
+      slot->mdpRXRequested &= ~mdp_block_bit(b);
+      if (b == slot->mdpRTTBlock)
+	slot->mdpRTTBlock = RHIZOME_MDP_NO_BLOCK;
+      ++lost;
+    }
+  }
+  if (lost) {
+    mdp_blocks_lost += lost;
+    if (block >= slot->mdpRecoverBlock) {
+      rhizome_fetch_mdp_shrink_window(slot);
+      slot->mdpRecoverBlock = slot->mdpRequestedEnd;
+    }
+  } else if (++slot->mdpCleanBlocks >= slot->mdpWindow && slot->mdpWindow < RHIZOME_MDP_MAX_WINDOW) {
+    slot->mdpWindow += RHIZOME_MDP_WINDOW_STEP;
+    if (slot->mdpWindow > RHIZOME_MDP_MAX_WINDOW)
+      slot->mdpWindow = RHIZOME_MDP_MAX_WINDOW;
+    slot->mdpCleanBlocks = 0;
+    if (config.debug.rhizome_rx)
+      DEBUGF("MDP block window grown to %d, rto=%dms", slot->mdpWindow, slot->mdpRTO);
+  }
+
+  if (block == next) {
+    // Once the whole file has arrived, or writing fails, the slot is no longer ours to touch.
+    slot->mdpWritingSource = source;
+    if (rhizome_write_content(slot, (char *)bytes, count))
+      return;
+    while (slot->mdpRXReceived & mdp_block_bit(++next)) {
+      int i = next % RHIZOME_MDP_MAX_WINDOW;
+      slot->mdpRXReceived &= ~mdp_block_bit(next);
+      slot->mdpWritingSource = slot->mdpBlockSender[i];
+      if (rhizome_write_content(slot, (char *)slot->mdpRXBuffer + i * slot->mdpRXBlockLength, slot->mdpRXLength[i]))
+	return;
+    }
+    slot->mdpWritingSource = -1;
+  } else {
+    if (!slot->mdpRXBuffer && !(slot->mdpRXBuffer = emalloc(RHIZOME_MDP_MAX_WINDOW * slot->mdpRXBlockLength)))
+      return;
+    int i = block % RHIZOME_MDP_MAX_WINDOW;
+    if (count > slot->mdpRXBlockLength)
+      count = slot->mdpRXBlockLength;
+    bcopy(bytes, slot->mdpRXBuffer + i * slot->mdpRXBlockLength, count);
+    slot->mdpRXLength[i] = count;
+    slot->mdpBlockSender[i] = source;
+    slot->mdpRXReceived |= bit;
+    mdp_blocks_held++;
+  }
+
+  rhizome_fetch_mdp_touch_timeout(slot);
+  if (lost || rhizome_fetch_mdp_requested_count(slot) <= slot->mdpWindow / 2)
+    rhizome_fetch_mdp_requestblocks(slot);
+}
+
+/* Start requesting blocks of the payload from the current write position.  When the blocks are
+ * verified against Merkle leaves, the MDP block length is cut to a power of two, so that each
+ * Merkle block is made of whole MDP blocks and a bad one can be requested again.
+ */
+static int rhizome_fetch_mdp_startblocks(struct rhizome_fetch_slot *slot)
+{
+  slot->mdpRXBlockLength=config.rhizome.rhizome_mdp_block_size; // Rhizome over MDP block size
+  if (slot->mdpRXBlockLength > RHIZOME_MDP_MAX_BLOCK_LENGTH)
+    slot->mdpRXBlockLength = RHIZOME_MDP_MAX_BLOCK_LENGTH;
+  if (slot->merkleState == RHIZOME_MERKLE_VERIFYING) {
+    // Any bytes held by an HTTP transfer are requested again.
+    slot->merkleBlockBytes = 0;
+    slot->merkleBlockSenders = 0;
+    slot->merkleBlockOverheard = 0;
+    slot->merkleRetrySource = -1;
+    if ((slot->write_state.file_offset + slot->write_state.data_size) % RHIZOME_MERKLE_BLOCK_BYTES) {
+      if (config.debug.rhizome_rx)
+	DEBUGF("Payload already written past the start of a Merkle block, fetching without per-block verification");
+      rhizome_fetch_merkle_release(slot);
+    } else {
+      int length = 1;
+      while (length * 2 <= slot->mdpRXBlockLength && length * 2 <= RHIZOME_MERKLE_BLOCK_BYTES)
+	length *= 2;
+      slot->mdpRXBlockLength = length;
+    }
+  }
+  if (slot->mdpRXBuffer) {
+    free(slot->mdpRXBuffer);
+    slot->mdpRXBuffer = NULL;
+  }
+  slot->mdpRXBase=rhizome_fetch_position(slot);
+  slot->mdpRXReceived=0; // no blocks received yet
+  slot->mdpRXRequested=0;
+  slot->mdpRequestedEnd=0;
+  slot->mdpRecoverBlock=0;
+  slot->mdpRTTBlock=RHIZOME_MDP_NO_BLOCK;
+  slot->mdpWindow=RHIZOME_MDP_INITIAL_WINDOW;
+  slot->mdpCleanBlocks=0;
+  return rhizome_fetch_mdp_requestblocks(slot);
+}
+
+/* Ask for the next leaves of the payload's Merkle tree, from each source in turn on successive
+ * timeouts.
+ */
+static int rhizome_fetch_mdp_requestleaves(struct rhizome_fetch_slot *slot)
+{
+  int count = slot->merkleLeafCount - slot->merkleLeavesReceived;
+  if (count > RHIZOME_MDP_MERKLE_MAX_REQUEST)
+    count = RHIZOME_MDP_MERKLE_MAX_REQUEST;
+  const unsigned char *sid = slot->mdpSources[slot->merkleRequestTries % slot->mdpSourceCount];
+
+  overlay_mdp_frame mdp;
+
+  bzero(&mdp,sizeof(mdp));
+  bcopy(my_subscriber->sid,mdp.out.src.sid,SID_SIZE);
+  mdp.out.src.port=MDP_PORT_RHIZOME_RESPONSE;
+  bcopy(sid,mdp.out.dst.sid,SID_SIZE);
+  mdp.out.dst.port=MDP_PORT_RHIZOME_MERKLE_REQUEST;
+  mdp.out.ttl=1;
+  mdp.packetTypeAndFlags=MDP_TX;
+
+  mdp.out.queue=OQ_ORDINARY;
+  mdp.out.payload_length=RHIZOME_MDP_MERKLE_REQUEST_BYTES;
+  bcopy(slot->bid,&mdp.out.payload[0],RHIZOME_MANIFEST_ID_BYTES);
+  write_uint64(&mdp.out.payload[RHIZOME_MANIFEST_ID_BYTES],slot->bidVersion);
+  write_uint32(&mdp.out.payload[RHIZOME_MANIFEST_ID_BYTES+8],slot->merkleLeavesReceived);
+  write_uint16(&mdp.out.payload[RHIZOME_MANIFEST_ID_BYTES+8+4],count);
+
+  if (config.debug.rhizome_rx)
+    DEBUGF("Requesting %d Merkle leaves from %d of %d, dst sid=%s",
+	   count, slot->merkleLeavesReceived, slot->merkleLeafCount, alloca_tohex_sid(sid));
+
+  overlay_mdp_dispatch(&mdp,0 /* system generated */,NULL,0);
+  slot->merkleRequestEnd = slot->merkleLeavesReceived + count;
+  return rhizome_fetch_mdp_touch_timeout(slot);
+}
+
+/* Accept leaves of the Merkle tree of a payload being fetched over MDP.  Only leaves that follow on
+ * from those already received are taken.  Once all have arrived they are checked against the root
+ * in the manifest, and then the blocks of the payload are requested.
+ */
+int rhizome_received_merkle_leaves(unsigned char *bidprefix, uint64_t version, uint32_t first,
+				   int count, const unsigned char *leaves)
+{
+  int i, j;
+  for (i = 0; i < NQUEUES; ++i) {
+    for (j = 0; j < rhizome_fetch_queues[i].slot_count; ++j) {
+      struct rhizome_fetch_slot *slot = rhizome_fetch_queues[i].slots[j];
+      if (slot->state != RHIZOME_FETCH_RXFILEMDP || !slot->bidP || slot->merkleState != RHIZOME_MERKLE_FETCHING
+	  || slot->bidVersion != version || memcmp(slot->bid, bidprefix, 16) != 0)
+	continue;
+      if (first > slot->merkleLeavesReceived || first + count <= slot->merkleLeavesReceived)
+	return 0;
+      int skip = slot->merkleLeavesReceived - first;
+      leaves += skip * RHIZOME_MERKLE_HASH_BYTES;
+      count -= skip;
+      if (count > slot->merkleLeafCount - slot->merkleLeavesReceived)
+	count = slot->merkleLeafCount - slot->merkleLeavesReceived;
+      bcopy(leaves, &slot->merkleLeaves[slot->merkleLeavesReceived * RHIZOME_MERKLE_HASH_BYTES],
+	    count * RHIZOME_MERKLE_HASH_BYTES);
+      slot->merkleLeavesReceived += count;
+      slot->merkleRequestTries = 0;
+      slot->last_write_time = gettime_ms();
+      merkle_leaves_received += count;
+      if (slot->merkleLeavesReceived < slot->merkleLeafCount) {
+	if (slot->merkleLeavesReceived >= slot->merkleRequestEnd)
+	  rhizome_fetch_mdp_requestleaves(slot);
+	return 0;
+      }
+      unsigned char root[RHIZOME_MERKLE_HASH_BYTES];
+      if (rhizome_merkle_root(slot->merkleLeaves, slot->merkleLeafCount, root) == 0
+	  && memcmp(root, slot->merkleRoot, sizeof root) == 0) {
+	slot->merkleState = RHIZOME_MERKLE_VERIFYING;
+	if (config.debug.rhizome_rx)
+	  DEBUGF("Received all %d Merkle leaves for bid %s, verifying each block",
+		 slot->merkleLeafCount, alloca_tohex_bid(slot->bid));
+      } else {
+	WARNF("Merkle leaves for bid %s version 0x%llx do not match the manifest",
+	      alloca_tohex_bid(slot->bid), (long long) slot->bidVersion);
+	rhizome_fetch_merkle_release(slot);
+      }
+      rhizome_fetch_mdp_startblocks(slot);
+      return 0;
+    }
+  }
+  return -1;
+}
+
 static int rhizome_fetch_mdp_requestmanifest(struct rhizome_fetch_slot *slot)
 {
   if (slot->prefix_length<1||slot->prefix_length>32) {
@@ -1254,7 +2267,8 @@ static int rhizome_fetch_switch_to_mdp(struct rhizome_fetch_slot *slot)
   
   /* close socket and stop watching it */
   if (slot->alarm.poll.fd>=0) {
-    unwatch(&slot->alarm);
+    if (is_watching(&slot->alarm))
+      unwatch(&slot->alarm);
     close(slot->alarm.poll.fd);
     slot->alarm.poll.fd = -1;
   }
@@ -1283,9 +2297,18 @@ static int rhizome_fetch_switch_to_mdp(struct rhizome_fetch_slot *slot)
        transport.
     */
     slot->mdpIdleTimeout=config.rhizome.idle_timeout; // give up if nothing received for 5 seconds
-    slot->mdpRXBitmap=0x00000000; // no blocks received yet
-    slot->mdpRXBlockLength=config.rhizome.rhizome_mdp_block_size; // Rhizome over MDP block size
-    rhizome_fetch_mdp_requestblocks(slot);    
+    slot->mdpSRTT=0;
+    slot->mdpRTTVar=0;
+    slot->mdpRTO=RHIZOME_MDP_MAX_RTO;
+    bcopy(slot->peer_sid,slot->mdpSources[0],SID_SIZE);
+    slot->mdpSourceCount=1;
+    slot->mdpSourceMisses[0]=0;
+    slot->mdpSourceHeard[0]=0;
+    slot->mdpWritingSource=-1;
+    if (slot->merkleState==RHIZOME_MERKLE_FETCHING)
+      rhizome_fetch_mdp_requestleaves(slot);
+    else
+      rhizome_fetch_mdp_startblocks(slot);
   } else {
     /* We are requesting a manifest, which is stateless, except that we eventually
        give up. All we need to do now is send the request, and set our alarm to
@@ -1330,7 +2353,53 @@ void rhizome_fetch_write(struct rhizome_fetch_slot *slot)
   return;
 }
 
-int rhizome_write_content(struct rhizome_fetch_slot *slot, char *buffer, int bytes)
+static void rhizome_fetch_stored(struct sched_ent *alarm)
+{
+  IN();
+  struct rhizome_fetch_slot *slot=(struct rhizome_fetch_slot*)alarm;
+  
+  if (slot->state!=RHIZOME_FETCH_STORING) {
+    DEBUGF("Stale alarm triggered on idle/reclaimed slot. Ignoring");
+    OUT();
+    return;
+  }
+  
+  if (rhizome_finish_write(&slot->write_state)){
+    rhizome_fetch_close(slot);
+    OUT();
+    return;
+  }
+  // A resumed payload was not hashed into a tree as it was written, so keep the leaves it was
+  // checked against, for other peers to fetch.
+  if (slot->merkleState==RHIZOME_MERKLE_VERIFYING && !slot->write_state.merkle.enabled)
+    rhizome_merkle_store(slot->write_state.id, slot->merkleLeaves, slot->merkleLeafCount, slot->write_state.file_length);
+
+  if (!rhizome_import_received_bundle(slot->manifest)){
+    if (slot->completed_state==RHIZOME_FETCH_RXFILE) {
+      char buf[INET_ADDRSTRLEN];
+      if (inet_ntop(AF_INET, &slot->peer_ipandport.sin_addr, buf, sizeof buf) == NULL) {
+	buf[0] = '*';
+	buf[1] = '\0';
+      }
+      INFOF("Completed http request from %s:%u  for file %s",
+	    buf, ntohs(slot->peer_ipandport.sin_port), 
+	    slot->manifest->fileHexHash);
+    } else {
+      INFOF("Completed MDP request from %s  for file %s",
+	    alloca_tohex_sid(slot->peer_sid), slot->manifest->fileHexHash);
+    }
+  }
+  if (config.debug.rhizome_rx)
+    DEBUGF("Closing rhizome fetch slot = 0x%p.  Received %lld bytes in %lldms (%lldKB/sec).  Buffer size = %d",
+	   slot,(long long)slot->write_state.file_offset,
+	   (long long)gettime_ms()-slot->start_time,
+	   (long long)slot->write_state.file_offset/(gettime_ms()-slot->start_time+1),
+	   slot->write_state.buffer_size);
+  rhizome_fetch_close(slot);
+  OUT();
+}
+
+static int rhizome_fetch_store_content(struct rhizome_fetch_slot *slot, char *buffer, int bytes)
 {
   IN();
   
@@ -1382,27 +2451,27 @@ int rhizome_write_content(struct rhizome_fetch_slot *slot, char *buffer, int byt
       DEBUGF("Received all of file via rhizome -- now to import it");
     if (slot->manifest) {
       
-      // Were fetching payload, now we have it.
-      if (rhizome_finish_write(&slot->write_state)){
+      // Were fetching payload, now we have it.  Wait until the writer has stored all of it before
+      // checking the hash and importing the bundle.
+      if (slot->write_state.data_size>0 && rhizome_flush(&slot->write_state)){
 	rhizome_fetch_close(slot);
 	RETURN(-1);
       }
-
-      if (!rhizome_import_received_bundle(slot->manifest)){
-	if (slot->state==RHIZOME_FETCH_RXFILE) {
-	  char buf[INET_ADDRSTRLEN];
-	  if (inet_ntop(AF_INET, &slot->peer_ipandport.sin_addr, buf, sizeof buf) == NULL) {
-	    buf[0] = '*';
-	    buf[1] = '\0';
-	  }
-	  INFOF("Completed http request from %s:%u  for file %s",
-		buf, ntohs(slot->peer_ipandport.sin_port), 
-		slot->manifest->fileHexHash);
-	} else {
-	  INFOF("Completed MDP request from %s  for file %s",
-		alloca_tohex_sid(slot->peer_sid), slot->manifest->fileHexHash);
-	}
+      unschedule(&slot->alarm);
+      if (slot->alarm.poll.fd>=0){
+	unwatch(&slot->alarm);
+	close(slot->alarm.poll.fd);
+      }
+      slot->alarm.poll.fd = -1;
+      slot->completed_state = slot->state;
+      slot->state = RHIZOME_FETCH_STORING;
+      slot->alarm.function = rhizome_fetch_stored;
+      slot->alarm.stats = &fetch_stored_stats;
+      if (!rhizome_write_when_idle(&slot->write_state, 0, &slot->alarm)) {
+	slot->alarm.alarm = slot->alarm.deadline = gettime_ms();
+	schedule(&slot->alarm);
       }
+      RETURN(-1);
     } else {
       /* This was to fetch the manifest, so now fetch the file if needed */
       if (config.debug.rhizome_rx)
@@ -1430,7 +2499,7 @@ int rhizome_write_content(struct rhizome_fetch_slot *slot, char *buffer, int byt
       DEBUGF("Closing rhizome fetch slot = 0x%p.  Received %lld bytes in %lldms (%lldKB/sec).  Buffer size = %d",
 	     slot,(long long)slot->write_state.file_offset+slot->write_state.data_size,
 	     (long long)gettime_ms()-slot->start_time,
-	     (long long)(slot->write_state.file_offset+slot->write_state.data_size)/(gettime_ms()-slot->start_time),
+	     (long long)(slot->write_state.file_offset+slot->write_state.data_size)/(gettime_ms()-slot->start_time+1),
 	     slot->write_state.buffer_size);
     rhizome_fetch_close(slot);
     RETURN(-1);
@@ -1441,36 +2510,133 @@ int rhizome_write_content(struct rhizome_fetch_slot *slot, char *buffer, int byt
   OUT();
 }
 
-int rhizome_received_content(unsigned char *bidprefix,
+/* Drop a Merkle block that did not match its leaf, and fetch it again from its start.  A source that
+ * sent all of it is dropped, unless it is the last one, and is not used again by this fetch.  When
+ * several sources sent parts of it, the block is asked again of just one of them, so that the next
+ * failure can be blamed.  A block that includes bytes overheard from a peer that is not a source
+ * blames nobody.  The fetch is given up after several bad blocks that could be blamed on a source
+ * that could not be dropped.  Returns -1 if the slot was closed, otherwise 1.
+ */
+static int rhizome_fetch_merkle_bad_block(struct rhizome_fetch_slot *slot, int64_t start)
+{
+  int length = slot->merkleBlockBytes;
+  unsigned senders = slot->merkleBlockSenders;
+  int overheard = slot->merkleBlockOverheard;
+  slot->merkleBlockBytes = 0;
+  slot->merkleBlockSenders = 0;
+  slot->merkleBlockOverheard = 0;
+  slot->merkleRetrySource = -1;
+  merkle_blocks_failed++;
+  WARNF("Block at %lld of payload %s does not match its Merkle leaf", (long long)start, slot->write_state.id);
+
+  // HTTP cannot go back, so fetch the rest over MDP.
+  if (slot->state != RHIZOME_FETCH_RXFILEMDP) {
+    if (++slot->merkleFailures >= RHIZOME_MERKLE_MAX_FAILURES) {
+      WARNF("Too many bad blocks, giving up fetch of bid %s", alloca_tohex_bid(slot->bid));
+      rhizome_fetch_close(slot);
+      return -1;
+    }
+    rhizome_fetch_switch_to_mdp(slot);
+    return 1;
+  }
+
+  // The slots in the ring of the blocks just taken back may now hold blocks further ahead, which
+  // will be requested again.
+  uint64_t next = rhizome_fetch_mdp_next_block(slot);
+  uint64_t end = next + (length + slot->mdpRXBlockLength - 1) / slot->mdpRXBlockLength;
+  uint64_t b;
+  for (b = next; b < end; ++b) {
+    slot->mdpRXReceived &= ~mdp_block_bit(b);
+    slot->mdpRXRequested &= ~mdp_block_bit(b);
+  }
+  slot->mdpRTTBlock = RHIZOME_MDP_NO_BLOCK;
+
+  if (senders && !overheard) {
+    int s;
+    for (s = 0; !(senders & (1u << s)); ++s)
+      ;
+    if (senders & (senders - 1)) {
+      slot->merkleRetrySource = s;
+      slot->merkleRetryEnd = end;
+      if (config.debug.rhizome_rx)
+	DEBUGF("Asking %s again for the block at %lld", alloca_tohex_sid(slot->mdpSources[s]), (long long)start);
+    } else if (slot->mdpSourceCount > 1) {
+      if (slot->mdpBannedCount < RHIZOME_FETCH_MAX_SOURCES)
+	bcopy(slot->mdpSources[s], slot->mdpBanned[slot->mdpBannedCount++], SID_SIZE);
+      rhizome_fetch_mdp_drop_source(slot, s, "misbehaving");
+    } else if (++slot->merkleFailures >= RHIZOME_MERKLE_MAX_FAILURES) {
+      WARNF("Too many bad blocks, giving up fetch of bid %s", alloca_tohex_bid(slot->bid));
+      rhizome_fetch_close(slot);
+      return -1;
+    }
+  }
+  rhizome_fetch_mdp_requestblocks(slot);
+  return 1;
+}
+
+/* Write payload bytes that have arrived in order.  When the payload is being verified, the bytes of
+ * each Merkle block are held until the block is complete, and only written if it matches its leaf.
+ * Returns nonzero if the caller must stop writing at this position, because the fetch has finished
+ * or been closed, or a bad block is being fetched again.
+ */
+int rhizome_write_content(struct rhizome_fetch_slot *slot, char *buffer, int bytes)
+{
+  IN();
+  if (slot->merkleState != RHIZOME_MERKLE_VERIFYING)
+    RETURN(rhizome_fetch_store_content(slot, buffer, bytes));
+  while (bytes > 0) {
+    int64_t start = slot->write_state.file_offset + slot->write_state.data_size;
+    int length = slot->write_state.file_length - start;
+    if (length > RHIZOME_MERKLE_BLOCK_BYTES)
+      length = RHIZOME_MERKLE_BLOCK_BYTES;
+    int n = length - slot->merkleBlockBytes;
+    if (n <= 0)
+      break;
+    if (n > bytes)
+      n = bytes;
+    bcopy(buffer, &slot->merkleBlock[slot->merkleBlockBytes], n);
+    slot->merkleBlockBytes += n;
+    buffer += n;
+    bytes -= n;
+    if (slot->mdpWritingSource >= 0)
+      slot->merkleBlockSenders |= 1u << slot->mdpWritingSource;
+    else if (slot->state == RHIZOME_FETCH_RXFILEMDP)
+      slot->merkleBlockOverheard = 1;
+    slot->last_write_time = gettime_ms();
+    if (slot->merkleBlockBytes < length)
+      break;
+
+    unsigned char hash[RHIZOME_MERKLE_HASH_BYTES];
+    rhizome_merkle_hash_leaf(slot->merkleBlock, length, hash);
+    if (memcmp(hash, &slot->merkleLeaves[(start / RHIZOME_MERKLE_BLOCK_BYTES) * RHIZOME_MERKLE_HASH_BYTES], sizeof hash))
+      RETURN(rhizome_fetch_merkle_bad_block(slot, start));
+    merkle_blocks_verified++;
+    slot->merkleRetrySource = -1;
+    slot->merkleBlockBytes = 0;
+    slot->merkleBlockSenders = 0;
+    slot->merkleBlockOverheard = 0;
+    if (slot->merkleVerified == start)
+      slot->merkleVerified += length;
+    if (rhizome_fetch_store_content(slot, (char *)slot->merkleBlock, length))
+      RETURN(-1);
+  }
+  RETURN(0);
+  OUT();
+}
+
+int rhizome_received_content(const unsigned char *sender, unsigned char *bidprefix,
 			     uint64_t version, uint64_t offset,
 			     int count,unsigned char *bytes,int type)
 {
   IN();
-  int i;
-  for(i=0;i<NQUEUES;i++) {
-    struct rhizome_fetch_slot *slot=&rhizome_fetch_queues[i].active;
+  int i,j;
+  for(i=0;i<NQUEUES;i++)
+  for(j=0;j<rhizome_fetch_queues[i].slot_count;j++) {
+    struct rhizome_fetch_slot *slot=rhizome_fetch_queues[i].slots[j];
     if (slot->state==RHIZOME_FETCH_RXFILEMDP&&slot->bidP) {
       if (!memcmp(slot->bid,bidprefix,16))
 	{
-	  if (slot->write_state.file_offset + slot->write_state.data_size==offset) {
-	    if (!rhizome_write_content(slot,(char *)bytes,count))
-	      {
-		rhizome_fetch_mdp_touch_timeout(slot);
-		slot->mdpResponsesOutstanding--;
-		if (slot->mdpResponsesOutstanding==0) {
-		  // We have received all responses, so immediately ask for more
-		  rhizome_fetch_mdp_requestblocks(slot);
-		}
-		
-		// TODO: Try flushing out stuck packets that we have kept due to
-		// packet loss / out-of-order delivery.
-	      }
-
-	    RETURN(0);
-	  } else {
-	    // TODO: Implement out-of-order buffering so that lost packets
-	    // don't cause wastage
-	  }
+	  rhizome_fetch_mdp_received_block(slot, sender, offset, count, bytes);
 	  RETURN(0);
 	}
     }
@@ -1497,7 +2663,10 @@ void rhizome_fetch_poll(struct sched_ent *alarm)
       int bytes = read_nonblock(slot->alarm.poll.fd, buffer, sizeof buffer);
       /* If we got some data, see if we have found the end of the HTTP request */
       if (bytes > 0) {
-	rhizome_write_content(slot, buffer, bytes);
+	if (rhizome_write_content(slot, buffer, bytes))
+	  return;
+	if (rhizome_fetch_wait_for_writer(slot))
+	  return;
 	// reset inactivity timeout
 	unschedule(&slot->alarm);
 	slot->alarm.alarm=gettime_ms() + config.rhizome.idle_timeout;
@@ -1566,7 +2735,10 @@ void rhizome_fetch_poll(struct sched_ent *alarm)
 	  slot->state = RHIZOME_FETCH_RXFILE;
 	  int content_bytes = slot->request + slot->request_len - parts.content_start;
 	  if (content_bytes > 0){
-	    rhizome_write_content(slot, parts.content_start, content_bytes);
+	    if (rhizome_write_content(slot, parts.content_start, content_bytes))
+	      return;
+	    if (rhizome_fetch_wait_for_writer(slot))
+	      return;
 	    // reset inactivity timeout
 	    unschedule(&slot->alarm);
 	    slot->alarm.alarm=gettime_ms() + config.rhizome.idle_timeout;
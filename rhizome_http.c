@@ -23,6 +23,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #ifdef HAVE_SYS_FILIO_H
 #include <sys/filio.h>
 #endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 #include "serval.h"
 #include "overlay_address.h"
@@ -411,7 +414,7 @@ int rhizome_server_sql_query_fill_buffer(rhizome_http_request *r, char *table, c
   }
 
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  sqlite3_stmt *statement = sqlite_prepare(&retry, "%s LIMIT %lld,%d", r->source, r->source_index, record_count);
+  sqlite3_stmt *statement = sqlite_prepare_read(&retry, "%s LIMIT %lld,%d", r->source, r->source_index, record_count);
   if (!statement)
     return -1;
   if (config.debug.rhizome_tx)
@@ -435,10 +438,10 @@ int rhizome_server_sql_query_fill_buffer(rhizome_http_request *r, char *table, c
 
       int ret;
       int64_t rowid = sqlite3_column_int64(statement, 1);
-      do ret = sqlite3_blob_open(rhizome_db, "main", table, column, rowid, 0 /* read only */, &blob);
+      do ret = sqlite3_blob_open(rhizome_reader(), "main", table, column, rowid, 0 /* read only */, &blob);
 	while (sqlite_code_busy(ret) && sqlite_retry(&retry, "sqlite3_blob_open"));
       if (!sqlite_code_ok(ret)) {
-	WHYF("sqlite3_blob_open() failed, %s", sqlite3_errmsg(rhizome_db));
+	WHYF("sqlite3_blob_open() failed, %s", sqlite3_errmsg(rhizome_reader()));
 	continue;
       }
       sqlite_retry_done(&retry, "sqlite3_blob_open");
@@ -447,7 +450,7 @@ int rhizome_server_sql_query_fill_buffer(rhizome_http_request *r, char *table, c
 			    de-hex the string or not */
 			    r->source_record_size*(1+(r->source_flags&1)),0)
 	  !=SQLITE_OK) {
-	WHYF("sqlite3_blob_read() failed, %s", sqlite3_errmsg(rhizome_db));
+	WHYF("sqlite3_blob_read() failed, %s", sqlite3_errmsg(rhizome_reader()));
 	sqlite3_blob_close(blob);
 	continue;
       }
@@ -529,6 +532,7 @@ int rhizome_server_parse_http_request(rhizome_http_request *r)
     INFOF("RHIZOME HTTP SERVER, GET %s", alloca_toprint(1024, path, pathlen));
     if (strcmp(path, "/favicon.ico") == 0) {
       r->request_type = RHIZOME_HTTP_REQUEST_FAVICON;
+      r->source_index = 0;
       rhizome_server_http_response_header(r, 200, "image/vnd.microsoft.icon", favicon_len);
     } else if (strcmp(path, "/rssi.csv") == 0) {
       r->request_type = RHIZOME_HTTP_REQUEST_FROMBUFFER;
@@ -596,6 +600,7 @@ int rhizome_server_parse_http_request(rhizome_http_request *r)
 	      if (rhizome_read(&r->read_state, NULL, 0)){
 		rhizome_server_simple_http_response(r, 404, "<html><h1>Unknown length</h1></html>\r\n");
 	      }
+	      rhizome_read_release(&r->read_state);
 	    }
 	    r->read_state.offset = r->source_index = 0;
 	    if (r->read_state.length - r->read_state.offset>0){
@@ -631,7 +636,7 @@ int rhizome_server_parse_http_request(rhizome_http_request *r)
 	r->sql_table="manifests";
 	r->sql_row="manifest";
 	sqlite_exec_int64(&r->rowid, "select rowid from manifests where id between '%s' and '%s';", bid_low,bid_high);
-	if (r->rowid >= 0 && sqlite3_blob_open(rhizome_db, "main", r->sql_table, r->sql_row, r->rowid, 0, &blob) != SQLITE_OK)
+	if (r->rowid >= 0 && sqlite3_blob_open(rhizome_reader(), "main", r->sql_table, r->sql_row, r->rowid, 0, &blob) != SQLITE_OK)
 	  r->rowid = -1;
 	if (r->rowid == -1) {
 	  DEBUGF("Row not found");
@@ -746,6 +751,27 @@ int rhizome_server_http_response_header(rhizome_http_request *r, int result, con
   return rhizome_server_set_response(r, &hr);
 }
 
+static long long http_bytes_sendfile=0, http_bytes_buffered=0;
+#ifdef HAVE_SENDFILE
+static int sendfile_unsupported=0;
+#endif
+
+void rhizome_http_showstats()
+{
+  if (http_bytes_sendfile || http_bytes_buffered)
+    INFOF("Rhizome HTTP payloads: %lld bytes zero-copy, %lld bytes buffered",
+	  http_bytes_sendfile, http_bytes_buffered);
+}
+
+static void http_request_sent(rhizome_http_request *r)
+{
+  // reset inactivity timer
+  r->alarm.alarm = gettime_ms()+RHIZOME_IDLE_TIMEOUT;
+  r->alarm.deadline = r->alarm.alarm+RHIZOME_IDLE_TIMEOUT;
+  unschedule(&r->alarm);
+  schedule(&r->alarm);
+}
+
 /*
   return codes:
   1: connection still open.
@@ -762,7 +788,13 @@ int rhizome_server_http_send_bytes(rhizome_http_request *r)
     if (r->request_type&RHIZOME_HTTP_REQUEST_FROMBUFFER)
       {
 	int bytes=r->buffer_length-r->buffer_offset;
-	bytes=write(r->alarm.poll.fd,&r->buffer[r->buffer_offset],bytes);
+	int flags=0;
+#ifdef MSG_MORE
+	// let the response header share a segment with the start of the payload
+	if (r->request_type&RHIZOME_HTTP_REQUEST_STORE)
+	  flags|=MSG_MORE;
+#endif
+	bytes=send(r->alarm.poll.fd,&r->buffer[r->buffer_offset],bytes,flags);
 	if (bytes<=0){
 	  // stop writing when the tcp buffer is full
 	  // TODO errors?
@@ -770,12 +802,7 @@ int rhizome_server_http_send_bytes(rhizome_http_request *r)
 	}
 	
 	r->buffer_offset+=bytes;
-	  
-	// reset inactivity timer
-	r->alarm.alarm = gettime_ms()+RHIZOME_IDLE_TIMEOUT;
-	r->alarm.deadline = r->alarm.alarm+RHIZOME_IDLE_TIMEOUT;
-	unschedule(&r->alarm);
-	schedule(&r->alarm);
+	http_request_sent(r);
 	
 	if (r->buffer_offset>=r->buffer_length) {
 	  /* Buffer's cleared */
@@ -791,25 +818,54 @@ int rhizome_server_http_send_bytes(rhizome_http_request *r)
     switch(r->request_type&(~RHIZOME_HTTP_REQUEST_FROMBUFFER))
       {
       case RHIZOME_HTTP_REQUEST_FAVICON:
-	if (r->buffer_size<favicon_len) {
-	  free(r->buffer);
-	  r->buffer_size=0;
-	  r->buffer=malloc(favicon_len);
-	  if (!r->buffer) r->request_type=0;
-	}
-	if (r->buffer)
-	{
-	    int i;
-	    for(i=0;i<favicon_len;i++)
-	      r->buffer[i]=favicon_bytes[i];
-	    r->buffer_length=i;
-	    if (config.debug.rhizome_tx)
-	      DEBUGF("favicon buffer_length=%d\n", r->buffer_length);
-	    r->request_type=RHIZOME_HTTP_REQUEST_FROMBUFFER;
-	}
+      {
+	// send straight from the static icon, rather than copying it into the request buffer
+	int bytes=write(r->alarm.poll.fd,&favicon_bytes[r->source_index],favicon_len-r->source_index);
+	if (bytes<=0)
+	  return 1;
+	r->source_index+=bytes;
+	http_request_sent(r);
+	if (r->source_index>=favicon_len)
+	  r->request_type=0;
 	break;
+      }
       case RHIZOME_HTTP_REQUEST_STORE:
       {
+#ifdef HAVE_SENDFILE
+	/* Unencrypted payloads in external blob files go straight from the page cache to the
+	   socket.  The payload hash isn't checked on the way through, which the buffered path
+	   only reports anyway. */
+	if (r->read_state.blob_fd!=-1 && !r->read_state.crypt && !sendfile_unsupported){
+	  off_t offset = r->read_state.offset;
+	  ssize_t sent = sendfile(r->alarm.poll.fd, r->read_state.blob_fd, &offset, r->read_state.length - r->read_state.offset);
+	  if (sent==-1){
+	    if (errno==EAGAIN || errno==EWOULDBLOCK)
+	      return 1;
+	    if (errno==EINVAL || errno==ENOSYS){
+	      // not supported for this file or socket, use the buffered path from now on
+	      WARN_perror("sendfile");
+	      sendfile_unsupported=1;
+	      break;
+	    }
+	    WHY_perror("sendfile");
+	    r->request_type=0;
+	    break;
+	  }
+	  if (sent==0){
+	    WHYF("Payload %s ended at %lld, expected %lld bytes", r->read_state.id,
+		 (long long)r->read_state.offset, (long long)r->read_state.length);
+	    r->request_type=0;
+	    break;
+	  }
+	  r->read_state.hash=0;
+	  r->read_state.offset+=sent;
+	  http_bytes_sendfile+=sent;
+	  http_request_sent(r);
+	  if (r->read_state.offset >= r->read_state.length)
+	    r->request_type=0;
+	  break;
+	}
+#endif
 	r->request_type=0;
 	int suggested_size=65536;
 	if (suggested_size > r->read_state.length - r->read_state.offset)
@@ -827,9 +883,13 @@ int rhizome_server_http_send_bytes(rhizome_http_request *r)
 	}
 	
 	r->buffer_length = rhizome_read(&r->read_state, r->buffer, r->buffer_size);
+	// don't hold the database read lock while the socket drains
+	rhizome_read_release(&r->read_state);
 	
-	if (r->buffer_length>0)
+	if (r->buffer_length>0){
+	  http_bytes_buffered+=r->buffer_length;
 	  r->request_type|=RHIZOME_HTTP_REQUEST_FROMBUFFER;
+	}
 	
 	if (r->read_state.offset < r->read_state.length)
 	  r->request_type|=RHIZOME_HTTP_REQUEST_STORE;
@@ -858,7 +918,7 @@ int rhizome_server_http_send_bytes(rhizome_http_request *r)
 	    }
 	    
 	    sqlite3_blob *blob=NULL;
-	    int ret=sqlite3_blob_open(rhizome_db, "main", r->sql_table, r->sql_row, r->rowid, 0, &blob);
+	    int ret=sqlite3_blob_open(rhizome_reader(), "main", r->sql_table, r->sql_row, r->rowid, 0, &blob);
 	    if (ret==SQLITE_OK){
 	      if (sqlite3_blob_read(blob,&r->buffer[0],read_size,r->source_index)==SQLITE_OK) {
 		r->buffer_length = read_size;
@@ -0,0 +1,226 @@
+/*
+Serval Mesh Software
+Copyright (C) 2013 Serval Project, Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Merkle hash trees over Rhizome payloads.
+
+  A payload is cut into blocks of RHIZOME_MERKLE_BLOCK_BYTES (the last one may be short).  Each
+  block hashes to a leaf, SHA512(0x00 | block), and each pair of nodes to their parent,
+  SHA512(0x01 | left | right).  A node without a partner at the end of a level is carried up
+  unchanged.  The root is carried in the signed manifest as the "merkle" field, so a receiver that
+  has all of the leaves and checked them against the root can verify every block as it arrives,
+  instead of only the whole payload once the last byte is in.
+
+  The leaves of every payload with a tree are stored in the MERKLE table, keyed by file hash, so
+  they can be sent to other peers.  The table also records how much of a payload that is still
+  being fetched has been verified and stored, so that an interrupted fetch can be resumed.
+*/
+
+#include "serval.h"
+#include "rhizome.h"
+#include "conf.h"
+#include "str.h"
+
+int rhizome_merkle_leaf_count(int64_t length)
+{
+  return (length + RHIZOME_MERKLE_BLOCK_BYTES - 1) / RHIZOME_MERKLE_BLOCK_BYTES;
+}
+
+void rhizome_merkle_hash_leaf(const unsigned char *data, int length, unsigned char *hash)
+{
+  SHA512_CTX context;
+  unsigned char prefix = 0;
+  SHA512_Init(&context);
+  SHA512_Update(&context, &prefix, 1);
+  SHA512_Update(&context, data, length);
+  SHA512_Final(hash, &context);
+}
+
+static void merkle_hash_node(const unsigned char *left, const unsigned char *right, unsigned char *hash)
+{
+  SHA512_CTX context;
+  unsigned char prefix = 1;
+  SHA512_Init(&context);
+  SHA512_Update(&context, &prefix, 1);
+  SHA512_Update(&context, left, RHIZOME_MERKLE_HASH_BYTES);
+  SHA512_Update(&context, right, RHIZOME_MERKLE_HASH_BYTES);
+  SHA512_Final(hash, &context);
+}
+
+/* Compute the root of the tree over the given leaves.
+ */
+int rhizome_merkle_root(const unsigned char *leaves, int count, unsigned char *root)
+{
+  if (count < 1)
+    return WHY("Merkle tree has no leaves");
+  if (count == 1) {
+    bcopy(leaves, root, RHIZOME_MERKLE_HASH_BYTES);
+    return 0;
+  }
+  unsigned char *level = emalloc(((count + 1) / 2) * RHIZOME_MERKLE_HASH_BYTES);
+  if (!level)
+    return -1;
+  const unsigned char *below = leaves;
+  while (count > 1) {
+    int i;
+    for (i = 0; i + 1 < count; i += 2)
+      merkle_hash_node(&below[i * RHIZOME_MERKLE_HASH_BYTES], &below[(i + 1) * RHIZOME_MERKLE_HASH_BYTES],
+		       &level[(i / 2) * RHIZOME_MERKLE_HASH_BYTES]);
+    if (i < count)
+      memmove(&level[(i / 2) * RHIZOME_MERKLE_HASH_BYTES], &below[i * RHIZOME_MERKLE_HASH_BYTES], RHIZOME_MERKLE_HASH_BYTES);
+    count = (count + 1) / 2;
+    below = level;
+  }
+  bcopy(level, root, RHIZOME_MERKLE_HASH_BYTES);
+  free(level);
+  return 0;
+}
+
+/* Return 1 and the root if the manifest carries a well formed "merkle" field, otherwise 0.
+ */
+int rhizome_manifest_merkle_root(const rhizome_manifest *m, unsigned char *root)
+{
+  const char *hex = rhizome_manifest_get(m, "merkle", NULL, 0);
+  if (!hex || strlen(hex) != RHIZOME_MERKLE_HASH_BYTES * 2)
+    return 0;
+  return fromhexstr(root, hex, RHIZOME_MERKLE_HASH_BYTES) == 0;
+}
+
+/* Add payload bytes to a tree being built as the payload is written.  Runs on the background writer
+ * thread, so it never logs; returns -1 if out of memory.
+ */
+int rhizome_merkle_update(struct rhizome_merkle *merkle, const unsigned char *buffer, int length)
+{
+  while (length > 0) {
+    if (merkle->block_bytes == 0) {
+      unsigned char prefix = 0;
+      SHA512_Init(&merkle->block_context);
+      SHA512_Update(&merkle->block_context, &prefix, 1);
+    }
+    int n = RHIZOME_MERKLE_BLOCK_BYTES - merkle->block_bytes;
+    if (n > length)
+      n = length;
+    SHA512_Update(&merkle->block_context, buffer, n);
+    merkle->block_bytes += n;
+    buffer += n;
+    length -= n;
+    if (merkle->block_bytes == RHIZOME_MERKLE_BLOCK_BYTES && rhizome_merkle_end_block(merkle))
+      return -1;
+  }
+  return 0;
+}
+
+/* Finish the leaf of the block in progress, if any.
+ */
+int rhizome_merkle_end_block(struct rhizome_merkle *merkle)
+{
+  if (merkle->block_bytes == 0)
+    return 0;
+  if (merkle->leaf_count >= merkle->allocated) {
+    int allocated = merkle->allocated ? merkle->allocated * 2 : 64;
+    unsigned char *leaves = realloc(merkle->leaves, allocated * RHIZOME_MERKLE_HASH_BYTES);
+    if (!leaves)
+      return -1;
+    merkle->leaves = leaves;
+    merkle->allocated = allocated;
+  }
+  SHA512_Final(&merkle->leaves[merkle->leaf_count++ * RHIZOME_MERKLE_HASH_BYTES], &merkle->block_context);
+  merkle->block_bytes = 0;
+  return 0;
+}
+
+void rhizome_merkle_release(struct rhizome_merkle *merkle)
+{
+  if (merkle->leaves)
+    free(merkle->leaves);
+  merkle->leaves = NULL;
+  merkle->leaf_count = 0;
+  merkle->allocated = 0;
+  merkle->block_bytes = 0;
+}
+
+/* Record the leaves of a payload, and how many bytes of it have been verified and stored.  For a
+ * complete payload 'verified' is its length.
+ */
+int rhizome_merkle_store(const char *fileid, const unsigned char *leaves, int count, int64_t verified)
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare(&retry, "INSERT OR REPLACE INTO MERKLE(id,leaves,verified) VALUES(?,?,?);");
+  if (!statement)
+    return -1;
+  int ret = 0;
+  if (!(   sqlite_code_ok(sqlite3_bind_text(statement, 1, fileid, -1, SQLITE_STATIC))
+	&& sqlite_code_ok(sqlite3_bind_blob(statement, 2, leaves, count * RHIZOME_MERKLE_HASH_BYTES, SQLITE_STATIC))
+	&& sqlite_code_ok(sqlite3_bind_int64(statement, 3, verified))
+  )) {
+    ret = WHYF("query failed, %s: %s", sqlite3_errmsg(rhizome_db), sqlite3_sql(statement));
+  } else if (sqlite_step_retry(&retry, statement) == -1)
+    ret = -1;
+  sqlite3_finalize(statement);
+  return ret;
+}
+
+/* Load the stored leaves of a payload into a newly allocated buffer, which the caller must free.
+ * Returns 0 if found, 1 if there is no tree for the payload, -1 on error.
+ */
+int rhizome_merkle_load(const char *fileid, unsigned char **leaves, int *count, int64_t *verified)
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_read(&retry, "SELECT leaves, verified FROM MERKLE WHERE id='%s';", fileid);
+  if (!statement)
+    return -1;
+  int ret = 1;
+  if (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+    const unsigned char *blob = sqlite3_column_blob(statement, 0);
+    int bytes = sqlite3_column_bytes(statement, 0); // must call after sqlite3_column_blob()
+    ret = -1;
+    if (blob && bytes > 0 && bytes % RHIZOME_MERKLE_HASH_BYTES == 0 && (*leaves = emalloc(bytes))) {
+      bcopy(blob, *leaves, bytes);
+      *count = bytes / RHIZOME_MERKLE_HASH_BYTES;
+      *verified = sqlite3_column_int64(statement, 1);
+      ret = 0;
+    }
+  }
+  sqlite3_finalize(statement);
+  return ret;
+}
+
+/* Copy up to 'count' stored leaves of a payload, starting at leaf 'first', into 'leaves'.  Returns
+ * the number copied, 0 if there are none, -1 on error.
+ */
+int rhizome_merkle_read(const char *fileid, int first, int count, unsigned char *leaves)
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_cached_read(&retry, "SELECT substr(leaves, ?2, ?3) FROM MERKLE WHERE id = ?1;");
+  if (!statement)
+    return -1;
+  sqlite3_bind_text(statement, 1, fileid, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(statement, 2, (long long)first * RHIZOME_MERKLE_HASH_BYTES + 1);
+  sqlite3_bind_int64(statement, 3, (long long)count * RHIZOME_MERKLE_HASH_BYTES);
+  int ret = 0;
+  if (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+    const unsigned char *blob = sqlite3_column_blob(statement, 0);
+    int bytes = sqlite3_column_bytes(statement, 0); // must call after sqlite3_column_blob()
+    ret = bytes / RHIZOME_MERKLE_HASH_BYTES;
+    if (blob && ret > 0)
+      bcopy(blob, leaves, ret * RHIZOME_MERKLE_HASH_BYTES);
+  }
+  sqlite_release(statement);
+  return ret;
+}
@@ -29,6 +29,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/stat.h>
 
 /* Android doesn't have log2(), and we don't really need to do floating point
    math to work out how big a file is.
@@ -134,48 +135,300 @@ unsigned long long rhizome_bar_bidprefix_ll(unsigned char *bar)
   return bidprefix;
 }
 
-static int append_bars(struct overlay_buffer *e, sqlite_retry_state *retry, const char *sql, long long *last_rowid){
-  int count=0;
-  
-  sqlite3_stmt *statement=sqlite_prepare(retry, sql, *last_rowid);
-  
+/* In-memory cache of the BARs of every stored bundle, oldest first (ie, in MANIFESTS ROWID order), so
+ * that periodic adverts don't need to query the database.  It is updated as this process stores and
+ * deletes bundles.  Other processes (eg, "servald rhizome add file") may change the database too,
+ * so whenever the database files change, a cheap MAX(ROWID) probe picks up any newer rows, and the
+ * whole cache is reloaded if that goes backwards or a minute has passed since the last reload (to
+ * drop bundles deleted elsewhere).  A change that did not call for a reload at once leaves one
+ * pending, which happens when the minute is up even if the files do not change again.
+ */
+struct bar_entry {
+  int64_t rowid;
+  unsigned char bar[RHIZOME_BAR_BYTES];
+};
+
+#define BAR_CACHE_RELOAD_MS 60000
+#define ADVERT_RECENT_BARS 3
+#define ADVERT_BARS 20
+
+struct bar_cache_stamp {
+  off_t db_size, wal_size;
+  time_t db_mtime, wal_mtime;
+};
+
+static struct bar_entry *bar_cache=NULL;
+static int bar_cache_count=0;
+static int bar_cache_size=0;
+static int bar_cache_loaded=0;
+static int64_t bar_cache_max_rowid=0;
+static time_ms_t bar_cache_reload_time=0;
+static struct bar_cache_stamp bar_cache_last_stamp;
+static time_t bar_cache_probe_time=0;
+static int bar_cache_reload_pending=0;
+
+static unsigned int bar_cache_reloads=0, bar_cache_probes=0, bar_cache_updates=0;
+static unsigned int adverts_sent=0, advert_bars_sent=0;
+static time_ms_t advert_stats_since=0;
+
+static void bar_cache_stamp(struct bar_cache_stamp *stamp)
+{
+  char path[1024];
+  struct stat st;
+  memset(stamp, 0, sizeof *stamp);
+  if (FORM_RHIZOME_DATASTORE_PATH(path, "rhizome.db") && stat(path, &st) == 0) {
+    stamp->db_size = st.st_size;
+    stamp->db_mtime = st.st_mtime;
+  }
+  if (FORM_RHIZOME_DATASTORE_PATH(path, "rhizome.db-wal") && stat(path, &st) == 0) {
+    stamp->wal_size = st.st_size;
+    stamp->wal_mtime = st.st_mtime;
+  }
+}
+
+static int bar_cache_find(const unsigned char *bid_prefix)
+{
+  int i;
+  for (i=0;i<bar_cache_count;i++)
+    if (memcmp(&bar_cache[i].bar[RHIZOME_BAR_PREFIX_OFFSET], bid_prefix, RHIZOME_BAR_PREFIX_BYTES)==0)
+      return i;
+  return -1;
+}
+
+static void bar_cache_remove(int i)
+{
+  bar_cache_count--;
+  memmove(&bar_cache[i], &bar_cache[i+1], (bar_cache_count - i) * sizeof bar_cache[0]);
+}
+
+/* Add a BAR with a higher ROWID than any already cached, replacing any older BAR of the same bundle
+ * if asked.
+ */
+static int bar_cache_append(int64_t rowid, const unsigned char *bar, int replace)
+{
+  int i = replace ? bar_cache_find(&bar[RHIZOME_BAR_PREFIX_OFFSET]) : -1;
+  if (i!=-1)
+    bar_cache_remove(i);
+  if (bar_cache_count >= bar_cache_size){
+    int size = bar_cache_size ? bar_cache_size*2 : 64;
+    struct bar_entry *entries = erealloc(bar_cache, size * sizeof *entries);
+    if (!entries)
+      return -1;
+    bar_cache = entries;
+    bar_cache_size = size;
+  }
+  bar_cache[bar_cache_count].rowid = rowid;
+  memcpy(bar_cache[bar_cache_count].bar, bar, RHIZOME_BAR_BYTES);
+  bar_cache_count++;
+  if (rowid > bar_cache_max_rowid)
+    bar_cache_max_rowid = rowid;
+  return 0;
+}
+
+static int bar_cache_load(sqlite_retry_state *retry, int64_t after_rowid)
+{
+  sqlite3_stmt *statement=sqlite_prepare_read(retry, "SELECT BAR,ROWID FROM MANIFESTS WHERE ROWID > %lld ORDER BY ROWID", (long long)after_rowid);
+  if (!statement)
+    return -1;
   while(sqlite_step_retry(retry, statement) == SQLITE_ROW) {
-    count++;
     if (sqlite3_column_type(statement, 0)!=SQLITE_BLOB)
       continue;
-    
     const void *data = sqlite3_column_blob(statement, 0);
     int blob_bytes = sqlite3_column_bytes(statement, 0);
     int64_t rowid = sqlite3_column_int64(statement, 1);
-    
     if (blob_bytes!=RHIZOME_BAR_BYTES) {
       if (config.debug.rhizome_ads)
 	DEBUG("Found a BAR that is the wrong size - ignoring");
       continue;
     }
-    
-    if (ob_append_bytes(e, (unsigned char *)data, blob_bytes)){
-      // out of room
-      count--;
+    // a full load can't contain the same bundle twice
+    bar_cache_append(rowid, data, after_rowid!=0);
+  }
+  sqlite3_finalize(statement);
+  return 0;
+}
+
+static int bar_cache_reload(sqlite_retry_state *retry)
+{
+  bar_cache_count=0;
+  bar_cache_max_rowid=0;
+  bar_cache_loaded=0;
+  if (bar_cache_load(retry, 0)==-1)
+    return -1;
+  bar_cache_loaded=1;
+  bar_cache_reload_pending=0;
+  bar_cache_reload_time=gettime_ms();
+  bar_cache_reloads++;
+  if (config.debug.rhizome_ads)
+    DEBUGF("Loaded %d BARs", bar_cache_count);
+  return 0;
+}
+
+/* Bring the cache up to date with changes made by other processes.
+ */
+static int bar_cache_refresh(sqlite_retry_state *retry)
+{
+  struct bar_cache_stamp stamp;
+  bar_cache_stamp(&stamp);
+  time_ms_t now = gettime_ms();
+  int ret=0;
+  if (!bar_cache_loaded){
+    ret = bar_cache_reload(retry);
+  }else if (memcmp(&stamp, &bar_cache_last_stamp, sizeof stamp)!=0
+	 // a change in the same second as the last probe would not show in the stamp
+	 || bar_cache_last_stamp.db_mtime >= bar_cache_probe_time
+	 || bar_cache_last_stamp.wal_mtime >= bar_cache_probe_time){
+    long long max_rowid=0;
+    bar_cache_probes++;
+    if (sqlite_exec_int64_prepared(retry, &max_rowid,
+	  sqlite_prepare_cached_read(retry, "SELECT MAX(ROWID) FROM MANIFESTS;")) == -1)
+      ret = -1;
+    else if (max_rowid < bar_cache_max_rowid || now - bar_cache_reload_time >= BAR_CACHE_RELOAD_MS)
+      ret = bar_cache_reload(retry);
+    else {
+      // rows may have been deleted too, which only a reload will show
+      bar_cache_reload_pending=1;
+      if (max_rowid > bar_cache_max_rowid)
+	ret = bar_cache_load(retry, bar_cache_max_rowid);
+    }
+  }else if (bar_cache_reload_pending && now - bar_cache_reload_time >= BAR_CACHE_RELOAD_MS){
+    ret = bar_cache_reload(retry);
+  }
+  if (ret==0){
+    bar_cache_last_stamp = stamp;
+    bar_cache_probe_time = now / 1000;
+  }
+  return ret;
+}
+
+/* Called after this process commits a bundle to the MANIFESTS table.
+ */
+void rhizome_bar_cache_store(int64_t rowid, const unsigned char *bar)
+{
+  if (!bar_cache_loaded)
+    return;
+  bar_cache_updates++;
+  bar_cache_append(rowid, bar, 1);
+}
+
+/* Called after this process deletes a bundle from the MANIFESTS table.
+ */
+void rhizome_bar_cache_delete(const char *manifestid)
+{
+  unsigned char bid[RHIZOME_MANIFEST_ID_BYTES];
+  if (!bar_cache_loaded || fromhexstr(bid, manifestid, RHIZOME_MANIFEST_ID_BYTES) == -1)
+    return;
+  int i = bar_cache_find(&bid[0]);
+  if (i!=-1){
+    bar_cache_updates++;
+    bar_cache_remove(i);
+  }
+}
+
+/* The size class of a BAR's bundle, ordered from empty payloads up */
+#define BAR_SIZE_CLASS(b) ((unsigned char)((b)[RHIZOME_BAR_FILESIZE_OFFSET] + 1))
+
+/* Index of the first cached BAR of the given size class after ROWID 'after', wrapping around to
+ * the oldest, or -1 if there are none.
+ */
+static int bar_cache_next_in_class(int class, int64_t after)
+{
+  int i, first=-1;
+  for (i=0;i<bar_cache_count;i++){
+    if (BAR_SIZE_CLASS(bar_cache[i].bar)!=class)
+      continue;
+    if (bar_cache[i].rowid > after)
+      return i;
+    if (first==-1)
+      first=i;
+  }
+  return first;
+}
+
+/* Choose which cached BARs to advertise next, returning how many were placed in picks[].
+ *
+ * recent: the newest few, plus a window that walks back through older bundles.
+ * round_robin: walk through every bundle in turn, oldest to newest.
+ * size: share the advert evenly between the size classes present, so that a handful of small
+ * bundles (eg, MeshMS conversations) are not drowned out by a large number of big ones.
+ */
+static int advert_pick_bars(int picks[ADVERT_BARS])
+{
+  int n=0, i;
+  if (bar_cache_count<=0)
+    return 0;
+  switch(config.rhizome.advertise.strategy){
+  case RHIZOME_ADVERTISE_ROUND_ROBIN:{
+      static int64_t cursor=0;
+      for (i=0;i<bar_cache_count && bar_cache[i].rowid<=cursor;i++)
+	;
+      while (n<ADVERT_BARS && n<bar_cache_count){
+	if (i>=bar_cache_count)
+	  i=0;
+	picks[n++]=i++;
+      }
+      cursor=bar_cache[picks[n-1]].rowid;
+      break;
+    }
+  case RHIZOME_ADVERTISE_SIZE:{
+      static int64_t cursors[256];
+      int remaining[256];
+      memset(remaining, 0, sizeof remaining);
+      for (i=0;i<bar_cache_count;i++)
+	remaining[BAR_SIZE_CLASS(bar_cache[i].bar)]++;
+      while (n<ADVERT_BARS && n<bar_cache_count){
+	int class;
+	for (class=0;class<256 && n<ADVERT_BARS;class++){
+	  if (!remaining[class])
+	    continue;
+	  int j=bar_cache_next_in_class(class, cursors[class]);
+	  cursors[class]=bar_cache[j].rowid;
+	  remaining[class]--;
+	  picks[n++]=j;
+	}
+      }
+      break;
+    }
+  default:{
+      static int64_t cursor=INT64_MAX;
+      for (i=bar_cache_count-1;i>=0 && n<ADVERT_RECENT_BARS;i--)
+	picks[n++]=i;
+      if (n<ADVERT_RECENT_BARS)
+	break;
+      int older=bar_cache_count-ADVERT_RECENT_BARS;
+      for (i=older-1;i>=0 && bar_cache[i].rowid>=cursor;i--)
+	;
+      int start=n;
+      for (;i>=0 && n<ADVERT_BARS;i--)
+	picks[n++]=i;
+      if (n-start < ADVERT_BARS-ADVERT_RECENT_BARS)
+	cursor=INT64_MAX;
+      else
+	cursor=bar_cache[picks[n-1]].rowid;
       break;
     }
-    
-    *last_rowid=rowid;
   }
-  
-  if (statement)
-    sqlite3_finalize(statement);
-  
-  return count;
+  return n;
 }
 
-/* Periodically queue BAR advertisements
- Always advertise the most recent 3 manifests in the table, cycle through the rest of the table, adding 17 BAR's at a time
+void rhizome_advert_showstats()
+{
+  time_ms_t now=gettime_ms();
+  if (adverts_sent && now > advert_stats_since)
+    INFOF("Rhizome adverts: %u sent (%.2f/s) with %u BARs, %d BARs cached, %u reloads, %u probes, %u updates",
+	  adverts_sent, adverts_sent * 1000.0 / (now - advert_stats_since), advert_bars_sent,
+	  bar_cache_count, bar_cache_reloads, bar_cache_probes, bar_cache_updates);
+  adverts_sent=0;
+  advert_bars_sent=0;
+  advert_stats_since=now;
+}
+
+/* Periodically queue BAR advertisements, from the in-memory BAR cache, in the order chosen by
+ * rhizome.advertise.strategy.
  */
 long long bundles_available=0;
 void overlay_rhizome_advertise(struct sched_ent *alarm){
   bundles_available=0;
-  static int64_t bundle_last_rowid=INT64_MAX;
   
   if (!is_rhizome_advertise_enabled())
     return;
@@ -183,17 +436,19 @@ void overlay_rhizome_advertise(struct sched_ent *alarm){
   int (*oldfunc)() = sqlite_set_tracefunc(is_debug_rhizome_ads);
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
 
-  /* Get number of bundles available */
-  if (sqlite_exec_int64_retry(&retry, &bundles_available, "SELECT COUNT(BAR) FROM MANIFESTS;") != 1){
-    WHY("Could not count BARs for advertisement");
+  if (bar_cache_refresh(&retry)==-1){
+    WHY("Could not load BARs for advertisement");
     goto end;
   }
+  bundles_available=bar_cache_count;
   
   if (bundles_available<1)
     goto end;
   
-  struct overlay_frame *frame = malloc(sizeof(struct overlay_frame));
-  bzero(frame,sizeof(struct overlay_frame));
+  if (!advert_stats_since)
+    advert_stats_since=gettime_ms();
+  
+  struct overlay_frame *frame = op_new();
   frame->type = OF_TYPE_RHIZOME_ADVERT;
   frame->source = my_subscriber;
   frame->ttl = 1;
@@ -204,24 +459,19 @@ void overlay_rhizome_advertise(struct sched_ent *alarm){
   ob_append_byte(frame->payload, 2);
   ob_append_ui16(frame->payload, rhizome_http_server_port);
   
-  long long rowid=0;
-  int count = append_bars(frame->payload, &retry, 
-			  "SELECT BAR,ROWID FROM MANIFESTS ORDER BY ROWID DESC LIMIT 3", 
-			  &rowid);
-  
-  if (count>=3){
-    if (bundle_last_rowid>rowid || bundle_last_rowid<=0)
-      bundle_last_rowid=rowid;
-    
-    count = append_bars(frame->payload, &retry, 
-			"SELECT BAR,ROWID FROM MANIFESTS WHERE ROWID < %lld ORDER BY ROWID DESC LIMIT 17", 
-			&bundle_last_rowid);
-    if (count<17)
-      bundle_last_rowid=INT64_MAX;
+  int picks[ADVERT_BARS];
+  int count=advert_pick_bars(picks), i;
+  for (i=0;i<count;i++){
+    if (ob_append_bytes(frame->payload, bar_cache[picks[i]].bar, RHIZOME_BAR_BYTES))
+      break;
   }
   
   if (overlay_payload_enqueue(frame))
     op_free(frame);
+  else{
+    adverts_sent++;
+    advert_bars_sent+=i;
+  }
   
 end:
   sqlite_set_tracefunc(oldfunc);
@@ -232,8 +482,7 @@ end:
 
 /* Queue an advertisment for a single manifest */
 int rhizome_advertise_manifest(rhizome_manifest *m){
-  struct overlay_frame *frame = malloc(sizeof(struct overlay_frame));
-  bzero(frame,sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
   frame->type = OF_TYPE_RHIZOME_ADVERT;
   frame->source = my_subscriber;
   frame->ttl = 1;
@@ -254,6 +503,30 @@ error:
   return -1;
 }
 
+#define ADVERT_VERIFY_BATCH 8
+
+/* Verify the signatures of new manifests heard in one advert, then queue the good ones for import.
+ */
+static void suggest_manifest_batch(rhizome_manifest *batch[], int count, struct sockaddr_in *httpaddr, unsigned char *sid)
+{
+  if (count<=0)
+    return;
+  rhizome_manifest_verify_batch(batch, count);
+  int i;
+  for (i=0;i<count;i++){
+    rhizome_manifest *m=batch[i];
+    if (!m->selfSigned){
+      /* Don't waste time looking at this manifest again for a while */
+      rhizome_queue_ignore_manifest(m->cryptoSignPublic,
+				    crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES, 60000);
+      rhizome_manifest_free(m);
+      continue;
+    }
+    // the manifest structure is freed by this function
+    rhizome_suggest_queue_manifest_import(m, httpaddr, sid);
+  }
+}
+
 int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long now)
 {
   IN();
@@ -269,6 +542,8 @@ int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long
   int manifest_length;
   rhizome_manifest *m=NULL;
   char httpaddrtxt[INET_ADDRSTRLEN];
+  rhizome_manifest *batch[ADVERT_VERIFY_BATCH];
+  int batch_count=0;
   
   int (*oldfunc)() = sqlite_set_tracefunc(is_debug_rhizome_ads);
 
@@ -305,6 +580,7 @@ int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long
       m = rhizome_new_manifest();
       if (!m) {
 	WHY("Out of manifests");
+	suggest_manifest_batch(batch, batch_count, &httpaddr, f->source->sid);
 	sqlite_set_tracefunc(oldfunc);
 	RETURN(0);
       }
@@ -312,6 +588,7 @@ int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long
       if (rhizome_read_manifest_file(m, (char *)data, manifest_length) == -1) {
 	WHY("Error importing manifest body");
 	rhizome_manifest_free(m);
+	suggest_manifest_batch(batch, batch_count, &httpaddr, f->source->sid);
 	sqlite_set_tracefunc(oldfunc);
 	RETURN(0);
       }
@@ -320,6 +597,7 @@ int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long
       if (rhizome_manifest_get(m, "id", manifest_id_prefix, sizeof manifest_id_prefix) == NULL) {
 	WHY("Manifest does not contain 'id' field");
 	rhizome_manifest_free(m);
+	suggest_manifest_batch(batch, batch_count, &httpaddr, f->source->sid);
 	sqlite_set_tracefunc(oldfunc);
 	RETURN(0);
       }
@@ -341,6 +619,7 @@ int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long
 	   offering the same manifest */
 	WARN("Ignoring manifest announcment with no signature");
 	rhizome_manifest_free(m);
+	suggest_manifest_batch(batch, batch_count, &httpaddr, f->source->sid);
 	sqlite_set_tracefunc(oldfunc);
 	RETURN(0);
       }
@@ -361,9 +640,13 @@ int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long
 	  } else {
 	    if (config.debug.rhizome_ads)
 	      DEBUG("Not seen before.");
-	    rhizome_suggest_queue_manifest_import(m, &httpaddr,f->source->sid);
-	    // the above function will free the manifest structure, make sure we don't free it again
+	    // verify the new manifests in this frame together before suggesting them
+	    batch[batch_count++]=m;
 	    m=NULL;
+	    if (batch_count>=ADVERT_VERIFY_BATCH){
+	      suggest_manifest_batch(batch, batch_count, &httpaddr, f->source->sid);
+	      batch_count=0;
+	    }
 	  }
 	}
       else
@@ -381,6 +664,7 @@ int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long
       }
     }
   }
+  suggest_manifest_batch(batch, batch_count, &httpaddr, f->source->sid);
   
   overlay_mdp_frame mdp;
   
@@ -394,6 +678,9 @@ int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long
       WARNF("Expected whole BAR @%x (only %d bytes remain)", ob_position(f->payload), ob_remaining(f->payload));
       break;
     }
+    // a peer advertising a bundle we are fetching over MDP can send us some of its blocks
+    rhizome_fetch_add_source(&bar[RHIZOME_BAR_PREFIX_OFFSET], RHIZOME_BAR_PREFIX_BYTES,
+			     rhizome_bar_version(bar), f->source->sid);
     if (rhizome_is_bar_interesting(bar)==1){
       // add a request for the manifest
       if (mdp.out.payload_length==0){
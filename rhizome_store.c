@@ -1,21 +1,460 @@
+#include <pthread.h>
 #include "serval.h"
 #include "rhizome.h"
 #include "conf.h"
+#include "net.h"
+#include "cli.h"
 #include "strlcpy.h"
 
 #define RHIZOME_BUFFER_MAXIMUM_SIZE (1024*1024)
 
-int rhizome_exists(const char *fileHash){
-  long long gotfile = 0;
+/* Write through the write's blob handle, opening it on first use.  If sqlite has expired the
+ handle because the row changed underneath it (SQLITE_ABORT), point it back at the row with
+ sqlite3_blob_reopen() and try once more.  On any other failure the handle is closed, so the caller
+ can simply try again.  Never logs, as the writer thread uses it too. */
+static int blob_write(sqlite3 *db, struct rhizome_write *write, const unsigned char *buffer, int size, int64_t offset)
+{
+  int ret=SQLITE_OK;
+  if (!write->blob)
+    ret = sqlite3_blob_open(db, "main", "FILEBLOBS", "data", write->blob_rowid, 1 /* read/write */, &write->blob);
+  if (ret==SQLITE_OK){
+    ret = sqlite3_blob_write(write->blob, buffer, size, offset);
+    if (ret==SQLITE_ABORT && sqlite3_blob_reopen(write->blob, write->blob_rowid)==SQLITE_OK)
+      ret = sqlite3_blob_write(write->blob, buffer, size, offset);
+  }
+  if (ret!=SQLITE_OK && write->blob){
+    sqlite3_blob_close(write->blob);
+    write->blob=NULL;
+  }
+  return ret;
+}
+
+/* A handle that stays open between flushes is kept inside an explicit transaction.  Otherwise
+ closing it commits, and a busy commit would silently roll back everything written through it. */
+static int blob_begin(sqlite3 *db, struct rhizome_write *write)
+{
+  if (write->blob_txn)
+    return SQLITE_OK;
+  int ret = sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL);
+  if (ret==SQLITE_OK)
+    write->blob_txn=1;
+  return ret;
+}
+
+/* Close the handle and end its transaction.  A failed COMMIT leaves the transaction open so the
+ caller can retry, or call again with commit=0 to roll it back. */
+static int blob_release(sqlite3 *db, struct rhizome_write *write, int commit)
+{
+  int ret=SQLITE_OK;
+  if (write->blob){
+    ret = sqlite3_blob_close(write->blob);
+    write->blob=NULL;
+  }
+  if (write->blob_txn){
+    ret = sqlite3_exec(db, commit?"COMMIT;":"ROLLBACK;", NULL, NULL, NULL);
+    if (ret==SQLITE_OK || !commit)
+      write->blob_txn=0;
+  }
+  return ret;
+}
+
+/* Background payload writer.
+ 
+ When write->async is set, rhizome_flush() hands each full buffer to a single writer thread which
+ encrypts, hashes and stores it, so that a large incoming payload does not stall the event loop.
+ One thread keeps each write's blocks in order, as the SHA512 hash requires.  The queue is bounded
+ by rhizome.write_queue.  The event loop never waits for the writer: a producer that gets ahead of
+ the disk asks rhizome_write_wait() whether to stop receiving, and gets an alarm once there is room.
+ 
+ The thread has its own database connection and never logs; the first error is copied into
+ write->error and reported from the main thread.  rhizome_write_when_idle() lets the caller get an
+ alarm through the fdqueue scheduler once all of a write's buffers are stored, or discarded, so that
+ finishing or failing the write does not have to wait either.
+ */
+
+struct write_job{
+  struct write_job *next;
+  struct rhizome_write *write;
+  unsigned char *buffer;
+  int size;
+  int64_t offset;
+  char external;
+};
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_work = PTHREAD_COND_INITIALIZER;
+static struct write_job *writer_head=NULL, *writer_tail=NULL;
+static int writer_queued=0;
+// while writer_wake is set, the writer tells the event loop when the queue drops below writer_limit
+static int writer_limit=1;
+static int writer_wake=0;
+// writes waiting for room in the queue, only touched by the event loop
+static struct rhizome_write *writer_waiting=NULL;
+static int writer_started=0;
+static pthread_t writer_thread;
+static int writer_pipe[2]={-1,-1};
+static char writer_dbpath[1024];
+
+static unsigned int writer_jobs=0, writer_stalls=0, writer_high_water=0;
+static long long writer_bytes=0;
+
+static void rhizome_writer_poll(struct sched_ent *alarm);
+static struct profile_total writer_stats={.name="rhizome_writer_poll"};
+static struct sched_ent writer_alarm={.function=rhizome_writer_poll, .stats=&writer_stats};
+
+int rhizome_is_writer_thread()
+{
+  return writer_started && pthread_equal(pthread_self(), writer_thread);
+}
+
+static int writer_store(sqlite3 *db, struct write_job *job, char *error, int error_len)
+{
+  struct rhizome_write *write=job->write;
+  
+  if (write->crypt && rhizome_crypt_xor_block(job->buffer, job->size, job->offset, write->key, write->nonce)){
+    strlcpy(error, "Failed to encrypt payload", error_len);
+    return -1;
+  }
+  
+  if (job->external){
+    int ofs=0;
+    while(ofs < job->size){
+      int r=pwrite(write->blob_fd, job->buffer + ofs, job->size - ofs, job->offset + ofs);
+      if (r<0){
+	snprintf(error, error_len, "pwrite: %s", strerror(errno));
+	return -1;
+      }
+      ofs+=r;
+    }
+  }else{
+    if (!db){
+      strlcpy(error, "Writer has no database connection", error_len);
+      return -1;
+    }
+    // the handle stays open while more of this write is queued, see writer_main()
+    int ret = blob_begin(db, write);
+    if (ret==SQLITE_OK)
+      ret = blob_write(db, write, job->buffer, job->size, job->offset);
+    if (ret!=SQLITE_OK){
+      snprintf(error, error_len, "sqlite3_blob_write() failed: %s", sqlite3_errmsg(db));
+      return -1;
+    }
+  }
+  
+  SHA512_Update(&write->sha512_context, job->buffer, job->size);
+  if (write->merkle.enabled && rhizome_merkle_update(&write->merkle, job->buffer, job->size)){
+    strlcpy(error, "Out of memory for Merkle tree", error_len);
+    return -1;
+  }
+  return 0;
+}
+
+static void *writer_main(void *context)
+{
+  // writer_start() holds the lock until writer_thread is set
+  pthread_mutex_lock(&writer_lock);
+  sqlite3 *db=NULL;
+  if (sqlite3_open(writer_dbpath, &db)!=SQLITE_OK && db){
+    sqlite3_close(db);
+    db=NULL;
+  }
+  if (db)
+    // the event loop's own transactions are short, so waiting here is cheap
+    sqlite3_busy_timeout(db, 10000);
+  
+  while(1){
+    while(!writer_head)
+      pthread_cond_wait(&writer_work, &writer_lock);
+    struct write_job *job=writer_head;
+    writer_head=job->next;
+    if (!writer_head)
+      writer_tail=NULL;
+    struct rhizome_write *w=job->write;
+    int skip = w->cancel || w->error[0];
+    pthread_mutex_unlock(&writer_lock);
+    
+    char error[sizeof w->error];
+    error[0]=0;
+    if (!skip)
+      writer_store(db, job, error, sizeof error);
+    free(job->buffer);
+    
+    // Keep the blob handle for the next buffer of the same write, but don't hold the database
+    // locked while the producer is idle or another write is waiting.
+    pthread_mutex_lock(&writer_lock);
+    int more = writer_head && writer_head->write==w && !w->cancel;
+    pthread_mutex_unlock(&writer_lock);
+    if (!more && db && (w->blob || w->blob_txn)){
+      int commit = !skip && !error[0];
+      if (blob_release(db, w, commit)!=SQLITE_OK && commit){
+	snprintf(error, sizeof error, "Failed to commit payload: %s", sqlite3_errmsg(db));
+	blob_release(db, w, 0);
+      }
+    }
+    
+    pthread_mutex_lock(&writer_lock);
+    if (error[0] && !w->error[0])
+      strlcpy(w->error, error, sizeof w->error);
+    writer_queued--;
+    w->pending--;
+    if (w->pending==0 && w->idle_alarm){
+      // the pipe holds thousands of pointers, far more than there can be writes in progress
+      if (write(writer_pipe[1], &w, sizeof w)!=sizeof w)
+	strlcpy(w->error, "Failed to notify the event loop", sizeof w->error);
+    }
+    if (writer_wake && writer_queued < writer_limit){
+      // a NULL write wakes everything waiting for room, or we try again after the next buffer
+      struct rhizome_write *none=NULL;
+      if (write(writer_pipe[1], &none, sizeof none)==sizeof none)
+	writer_wake=0;
+    }
+    free(job);
+  }
+  return NULL;
+}
+
+static int writer_start()
+{
+  if (writer_started)
+    return 0;
+  if (!FORM_RHIZOME_DATASTORE_PATH(writer_dbpath, "rhizome.db"))
+    return WHY("Invalid path");
+  if (pipe(writer_pipe)==-1)
+    return WHY_perror("pipe");
+  if (set_nonblock(writer_pipe[0])==-1 || set_nonblock(writer_pipe[1])==-1)
+    goto fail;
+  pthread_mutex_lock(&writer_lock);
+  int err = pthread_create(&writer_thread, NULL, writer_main, NULL);
+  if (!err)
+    writer_started=1;
+  pthread_mutex_unlock(&writer_lock);
+  if (err){
+    WHYF("pthread_create() failed: %s", strerror(err));
+    goto fail;
+  }
+  pthread_detach(writer_thread);
+  writer_alarm.poll.fd=writer_pipe[0];
+  writer_alarm.poll.events=POLLIN;
+  watch(&writer_alarm);
+  return 0;
+fail:
+  close(writer_pipe[0]);
+  close(writer_pipe[1]);
+  writer_pipe[0]=writer_pipe[1]=-1;
+  return -1;
+}
+
+static void writer_schedule_now(struct sched_ent *alarm)
+{
+  unschedule(alarm);
+  alarm->alarm=alarm->deadline=gettime_ms();
+  schedule(alarm);
+}
+
+static void rhizome_writer_poll(struct sched_ent *alarm)
+{
+  struct rhizome_write *w;
+  while(read(alarm->poll.fd, &w, sizeof w)==sizeof w){
+    if (!w){
+      // there is room in the queue, let every waiting producer carry on
+      while(writer_waiting){
+	w=writer_waiting;
+	writer_waiting=w->next_waiting;
+	w->next_waiting=NULL;
+	struct sched_ent *ready=w->ready_alarm;
+	w->ready_alarm=NULL;
+	writer_schedule_now(ready);
+      }
+      continue;
+    }
+    struct sched_ent *idle=NULL;
+    pthread_mutex_lock(&writer_lock);
+    // the write may have been finished or failed since the writer sent this
+    if (w->pending==0 && w->idle_alarm){
+      idle=w->idle_alarm;
+      w->idle_alarm=NULL;
+    }
+    pthread_mutex_unlock(&writer_lock);
+    if (idle)
+      writer_schedule_now(idle);
+  }
+}
+
+/* Queue the current buffer for the writer thread and give the caller a fresh one.  This never waits
+ for room, the producer should have checked rhizome_write_wait() before receiving more content. */
+static int rhizome_flush_async(struct rhizome_write *write_state)
+{
+  if (writer_start())
+    return -1;
+  unsigned char *buffer=malloc(write_state->buffer_size);
+  struct write_job *job=malloc(sizeof(struct write_job));
+  if (!buffer || !job){
+    if (buffer) free(buffer);
+    if (job) free(job);
+    return WHY("Unable to allocate write buffer");
+  }
+  job->next=NULL;
+  job->write=write_state;
+  job->buffer=write_state->buffer;
+  job->size=write_state->data_size;
+  job->offset=write_state->file_offset;
+  job->external=config.rhizome.external_blobs;
+  
+  pthread_mutex_lock(&writer_lock);
+  if (write_state->error[0]){
+    char error[sizeof write_state->error];
+    strlcpy(error, write_state->error, sizeof error);
+    pthread_mutex_unlock(&writer_lock);
+    free(buffer);
+    free(job);
+    return WHYF("Background write failed: %s", error);
+  }
+  if (writer_tail)
+    writer_tail->next=job;
+  else
+    writer_head=job;
+  writer_tail=job;
+  writer_queued++;
+  write_state->pending++;
+  writer_jobs++;
+  writer_bytes+=job->size;
+  if (writer_queued > writer_high_water)
+    writer_high_water=writer_queued;
+  pthread_cond_signal(&writer_work);
+  pthread_mutex_unlock(&writer_lock);
   
-  if (sqlite_exec_int64(&gotfile, 
-	"SELECT COUNT(*) FROM FILES WHERE ID='%s' and datavalid=1;", 
-			fileHash) != 1){
+  write_state->buffer=buffer;
+  write_state->file_offset+=write_state->data_size;
+  if (config.debug.rhizome)
+    DEBUGF("Queued %lld of %lld", write_state->file_offset, write_state->file_length);
+  write_state->data_size=0;
+  return 0;
+}
+
+static int write_pending(struct rhizome_write *write)
+{
+  if (!writer_started)
+    return 0;
+  pthread_mutex_lock(&writer_lock);
+  int pending=write->pending;
+  pthread_mutex_unlock(&writer_lock);
+  return pending;
+}
+
+// stop waiting for room in the queue
+static void writer_forget(struct rhizome_write *write)
+{
+  struct rhizome_write **w;
+  for (w=&writer_waiting; *w; w=&(*w)->next_waiting){
+    if (*w==write){
+      *w=write->next_waiting;
+      break;
+    }
+  }
+  write->next_waiting=NULL;
+  write->ready_alarm=NULL;
+}
+
+/* Returns 1 if the writer's queue is full, in which case the caller should stop receiving content
+ for this write until the alarm is scheduled, once there is room again.  Returns 0 if the caller can
+ carry on now. */
+int rhizome_write_wait(struct rhizome_write *write, struct sched_ent *alarm)
+{
+  if (!write->async || !writer_started)
+    return 0;
+  if (write->ready_alarm)
+    return 1;
+  int limit = config.rhizome.write_queue>0 ? config.rhizome.write_queue : 1;
+  pthread_mutex_lock(&writer_lock);
+  int full = writer_queued >= limit;
+  if (full){
+    writer_limit=limit;
+    writer_wake=1;
+    writer_stalls++;
+  }
+  pthread_mutex_unlock(&writer_lock);
+  if (!full)
+    return 0;
+  write->ready_alarm=alarm;
+  write->next_waiting=writer_waiting;
+  writer_waiting=write;
+  return 1;
+}
+
+/* Schedule the alarm once the writer has stored every buffer flushed so far, or, if cancel is set,
+ discarded everything still queued, and return 1.  Returns 0 without scheduling the alarm if there
+ is nothing to wait for.  Either way the caller can then rhizome_finish_write(),
+ rhizome_suspend_write() or rhizome_fail_write() without waiting on the writer thread. */
+int rhizome_write_when_idle(struct rhizome_write *write, int cancel, struct sched_ent *alarm)
+{
+  writer_forget(write);
+  if (!writer_started){
+    if (cancel)
+      write->cancel=1;
     return 0;
   }
+  int idle=1;
+  pthread_mutex_lock(&writer_lock);
+  if (cancel)
+    write->cancel=1;
+  if (write->pending){
+    write->idle_alarm=alarm;
+    idle=0;
+  }
+  pthread_mutex_unlock(&writer_lock);
+  return !idle;
+}
+
+void rhizome_write_showstats()
+{
+  if (!writer_started)
+    return;
+  INFOF("Rhizome writer: %u buffers, %lld bytes, %u stalls, queue high water %u",
+	writer_jobs, writer_bytes, writer_stalls, writer_high_water);
+}
+
+int rhizome_exists(const char *fileHash){
+  long long gotfile = 0;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_cached(&retry, "SELECT COUNT(*) FROM FILES WHERE ID=?1 and datavalid=1;");
+  if (!statement)
+    return 0;
+  sqlite3_bind_text(statement, 1, fileHash, -1, SQLITE_STATIC);
+  if (sqlite_exec_int64_prepared(&retry, &gotfile, statement) != 1)
+    return 0;
   return gotfile;
 }
 
+static int write_init(struct rhizome_write *write, int64_t file_length)
+{
+  write->file_length = file_length;
+  write->file_offset = 0;
+  write->data_size = 0;
+  write->async = 0;
+  write->pending = 0;
+  write->cancel = 0;
+  write->error[0] = 0;
+  write->idle_alarm = NULL;
+  write->ready_alarm = NULL;
+  write->next_waiting = NULL;
+  write->blob = NULL;
+  write->blob_txn = 0;
+  bzero(&write->merkle, sizeof write->merkle);
+  
+  SHA512_Init(&write->sha512_context);
+  
+  write->buffer_size=write->file_length;
+  
+  if (write->buffer_size>RHIZOME_BUFFER_MAXIMUM_SIZE)
+    write->buffer_size=RHIZOME_BUFFER_MAXIMUM_SIZE;
+  
+  write->buffer=malloc(write->buffer_size);
+  if (!write->buffer)
+    return WHY("Unable to allocate write buffer");
+  
+  return 0;
+}
+
 int rhizome_open_write(struct rhizome_write *write, char *expectedFileHash, int64_t file_length, int priority){
   if (expectedFileHash){
     if (rhizome_exists(expectedFileHash))
@@ -114,21 +553,7 @@ int rhizome_open_write(struct rhizome_write *write, char *expectedFileHash, int6
     return -1;
   }
   
-  write->file_length = file_length;
-  write->file_offset = 0;
-  
-  SHA512_Init(&write->sha512_context);
-  
-  write->buffer_size=write->file_length;
-  
-  if (write->buffer_size>RHIZOME_BUFFER_MAXIMUM_SIZE)
-    write->buffer_size=RHIZOME_BUFFER_MAXIMUM_SIZE;
-  
-  write->buffer=malloc(write->buffer_size);
-  if (!write->buffer)
-    return WHY("Unable to allocate write buffer");
-  
-  return 0;
+  return write_init(write, file_length);
 }
 
 /* Write write_state->buffer into the store
@@ -144,6 +569,10 @@ int rhizome_flush(struct rhizome_write *write_state){
   if (write_state->data_size<=0)
     RETURN(WHY("No content supplied"));
   
+  // once anything is queued, keep going through the writer so the blocks stay in order
+  if (write_state->async && (config.rhizome.write_queue>0 || write_state->pending))
+    RETURN(rhizome_flush_async(write_state));
+  
   if (write_state->crypt){
     if (rhizome_crypt_xor_block(write_state->buffer, write_state->data_size, 
 				write_state->file_offset, write_state->key, write_state->nonce))
@@ -162,52 +591,30 @@ int rhizome_flush(struct rhizome_write *write_state){
     }
   }else{
     sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+    // Keep the blob handle open until the write is finished, unless we are on the event loop, where
+    // other queries must not find the connection inside our transaction between flushes.
+    int keep = !write_state->async;
     
     do{
-      
-      sqlite3_blob *blob=NULL;
-      
-      int ret = sqlite3_blob_open(rhizome_db, "main", "FILEBLOBS", "data", write_state->blob_rowid, 1 /* read/write */, &blob);
-      if (sqlite_code_busy(ret))
-	goto again;
-      else if (ret!=SQLITE_OK) {
-	WHYF("sqlite3_blob_open() failed: %s", 
-	     sqlite3_errmsg(rhizome_db));
-	if (blob) sqlite3_blob_close(blob);
-	RETURN(-1);
-      }
-      
-      ret=sqlite3_blob_write(blob, write_state->buffer, write_state->data_size, 
-			     write_state->file_offset);
-      
-      if (sqlite_code_busy(ret))
-	goto again;
-      else if (ret!=SQLITE_OK) {
-	WHYF("sqlite3_blob_write() failed: %s", 
-	     sqlite3_errmsg(rhizome_db));
-	if (blob) sqlite3_blob_close(blob);
-	RETURN(-1);
-      }
-      
-      ret = sqlite3_blob_close(blob);
-      blob=NULL;
-      if (sqlite_code_busy(ret))
-	goto again;
-      else if (ret==SQLITE_OK){
+      int ret = keep ? blob_begin(rhizome_db, write_state) : SQLITE_OK;
+      if (ret==SQLITE_OK)
+	ret = blob_write(rhizome_db, write_state, write_state->buffer, write_state->data_size, 
+			 write_state->file_offset);
+      // without a transaction, closing the handle commits the write
+      if (ret==SQLITE_OK && !keep)
+	ret = blob_release(rhizome_db, write_state, 1);
+      if (ret==SQLITE_OK)
 	break;
-      }
-      
-      RETURN(WHYF("sqlite3_blob_close() failed: %s", sqlite3_errmsg(rhizome_db)));
-      
-    again:
-      if (blob) sqlite3_blob_close(blob);
+      if (!sqlite_code_busy(ret))
+	RETURN(WHYF("sqlite3_blob_write() failed: %s", sqlite3_errmsg(rhizome_db)));
       if (sqlite_retry(&retry, "sqlite3_blob_write")==0)
 	RETURN(1);
-      
     }while(1);
   }
   
   SHA512_Update(&write_state->sha512_context, write_state->buffer, write_state->data_size);
+  if (write_state->merkle.enabled && rhizome_merkle_update(&write_state->merkle, write_state->buffer, write_state->data_size))
+    RETURN(WHY("Out of memory for Merkle tree"));
   write_state->file_offset+=write_state->data_size;
   if (config.debug.rhizome)
     DEBUGF("Written %lld of %lld", write_state->file_offset, write_state->file_length);
@@ -247,6 +654,7 @@ int rhizome_write_file(struct rhizome_write *write, const char *filename){
 }
 
 int rhizome_store_delete(const char *id){
+  rhizome_read_cache_invalidate(id);
   char blob_path[1024];
   if (!FORM_RHIZOME_DATASTORE_PATH(blob_path, id))
     return -1;
@@ -259,9 +667,20 @@ int rhizome_store_delete(const char *id){
 }
 
 int rhizome_fail_write(struct rhizome_write *write){
+  writer_forget(write);
+  if (write_pending(write)){
+    // the writer still uses the hash context and Merkle tree, so leave them for rhizome_cleanup()
+    pthread_mutex_lock(&writer_lock);
+    write->cancel=1;
+    write->idle_alarm=NULL;
+    pthread_mutex_unlock(&writer_lock);
+    return WHY("Write is still queued, see rhizome_write_when_idle()");
+  }
+  blob_release(rhizome_db, write, 0);
   if (write->buffer)
     free(write->buffer);
   write->buffer=NULL;
+  rhizome_merkle_release(&write->merkle);
   
   if (write->blob_fd){
     close(write->blob_fd);
@@ -279,24 +698,75 @@ int rhizome_fail_write(struct rhizome_write *write){
   return 0; 
 }
 
-int rhizome_finish_write(struct rhizome_write *write){
+/* Store everything written so far, and release the blob handle and buffer. */
+static int write_commit(struct rhizome_write *write){
   if (write->data_size>0){
     if (rhizome_flush(write))
       return -1;
   }
+  writer_forget(write);
+  if (write_pending(write))
+    return WHY("Write is still queued, see rhizome_write_when_idle()");
+  if (write->error[0])
+    return WHYF("Background write failed: %s", write->error);
+  if (write->blob || write->blob_txn){
+    sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+    int ret;
+    while(sqlite_code_busy(ret = blob_release(rhizome_db, write, 1))){
+      if (!sqlite_retry(&retry, "COMMIT"))
+	break;
+    }
+    if (ret!=SQLITE_OK){
+      WHYF("Failed to commit payload: %s", sqlite3_errmsg(rhizome_db));
+      blob_release(rhizome_db, write, 0);
+      return -1;
+    }
+  }
   if (write->blob_fd)
     close(write->blob_fd);
   if (write->buffer)
     free(write->buffer);
   write->buffer=NULL;
+  return 0;
+}
+
+/* Complete the Merkle tree built while writing, check it against the expected root if there is
+ * one, and store its leaves for the payload.  The whole payload hash has the final say, so leaves
+ * that do not match the manifest are only left out of the store. */
+static int write_merkle_finish(struct rhizome_write *write, const char *fileid){
+  unsigned char root[RHIZOME_MERKLE_HASH_BYTES];
+  if (rhizome_merkle_end_block(&write->merkle))
+    return WHY("Out of memory for Merkle tree");
+  if (rhizome_merkle_root(write->merkle.leaves, write->merkle.leaf_count, root))
+    return -1;
+  if (write->merkle.have_root && memcmp(root, write->merkle.root, sizeof root)){
+    WARNF("Expected Merkle root=%s, got %s",
+	  alloca_tohex(write->merkle.root, sizeof root), alloca_tohex(root, sizeof root));
+    rhizome_merkle_release(&write->merkle);
+    return 0;
+  }
+  bcopy(root, write->merkle.root, sizeof root);
+  write->merkle.have_root=1;
+  int ret = rhizome_merkle_store(fileid, write->merkle.leaves, write->merkle.leaf_count, write->file_length);
+  rhizome_merkle_release(&write->merkle);
+  return ret;
+}
+
+int rhizome_finish_write(struct rhizome_write *write){
+  if (write_commit(write))
+    return -1;
   
   char hash_out[SHA512_DIGEST_STRING_LENGTH+1];
   SHA512_End(&write->sha512_context, hash_out);
+  str_toupper_inplace(hash_out);
   
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
   if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;") == -1)
     goto failure;
   
+  if (write->merkle.enabled && write_merkle_finish(write, write->id_known ? write->id : hash_out))
+    goto failure;
+  
   if (write->id_known){
     if (strcasecmp(write->id, hash_out)){
       WHYF("Expected hash=%s, got %s", write->id, hash_out);
@@ -306,8 +776,6 @@ int rhizome_finish_write(struct rhizome_write *write){
 			       gettime_ms(), write->id) == -1)
       goto failure;
   }else{
-    str_toupper_inplace(hash_out);
-    
     if (rhizome_exists(hash_out)){
       // ooops, we've already got that file, delete the new copy.
       rhizome_fail_write(write);
@@ -360,6 +828,148 @@ failure:
   return -1;
 }
 
+// anything buffered beyond the first length bytes will be written again
+static void write_discard_after(struct rhizome_write *write, int64_t length){
+  if (write->file_offset >= length)
+    write->data_size=0;
+  else if (write->file_offset + write->data_size > length)
+    write->data_size=length - write->file_offset;
+}
+
+/* Flush what is buffered of the first length bytes of the payload, and discard the rest.  An async
+ * write should be truncated like this before rhizome_write_when_idle() and rhizome_suspend_write(),
+ * so that the kept bytes are stored by the writer, not from the event loop.
+ */
+int rhizome_write_truncate(struct rhizome_write *write, int64_t length){
+  write_discard_after(write, length);
+  if (write->data_size>0)
+    return rhizome_flush(write);
+  return 0;
+}
+
+/* Keep the first 'verified' bytes of a payload whose fetch has stopped, so that a later fetch can
+ * resume from there with rhizome_resume_write().  The leaves of the payload's Merkle tree are stored
+ * with it, and used to check the kept bytes again when resuming.  Partial payloads are deleted by
+ * rhizome_cleanup() like any other incomplete file, five minutes after they were last suspended.
+ */
+int rhizome_suspend_write(struct rhizome_write *write, int64_t verified, const unsigned char *leaves, int leaf_count){
+  if (!write->id_known || verified<=0 || verified>=write->file_length)
+    return rhizome_fail_write(write);
+  write_discard_after(write, verified);
+  if (write_commit(write)
+    || rhizome_merkle_store(write->id, leaves, leaf_count, verified)){
+    rhizome_fail_write(write);
+    return -1;
+  }
+  rhizome_merkle_release(&write->merkle);
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry,
+      "UPDATE FILES SET inserttime=%lld WHERE id='%s' AND datavalid=0", gettime_ms(), write->id);
+  if (config.debug.rhizome_rx)
+    DEBUGF("Kept %lld of %lld bytes of %s to resume later", (long long)verified, (long long)write->file_length, write->id);
+  return 0;
+}
+
+/* Reopen a payload kept by rhizome_suspend_write().  The kept bytes are checked against the leaves
+ * again, and hashed, then writing continues after the last good block.  Returns 1 if there is
+ * nothing to resume, in which case the caller should rhizome_open_write() instead.
+ */
+int rhizome_resume_write(struct rhizome_write *write, const char *fileHash, int64_t file_length,
+			 const unsigned char *leaves, int leaf_count, int64_t verified){
+  if (verified<=0 || verified>=file_length || leaf_count!=rhizome_merkle_leaf_count(file_length))
+    return 1;
+  long long length = -1;
+  if (sqlite_exec_int64(&length, "SELECT length FROM FILES WHERE id='%s' AND datavalid=0;", fileHash) != 1
+    || length != file_length)
+    return 1;
+  
+  strlcpy(write->id, fileHash, SHA512_DIGEST_STRING_LENGTH);
+  str_toupper_inplace(write->id);
+  write->id_known=1;
+  write->blob_fd=0;
+  write->blob_rowid=-1;
+  
+  char blob_path[1024];
+  int read_fd=-1;
+  sqlite3_blob *blob=NULL;
+  if (config.rhizome.external_blobs){
+    if (!FORM_RHIZOME_DATASTORE_PATH(blob_path, write->id))
+      return 1;
+    read_fd=open(blob_path, O_RDONLY);
+    if (read_fd<0)
+      return 1;
+  }else{
+    long long rowid = -1;
+    if (sqlite_exec_int64(&rowid, "SELECT rowid FROM FILEBLOBS WHERE id='%s';", write->id) != 1)
+      return 1;
+    write->blob_rowid = rowid;
+    if (sqlite3_blob_open(rhizome_db, "main", "FILEBLOBS", "data", write->blob_rowid, 0, &blob)!=SQLITE_OK
+      || sqlite3_blob_bytes(blob)!=file_length){
+      if (blob)
+	sqlite3_blob_close(blob);
+      return 1;
+    }
+  }
+  
+  if (write_init(write, file_length))
+    goto fail;
+  
+  // check and hash the kept blocks, stopping at the first bad one
+  int64_t offset=0;
+  unsigned char block[RHIZOME_MERKLE_BLOCK_BYTES];
+  unsigned char hash[RHIZOME_MERKLE_HASH_BYTES];
+  int i;
+  for (i=0; offset + RHIZOME_MERKLE_BLOCK_BYTES <= verified; i++){
+    int ok = read_fd>=0
+      ? pread(read_fd, block, sizeof block, offset)==sizeof block
+      : sqlite3_blob_read(blob, block, sizeof block, offset)==SQLITE_OK;
+    if (!ok)
+      break;
+    rhizome_merkle_hash_leaf(block, sizeof block, hash);
+    if (memcmp(hash, &leaves[i*RHIZOME_MERKLE_HASH_BYTES], sizeof hash))
+      break;
+    SHA512_Update(&write->sha512_context, block, sizeof block);
+    offset+=sizeof block;
+  }
+  if (read_fd>=0)
+    close(read_fd);
+  if (blob)
+    sqlite3_blob_close(blob);
+  read_fd=-1;
+  blob=NULL;
+  if (offset==0)
+    goto fail;
+  
+  if (config.rhizome.external_blobs){
+    write->blob_fd=open(blob_path, O_WRONLY);
+    if (write->blob_fd<0 || lseek(write->blob_fd, offset, SEEK_SET)==-1){
+      WHYF_perror("open(%s)", alloca_str_toprint(blob_path));
+      goto fail;
+    }
+  }
+  write->file_offset=offset;
+  
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry,
+      "UPDATE FILES SET inserttime=%lld WHERE id='%s'", gettime_ms(), write->id);
+  if (config.debug.rhizome_rx)
+    DEBUGF("Resuming %s at %lld of %lld bytes", write->id, (long long)offset, (long long)file_length);
+  return 0;
+  
+fail:
+  if (read_fd>=0)
+    close(read_fd);
+  if (blob)
+    sqlite3_blob_close(blob);
+  if (write->blob_fd>0)
+    close(write->blob_fd);
+  write->blob_fd=0;
+  if (write->buffer)
+    free(write->buffer);
+  write->buffer=NULL;
+  return 1;
+}
+
 // import a file for an existing bundle with a known file hash
 int rhizome_import_file(rhizome_manifest *m, const char *filepath)
 {
@@ -374,6 +984,10 @@ int rhizome_import_file(rhizome_manifest *m, const char *filepath)
   if (ret!=0)
     return ret;
   
+  // build the payload's Merkle tree too, so that we can send it to peers that verify each block
+  if (rhizome_manifest_merkle_root(m, write.merkle.root))
+    write.merkle.enabled = write.merkle.have_root = 1;
+  
   // file payload is not in the store yet
   if (rhizome_write_file(&write, filepath)){
     rhizome_fail_write(&write);
@@ -413,6 +1027,7 @@ int rhizome_stat_file(rhizome_manifest *m, const char *filepath)
   if (m->fileLength == 0){
     m->fileHexHash[0] = '\0';
     rhizome_manifest_del(m, "filehash");
+    rhizome_manifest_del(m, "merkle");
   }
   return 0;
 }
@@ -427,6 +1042,7 @@ int rhizome_add_file(rhizome_manifest *m, const char *filepath)
 
   if (rhizome_open_write(&write, NULL, m->fileLength, RHIZOME_PRIORITY_DEFAULT))
     return -1;
+  write.merkle.enabled=config.rhizome.merkle;
 
   write.crypt=m->payloadEncryption;
   if (write.crypt){
@@ -453,6 +1069,10 @@ int rhizome_add_file(rhizome_manifest *m, const char *filepath)
 
   strlcpy(m->fileHexHash, write.id, SHA512_DIGEST_STRING_LENGTH);
   rhizome_manifest_set(m, "filehash", m->fileHexHash);
+  if (write.merkle.have_root)
+    rhizome_manifest_set(m, "merkle", alloca_tohex(write.merkle.root, RHIZOME_MERKLE_HASH_BYTES));
+  else
+    rhizome_manifest_del(m, "merkle");
   return 0;
 }
 
@@ -465,8 +1085,16 @@ int rhizome_open_read(struct rhizome_read *read, const char *fileid, int hash)
   str_toupper_inplace(read->id);
   read->blob_rowid = -1;
   read->blob_fd = -1;
-  if (sqlite_exec_int64(&read->blob_rowid, "SELECT FILEBLOBS.rowid FROM FILEBLOBS, FILES WHERE FILEBLOBS.id = FILES.id AND FILES.id = '%s' AND FILES.datavalid != 0", read->id) == -1)
+  read->blob = NULL;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_cached_read(&retry, "SELECT FILEBLOBS.rowid FROM FILEBLOBS, FILES WHERE FILEBLOBS.id = FILES.id AND FILES.id = ?1 AND FILES.datavalid != 0");
+  if (!statement)
+    return -1;
+  sqlite3_bind_text(statement, 1, read->id, -1, SQLITE_STATIC);
+  long long rowid = -1;
+  if (sqlite_exec_int64_prepared(&retry, &rowid, statement) == -1)
     return -1;
+  read->blob_rowid = rowid;
   if (read->blob_rowid != -1) {
     read->length = -1; // discover the length on opening the db BLOB
   } else {
@@ -498,22 +1126,26 @@ int rhizome_read(struct rhizome_read *read_state, unsigned char *buffer, int buf
   IN();
   int bytes_read = 0;
   if (read_state->blob_fd != -1) {
-    if (lseek(read_state->blob_fd, read_state->offset, SEEK_SET) == -1)
-      RETURN(WHYF_perror("lseek(%d,%ld,SEEK_SET)", read_state->blob_fd, (long)read_state->offset));
-    bytes_read = read(read_state->blob_fd, buffer, buffer_length);
+    // positioned read, so one descriptor can be shared by readers at different offsets
+    bytes_read = pread(read_state->blob_fd, buffer, buffer_length, read_state->offset);
     if (bytes_read == -1)
-      RETURN(WHYF_perror("read(%d,%p,%ld)", read_state->blob_fd, buffer, (long)buffer_length));
+      RETURN(WHYF_perror("pread(%d,%p,%ld,%ld)", read_state->blob_fd, buffer, (long)buffer_length, (long)read_state->offset));
   } else if (read_state->blob_rowid != -1) {
     sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
     do{
-      sqlite3_blob *blob = NULL;
-      int ret = sqlite3_blob_open(rhizome_db, "main", "FILEBLOBS", "data", read_state->blob_rowid, 0 /* read only */, &blob);
+      // the handle is kept until rhizome_read_release() or rhizome_read_close()
+      int ret = SQLITE_OK;
+      if (!read_state->blob)
+	ret = sqlite3_blob_open(rhizome_reader(), "main", "FILEBLOBS", "data", read_state->blob_rowid, 0 /* read only */, &read_state->blob);
       if (sqlite_code_busy(ret))
 	goto again;
-      else if(ret!=SQLITE_OK)
-	RETURN(WHYF("sqlite3_blob_open failed: %s",sqlite3_errmsg(rhizome_db)));
+      else if(ret!=SQLITE_OK){
+	WHYF("sqlite3_blob_open failed: %s",sqlite3_errmsg(rhizome_reader()));
+	rhizome_read_release(read_state);
+	RETURN(-1);
+      }
       if (read_state->length==-1)
-	read_state->length=sqlite3_blob_bytes(blob);
+	read_state->length=sqlite3_blob_bytes(read_state->blob);
       bytes_read = read_state->length - read_state->offset;
       if (bytes_read>buffer_length)
 	bytes_read=buffer_length;
@@ -521,19 +1153,21 @@ int rhizome_read(struct rhizome_read *read_state, unsigned char *buffer, int buf
       if (!buffer)
 	bytes_read=0;
       if (bytes_read>0){
-	ret = sqlite3_blob_read(blob, buffer, bytes_read, read_state->offset);
+	ret = sqlite3_blob_read(read_state->blob, buffer, bytes_read, read_state->offset);
+	// the row was written since the handle was opened, point the handle at it again
+	if (ret==SQLITE_ABORT && sqlite3_blob_reopen(read_state->blob, read_state->blob_rowid)==SQLITE_OK)
+	  ret = sqlite3_blob_read(read_state->blob, buffer, bytes_read, read_state->offset);
 	if (sqlite_code_busy(ret))
 	  goto again;
 	else if(ret!=SQLITE_OK){
-	  WHYF("sqlite3_blob_read failed: %s",sqlite3_errmsg(rhizome_db));
-	  sqlite3_blob_close(blob);
+	  WHYF("sqlite3_blob_read failed: %s",sqlite3_errmsg(rhizome_reader()));
+	  rhizome_read_release(read_state);
 	  RETURN(-1);
 	}
       }
-      sqlite3_blob_close(blob);
       break;
     again:
-      if (blob) sqlite3_blob_close(blob);
+      rhizome_read_release(read_state);
       if (!sqlite_retry(&retry, "sqlite3_blob_open"))
 	RETURN(-1);
     } while (1);
@@ -561,14 +1195,162 @@ int rhizome_read(struct rhizome_read *read_state, unsigned char *buffer, int buf
   OUT();
 }
 
+/* Close the blob handle but keep the read open.  An open handle holds a read lock on the database,
+ so callers that return to the event loop between reads should release it. */
+void rhizome_read_release(struct rhizome_read *read)
+{
+  if (read->blob)
+    sqlite3_blob_close(read->blob);
+  read->blob = NULL;
+}
+
 int rhizome_read_close(struct rhizome_read *read)
 {
+  rhizome_read_release(read);
   if (read->blob_fd != -1)
     close(read->blob_fd);
   read->blob_fd = -1;
   return 0;
 }
 
+/* Cache of payloads opened for serving blocks over MDP.
+
+   Every block request names a bundle and version, and popular bundles are requested by many
+   neighbours at once, so the file hash lookup and the open() (or blob rowid and length) are kept
+   for a while rather than repeated for each request.  Entries idle for READ_CACHE_IDLE_MS are
+   closed.  Blob handles for payloads stored in the database are never kept between requests; with
+   a rollback journal an open handle would stop anyone else from writing, and in WAL mode it would
+   pin the read snapshot of rhizome_read_db, hiding new bundles from every other query on it.
+ */
+
+#define READ_CACHE_SIZE 8
+#define READ_CACHE_IDLE_MS 30000
+
+struct read_cache_entry{
+  unsigned char bid[RHIZOME_MANIFEST_ID_BYTES];
+  uint64_t version;
+  time_ms_t last_used;
+  struct rhizome_read read;
+};
+
+static struct read_cache_entry read_cache[READ_CACHE_SIZE];
+static int read_cache_count=0;
+static unsigned int read_cache_hits=0, read_cache_misses=0, read_cache_evictions=0;
+
+static void read_cache_expire(struct sched_ent *alarm);
+static struct profile_total read_cache_stats={.name="rhizome_read_cache_expire"};
+static struct sched_ent read_cache_alarm={.function=read_cache_expire, .stats=&read_cache_stats};
+
+static void read_cache_remove(int i)
+{
+  rhizome_read_close(&read_cache[i].read);
+  read_cache[i]=read_cache[--read_cache_count];
+}
+
+static void read_cache_expire(struct sched_ent *alarm)
+{
+  time_ms_t now = gettime_ms();
+  int i;
+  for (i=read_cache_count -1;i>=0;i--)
+    if (read_cache[i].last_used + READ_CACHE_IDLE_MS <= now)
+      read_cache_remove(i);
+  if (read_cache_count){
+    alarm->alarm = now + READ_CACHE_IDLE_MS;
+    alarm->deadline = alarm->alarm + 1000;
+    schedule(alarm);
+  }
+}
+
+/* Return an open read of the payload of the given bundle version, or NULL if we don't have it.  The
+ * caller must set the offset before each read, and must not close it; call rhizome_read_cached_done()
+ * when finished with it.
+ */
+struct rhizome_read *rhizome_read_cached(const unsigned char *bid, uint64_t version)
+{
+  time_ms_t now = gettime_ms();
+  int i;
+  for (i=0;i<read_cache_count;i++){
+    if (read_cache[i].version==version && memcmp(read_cache[i].bid, bid, RHIZOME_MANIFEST_ID_BYTES)==0){
+      read_cache_hits++;
+      read_cache[i].last_used = now;
+      return &read_cache[i].read;
+    }
+  }
+  read_cache_misses++;
+  
+  char filehash[SHA512_DIGEST_STRING_LENGTH];
+  if (rhizome_database_filehash_from_id(alloca_tohex_bid(bid), version, filehash)<=0)
+    return NULL;
+  
+  if (read_cache_count>=READ_CACHE_SIZE){
+    int oldest=0;
+    for (i=1;i<read_cache_count;i++)
+      if (read_cache[i].last_used < read_cache[oldest].last_used)
+	oldest=i;
+    read_cache_remove(oldest);
+    read_cache_evictions++;
+  }
+  struct read_cache_entry *e = &read_cache[read_cache_count];
+  bzero(e, sizeof *e);
+  e->read.blob_fd = -1;
+  if (rhizome_open_read(&e->read, filehash, 0)){
+    rhizome_read_close(&e->read);
+    return NULL;
+  }
+  bcopy(bid, e->bid, RHIZOME_MANIFEST_ID_BYTES);
+  e->version = version;
+  e->last_used = now;
+  read_cache_count++;
+  if (!is_scheduled(&read_cache_alarm)){
+    read_cache_alarm.alarm = now + READ_CACHE_IDLE_MS;
+    read_cache_alarm.deadline = read_cache_alarm.alarm + 1000;
+    schedule(&read_cache_alarm);
+  }
+  return &e->read;
+}
+
+/* Finished with a read returned by rhizome_read_cached().  If the read failed, it is dropped from
+ * the cache.
+ */
+void rhizome_read_cached_done(struct rhizome_read *read, int failed)
+{
+  int i;
+  for (i=0;i<read_cache_count;i++){
+    if (&read_cache[i].read==read){
+      if (failed)
+	read_cache_remove(i);
+      else
+	rhizome_read_release(read);
+      return;
+    }
+  }
+}
+
+/* Close any cached reads of a payload that is being deleted.
+ */
+void rhizome_read_cache_invalidate(const char *fileid)
+{
+  int i;
+  for (i=read_cache_count -1;i>=0;i--)
+    if (strcasecmp(read_cache[i].read.id, fileid)==0)
+      read_cache_remove(i);
+}
+
+void rhizome_read_cache_flush()
+{
+  while(read_cache_count)
+    read_cache_remove(read_cache_count -1);
+  if (is_scheduled(&read_cache_alarm))
+    unschedule(&read_cache_alarm);
+}
+
+void rhizome_read_showstats()
+{
+  if (read_cache_hits || read_cache_misses)
+    INFOF("Rhizome read cache: %u hits, %u opened, %u evicted, %d open",
+	  read_cache_hits, read_cache_misses, read_cache_evictions, read_cache_count);
+}
+
 /* Returns -1 on error, 0 on success.
  */
 static int write_file(struct rhizome_read *read, const char *filepath){
@@ -658,3 +1440,103 @@ int rhizome_dump_file(const char *id, const char *filepath, int64_t *length)
   rhizome_read_close(&read_state);
   return ret;
 }
+
+static int store_test(int64_t size, int external)
+{
+  int ret=0;
+  int saved_external = config.rhizome.external_blobs;
+  config.rhizome.external_blobs = external;
+  
+  struct rhizome_write write;
+  bzero(&write, sizeof write);
+  struct rhizome_read read;
+  bzero(&read, sizeof read);
+  read.blob_fd=-1;
+  
+  // incompressible content, so the numbers don't depend on the filesystem
+  uint32_t x = 0x9e3779b9;
+  time_ms_t start = gettime_ms();
+  if (rhizome_open_write(&write, NULL, size, RHIZOME_PRIORITY_DEFAULT)){
+    ret=-1;
+    goto end;
+  }
+  while(write.file_offset + write.data_size < write.file_length){
+    int len = write.buffer_size - write.data_size;
+    if (write.file_offset + write.data_size + len > write.file_length)
+      len = write.file_length - write.file_offset - write.data_size;
+    int i;
+    for (i=0;i<len;i++){
+      x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+      write.buffer[write.data_size + i] = x;
+    }
+    write.data_size += len;
+    if (rhizome_flush(&write)){
+      rhizome_fail_write(&write);
+      ret=-1;
+      goto end;
+    }
+  }
+  if (rhizome_finish_write(&write)){
+    ret=-1;
+    goto end;
+  }
+  time_ms_t written = gettime_ms();
+  
+  if (rhizome_open_read(&read, write.id, 1)){
+    ret=WHYF("Could not open %s", write.id);
+    goto end;
+  }
+  // read a page at a time, as rhizome extract does
+  unsigned char buffer[RHIZOME_CRYPT_PAGE_SIZE];
+  int64_t total=0;
+  int r;
+  while((r=rhizome_read(&read, buffer, sizeof buffer))>0)
+    total+=r;
+  if (r<0 || total!=size){
+    ret=WHYF("Read %lld bytes of %lld", (long long)total, (long long)size);
+    goto end;
+  }
+  time_ms_t end = gettime_ms();
+  
+  printf("%s %6lldKB: write %5lldms (%6lldKB/s), read %5lldms (%6lldKB/s)\n",
+	 external?"external":"internal", (long long)size/1024,
+	 (long long)(written - start), (long long)size/(written - start + 1),
+	 (long long)(end - written), (long long)size/(end - written + 1));
+  
+end:
+  rhizome_read_close(&read);
+  if (write.id[0] && !write.buffer){
+    sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+    sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry, "DELETE FROM FILEBLOBS WHERE id='%s';", write.id);
+    sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry, "DELETE FROM FILES WHERE id='%s';", write.id);
+    if (external)
+      rhizome_store_delete(write.id);
+  }
+  config.rhizome.external_blobs = saved_external;
+  return ret;
+}
+
+int app_rhizome_store_test(const struct cli_parsed *parsed, void *context)
+{
+  const char *size_arg = NULL;
+  if (cli_arg(parsed, "--size", &size_arg, cli_uint, NULL) == -1)
+    return -1;
+  int external = 0 == cli_arg(parsed, "--external", NULL, NULL, NULL);
+  if (rhizome_opendb() == -1)
+    return -1;
+  if (size_arg){
+    int64_t size = atoll(size_arg);
+    if (size <= 0)
+      return WHY("Invalid payload size");
+    if (store_test(size, external))
+      return -1;
+  }else{
+    printf("Benchmarking rhizome payload storage:\n");
+    int64_t size;
+    for (size = 1024*1024; size <= 100*1024*1024; size *= 10)
+      if (store_test(size, 0) || store_test(size, 1))
+	return -1;
+  }
+  printf("Test passed.\n");
+  return 0;
+}
@@ -52,6 +52,9 @@ int rotbuf_next_chunk(struct rotbuf *rb, unsigned char **bufp, size_t *lenp)
     *bufp = rb->cursor;
     *lenp = rb->ebuf - rb->cursor;
     rb->cursor = rb->buf;
+    // an unrotated buffer has no second chunk
+    if (rb->start == rb->buf)
+      ++rb->wrap;
     return 1;
   }
   *bufp = rb->cursor;
@@ -514,7 +514,7 @@ static void clean_neighbours(time_ms_t now)
 }
 
 static int send_legacy_self_announce_ack(struct neighbour *neighbour, struct neighbour_link *link, time_ms_t now){
-  struct overlay_frame *frame=emalloc_zero(sizeof(struct overlay_frame));
+  struct overlay_frame *frame=op_new();
   frame->type = OF_TYPE_SELFANNOUNCE_ACK;
   frame->ttl = 6;
   frame->destination = neighbour->subscriber;
@@ -595,7 +595,7 @@ static void link_send(struct sched_ent *alarm)
 
   alarm->alarm=now + 10000;
 
-  struct overlay_frame *frame=emalloc_zero(sizeof(struct overlay_frame));
+  struct overlay_frame *frame=op_new();
   frame->type=OF_TYPE_DATA;
   frame->source=my_subscriber;
   frame->ttl=1;
@@ -925,3 +925,46 @@ int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now)
   return 0;
 }
 
+static void mark_links(struct link *link)
+{
+  if (!link)
+    return;
+  mark_subscriber_in_use(link->transmitter);
+  mark_subscriber_in_use(link->receiver);
+  mark_links(link->_left);
+  mark_links(link->_right);
+}
+
+// mark every subscriber that our neighbours have told us about as being in use
+void link_mark_subscribers()
+{
+  struct neighbour *n = neighbours;
+  while(n){
+    mark_subscriber_in_use(n->subscriber);
+    mark_links(n->root);
+    n = n->_next;
+  }
+}
+
+// drop any routing information that refers to subscribers that are about to be freed
+void link_forget_expiring(struct subscriber *subscriber)
+{
+  struct link_state *state = subscriber->link_state;
+  if (!state)
+    return;
+  if ((state->next_hop && state->next_hop->expiring)
+    || (state->transmitter && state->transmitter->expiring)){
+    state->next_hop = NULL;
+    state->transmitter = NULL;
+    state->link = NULL;
+    state->route_version = route_version -1;
+  }
+}
+
+void link_free_state(struct subscriber *subscriber)
+{
+  if (subscriber->link_state){
+    free(subscriber->link_state);
+    subscriber->link_state=NULL;
+  }
+}
@@ -309,12 +309,16 @@ struct call_stats{
 };
 
 struct sched_ent;
+struct sched_heap;
 
 typedef void (*ALARM_FUNCP) (struct sched_ent *alarm);
 
 struct sched_ent{
-  struct sched_ent *_next;
-  struct sched_ent *_prev;
+  // the alarm or deadline heap we are queued in, and our position within it
+  struct sched_heap *_heap;
+  unsigned int _heap_index;
+  // insertion order, so that alarms with equal times fire first-in first-out
+  unsigned int _sched_seq;
   
   ALARM_FUNCP function;
   void *context;
@@ -343,7 +347,7 @@ struct overlay_buffer;
 struct overlay_frame;
 struct broadcast;
 
-#define STRUCT_SCHED_ENT_UNUSED ((struct sched_ent){NULL, NULL, NULL, NULL, {-1, 0, 0}, 0LL, 0LL, NULL, -1})
+#define STRUCT_SCHED_ENT_UNUSED ((struct sched_ent){NULL, 0, 0, NULL, NULL, {-1, 0, 0}, 0LL, 0LL, NULL, -1})
 
 extern int overlayMode;
 
@@ -419,6 +423,19 @@ typedef struct overlay_interface {
   unsigned int uartbps; // set serial port speed (which might be different from link speed)
   int ctsrts; // enabled hardware flow control if non-zero
 
+  // datagrams to read per system call, and per poll wake-up
+  int recv_batch;
+  int recv_budget;
+  // datagrams to send per system call
+  int send_batch;
+  // receive counters, to show how many packets we handle per wake-up
+  unsigned int recv_wakeups;
+  unsigned int recv_calls;
+  unsigned int recv_packets;
+  unsigned int recv_max_per_wakeup;
+  unsigned int send_calls;
+  unsigned int send_packets;
+
   // time last packet was sent on this interface
   time_ms_t last_tx;
 
@@ -496,6 +513,8 @@ void insertTransactionInCache(unsigned char *transaction_id);
 int overlay_forward_payload(struct overlay_frame *f);
 int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, size_t len,
 		    int recvttl, struct sockaddr *recvaddr, size_t recvaddrlen);
+int packetOkOverlayBuffer(struct overlay_interface *interface, struct overlay_buffer *b,
+		    int recvttl, struct sockaddr *recvaddr, size_t recvaddrlen);
 int parseMdpPacketHeader(struct decode_context *context, struct overlay_frame *frame, 
 			 struct overlay_buffer *buffer, struct subscriber **nexthop);
 int parseEnvelopeHeader(struct decode_context *context, struct overlay_interface *interface, 
@@ -539,6 +558,7 @@ int overlayServerMode();
 int overlay_payload_enqueue(struct overlay_frame *p);
 int overlay_queue_remaining(int queue);
 int overlay_queue_schedule_next(time_ms_t next_allowed_packet);
+void overlay_queue_mark_subscribers();
 int overlay_send_tick_packet(struct overlay_interface *interface);
 int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f,  time_ms_t now);
 int rhizome_server_get_fds(struct pollfd *fds,int *fdcount,int fdmax);
@@ -565,6 +585,7 @@ typedef struct sockaddr_mdp {
   unsigned int port;
 } sockaddr_mdp;
 unsigned char *keyring_get_nm_bytes(unsigned char *known_sid, unsigned char *unknown_sid);
+void keyring_forget_nm_bytes(const unsigned char *unknown_sid);
 
 typedef struct overlay_mdp_data_frame {
   sockaddr_mdp src;
@@ -638,6 +659,7 @@ struct vomp_call_state *vomp_find_call_by_session(int session_token);
 int vomp_mdp_received(overlay_mdp_frame *mdp);
 int vomp_parse_dtmf_digit(char c);
 int vomp_dial(struct subscriber *local, struct subscriber *remote, const char *local_did, const char *remote_did);
+void vomp_mark_subscribers();
 int vomp_pickup(struct vomp_call_state *call);
 int vomp_hangup(struct vomp_call_state *call);
 int vomp_ringing(struct vomp_call_state *call);
@@ -663,6 +685,15 @@ int overlay_interface_register(char *name,
 			       struct in_addr addr,
 			       struct in_addr mask);
 overlay_interface * overlay_interface_get_default();
+void overlay_interface_showstats();
+void overlay_buffer_showstats();
+void rhizome_write_showstats();
+void rhizome_read_showstats();
+void rhizome_http_showstats();
+void rhizome_database_showstats();
+void rhizome_signature_showstats();
+void rhizome_advert_showstats();
+void rhizome_fetch_showstats();
 overlay_interface * overlay_interface_find(struct in_addr addr, int return_default);
 overlay_interface * overlay_interface_find_name(const char *name);
 int overlay_interface_compare(overlay_interface *one, overlay_interface *two);
@@ -670,11 +701,19 @@ int
 overlay_broadcast_ensemble(overlay_interface *interface,
 			   struct sockaddr_in *recipientaddr,
 			   unsigned char *bytes,int len);
+int overlay_broadcast_ensemble_batch(overlay_interface *interface,
+				     struct send_datagram *dgrams, char *failed, int count);
 
 int directory_registration();
 int directory_service_init();
 
 struct cli_parsed;
+int app_sched_test(const struct cli_parsed *parsed, void *context);
+int app_subscriber_test(const struct cli_parsed *parsed, void *context);
+int app_rhizome_store_test(const struct cli_parsed *parsed, void *context);
+int app_rhizome_sql_test(const struct cli_parsed *parsed, void *context);
+int app_rhizome_crypt_test(const struct cli_parsed *parsed, void *context);
+int app_rhizome_manifest_test(const struct cli_parsed *parsed, void *context);
 int app_nonce_test(const struct cli_parsed *parsed, void *context);
 int app_rhizome_direct_sync(const struct cli_parsed *parsed, void *context);
 #ifdef HAVE_VOIPTEST
@@ -747,6 +786,7 @@ void sigIoHandler(int signal);
 int overlay_mdp_setup_sockets();
 
 int is_scheduled(const struct sched_ent *alarm);
+int is_watching(const struct sched_ent *alarm);
 int _schedule(struct __sourceloc whence, struct sched_ent *alarm);
 int _unschedule(struct __sourceloc whence, struct sched_ent *alarm);
 int _watch(struct __sourceloc whence, struct sched_ent *alarm);
@@ -765,6 +805,7 @@ void overlay_dummy_poll(struct sched_ent *alarm);
 void server_config_reload(struct sched_ent *alarm);
 void server_shutdown_check(struct sched_ent *alarm);
 void overlay_mdp_poll(struct sched_ent *alarm);
+void overlay_mdp_mark_subscribers();
 int overlay_mdp_try_interal_services(overlay_mdp_frame *mdp);
 int overlay_send_probe(struct subscriber *peer, struct sockaddr_in addr, overlay_interface *interface, int queue);
 int overlay_send_stun_request(struct subscriber *server, struct subscriber *request);
@@ -835,6 +876,9 @@ void link_explained(struct subscriber *subscriber);
 void link_interface_down(struct overlay_interface *interface);
 int link_state_announce_links();
 int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now);
+void link_mark_subscribers();
+void link_forget_expiring(struct subscriber *subscriber);
+void link_free_state(struct subscriber *subscriber);
 
 int generate_nonce(unsigned char *nonce,int bytes);
 
@@ -33,6 +33,18 @@
 
 #include <string.h>	/* memcpy()/memset() or bcopy()/bzero() */
 #include <assert.h>	/* assert() */
+
+/*
+ * On x86 the SHA-512 message schedule is computed two words at a time
+ * with SSSE3, and SHA512_Update_Multi() hashes four independent streams
+ * at once with AVX2.  Both are chosen at run time, so the binary still
+ * runs on CPUs without them.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define SHA2_X86 1
+#include <immintrin.h>
+#endif
 #ifdef HAVE_SYS_ENDIAN_H
 #include <sys/endian.h>
 #endif
@@ -238,6 +250,7 @@ typedef u_int64_t sha2_word64;	/* Exactly 8 bytes */
 void SHA512_Last(SHA512_CTX*);
 void SHA256_Transform(SHA256_CTX*, const sha2_word32*);
 void SHA512_Transform(SHA512_CTX*, const sha2_word64*);
+static void SHA512_Transform_generic(SHA512_CTX*, const sha2_word64*);
 
 
 /*** SHA-XYZ INITIAL HASH VALUES AND CONSTANTS ************************/
@@ -723,7 +736,7 @@ void SHA512_Init(SHA512_CTX* context) {
 	(h) = T1 + Sigma0_512(a) + Maj((a), (b), (c)); \
 	j++
 
-void SHA512_Transform(SHA512_CTX* context, const sha2_word64* data) {
+static void SHA512_Transform_generic(SHA512_CTX* context, const sha2_word64* data) {
 	sha2_word64	a, b, c, d, e, f, g, h, s0, s1;
 	sha2_word64	T1, *W512 = (sha2_word64*)context->buffer;
 	int		j;
@@ -778,7 +791,7 @@ void SHA512_Transform(SHA512_CTX* context, const sha2_word64* data) {
 
 #else /* SHA2_UNROLL_TRANSFORM */
 
-void SHA512_Transform(SHA512_CTX* context, const sha2_word64* data) {
+static void SHA512_Transform_generic(SHA512_CTX* context, const sha2_word64* data) {
 	sha2_word64	a, b, c, d, e, f, g, h, s0, s1;
 	sha2_word64	T1, T2, *W512 = (sha2_word64*)context->buffer;
 	int		j;
@@ -856,6 +869,171 @@ void SHA512_Transform(SHA512_CTX* context, const sha2_word64* data) {
 
 #endif /* SHA2_UNROLL_TRANSFORM */
 
+/*** SHA-512 SIMD backends: ******************************************/
+static int sha512_simd_level = -1;
+static int sha512_simd_enabled = 1;
+
+static int SHA512_SIMD_Level(void) {
+	if (sha512_simd_level == -1) {
+		int level = 0;
+#ifdef SHA2_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			level = 2;
+		else if (__builtin_cpu_supports("ssse3"))
+			level = 1;
+#endif
+		sha512_simd_level = level;
+	}
+	return sha512_simd_enabled ? sha512_simd_level : 0;
+}
+
+int SHA512_SIMD_Enable(int enable) {
+	int was = sha512_simd_enabled;
+	sha512_simd_enabled = enable;
+	return was;
+}
+
+const char *SHA512_Backend(void) {
+	switch (SHA512_SIMD_Level()) {
+	case 2:
+		return "ssse3, avx2 x4";
+	case 1:
+		return "ssse3";
+	}
+	return "generic";
+}
+
+#ifdef SHA2_X86
+
+#define ROTR64_128(x,n)	_mm_or_si128(_mm_srli_epi64((x), (n)), _mm_slli_epi64((x), 64 - (n)))
+#define sigma0_512_128(x)	_mm_xor_si128(_mm_xor_si128(ROTR64_128((x), 1), ROTR64_128((x), 8)), _mm_srli_epi64((x), 7))
+#define sigma1_512_128(x)	_mm_xor_si128(_mm_xor_si128(ROTR64_128((x), 19), ROTR64_128((x), 61)), _mm_srli_epi64((x), 6))
+
+/*
+ * The whole 80 word message schedule is computed up front, two words per
+ * step, since W[t] and W[t+1] only depend on words at least two behind.
+ */
+__attribute__((target("ssse3")))
+static void SHA512_Transform_ssse3(SHA512_CTX* context, const sha2_word64* data) {
+	sha2_word64	a, b, c, d, e, f, g, h, T1, T2;
+	__m128i		W[40];
+	const __m128i	bswap = _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+	const sha2_word64 *W512 = (const sha2_word64*)W;
+	int		j;
+
+	for (j = 0; j < 8; j++)
+		W[j] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)data + j), bswap);
+	for (j = 8; j < 40; j++) {
+		__m128i w15 = _mm_alignr_epi8(W[j-7], W[j-8], 8);
+		__m128i w7 = _mm_alignr_epi8(W[j-3], W[j-4], 8);
+		W[j] = _mm_add_epi64(_mm_add_epi64(W[j-8], sigma0_512_128(w15)),
+				     _mm_add_epi64(w7, sigma1_512_128(W[j-1])));
+	}
+
+	a = context->state[0];
+	b = context->state[1];
+	c = context->state[2];
+	d = context->state[3];
+	e = context->state[4];
+	f = context->state[5];
+	g = context->state[6];
+	h = context->state[7];
+
+	for (j = 0; j < 80; j++) {
+		T1 = h + Sigma1_512(e) + Ch(e, f, g) + K512[j] + W512[j];
+		T2 = Sigma0_512(a) + Maj(a, b, c);
+		h = g;
+		g = f;
+		f = e;
+		e = d + T1;
+		d = c;
+		c = b;
+		b = a;
+		a = T1 + T2;
+	}
+
+	context->state[0] += a;
+	context->state[1] += b;
+	context->state[2] += c;
+	context->state[3] += d;
+	context->state[4] += e;
+	context->state[5] += f;
+	context->state[6] += g;
+	context->state[7] += h;
+}
+
+#define ROTR64_256(x,n)	_mm256_or_si256(_mm256_srli_epi64((x), (n)), _mm256_slli_epi64((x), 64 - (n)))
+#define XOR3_256(x,y,z)	_mm256_xor_si256(_mm256_xor_si256((x), (y)), (z))
+#define Sigma0_512_256(x)	XOR3_256(ROTR64_256((x), 28), ROTR64_256((x), 34), ROTR64_256((x), 39))
+#define Sigma1_512_256(x)	XOR3_256(ROTR64_256((x), 14), ROTR64_256((x), 18), ROTR64_256((x), 41))
+#define sigma0_512_256(x)	XOR3_256(ROTR64_256((x), 1), ROTR64_256((x), 8), _mm256_srli_epi64((x), 7))
+#define sigma1_512_256(x)	XOR3_256(ROTR64_256((x), 19), ROTR64_256((x), 61), _mm256_srli_epi64((x), 6))
+#define Ch_256(x,y,z)	_mm256_xor_si256(_mm256_and_si256((x), (y)), _mm256_andnot_si256((x), (z)))
+#define Maj_256(x,y,z)	XOR3_256(_mm256_and_si256((x), (y)), _mm256_and_si256((x), (z)), _mm256_and_si256((y), (z)))
+
+/*
+ * One block from each of up to four independent streams, one stream per
+ * 64 bit lane.  Unused lanes hash a scratch state that is thrown away.
+ */
+__attribute__((target("avx2")))
+static void SHA512_Transform_x4(SHA512_CTX* context[], const sha2_byte* data[], int lanes) {
+	__m256i		v[8], W[16], T1, T2;
+	sha2_word64	state[8][4] __attribute__((aligned(32)));
+	const sha2_word64 *in[4];
+	int		i, j;
+
+	for (i = 0; i < 4; i++)
+		in[i] = (const sha2_word64*)data[i < lanes ? i : 0];
+	for (j = 0; j < 8; j++) {
+		for (i = 0; i < 4; i++)
+			state[j][i] = i < lanes ? context[i]->state[j] : 0;
+		v[j] = _mm256_load_si256((const __m256i*)state[j]);
+	}
+
+	for (j = 0; j < 80; j++) {
+		if (j < 16) {
+			W[j] = _mm256_set_epi64x(__builtin_bswap64(in[3][j]), __builtin_bswap64(in[2][j]),
+						 __builtin_bswap64(in[1][j]), __builtin_bswap64(in[0][j]));
+		} else {
+			W[j&0x0f] = _mm256_add_epi64(
+				_mm256_add_epi64(W[j&0x0f], sigma0_512_256(W[(j+1)&0x0f])),
+				_mm256_add_epi64(W[(j+9)&0x0f], sigma1_512_256(W[(j+14)&0x0f])));
+		}
+		T1 = _mm256_add_epi64(
+			_mm256_add_epi64(v[7], Sigma1_512_256(v[4])),
+			_mm256_add_epi64(Ch_256(v[4], v[5], v[6]),
+					 _mm256_add_epi64(_mm256_set1_epi64x(K512[j]), W[j&0x0f])));
+		T2 = _mm256_add_epi64(Sigma0_512_256(v[0]), Maj_256(v[0], v[1], v[2]));
+		v[7] = v[6];
+		v[6] = v[5];
+		v[5] = v[4];
+		v[4] = _mm256_add_epi64(v[3], T1);
+		v[3] = v[2];
+		v[2] = v[1];
+		v[1] = v[0];
+		v[0] = _mm256_add_epi64(T1, T2);
+	}
+
+	for (j = 0; j < 8; j++) {
+		_mm256_store_si256((__m256i*)state[j], v[j]);
+		for (i = 0; i < lanes; i++)
+			context[i]->state[j] += state[j][i];
+	}
+}
+
+#endif /* SHA2_X86 */
+
+void SHA512_Transform(SHA512_CTX* context, const sha2_word64* data) {
+#ifdef SHA2_X86
+	if (SHA512_SIMD_Level() >= 1) {
+		SHA512_Transform_ssse3(context, data);
+		return;
+	}
+#endif
+	SHA512_Transform_generic(context, data);
+}
+
 void SHA512_Update(SHA512_CTX* context, const sha2_byte *data, size_t len) {
 	unsigned int	freespace, usedspace;
 
@@ -904,6 +1082,72 @@ void SHA512_Update(SHA512_CTX* context, const sha2_byte *data, size_t len) {
 	usedspace = freespace = 0;
 }
 
+/*
+ * Hash several independent streams at once, as if SHA512_Update() had
+ * been called on each.  Streams with whole blocks to hash share the SIMD
+ * lanes, and a lane is handed to the next stream as soon as one runs out.
+ */
+void SHA512_Update_Multi(SHA512_CTX* context[], const sha2_byte* data[], const size_t len[], int count) {
+	SHA512_CTX	*lane_context[4];
+	const sha2_byte	*lane_data[4];
+	size_t		lane_len[4];
+	int		lanes = 0, next = 0, i;
+
+	for (;;) {
+		/* Give any free lanes to streams with whole blocks left */
+		while (lanes < 4 && next < count) {
+			SHA512_CTX *ctx = context[next];
+			const sha2_byte *d = data[next];
+			size_t l = len[next];
+			unsigned int usedspace = (ctx->bitcount[0] >> 3) % SHA512_BLOCK_LENGTH;
+
+			next++;
+			if (usedspace > 0 && l > 0) {
+				/* Finish the buffered block first */
+				size_t fill = SHA512_BLOCK_LENGTH - usedspace;
+				if (fill > l)
+					fill = l;
+				SHA512_Update(ctx, d, fill);
+				d += fill;
+				l -= fill;
+			}
+			if (l < SHA512_BLOCK_LENGTH || SHA512_SIMD_Level() < 2) {
+				SHA512_Update(ctx, d, l);
+				continue;
+			}
+			lane_context[lanes] = ctx;
+			lane_data[lanes] = d;
+			lane_len[lanes] = l;
+			lanes++;
+		}
+		if (lanes == 0)
+			break;
+		if (lanes == 1) {
+			/* Nothing left to share the lanes with */
+			SHA512_Update(lane_context[0], lane_data[0], lane_len[0]);
+			break;
+		}
+#ifdef SHA2_X86
+		SHA512_Transform_x4(lane_context, lane_data, lanes);
+#endif
+		for (i = 0; i < lanes; ) {
+			ADDINC128(lane_context[i]->bitcount, SHA512_BLOCK_LENGTH << 3);
+			lane_data[i] += SHA512_BLOCK_LENGTH;
+			lane_len[i] -= SHA512_BLOCK_LENGTH;
+			if (lane_len[i] < SHA512_BLOCK_LENGTH) {
+				/* Buffer the left-overs and free the lane */
+				SHA512_Update(lane_context[i], lane_data[i], lane_len[i]);
+				lanes--;
+				lane_context[i] = lane_context[lanes];
+				lane_data[i] = lane_data[lanes];
+				lane_len[i] = lane_len[lanes];
+			} else {
+				i++;
+			}
+		}
+	}
+}
+
 void SHA512_Last(SHA512_CTX* context) {
 	unsigned int	usedspace;
 
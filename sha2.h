@@ -144,6 +144,7 @@ void SHA512_Update(SHA512_CTX*, const uint8_t*, size_t);
 void SHA512_Final(uint8_t[SHA512_DIGEST_LENGTH], SHA512_CTX*);
 char* SHA512_End(SHA512_CTX*, char[SHA512_DIGEST_STRING_LENGTH]);
 char* SHA512_Data(const uint8_t*, size_t, char[SHA512_DIGEST_STRING_LENGTH]);
+void SHA512_Update_Multi(SHA512_CTX*[], const uint8_t*[], const size_t[], int);
 
 #else /* SHA2_USE_INTTYPES_H */
 
@@ -164,6 +165,7 @@ void SHA512_Update(SHA512_CTX*, const u_int8_t*, size_t);
 void SHA512_Final(u_int8_t[SHA512_DIGEST_LENGTH], SHA512_CTX*);
 char* SHA512_End(SHA512_CTX*, char[SHA512_DIGEST_STRING_LENGTH]);
 char* SHA512_Data(const u_int8_t*, size_t, char[SHA512_DIGEST_STRING_LENGTH]);
+void SHA512_Update_Multi(SHA512_CTX*[], const u_int8_t*[], const size_t[], int);
 
 #endif /* SHA2_USE_INTTYPES_H */
 
@@ -186,9 +188,14 @@ void SHA512_Update();
 void SHA512_Final();
 char* SHA512_End();
 char* SHA512_Data();
+void SHA512_Update_Multi();
 
 #endif /* NOPROTO */
 
+/* Choose between the SIMD and generic SHA-512 code, eg, for benchmarks */
+int SHA512_SIMD_Enable(int);
+const char *SHA512_Backend(void);
+
 #ifdef	__cplusplus
 }
 #endif /* __cplusplus */
@@ -15,8 +15,9 @@ size_t
 strlcpy(char *dst, const char *src, size_t size) {
         const size_t len = strlen(src);
         if (size != 0) {
-                memcpy(dst, src, (len > size - 1) ? size - 1 : len);
-                dst[size - 1] = 0;
+                const size_t n = (len > size - 1) ? size - 1 : len;
+                memcpy(dst, src, n);
+                dst[n] = 0;
         }
         return len;
 }
@@ -329,6 +329,15 @@ int is_codec_set(int codec, unsigned char *flags){
   return flags[codec >> 3] & (1<<(codec & 7));
 }
 
+void vomp_mark_subscribers()
+{
+  int i;
+  for(i=0;i<vomp_call_count;i++){
+    mark_subscriber_in_use(vomp_call_states[i].local.subscriber);
+    mark_subscriber_in_use(vomp_call_states[i].remote.subscriber);
+  }
+}
+
 struct vomp_call_state *vomp_find_call_by_session(int session_token)
 {
   int i;